@@ -0,0 +1,71 @@
+//! Parsing datapath messages: the owned decoders against the zero-copy views, with each message
+//! at an aligned and at a misaligned offset in the receive buffer. `Msg::from_buf` decodes
+//! measurements as views, so the owned measure decoder is called directly.
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion};
+use portus::serialize::{self, create, measure, AsRawMsg, CreateView, MeasureView, Msg, RawMsg};
+
+fn at_offset(msg: &[u8], off: usize) -> Vec<u8> {
+    let mut buf = vec![0; off];
+    buf.extend_from_slice(msg);
+    buf
+}
+
+fn bench_measure(c: &mut Criterion) {
+    let msg = serialize::serialize(&measure::Msg {
+        sid: 15,
+        program_uid: 72,
+        num_fields: 8,
+        fields: vec![424242, 65535, 65530, 200000, 150000, 1, 2, 3],
+    })
+    .unwrap();
+
+    let mut g = c.benchmark_group("measure");
+    for &off in &[0, 3] {
+        let buf = at_offset(&msg, off);
+        g.bench_with_input(BenchmarkId::new("owned", off), &buf[off..], |b, buf| {
+            b.iter(|| measure::Msg::from_raw_msg(RawMsg::parse(black_box(buf)).unwrap()).unwrap())
+        });
+        g.bench_with_input(BenchmarkId::new("view", off), &buf[off..], |b, buf| {
+            b.iter(|| {
+                let raw = RawMsg::parse(black_box(buf)).unwrap();
+                let v = MeasureView::new(&raw).unwrap();
+                v.fields().fold(v.program_uid() as u64, u64::wrapping_add)
+            })
+        });
+    }
+    g.finish();
+}
+
+fn bench_create(c: &mut Criterion) {
+    let msg = serialize::serialize(&create::Msg {
+        sid: 15,
+        init_cwnd: 1448 * 10,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: Some(String::from("reno")),
+    })
+    .unwrap();
+
+    let mut g = c.benchmark_group("create");
+    for &off in &[0, 3] {
+        let buf = at_offset(&msg, off);
+        g.bench_with_input(BenchmarkId::new("from_buf", off), &buf[off..], |b, buf| {
+            b.iter(|| Msg::from_buf(black_box(buf)).unwrap())
+        });
+        g.bench_with_input(BenchmarkId::new("view", off), &buf[off..], |b, buf| {
+            b.iter(|| {
+                let raw = RawMsg::parse(black_box(buf)).unwrap();
+                let v = CreateView::new(&raw).unwrap();
+                (v.mss(), v.cong_alg().map(str::len))
+            })
+        });
+    }
+    g.finish();
+}
+
+criterion_group!(benches, bench_measure, bench_create);
+criterion_main!(benches);
@@ -0,0 +1,290 @@
+//! The per-program and per-report work CCP does: parsing and compiling datapath programs,
+//! serializing them, encoding and decoding the messages that carry them, and reading report
+//! fields, for a small, a medium and a large program.
+//!
+//! Save a baseline next to the code with `make bench-baseline`, and compare a change against it
+//! with `make bench-compare`.
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion};
+use portus::ipc::direct;
+use portus::lang::{self, Bin, Prog, Scope};
+use portus::serialize::{self, install, measure, update_field, Msg, RawMsg};
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, DirectRuntime, Flow, Report};
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+
+const SOURCES: &[&str] = &[
+    "Ack.bytes_acked",
+    "Ack.packets_acked",
+    "Ack.bytes_misordered",
+    "Ack.ecn_bytes",
+    "Ack.lost_pkts_sample",
+    "Flow.bytes_in_flight",
+    "Flow.rate_outgoing",
+    "Flow.rtt_sample_us",
+];
+
+/// A program accumulating `fields` report fields; `timer` adds a second, timed event.
+fn program(fields: usize, timer: bool) -> String {
+    let defs: String = (0..fields)
+        .map(|i| format!(" (volatile f{} 0)", i))
+        .collect();
+    let body: String = (0..fields)
+        .map(|i| {
+            format!(
+                "\n        (:= Report.f{} (+ Report.f{} {}))",
+                i,
+                i,
+                SOURCES[i % SOURCES.len()]
+            )
+        })
+        .collect();
+    if !timer {
+        return format!("(def (Report{}))\n(when true{}\n)", defs, body);
+    }
+
+    format!(
+        "(def (Report{}) (Control.state 0) (Control.rtt 0))
+(when true{}
+        (:= Control.rtt (ewma 2 Flow.rtt_sample_us))
+        (bind Control.state (if (> Ack.lost_pkts_sample 0) 1))
+        (fallthrough)
+)
+(when (&& (> Micros Control.rtt) (== Control.state 0))
+        (:= Micros 0)
+        (report)
+)",
+        defs, body
+    )
+}
+
+fn programs() -> Vec<(&'static str, usize, String)> {
+    vec![
+        ("small", 1, program(1, false)),
+        ("medium", 4, program(4, true)),
+        ("large", 16, program(16, true)),
+    ]
+}
+
+fn bench_compile(c: &mut Criterion) {
+    let mut g = c.benchmark_group("compile");
+    for (size, _, src) in programs() {
+        let src = src.as_bytes();
+        g.bench_with_input(BenchmarkId::new("parse", size), src, |b, src| {
+            b.iter(|| Prog::new_with_scope(black_box(src)).unwrap())
+        });
+
+        let (p, sc) = Prog::new_with_scope(src).unwrap();
+        g.bench_with_input(BenchmarkId::new("compile_prog", size), &p, |b, p| {
+            b.iter(|| Bin::compile_prog(black_box(p), &mut sc.clone()).unwrap())
+        });
+
+        let (bin, _) = lang::compile(src, &[]).unwrap();
+        g.bench_with_input(BenchmarkId::new("Bin::serialize", size), &bin, |b, bin| {
+            b.iter(|| black_box(bin).serialize().unwrap())
+        });
+
+        g.bench_with_input(
+            BenchmarkId::new("compile_and_serialize", size),
+            src,
+            |b, src| b.iter(|| lang::compile_and_serialize(black_box(src), &[]).unwrap()),
+        );
+    }
+    g.finish();
+}
+
+fn bench_messages(c: &mut Criterion) {
+    let mut g = c.benchmark_group("messages");
+    for (size, fields, src) in programs() {
+        let (bin, sc) = lang::compile(src.as_bytes(), &[]).unwrap();
+        let ins = install::Msg {
+            sid: 1,
+            program_uid: sc.program_uid,
+            num_events: bin.events.len() as u32,
+            num_instrs: bin.instrs.len() as u32,
+            instrs: bin,
+        };
+        g.bench_with_input(BenchmarkId::new("install encode", size), &ins, |b, m| {
+            b.iter(|| serialize::serialize(black_box(m)).unwrap())
+        });
+
+        // CCP never decodes installs or updates; the datapath's side is the header.
+        let buf = serialize::serialize(&ins).unwrap();
+        g.bench_with_input(BenchmarkId::new("install header", size), &buf, |b, buf| {
+            b.iter(|| RawMsg::parse(black_box(buf)).unwrap().len)
+        });
+
+        let upd = update_field::Msg {
+            sid: 1,
+            num_fields: fields as u8,
+            fields: (0..fields)
+                .map(|i| (sc.get(&format!("Report.f{}", i)).unwrap().clone(), i as u64))
+                .collect(),
+        };
+        g.bench_with_input(BenchmarkId::new("update encode", size), &upd, |b, m| {
+            b.iter(|| serialize::serialize(black_box(m)).unwrap())
+        });
+
+        let ms = measure::Msg {
+            sid: 1,
+            program_uid: sc.program_uid,
+            num_fields: fields as u8,
+            fields: (0..fields as u64).collect(),
+        };
+        g.bench_with_input(BenchmarkId::new("measure encode", size), &ms, |b, m| {
+            b.iter(|| serialize::serialize(black_box(m)).unwrap())
+        });
+
+        let buf = serialize::serialize(&ms).unwrap();
+        g.bench_with_input(BenchmarkId::new("measure decode", size), &buf, |b, buf| {
+            b.iter(|| Msg::from_buf(black_box(buf)).unwrap())
+        });
+    }
+    g.finish();
+}
+
+#[derive(Clone, Copy)]
+enum Access {
+    None,
+    ByName,
+    Indexed,
+    Update,
+}
+
+struct ReportAlg {
+    src: String,
+    fields: usize,
+    access: Access,
+}
+
+struct ReportFlow {
+    dp: Datapath<direct::Socket>,
+    sc: Scope,
+    names: Vec<String>,
+    idxs: Vec<usize>,
+    access: Access,
+}
+
+impl CongAlg<direct::Socket> for ReportAlg {
+    type Flow = ReportFlow;
+
+    fn name() -> &'static str {
+        "bench"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("bench", self.src.clone());
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<direct::Socket>, _info: DatapathInfo) -> Self::Flow {
+        let sc = dp.set_program("bench", None).unwrap();
+        let names: Vec<String> = (0..self.fields).map(|i| format!("Report.f{}", i)).collect();
+        let idxs = names
+            .iter()
+            .map(|n| match sc.get(n) {
+                Some(lang::Reg::Report(idx, _, _)) => *idx as usize,
+                _ => unreachable!(),
+            })
+            .collect();
+        ReportFlow {
+            dp,
+            sc,
+            names,
+            idxs,
+            access: self.access,
+        }
+    }
+}
+
+impl Flow for ReportFlow {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        match self.access {
+            Access::None => (),
+            Access::ByName => {
+                for n in &self.names {
+                    black_box(m.get_field(n, &self.sc).unwrap());
+                }
+            }
+            Access::Indexed => {
+                assert_eq!(m.program_uid, self.sc.program_uid);
+                let fields = m.fields();
+                for &i in &self.idxs {
+                    black_box(fields[i]);
+                }
+            }
+            Access::Update => {
+                let acked = m.get_field("Report.f0", &self.sc).unwrap();
+                self.dp
+                    .update_field(&self.sc, &[("Cwnd", acked as u32)])
+                    .unwrap();
+            }
+        }
+    }
+}
+
+// Each iteration delivers one measurement through `DirectRuntime`; `dispatch` is the cost of
+// getting the report to `on_report`, and the rest add what the flow does with it.
+fn bench_report(c: &mut Criterion) {
+    let mut g = c.benchmark_group("report");
+    for (size, fields, src) in programs() {
+        for &(name, access) in &[
+            ("dispatch", Access::None),
+            ("get_field", Access::ByName),
+            ("fields", Access::Indexed),
+            ("update_field", Access::Update),
+        ] {
+            let uid = Arc::new(AtomicU32::new(0));
+            let u = uid.clone();
+            let sock = direct::Socket::new(move |msg| {
+                if msg[0] == 4 {
+                    u.store(
+                        u32::from_le_bytes([msg[8], msg[9], msg[10], msg[11]]),
+                        Ordering::Relaxed,
+                    );
+                }
+
+                Ok(())
+            });
+            let alg = ReportAlg {
+                src: src.clone(),
+                fields,
+                access,
+            };
+            let mut rt = DirectRuntime::new(sock, alg).unwrap();
+            rt.recv_msg(&serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+                .unwrap();
+            rt.recv_msg(
+                &serialize::serialize(&serialize::create::Msg {
+                    sid: 1,
+                    init_cwnd: 14480,
+                    mss: 1448,
+                    src_ip: 0,
+                    src_port: 4242,
+                    dst_ip: 0,
+                    dst_port: 4242,
+                    cong_alg: None,
+                })
+                .unwrap(),
+            )
+            .unwrap();
+            let ms = serialize::serialize(&measure::Msg {
+                sid: 1,
+                program_uid: uid.load(Ordering::Relaxed),
+                num_fields: fields as u8,
+                fields: (0..fields as u64).collect(),
+            })
+            .unwrap();
+
+            g.bench_with_input(BenchmarkId::new(name, size), &ms, |b, ms| {
+                b.iter(|| rt.recv_msg(black_box(ms)).unwrap())
+            });
+        }
+    }
+    g.finish();
+}
+
+criterion_group!(benches, bench_compile, bench_messages, bench_report);
+criterion_main!(benches);
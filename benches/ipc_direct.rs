@@ -0,0 +1,150 @@
+//! Report-to-update round trip over the in-process transports.
+//!
+//! The stand-in datapath delivers one measurement; the flow's `on_report` answers with an
+//! `update_field`, and the iteration ends when the datapath has that update. `chan` goes through
+//! the runtime thread and two channel hops; `direct` is a function call in each direction.
+
+use criterion::{criterion_group, criterion_main, Criterion};
+use crossbeam::channel;
+use portus::ipc::{chan, direct, BackendBuilder, Blocking, Ipc};
+use portus::lang::Scope;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, DirectRuntime, Flow, Report};
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+
+struct EchoAlg;
+
+struct EchoFlow<I: Ipc> {
+    dp: Datapath<I>,
+    sc: Scope,
+}
+
+impl<I: Ipc> CongAlg<I> for EchoAlg {
+    type Flow = EchoFlow<I>;
+
+    fn name() -> &'static str {
+        "echo"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "echo",
+            "
+            (def (Report.acked 0) (target 0))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        let sc = dp.set_program("echo", None).unwrap();
+        EchoFlow { dp, sc }
+    }
+}
+
+impl<I: Ipc> Flow for EchoFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        self.dp
+            .update_field(&self.sc, &[("target", acked as u32)])
+            .unwrap();
+    }
+}
+
+fn ready_msg() -> Vec<u8> {
+    serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap()
+}
+
+fn create_msg() -> Vec<u8> {
+    serialize::serialize(&serialize::create::Msg {
+        sid: 1,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap()
+}
+
+fn measure_msg(program_uid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::measure::Msg {
+        sid: 1,
+        program_uid,
+        num_fields: 1,
+        fields: vec![1448],
+    })
+    .unwrap()
+}
+
+// The program uid in a change-program message.
+fn changeprog_uid(buf: &[u8]) -> u32 {
+    u32::from_le_bytes([buf[8], buf[9], buf[10], buf[11]])
+}
+
+fn bench_chan(c: &mut Criterion) {
+    let (to_dp, from_ccp) = channel::unbounded();
+    let (to_ccp, from_dp) = channel::unbounded();
+    let sock = chan::Socket::<Blocking>::new(to_dp, from_dp);
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(EchoAlg)
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    to_ccp.send(ready_msg()).unwrap();
+    from_ccp.recv().unwrap(); // install
+    to_ccp.send(create_msg()).unwrap();
+    let program_uid = changeprog_uid(&from_ccp.recv().unwrap());
+    let measure = measure_msg(program_uid);
+
+    c.bench_function("report round trip: chan", |b| {
+        b.iter(|| {
+            to_ccp.send(measure.clone()).unwrap();
+            from_ccp.recv().unwrap()
+        })
+    });
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
+
+fn bench_direct(c: &mut Criterion) {
+    let updates = Arc::new(AtomicUsize::new(0));
+    let changeprog_uid_seen = Arc::new(AtomicUsize::new(0));
+    let (u, p) = (updates.clone(), changeprog_uid_seen.clone());
+    let sock = direct::Socket::new(move |msg| {
+        match msg[0] {
+            3 => {
+                u.fetch_add(1, Ordering::Relaxed);
+            }
+            4 => p.store(changeprog_uid(msg) as usize, Ordering::Relaxed),
+            _ => (),
+        }
+
+        Ok(())
+    });
+    let mut rt = DirectRuntime::new(sock, EchoAlg).unwrap();
+
+    rt.recv_msg(&ready_msg()).unwrap();
+    rt.recv_msg(&create_msg()).unwrap();
+    let measure = measure_msg(changeprog_uid_seen.load(Ordering::Relaxed) as u32);
+
+    c.bench_function("report round trip: direct", |b| {
+        b.iter(|| rt.recv_msg(&measure).unwrap())
+    });
+
+    assert!(updates.load(Ordering::Relaxed) > 0);
+}
+
+criterion_group!(benches, bench_chan, bench_direct);
+criterion_main!(benches);
@@ -0,0 +1,161 @@
+//! `#[derive(CcpMessage)]` encoders and decoders against the hand-written implementations they
+//! replaced, which are reproduced here for `create` and `measure`.
+
+use byteorder::{ByteOrder, LittleEndian};
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use portus::serialize::{self, create, measure, AsRawMsg, RawMsg, HDR_LENGTH};
+use portus::Result;
+use std::io::prelude::*;
+
+#[derive(Clone)]
+struct HandCreate(create::Msg);
+
+impl AsRawMsg for HandCreate {
+    fn get_hdr(&self) -> (u8, u32, u32) {
+        (0, HDR_LENGTH + 6 * 4 + 64, self.0.sid)
+    }
+
+    fn get_u32s<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 4];
+        for x in &[
+            self.0.init_cwnd,
+            self.0.mss,
+            self.0.src_ip,
+            self.0.src_port,
+            self.0.dst_ip,
+            self.0.dst_port,
+        ] {
+            LittleEndian::write_u32(&mut buf, *x);
+            w.write_all(&buf[..])?;
+        }
+
+        Ok(())
+    }
+
+    fn get_bytes<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 64];
+        if let Some(c) = &self.0.cong_alg {
+            buf[..c.len()].copy_from_slice(c.as_bytes());
+        }
+
+        w.write_all(&buf)?;
+        Ok(())
+    }
+
+    fn from_raw_msg(msg: RawMsg) -> Result<Self> {
+        let b = msg.payload();
+        let u32s: Vec<u32> = b[..24].chunks(4).map(LittleEndian::read_u32).collect();
+        let name = &b[24..];
+        let cong_alg = if name[0] == 0 {
+            None
+        } else {
+            let end = name.iter().position(|&c| c == b'\0').unwrap_or(name.len());
+            Some(std::str::from_utf8(&name[..end])?.to_owned())
+        };
+
+        Ok(HandCreate(create::Msg {
+            sid: msg.sid,
+            init_cwnd: u32s[0],
+            mss: u32s[1],
+            src_ip: u32s[2],
+            src_port: u32s[3],
+            dst_ip: u32s[4],
+            dst_port: u32s[5],
+            cong_alg,
+        }))
+    }
+}
+
+#[derive(Clone)]
+struct HandMeasure(measure::Msg);
+
+impl AsRawMsg for HandMeasure {
+    fn get_hdr(&self) -> (u8, u32, u32) {
+        (
+            1,
+            HDR_LENGTH + 8 + u32::from(self.0.num_fields) * 8,
+            self.0.sid,
+        )
+    }
+
+    fn get_u32s<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 4];
+        LittleEndian::write_u32(&mut buf, self.0.program_uid);
+        w.write_all(&buf[..])?;
+        LittleEndian::write_u32(&mut buf, u32::from(self.0.num_fields));
+        w.write_all(&buf[..])?;
+        Ok(())
+    }
+
+    fn get_bytes<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 8];
+        for f in &self.0.fields {
+            LittleEndian::write_u64(&mut buf, *f);
+            w.write_all(&buf[..])?;
+        }
+
+        Ok(())
+    }
+
+    fn from_raw_msg(msg: RawMsg) -> Result<Self> {
+        let b = msg.payload();
+        Ok(HandMeasure(measure::Msg {
+            sid: msg.sid,
+            program_uid: LittleEndian::read_u32(&b[0..4]),
+            num_fields: LittleEndian::read_u32(&b[4..8]) as u8,
+            fields: b[8..].chunks(8).map(LittleEndian::read_u64).collect(),
+        }))
+    }
+}
+
+fn create_msg() -> create::Msg {
+    create::Msg {
+        sid: 15,
+        init_cwnd: 1448 * 10,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: Some(String::from("reno")),
+    }
+}
+
+fn measure_msg() -> measure::Msg {
+    measure::Msg {
+        sid: 15,
+        program_uid: 72,
+        num_fields: 5,
+        fields: vec![424242, 65535, 65530, 200000, 150000],
+    }
+}
+
+fn bench_pair<D: AsRawMsg, H: AsRawMsg>(c: &mut Criterion, name: &str, derived: D, hand: H) {
+    let mut g = c.benchmark_group(name);
+    g.bench_function("encode/derived", |b| {
+        b.iter(|| serialize::serialize(black_box(&derived)).unwrap())
+    });
+    g.bench_function("encode/hand-written", |b| {
+        b.iter(|| serialize::serialize(black_box(&hand)).unwrap())
+    });
+
+    let buf = serialize::serialize(&derived).unwrap();
+    g.bench_function("decode/derived", |b| {
+        b.iter(|| D::from_raw_msg(RawMsg::parse(black_box(&buf)).unwrap()).unwrap())
+    });
+    g.bench_function("decode/hand-written", |b| {
+        b.iter(|| H::from_raw_msg(RawMsg::parse(black_box(&buf)).unwrap()).unwrap())
+    });
+    g.finish();
+}
+
+fn bench_create(c: &mut Criterion) {
+    bench_pair(c, "create", create_msg(), HandCreate(create_msg()));
+}
+
+fn bench_measure(c: &mut Criterion) {
+    bench_pair(c, "measure", measure_msg(), HandMeasure(measure_msg()));
+}
+
+criterion_group!(benches, bench_create, bench_measure);
+criterion_main!(benches);
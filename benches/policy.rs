@@ -0,0 +1,71 @@
+//! Policy lookups on the create path: a table of random prefixes and port ranges, looked up with
+//! random destinations, for a small and a large table.
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use portus::policy::Policy;
+
+// A deterministic xorshift, so every run looks up the same destinations.
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+fn table(rules: usize, rng: &mut Rng) -> String {
+    (0..rules)
+        .map(|i| {
+            let addr = rng.next() as u32;
+            let len = 8 + rng.next() % 25;
+            let ports = match i % 3 {
+                0 => String::from("*"),
+                1 => format!("{}", rng.next() % 65536),
+                _ => {
+                    let lo = rng.next() % 60000;
+                    format!("{}-{}", lo, lo + rng.next() % 5000)
+                }
+            };
+            format!(
+                "{}/{} {} alg{}\n",
+                std::net::Ipv4Addr::from(addr),
+                len,
+                ports,
+                i % 8
+            )
+        })
+        .collect()
+}
+
+fn bench_lookup(c: &mut Criterion) {
+    let mut rng = Rng(0x2545_f491_4f6c_dd1d);
+    let flows: Vec<(u32, u32)> = (0..4096)
+        .map(|_| (rng.next() as u32, (rng.next() % 65536) as u32))
+        .collect();
+
+    let mut g = c.benchmark_group("policy");
+    g.throughput(Throughput::Elements(flows.len() as u64));
+    for &rules in &[16, 10_000] {
+        let p = Policy::parse(&table(rules, &mut rng)).unwrap();
+        g.bench_with_input(BenchmarkId::new("lookup", rules), &p, |b, p| {
+            b.iter(|| {
+                flows
+                    .iter()
+                    .filter(|&&(ip, port)| p.lookup(black_box(ip), black_box(port)).is_some())
+                    .count()
+            })
+        });
+    }
+
+    g.bench_function("compile/10000", |b| {
+        let t = table(10_000, &mut rng);
+        b.iter(|| Policy::parse(black_box(&t)).unwrap())
+    });
+    g.finish();
+}
+
+criterion_group!(benches, bench_lookup);
+criterion_main!(benches);
@@ -0,0 +1,43 @@
+//! `cargo +nightly fuzz run from_buf`
+//!
+//! Parse an arbitrary buffer of back-to-back datapath messages, as `Backend` does, along with the
+//! zero-copy views. Nothing may panic.
+
+#![no_main]
+use libfuzzer_sys::fuzz_target;
+use portus::serialize::{CreateView, MeasureView, Msg, RawMsg};
+
+fuzz_target!(|data: &[u8]| {
+    let mut rest = data;
+    while let Ok((msg, consumed)) = Msg::from_buf(rest) {
+        match msg {
+            Msg::Other(raw) => {
+                let _ = raw.get_bytes();
+            }
+            Msg::BatchMs(batch) => {
+                assert_eq!(batch.iter().len(), batch.num_reports());
+                for r in batch {
+                    assert_eq!(r.fields().len(), r.num_fields());
+                }
+            }
+            _ => (),
+        }
+
+        if consumed == 0 || consumed >= rest.len() {
+            break;
+        }
+
+        rest = &rest[consumed..];
+    }
+
+    if let Ok(raw) = RawMsg::parse(data) {
+        if let Ok(v) = MeasureView::new(&raw) {
+            assert_eq!(v.fields().len(), v.num_fields());
+            let _ = v.program_uid();
+        }
+
+        if let Ok(v) = CreateView::new(&raw) {
+            let _ = (v.init_cwnd(), v.dst_port(), v.cong_alg());
+        }
+    }
+});
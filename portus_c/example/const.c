@@ -0,0 +1,83 @@
+/*
+ * Sets a constant congestion window and logs the acked bytes of each report.
+ *
+ * cargo build --release --manifest-path portus_c/Cargo.toml
+ * cc -Iportus_c/include portus_c/example/const.c -Lportus_c/target/release -lportus_c -o const
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "portus.h"
+
+#define CWND_PKTS 10
+
+static const char *PROGRAM =
+    "(def (Report (volatile acked 0) (volatile rtt 0)))"
+    "(when true"
+    "    (:= Report.acked (+ Report.acked Ack.bytes_acked))"
+    "    (:= Report.rtt Flow.rtt_sample_us)"
+    "    (fallthrough))"
+    "(when (> Micros Report.rtt)"
+    "    (report)"
+    "    (:= Micros 0))";
+
+struct alg {
+    int32_t acked_idx;
+    int32_t cwnd;
+};
+
+struct flow {
+    uint32_t mss;
+};
+
+static void *new_flow(void *alg_state, ccp_datapath *dp, const ccp_datapath_info *info) {
+    struct alg *alg = alg_state;
+    struct flow *flow = malloc(sizeof(*flow));
+    flow->mss = info->mss;
+
+    ccp_update cwnd = { .field = alg->cwnd, .value = CWND_PKTS * info->mss };
+    if (ccp_datapath_set_program(dp, "const", &cwnd, 1) < 0) {
+        fprintf(stderr, "flow %u: set_program failed\n", info->sock_id);
+    }
+
+    return flow;
+}
+
+static struct alg ALG;
+
+static void on_report(void *flow_state, ccp_datapath *dp, const uint64_t *fields, size_t num_fields) {
+    (void)flow_state;
+    (void)num_fields;
+    fprintf(stderr, "flow %u: acked %llu\n", ccp_datapath_sock_id(dp),
+            (unsigned long long)fields[ALG.acked_idx]);
+}
+
+static void close_flow(void *flow_state) {
+    free(flow_state);
+}
+
+int main(void) {
+    ccp_program programs[] = { { .name = "const", .source = PROGRAM } };
+    ccp_alg_callbacks callbacks = {
+        .new_flow = new_flow,
+        .on_report = on_report,
+        .close = close_flow,
+    };
+
+    ccp_alg *alg = ccp_alg_new(programs, 1, callbacks, &ALG);
+    if (!alg) {
+        return 1;
+    }
+
+    ALG.acked_idx = ccp_report_field_index(alg, "const", "Report.acked");
+    ALG.cwnd = ccp_update_field_handle(alg, "const", "Cwnd");
+    if (ALG.acked_idx < 0 || ALG.cwnd < 0) {
+        fprintf(stderr, "failed to resolve fields\n");
+        return 1;
+    }
+
+    int ret = ccp_run("unix", alg);
+    ccp_alg_free(alg);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * C interface to portus, for congestion control algorithms written in C or C++.
+ *
+ * An algorithm is a set of named datapath programs plus three callbacks. Register them with
+ * `ccp_alg_new`, resolve the fields you read and write once with `ccp_report_field_index` and
+ * `ccp_update_field_handle`, then call `ccp_run`, which blocks and dispatches datapath messages
+ * to the callbacks on the calling thread.
+ *
+ * Reports are delivered as a pointer to the report registers plus their count; the pointer is
+ * only valid for the duration of the `on_report` call.
+ */
+
+#ifndef PORTUS_H
+#define PORTUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A registered algorithm. Owned by the caller; free it with `ccp_alg_free`. */
+typedef struct ccp_alg ccp_alg;
+
+/* A handle to the datapath of one flow. Valid from `new_flow` until `close` returns. */
+typedef struct ccp_datapath ccp_datapath;
+
+typedef struct ccp_datapath_info {
+    uint32_t sock_id;
+    uint32_t init_cwnd;
+    uint32_t mss;
+    uint32_t src_ip;
+    uint32_t src_port;
+    uint32_t dst_ip;
+    uint32_t dst_port;
+} ccp_datapath_info;
+
+typedef struct ccp_program {
+    /* unique name used with `ccp_datapath_set_program` */
+    const char *name;
+    /* datapath program source */
+    const char *source;
+} ccp_program;
+
+/* A field update: `field` is a handle from `ccp_update_field_handle`. */
+typedef struct ccp_update {
+    int32_t field;
+    uint64_t value;
+} ccp_update;
+
+typedef struct ccp_alg_callbacks {
+    /* Called for each new flow. Returns the flow's state, passed back to `on_report` and
+     * `close`. Typically calls `ccp_datapath_set_program`. */
+    void *(*new_flow)(void *alg_state, ccp_datapath *dp, const ccp_datapath_info *info);
+
+    /* Called for each report from the flow's current program. `fields[i]` is the value of the
+     * report field whose index `ccp_report_field_index` returned as `i`. Reports from a program
+     * other than the current one are dropped before this is called. */
+    void (*on_report)(void *flow_state, ccp_datapath *dp, const uint64_t *fields, size_t num_fields);
+
+    /* Called when the flow ends; frees `flow_state`. May be NULL. */
+    void (*close)(void *flow_state);
+} ccp_alg_callbacks;
+
+/* Compile `programs` and register the callbacks. The programs are copied.
+ * Returns NULL if a program fails to compile or an argument is invalid. */
+ccp_alg *ccp_alg_new(const ccp_program *programs,
+                     size_t num_programs,
+                     ccp_alg_callbacks callbacks,
+                     void *alg_state);
+
+void ccp_alg_free(ccp_alg *alg);
+
+/* Index of `field` (e.g. "Report.acked") in the `fields` array passed to `on_report`, or -1 if
+ * `program` has no such report field. */
+int32_t ccp_report_field_index(const ccp_alg *alg, const char *program, const char *field);
+
+/* Handle for updating `field` (a control register, "Cwnd" or "Rate") of `program`, for use in
+ * `ccp_update`, or -1 if the field cannot be updated. */
+int32_t ccp_update_field_handle(const ccp_alg *alg, const char *program, const char *field);
+
+/* Switch the flow to `program`, applying `updates` (handles resolved against `program`).
+ * Returns 0 on success, -1 on error. */
+int ccp_datapath_set_program(ccp_datapath *dp,
+                             const char *program,
+                             const ccp_update *updates,
+                             size_t num_updates);
+
+/* Update fields of the flow's current program. Returns 0 on success, -1 on error, including
+ * when a handle was resolved against a different program. */
+int ccp_datapath_update_fields(ccp_datapath *dp, const ccp_update *updates, size_t num_updates);
+
+uint32_t ccp_datapath_sock_id(const ccp_datapath *dp);
+
+/* Run `alg` over `ipc` ("unix", or "netlink" on Linux). Blocks until the IPC fails.
+ * Returns -1 on error. */
+int ccp_run(const char *ipc, const ccp_alg *alg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PORTUS_H */
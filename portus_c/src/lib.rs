@@ -0,0 +1,558 @@
+//! A C ABI for portus, so congestion control algorithms written in C or C++ can run on the portus
+//! runtime without an interpreter in the loop. See `include/portus.h` for the interface.
+//!
+//! Field names are resolved once, against the compiled programs, into report indices and update
+//! handles; after that, each report is a single call into the algorithm with a pointer to the
+//! report registers, and each update serializes pre-resolved registers directly.
+
+#![allow(non_camel_case_types)]
+
+use portus::ipc::{self, BackendBuilder, Ipc};
+use portus::lang::{Reg, Scope};
+use portus::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::ffi::CStr;
+use std::os::raw::{c_char, c_int, c_void};
+
+#[repr(C)]
+pub struct ccp_datapath_info {
+    pub sock_id: u32,
+    pub init_cwnd: u32,
+    pub mss: u32,
+    pub src_ip: u32,
+    pub src_port: u32,
+    pub dst_ip: u32,
+    pub dst_port: u32,
+}
+
+#[repr(C)]
+pub struct ccp_program {
+    pub name: *const c_char,
+    pub source: *const c_char,
+}
+
+#[repr(C)]
+pub struct ccp_update {
+    pub field: i32,
+    pub value: u64,
+}
+
+type NewFlowFn =
+    unsafe extern "C" fn(*mut c_void, *mut ccp_datapath, *const ccp_datapath_info) -> *mut c_void;
+type OnReportFn = unsafe extern "C" fn(*mut c_void, *mut ccp_datapath, *const u64, usize);
+type CloseFn = unsafe extern "C" fn(*mut c_void);
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct ccp_alg_callbacks {
+    pub new_flow: Option<NewFlowFn>,
+    pub on_report: Option<OnReportFn>,
+    pub close: Option<CloseFn>,
+}
+
+struct Program {
+    name: &'static str,
+    source: String,
+    scope: Scope,
+}
+
+pub struct ccp_alg {
+    programs: Vec<Program>,
+    /// Update handles: the index of the program the register was resolved against, and the
+    /// register itself.
+    update_regs: RefCell<Vec<(usize, Reg)>>,
+    new_flow: NewFlowFn,
+    on_report: OnReportFn,
+    close: Option<CloseFn>,
+    state: *mut c_void,
+}
+
+impl ccp_alg {
+    fn program_idx(&self, name: &str) -> Option<usize> {
+        self.programs.iter().position(|p| p.name == name)
+    }
+
+    fn resolve_updates(
+        &self,
+        prog_idx: usize,
+        updates: &[ccp_update],
+    ) -> portus::Result<Vec<(Reg, u64)>> {
+        let regs = self.update_regs.borrow();
+        updates
+            .iter()
+            .map(|u| match regs.get(u.field as usize) {
+                Some((p, reg)) if u.field >= 0 && *p == prog_idx => Ok((reg.clone(), u.value)),
+                Some(_) if u.field >= 0 => Err(portus::Error(format!(
+                    "field handle {} belongs to a different program",
+                    u.field
+                ))),
+                _ => Err(portus::Error(format!("invalid field handle {}", u.field))),
+            })
+            .collect()
+    }
+}
+
+/// Object-safe view of `Datapath<I>`, so the C side sees one `ccp_datapath` type regardless of
+/// the IPC mechanism.
+trait RawDatapath {
+    fn sock_id(&self) -> u32;
+    fn set_program_regs(&mut self, name: &str, fields: Vec<(Reg, u64)>) -> portus::Result<Scope>;
+    fn update_regs(&self, fields: Vec<(Reg, u64)>) -> portus::Result<()>;
+}
+
+impl<I: Ipc + 'static> RawDatapath for Datapath<I> {
+    fn sock_id(&self) -> u32 {
+        portus::DatapathTrait::get_sock_id(self)
+    }
+
+    fn set_program_regs(&mut self, name: &str, fields: Vec<(Reg, u64)>) -> portus::Result<Scope> {
+        Datapath::set_program_regs(self, name, fields)
+    }
+
+    fn update_regs(&self, fields: Vec<(Reg, u64)>) -> portus::Result<()> {
+        Datapath::update_regs(self, fields)
+    }
+}
+
+pub struct ccp_datapath {
+    inner: Box<dyn RawDatapath>,
+    // valid for as long as `ccp_run` is running, which outlives every flow.
+    alg: *const ccp_alg,
+    /// The current program's index in `alg.programs`, and the uid the runtime assigned it.
+    current: Option<(usize, u32)>,
+}
+
+struct CFlow {
+    state: *mut c_void,
+    dp: Box<ccp_datapath>,
+    on_report: OnReportFn,
+    close: Option<CloseFn>,
+}
+
+impl Flow for CFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        match self.dp.current {
+            Some((_, uid)) if uid == m.program_uid => (),
+            _ => {
+                tracing::debug!(?sock_id, ?m.program_uid, "Report is stale, ignoring");
+                return;
+            }
+        }
+
+        let fields = m.fields();
+        unsafe { (self.on_report)(self.state, &mut *self.dp, fields.as_ptr(), fields.len()) };
+    }
+
+    fn close(&mut self) {
+        if let Some(close) = self.close {
+            unsafe { close(self.state) };
+        }
+    }
+}
+
+struct CAlg<'a>(&'a ccp_alg);
+
+impl<'a, I: Ipc + 'static> CongAlg<I> for CAlg<'a> {
+    type Flow = CFlow;
+
+    fn name() -> &'static str {
+        "c"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        self.0
+            .programs
+            .iter()
+            .map(|p| (p.name, p.source.clone()))
+            .collect()
+    }
+
+    fn new_flow(&self, control: Datapath<I>, info: DatapathInfo) -> Self::Flow {
+        tracing::debug!(sock_id = ?info.sock_id, "New flow");
+        let mut dp = Box::new(ccp_datapath {
+            inner: Box::new(control),
+            alg: self.0,
+            current: None,
+        });
+        let info = ccp_datapath_info {
+            sock_id: info.sock_id,
+            init_cwnd: info.init_cwnd,
+            mss: info.mss,
+            src_ip: info.src_ip,
+            src_port: info.src_port,
+            dst_ip: info.dst_ip,
+            dst_port: info.dst_port,
+        };
+
+        let state = unsafe { (self.0.new_flow)(self.0.state, &mut *dp, &info) };
+        CFlow {
+            state,
+            dp,
+            on_report: self.0.on_report,
+            close: self.0.close,
+        }
+    }
+}
+
+unsafe fn str_arg<'a>(s: *const c_char) -> Option<&'a str> {
+    if s.is_null() {
+        return None;
+    }
+
+    CStr::from_ptr(s).to_str().ok()
+}
+
+unsafe fn slice_arg<'a, T>(p: *const T, len: usize) -> Option<&'a [T]> {
+    if len == 0 {
+        Some(&[])
+    } else if p.is_null() {
+        None
+    } else {
+        Some(std::slice::from_raw_parts(p, len))
+    }
+}
+
+/// # Safety
+/// `programs` must point to `num_programs` entries whose strings are valid NUL-terminated
+/// strings. `alg_state` is passed to `new_flow` unchanged.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_alg_new(
+    programs: *const ccp_program,
+    num_programs: usize,
+    callbacks: ccp_alg_callbacks,
+    alg_state: *mut c_void,
+) -> *mut ccp_alg {
+    let (new_flow, on_report) = match (callbacks.new_flow, callbacks.on_report) {
+        (Some(n), Some(r)) => (n, r),
+        _ => {
+            tracing::error!("new_flow and on_report callbacks are required");
+            return std::ptr::null_mut();
+        }
+    };
+
+    let programs = match slice_arg(programs, num_programs) {
+        Some(p) => p,
+        None => return std::ptr::null_mut(),
+    };
+
+    let mut compiled = Vec::with_capacity(programs.len());
+    for p in programs {
+        let (name, source) = match (str_arg(p.name), str_arg(p.source)) {
+            (Some(n), Some(s)) => (n, s),
+            _ => {
+                tracing::error!("program name and source must be valid UTF-8 strings");
+                return std::ptr::null_mut();
+            }
+        };
+
+        let scope = match portus::lang::compile(source.as_bytes(), &[]) {
+            Ok((_, sc)) => sc,
+            Err(e) => {
+                tracing::error!(?name, err = ?e, "datapath program failed to compile");
+                return std::ptr::null_mut();
+            }
+        };
+
+        compiled.push(Program {
+            // program names are registered once per process; portus needs them to be 'static.
+            name: Box::leak(name.to_owned().into_boxed_str()),
+            source: source.to_owned(),
+            scope,
+        });
+    }
+
+    Box::into_raw(Box::new(ccp_alg {
+        programs: compiled,
+        update_regs: Default::default(),
+        new_flow,
+        on_report,
+        close: callbacks.close,
+        state: alg_state,
+    }))
+}
+
+/// # Safety
+/// `alg` must come from `ccp_alg_new` and must not be in use by `ccp_run`.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_alg_free(alg: *mut ccp_alg) {
+    if !alg.is_null() {
+        drop(Box::from_raw(alg));
+    }
+}
+
+/// # Safety
+/// `alg` must come from `ccp_alg_new`; `program` and `field` must be NUL-terminated strings.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_report_field_index(
+    alg: *const ccp_alg,
+    program: *const c_char,
+    field: *const c_char,
+) -> i32 {
+    let alg = match alg.as_ref() {
+        Some(a) => a,
+        None => return -1,
+    };
+
+    match (str_arg(program), str_arg(field)) {
+        (Some(program), Some(field)) => alg
+            .program_idx(program)
+            .and_then(|i| alg.programs[i].scope.get(field))
+            .and_then(|reg| match *reg {
+                Reg::Report(idx, _, _) => Some(i32::from(idx)),
+                _ => None,
+            })
+            .unwrap_or(-1),
+        _ => -1,
+    }
+}
+
+/// # Safety
+/// `alg` must come from `ccp_alg_new`; `program` and `field` must be NUL-terminated strings.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_update_field_handle(
+    alg: *const ccp_alg,
+    program: *const c_char,
+    field: *const c_char,
+) -> i32 {
+    let alg = match alg.as_ref() {
+        Some(a) => a,
+        None => return -1,
+    };
+
+    let (program, field) = match (str_arg(program), str_arg(field)) {
+        (Some(p), Some(f)) => (p, f),
+        _ => return -1,
+    };
+
+    let prog_idx = match alg.program_idx(program) {
+        Some(i) => i,
+        None => return -1,
+    };
+
+    match portus::resolve_update_reg(&alg.programs[prog_idx].scope, field) {
+        Ok(reg) => {
+            let mut regs = alg.update_regs.borrow_mut();
+            if let Some(h) = regs.iter().position(|(p, r)| *p == prog_idx && *r == reg) {
+                return h as i32;
+            }
+
+            regs.push((prog_idx, reg));
+            (regs.len() - 1) as i32
+        }
+        Err(e) => {
+            tracing::debug!(?program, ?field, err = ?e, "cannot resolve update field");
+            -1
+        }
+    }
+}
+
+/// # Safety
+/// `dp` must be a datapath passed to a callback; `program` must be a NUL-terminated string and
+/// `updates` must point to `num_updates` entries.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_datapath_set_program(
+    dp: *mut ccp_datapath,
+    program: *const c_char,
+    updates: *const ccp_update,
+    num_updates: usize,
+) -> c_int {
+    let dp = match dp.as_mut() {
+        Some(d) => d,
+        None => return -1,
+    };
+
+    let alg = &*dp.alg;
+    let (program, updates) = match (str_arg(program), slice_arg(updates, num_updates)) {
+        (Some(p), Some(u)) => (p, u),
+        _ => return -1,
+    };
+
+    let res = alg
+        .program_idx(program)
+        .ok_or_else(|| portus::Error(format!("unknown datapath program: {:?}", program)))
+        .and_then(|idx| {
+            let fields = alg.resolve_updates(idx, updates)?;
+            let sc = dp.inner.set_program_regs(program, fields)?;
+            Ok((idx, sc.program_uid))
+        });
+
+    match res {
+        Ok(current) => {
+            dp.current = Some(current);
+            0
+        }
+        Err(e) => {
+            tracing::error!(sock_id = dp.inner.sock_id(), err = ?e, "set_program failed");
+            -1
+        }
+    }
+}
+
+/// # Safety
+/// `dp` must be a datapath passed to a callback and `updates` must point to `num_updates`
+/// entries.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_datapath_update_fields(
+    dp: *mut ccp_datapath,
+    updates: *const ccp_update,
+    num_updates: usize,
+) -> c_int {
+    let dp = match dp.as_ref() {
+        Some(d) => d,
+        None => return -1,
+    };
+
+    let updates = match slice_arg(updates, num_updates) {
+        Some(u) => u,
+        None => return -1,
+    };
+
+    let res = match dp.current {
+        Some((idx, _)) => (*dp.alg)
+            .resolve_updates(idx, updates)
+            .and_then(|fields| dp.inner.update_regs(fields)),
+        None => Err(portus::Error(String::from(
+            "no datapath program installed yet",
+        ))),
+    };
+
+    match res {
+        Ok(()) => 0,
+        Err(e) => {
+            tracing::error!(sock_id = dp.inner.sock_id(), err = ?e, "update_fields failed");
+            -1
+        }
+    }
+}
+
+/// # Safety
+/// `dp` must be a datapath passed to a callback.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_datapath_sock_id(dp: *const ccp_datapath) -> u32 {
+    dp.as_ref().map(|d| d.inner.sock_id()).unwrap_or(0)
+}
+
+/// # Safety
+/// `ipc` must be a NUL-terminated string and `alg` must come from `ccp_alg_new`.
+#[no_mangle]
+pub unsafe extern "C" fn ccp_run(ipc: *const c_char, alg: *const ccp_alg) -> c_int {
+    let (ipc, alg) = match (str_arg(ipc), alg.as_ref()) {
+        (Some(i), Some(a)) => (i, a),
+        _ => return -1,
+    };
+
+    let _ = tracing_subscriber::fmt::try_init();
+    tracing::info!(?ipc, "starting CCP");
+
+    // Don't unwind into C.
+    let res = std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| run(ipc, CAlg(alg))));
+    match res {
+        Ok(Ok(())) => 0,
+        Ok(Err(e)) => {
+            tracing::error!(err = ?e, "CCP exited");
+            -1
+        }
+        Err(_) => -1,
+    }
+}
+
+fn run(ipc: &str, alg: CAlg) -> portus::Result<()> {
+    match ipc {
+        "unix" => {
+            use ipc::unix::Socket;
+            let b = Socket::<ipc::Blocking>::new("portus").map(|sk| BackendBuilder { sock: sk })?;
+            portus::RunBuilder::new(b).default_alg(alg).run()
+        }
+        #[cfg(all(target_os = "linux"))]
+        "netlink" => {
+            use ipc::netlink::Socket;
+            let b = Socket::<ipc::Blocking>::new().map(|sk| BackendBuilder { sock: sk })?;
+            portus::RunBuilder::new(b).default_alg(alg).run()
+        }
+        _ => Err(portus::Error(format!("unsupported ipc: {:?}", ipc))),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::ffi::CString;
+
+    const PROG: &str = "
+        (def (Report (volatile acked 0) (volatile rtt 0)) (target 0))
+        (when true
+            (:= Report.acked (+ Report.acked Ack.bytes_acked))
+            (:= Report.rtt Flow.rtt_sample_us)
+            (report)
+        )
+    ";
+
+    unsafe extern "C" fn new_flow(
+        _: *mut c_void,
+        _: *mut ccp_datapath,
+        _: *const ccp_datapath_info,
+    ) -> *mut c_void {
+        std::ptr::null_mut()
+    }
+
+    unsafe extern "C" fn on_report(_: *mut c_void, _: *mut ccp_datapath, _: *const u64, _: usize) {}
+
+    #[test]
+    fn resolve_fields() {
+        let name = CString::new("prog").unwrap();
+        let source = CString::new(PROG).unwrap();
+        let programs = [ccp_program {
+            name: name.as_ptr(),
+            source: source.as_ptr(),
+        }];
+        let callbacks = ccp_alg_callbacks {
+            new_flow: Some(new_flow),
+            on_report: Some(on_report),
+            close: None,
+        };
+
+        let field = |s: &str| CString::new(s).unwrap();
+        unsafe {
+            let alg = ccp_alg_new(programs.as_ptr(), 1, callbacks, std::ptr::null_mut());
+            assert!(!alg.is_null());
+
+            let acked = ccp_report_field_index(alg, name.as_ptr(), field("Report.acked").as_ptr());
+            let rtt = ccp_report_field_index(alg, name.as_ptr(), field("Report.rtt").as_ptr());
+            assert_eq!(acked, 0);
+            assert_eq!(rtt, 1);
+            assert_eq!(
+                ccp_report_field_index(alg, name.as_ptr(), field("Report.nope").as_ptr()),
+                -1
+            );
+
+            let target = ccp_update_field_handle(alg, name.as_ptr(), field("target").as_ptr());
+            let cwnd = ccp_update_field_handle(alg, name.as_ptr(), field("Cwnd").as_ptr());
+            assert_eq!(target, 0);
+            assert_eq!(cwnd, 1);
+            assert_eq!(
+                ccp_update_field_handle(alg, name.as_ptr(), field("target").as_ptr()),
+                target
+            );
+            // report fields are not updatable
+            assert_eq!(
+                ccp_update_field_handle(alg, name.as_ptr(), field("Report.acked").as_ptr()),
+                -1
+            );
+
+            ccp_alg_free(alg);
+        }
+    }
+
+    #[test]
+    fn missing_callbacks() {
+        let callbacks = ccp_alg_callbacks {
+            new_flow: None,
+            on_report: Some(on_report),
+            close: None,
+        };
+
+        let alg = unsafe { ccp_alg_new(std::ptr::null(), 0, callbacks, std::ptr::null_mut()) };
+        assert!(alg.is_null());
+    }
+}
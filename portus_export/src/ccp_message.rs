@@ -0,0 +1,227 @@
+//! `#[derive(CcpMessage)]`: fixed-layout `AsRawMsg` implementations for CCP messages.
+//!
+//! A message is the CCP header, then its fixed fields as little-endian u32s in declaration
+//! order, then an optional variable-length tail:
+//!
+//! ```ignore
+//! #[derive(CcpMessage)]
+//! #[ccp(typ = MEASURE)]
+//! pub struct Msg {
+//!     #[ccp(sid)]
+//!     pub sid: u32,        // goes in the header
+//!     pub program_uid: u32,
+//!     pub num_fields: u8,  // widened to a u32 on the wire
+//!     #[ccp(tail)]
+//!     pub fields: Vec<u64>, // portus::serialize::MsgTail
+//! }
+//! ```
+//!
+//! `#[ccp(tail = path)]` uses the functions `path::tail_len`, `path::write_tail` and
+//! `path::read_tail` instead of the `MsgTail` trait.
+
+use proc_macro2::{Span, TokenStream};
+use quote::quote;
+use syn::parse::{Parse, ParseStream};
+use syn::spanned::Spanned;
+use syn::{Data, DeriveInput, Error, Expr, Fields, Ident, Path, Result, Token, Type};
+
+struct MsgAttr {
+    typ: Expr,
+}
+
+impl Parse for MsgAttr {
+    fn parse(input: ParseStream) -> Result<Self> {
+        let key: Ident = input.parse()?;
+        if key != "typ" {
+            return Err(Error::new(key.span(), "expected `typ = <message type>`"));
+        }
+
+        input.parse::<Token![=]>()?;
+        Ok(MsgAttr {
+            typ: input.parse()?,
+        })
+    }
+}
+
+enum FieldAttr {
+    Sid,
+    Tail(Option<Path>),
+}
+
+impl Parse for FieldAttr {
+    fn parse(input: ParseStream) -> Result<Self> {
+        let key: Ident = input.parse()?;
+        if key == "sid" {
+            Ok(FieldAttr::Sid)
+        } else if key == "tail" {
+            if input.peek(Token![=]) {
+                input.parse::<Token![=]>()?;
+                Ok(FieldAttr::Tail(Some(input.parse()?)))
+            } else {
+                Ok(FieldAttr::Tail(None))
+            }
+        } else {
+            Err(Error::new(
+                key.span(),
+                "expected `sid`, `tail`, or `tail = <path>`",
+            ))
+        }
+    }
+}
+
+fn ccp_attr<T: Parse>(attrs: &[syn::Attribute]) -> Result<Option<T>> {
+    let mut found = None;
+    for a in attrs.iter().filter(|a| a.path.is_ident("ccp")) {
+        if found.is_some() {
+            return Err(Error::new(a.span(), "duplicate #[ccp(..)] attribute"));
+        }
+
+        found = Some(a.parse_args()?);
+    }
+
+    Ok(found)
+}
+
+fn is_fixed_type(ty: &Type) -> bool {
+    match ty {
+        Type::Path(p) => {
+            p.qself.is_none() && ["u8", "u16", "u32"].iter().any(|t| p.path.is_ident(t))
+        }
+        _ => false,
+    }
+}
+
+pub fn expand(input: DeriveInput) -> Result<TokenStream> {
+    let name = &input.ident;
+    let typ = ccp_attr::<MsgAttr>(&input.attrs)?
+        .ok_or_else(|| Error::new(Span::call_site(), "missing #[ccp(typ = <message type>)]"))?
+        .typ;
+
+    let fields = match &input.data {
+        Data::Struct(s) => match &s.fields {
+            Fields::Named(f) => &f.named,
+            _ => return Err(Error::new(name.span(), "CcpMessage needs named fields")),
+        },
+        _ => {
+            return Err(Error::new(
+                name.span(),
+                "CcpMessage can only be derived for structs",
+            ))
+        }
+    };
+
+    let mut sid = None;
+    let mut tail = None;
+    let mut fixed = vec![];
+    for f in fields {
+        let ident = f.ident.clone().unwrap();
+        if tail.is_some() {
+            return Err(Error::new(f.span(), "the #[ccp(tail)] field must be last"));
+        }
+
+        match ccp_attr::<FieldAttr>(&f.attrs)? {
+            Some(FieldAttr::Sid) => {
+                if sid.is_some() {
+                    return Err(Error::new(f.span(), "only one field can be #[ccp(sid)]"));
+                }
+                sid = Some(ident);
+            }
+            Some(FieldAttr::Tail(with)) => tail = Some((ident, with)),
+            None if is_fixed_type(&f.ty) => fixed.push((ident, f.ty.clone())),
+            None => {
+                return Err(Error::new(
+                    f.ty.span(),
+                    "fixed fields must be u8, u16 or u32; mark other fields #[ccp(tail)]",
+                ))
+            }
+        }
+    }
+
+    let fixed_len = 4 * fixed.len();
+    let offsets: Vec<_> = (0..fixed.len()).map(|i| 4 * i).collect();
+    let ends: Vec<_> = offsets.iter().map(|o| o + 4).collect();
+    let fixed_idents: Vec<_> = fixed.iter().map(|(i, _)| i).collect();
+    let fixed_types: Vec<_> = fixed.iter().map(|(_, t)| t).collect();
+
+    let sid_get = match &sid {
+        Some(s) => quote!(self.#s),
+        None => quote!(0),
+    };
+    let sid_set = sid.iter().map(|s| quote!(#s: msg.sid,));
+
+    let (tail_len, tail_write, tail_read) = match &tail {
+        Some((f, Some(with))) => (
+            quote!(#with::tail_len(&self.#f)),
+            quote!(#with::write_tail(&self.#f, w)),
+            quote!(#f: #with::read_tail(&b[#fixed_len..])?,),
+        ),
+        Some((f, None)) => (
+            quote!(::portus::serialize::MsgTail::tail_len(&self.#f)),
+            quote!(::portus::serialize::MsgTail::write_tail(&self.#f, w)),
+            quote!(#f: ::portus::serialize::MsgTail::read_tail(&b[#fixed_len..])?,),
+        ),
+        None => (quote!(0), quote!(Ok(())), quote!()),
+    };
+
+    let (impl_generics, ty_generics, where_clause) = input.generics.split_for_impl();
+    Ok(quote! {
+        impl #impl_generics #name #ty_generics #where_clause {
+            /// Length in bytes of the header and fixed fields.
+            pub const FIXED_LEN: u32 = ::portus::serialize::HDR_LENGTH + #fixed_len as u32;
+        }
+
+        impl #impl_generics ::portus::serialize::AsRawMsg for #name #ty_generics #where_clause {
+            fn get_hdr(&self) -> (u8, u32, u32) {
+                (#typ, Self::FIXED_LEN.saturating_add(#tail_len), #sid_get)
+            }
+
+            fn get_u32s<W: ::std::io::Write>(&self, w: &mut W) -> ::portus::Result<()> {
+                let mut buf = [0u8; #fixed_len];
+                #(
+                    buf[#offsets..#ends].copy_from_slice(&u32::from(self.#fixed_idents).to_le_bytes());
+                )*
+                w.write_all(&buf[..])?;
+                Ok(())
+            }
+
+            fn get_bytes<W: ::std::io::Write>(&self, w: &mut W) -> ::portus::Result<()> {
+                #tail_write
+            }
+
+            fn from_raw_msg(msg: ::portus::serialize::RawMsg) -> ::portus::Result<Self> {
+                let b = msg.payload();
+                if b.len() < #fixed_len {
+                    return Err(::portus::Error(format!(
+                        "{} too short: {} < {} bytes",
+                        stringify!(#name),
+                        b.len(),
+                        #fixed_len
+                    )));
+                }
+
+                Ok(#name {
+                    #(
+                        #fixed_idents: {
+                            let v = u32::from_le_bytes([
+                                b[#offsets],
+                                b[#offsets + 1],
+                                b[#offsets + 2],
+                                b[#offsets + 3],
+                            ]);
+                            <#fixed_types as ::std::convert::TryFrom<u32>>::try_from(v).map_err(|_| {
+                                ::portus::Error(format!(
+                                    "{}.{} out of range: {}",
+                                    stringify!(#name),
+                                    stringify!(#fixed_idents),
+                                    v
+                                ))
+                            })?
+                        },
+                    )*
+                    #(#sid_set)*
+                    #tail_read
+                })
+            }
+        }
+    })
+}
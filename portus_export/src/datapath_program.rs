@@ -0,0 +1,62 @@
+//! `datapath_program!`: compile a datapath program while the algorithm crate builds.
+//!
+//! ```ignore
+//! h.insert("MyProgram", datapath_program!("
+//!     (def (Report (volatile acked 0)))
+//!     (when true
+//!         (:= Report.acked (+ Report.acked Ack.bytes_acked))
+//!     )
+//! "));
+//! ```
+//!
+//! The program is compiled with `portus_lang::compile`, which portus re-exports as
+//! `portus::lang::compile`, so a program that does not compile fails the build at the literal.
+//! The serialized `Bin` and the `Scope` layout are embedded in a
+//! `static portus::lang::Precompiled`, and the macro evaluates to the program text as a
+//! `String`, registering the static on the way. The portus runtime looks the text up and
+//! installs the embedded program without parsing it.
+
+use portus_lang as lang;
+use proc_macro2::{Literal, TokenStream};
+use quote::quote;
+use syn::{Error, LitStr, Result};
+
+pub fn expand(src: LitStr) -> Result<TokenStream> {
+    precompile(&src).map(|(program, _)| program)
+}
+
+/// The `datapath_program!` expansion for `src`, and the program's `Scope`.
+pub fn precompile(src: &LitStr) -> Result<(TokenStream, lang::Scope)> {
+    let source = src.value();
+    let (bin, scope) = lang::compile(source.as_bytes(), &[]).map_err(|e| {
+        Error::new(
+            src.span(),
+            format!("datapath program failed to compile: {}", e),
+        )
+    })?;
+    let num_events = bin.events.len() as u32;
+    let num_instrs = bin.instrs.len() as u32;
+    let bin = bin.serialize().map_err(|e| {
+        Error::new(
+            src.span(),
+            format!("datapath program failed to serialize: {}", e),
+        )
+    })?;
+    let bin = Literal::byte_string(&bin);
+    let layout = Literal::byte_string(&scope.layout());
+
+    let program = quote! {
+        {
+            static PROGRAM: ::portus::lang::Precompiled = ::portus::lang::Precompiled::new(
+                #src,
+                #bin,
+                #num_events,
+                #num_instrs,
+                #layout,
+            );
+            PROGRAM.register()
+        }
+    };
+
+    Ok((program, scope))
+}
@@ -0,0 +1,122 @@
+//! `datapath_report!`: a plain struct for a datapath program's report.
+//!
+//! ```ignore
+//! datapath_report! {
+//!     /// What `MyProgram` reports.
+//!     pub struct MyReport = "
+//!         (def (Report (volatile acked 0) (minrtt +infinity) (timeout false)))
+//!         ...
+//!     ";
+//! }
+//! ```
+//!
+//! compiles the program as `datapath_program!` does and generates
+//!
+//! ```ignore
+//! pub struct MyReport {
+//!     pub acked: u64,
+//!     pub minrtt: u64,
+//!     pub timeout: bool,
+//! }
+//! ```
+//!
+//! with `MyReport::program()` returning the (precompiled) program text, and an implementation of
+//! `portus::ReportStruct` that reads each field from its report index, fixed when the macro ran.
+//! Decode a report with `report.decode::<MyReport>(&scope)`.
+//!
+//! Field names drop the `Report.` prefix; any other `.` becomes `_`.
+
+use crate::datapath_program;
+use portus_lang::{Reg, Type};
+use proc_macro2::{Ident, Span, TokenStream};
+use quote::quote;
+use syn::parse::{Parse, ParseStream};
+use syn::{Attribute, Error, LitStr, Result, Token, Visibility};
+
+pub struct ReportDef {
+    attrs: Vec<Attribute>,
+    vis: Visibility,
+    name: Ident,
+    src: LitStr,
+}
+
+impl Parse for ReportDef {
+    fn parse(input: ParseStream) -> Result<Self> {
+        let attrs = input.call(Attribute::parse_outer)?;
+        let vis = input.parse()?;
+        input.parse::<Token![struct]>()?;
+        let name = input.parse()?;
+        input.parse::<Token![=]>()?;
+        let src = input.parse()?;
+        input.parse::<Token![;]>()?;
+        Ok(ReportDef {
+            attrs,
+            vis,
+            name,
+            src,
+        })
+    }
+}
+
+fn field_ident(reg_name: &str) -> Ident {
+    let name = reg_name.trim_start_matches("Report.").replace('.', "_");
+    let name = if name.starts_with(|c: char| c.is_ascii_digit()) {
+        format!("_{}", name)
+    } else {
+        name
+    };
+
+    syn::parse_str::<Ident>(&name).unwrap_or_else(|_| Ident::new_raw(&name, Span::call_site()))
+}
+
+pub fn expand(def: ReportDef) -> Result<TokenStream> {
+    let (program, scope) = datapath_program::precompile(&def.src)?;
+    let regs = scope.report_regs();
+    if regs.is_empty() {
+        return Err(Error::new(
+            def.src.span(),
+            "datapath program defines no Report fields",
+        ));
+    }
+
+    let names: Vec<_> = regs.iter().map(|(name, _)| *name).collect();
+    let idents: Vec<_> = names.iter().map(|n| field_ident(n)).collect();
+    let idxs: Vec<_> = (0..regs.len()).collect();
+    let (types, reads): (Vec<_>, Vec<_>) = regs
+        .iter()
+        .zip(&idxs)
+        .map(|((_, reg), i)| match reg {
+            Reg::Report(_, Type::Bool(_), _) => (quote!(bool), quote!(fields[#i] != 0)),
+            _ => (quote!(u64), quote!(fields[#i])),
+        })
+        .unzip();
+
+    let ReportDef {
+        attrs, vis, name, ..
+    } = def;
+    Ok(quote! {
+        #(#attrs)*
+        #[derive(Clone, Copy, Debug, PartialEq)]
+        #[allow(non_snake_case)]
+        #vis struct #name {
+            #(pub #idents: #types,)*
+        }
+
+        impl #name {
+            /// The datapath program, for `CongAlg::datapath_programs`.
+            #vis fn program() -> String {
+                #program
+            }
+        }
+
+        impl ::portus::ReportStruct for #name {
+            const FIELDS: &'static [&'static str] = &[#(#names),*];
+
+            fn from_fields(fields: &[u64]) -> Self {
+                #name {
+                    #(#idents: #reads,)*
+                }
+            }
+        }
+    })
+}
@@ -2,6 +2,10 @@ extern crate proc_macro;
 use proc_macro::TokenStream;
 use quote::quote;
 
+mod ccp_message;
+mod datapath_program;
+mod datapath_report;
+
 #[proc_macro_attribute]
 pub fn register_ccp_alg(_attr: TokenStream, item: TokenStream) -> TokenStream {
     let alg_struct = syn::parse_macro_input!(item as syn::ItemStruct);
@@ -12,3 +16,37 @@ pub fn register_ccp_alg(_attr: TokenStream, item: TokenStream) -> TokenStream {
     };
     result.into()
 }
+
+/// Derive `portus::serialize::AsRawMsg` for a fixed-layout CCP message.
+///
+/// See the `ccp_message` module for the layout and attributes.
+#[proc_macro_derive(CcpMessage, attributes(ccp))]
+pub fn derive_ccp_message(input: TokenStream) -> TokenStream {
+    let input = syn::parse_macro_input!(input as syn::DeriveInput);
+    ccp_message::expand(input)
+        .unwrap_or_else(|e| e.to_compile_error())
+        .into()
+}
+
+/// Compile a datapath program at build time.
+///
+/// Evaluates to the program text as a `String`, for `CongAlg::datapath_programs`. See the
+/// `datapath_program` module.
+#[proc_macro]
+pub fn datapath_program(input: TokenStream) -> TokenStream {
+    let src = syn::parse_macro_input!(input as syn::LitStr);
+    datapath_program::expand(src)
+        .unwrap_or_else(|e| e.to_compile_error())
+        .into()
+}
+
+/// Generate a struct of a datapath program's report fields, and compile the program.
+///
+/// See the `datapath_report` module.
+#[proc_macro]
+pub fn datapath_report(input: TokenStream) -> TokenStream {
+    let def = syn::parse_macro_input!(input as datapath_report::ReportDef);
+    datapath_report::expand(def)
+        .unwrap_or_else(|e| e.to_compile_error())
+        .into()
+}
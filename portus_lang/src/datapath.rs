@@ -456,6 +456,15 @@ macro_rules! get_next_uid {
     };
 }
 
+/// Allocate program uids above `base` from now on.
+///
+/// Each copy of portus counts program uids from 1. A host that loads several copies against one
+/// datapath (for example, two versions of an algorithm library) gives each a disjoint range so
+/// their programs do not collide.
+pub fn set_program_uid_base(base: u32) {
+    ID_COUNTER.fetch_max(base, Ordering::SeqCst);
+}
+
 impl Scope {
     /// Define variables always accessible in the datapath,
     /// in the context of the most recent packet.
@@ -516,6 +525,21 @@ impl Scope {
         self.named.get(name)
     }
 
+    /// The `Report` registers and their names, in the order their values appear in a report.
+    pub fn report_regs(&self) -> Vec<(&str, &Reg)> {
+        let mut regs: Vec<_> = self
+            .named
+            .0
+            .iter()
+            .filter_map(|(name, reg)| match reg {
+                Reg::Report(idx, _, _) => Some((*idx, name.as_str(), reg)),
+                _ => None,
+            })
+            .collect();
+        regs.sort_by_key(|&(idx, _, _)| idx);
+        regs.into_iter().map(|(_, name, reg)| (name, reg)).collect()
+    }
+
     pub(crate) fn new_tmp(&mut self, t: Type) -> Reg {
         let id = self.tmp.len() as u8;
         let r = Reg::Tmp(id, t);
@@ -632,8 +656,8 @@ impl IntoIterator for Scope {
 #[cfg(test)]
 mod tests {
     use super::{Bin, Event, Instr, Reg, Type};
-    use crate::lang::ast::Op;
-    use crate::lang::prog::Prog;
+    use crate::ast::Op;
+    use crate::prog::Prog;
     #[test]
     fn primitives() {
         let foo = b"
@@ -1,5 +1,8 @@
 //! The datapath program compiler.
 //!
+//! portus re-exports this crate as `portus::lang`. It is a crate of its own so that
+//! `portus_export` can compile programs at build time without depending on portus.
+//!
 //! Datapath programs consist of two parts:
 //! 1. Variable definitions
 //! 2. Event definitions
@@ -58,8 +61,7 @@
 //! Let's compile a program which would count the number of ECN-marked packets over 1 millisecond intervals.
 //!
 //! ```
-//! extern crate portus;
-//! use portus::lang;
+//! use portus_lang as lang;
 //!
 //! fn main() {
 //!     let my_cool_program = b"
@@ -185,13 +187,16 @@ macro_rules! named_complete {
 
 mod ast;
 mod datapath;
+mod precompiled;
 mod prog;
 mod serialize;
 
+pub use self::datapath::set_program_uid_base;
 pub use self::datapath::Bin;
 pub use self::datapath::Reg;
 pub use self::datapath::Scope;
 pub use self::datapath::Type;
+pub use self::precompiled::Precompiled;
 pub use self::prog::Prog;
 
 /// `compile()` uses 5 passes to yield Instrs.
@@ -222,89 +227,3 @@ pub fn compile(src: &[u8], updates: &[(&str, u32)]) -> Result<(Bin, Scope)> {
 pub fn compile_and_serialize(src: &[u8], updates: &[(&str, u32)]) -> Result<(Vec<u8>, Scope)> {
     compile(src, updates).and_then(|(b, s)| Ok((b.serialize()?, s)))
 }
-
-// TODO wait for feature(test)
-/*
-#[cfg(test)]
-mod tests {
-    extern crate test;
-    use self::test::Bencher;
-
-    #[bench]
-    fn bench_1_line_compileonly(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile(fold, &[]).unwrap())
-    }
-
-    #[bench]
-    fn bench_1_line(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile_and_serialize(fold, &[]).unwrap())
-    }
-
-    #[bench]
-    fn bench_2_line(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0) (Report.bar 0))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-                (:= Report.bar (+ Report.bar Ack.bytes_misordered))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile_and_serialize(fold, &[]).unwrap())
-    }
-
-    #[bench]
-    fn bench_ewma(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0) (Report.bar 0))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-                (:= Report.bar (ewma 2 Flow.rate_outgoing))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile_and_serialize(fold, &[]).unwrap())
-    }
-
-    #[bench]
-    fn bench_if(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0) (Report.bar false))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-                (bind Report.bar (!if Report.bar (> Ack.lost_pkts_sample 0)))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile_and_serialize(fold, &[]).unwrap())
-    }
-
-    #[bench]
-    fn bench_3_line(b: &mut Bencher) {
-        let fold = "
-            (def (Report.foo 0) (Report.bar 0) (Control.baz 0))
-            (when true
-                (:= Report.foo (+ Report.foo Ack.bytes_acked))
-                (:= Report.bar (+ Report.bar Ack.bytes_misordered))
-                (:= Report.baz (+ Report.bar Ack.ecn_bytes))
-            )
-        "
-        .as_bytes();
-        b.iter(|| super::compile_and_serialize(fold, &[]).unwrap())
-    }
-}
-*/
@@ -0,0 +1,326 @@
+//! Datapath programs compiled at build time by `portus_export::datapath_program!`.
+//!
+//! The macro runs `compile()` while the algorithm crate builds and embeds the serialized `Bin`
+//! and the `Scope` layout in a `static Precompiled`. At runtime, `Precompiled::find()` maps the
+//! program source back to that static, so CCP can install the program without parsing it.
+//!
+//! The layout encoding below is private to a single build: the macro and the runtime are built
+//! from the same `lang` sources.
+
+use super::datapath::{RegFile, Scope};
+use super::{Error, Reg, Result, Type};
+use std::ptr;
+use std::sync::atomic::{AtomicBool, AtomicPtr, Ordering};
+
+const LAYOUT_VERSION: u8 = 1;
+
+/// A program compiled by `datapath_program!`.
+pub struct Precompiled {
+    source: &'static str,
+    bin: &'static [u8],
+    num_events: u32,
+    num_instrs: u32,
+    layout: &'static [u8],
+    registered: AtomicBool,
+    next: AtomicPtr<Precompiled>,
+}
+
+// Registered programs, as an intrusive list through `Precompiled::next` so that registering
+// needs neither allocation nor locking.
+static REGISTERED: AtomicPtr<Precompiled> = AtomicPtr::new(ptr::null_mut());
+
+impl Precompiled {
+    #[doc(hidden)]
+    pub const fn new(
+        source: &'static str,
+        bin: &'static [u8],
+        num_events: u32,
+        num_instrs: u32,
+        layout: &'static [u8],
+    ) -> Self {
+        Precompiled {
+            source,
+            bin,
+            num_events,
+            num_instrs,
+            layout,
+            registered: AtomicBool::new(false),
+            next: AtomicPtr::new(ptr::null_mut()),
+        }
+    }
+
+    /// Make this program findable by its source, and return the source.
+    ///
+    /// `datapath_program!` calls this, so its value can go wherever program text did.
+    pub fn register(&'static self) -> String {
+        if self
+            .registered
+            .compare_exchange(false, true, Ordering::AcqRel, Ordering::Acquire)
+            .is_ok()
+        {
+            let me = self as *const Precompiled as *mut Precompiled;
+            let mut head = REGISTERED.load(Ordering::Acquire);
+            loop {
+                self.next.store(head, Ordering::Relaxed);
+                match REGISTERED.compare_exchange_weak(
+                    head,
+                    me,
+                    Ordering::AcqRel,
+                    Ordering::Acquire,
+                ) {
+                    Ok(_) => break,
+                    Err(h) => head = h,
+                }
+            }
+        }
+
+        self.source.to_owned()
+    }
+
+    /// The registered program with this source, if any.
+    pub fn find(source: &str) -> Option<&'static Precompiled> {
+        let mut p = REGISTERED.load(Ordering::Acquire);
+        // nodes are `&'static Precompiled`s, and are never removed.
+        while let Some(node) = unsafe { p.as_ref() } {
+            if node.source == source {
+                return Some(node);
+            }
+
+            p = node.next.load(Ordering::Acquire);
+        }
+
+        None
+    }
+
+    pub fn source(&self) -> &'static str {
+        self.source
+    }
+
+    /// The program's events and instructions, serialized as for an install message.
+    pub fn bin(&self) -> &'static [u8] {
+        self.bin
+    }
+
+    pub fn num_events(&self) -> u32 {
+        self.num_events
+    }
+
+    pub fn num_instrs(&self) -> u32 {
+        self.num_instrs
+    }
+
+    /// The program's `Scope`. Like `compile()`, each call allocates a new program uid.
+    pub fn scope(&self) -> Result<Scope> {
+        Scope::from_layout(self.layout)
+    }
+}
+
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8]> {
+        if self.0.len() < n {
+            return Err(Error::from("truncated scope layout"));
+        }
+
+        let (b, rest) = self.0.split_at(n);
+        self.0 = rest;
+        Ok(b)
+    }
+
+    fn u8(&mut self) -> Result<u8> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u64(&mut self) -> Result<u64> {
+        let mut b = [0u8; 8];
+        b.copy_from_slice(self.take(8)?);
+        Ok(u64::from_le_bytes(b))
+    }
+
+    fn str(&mut self) -> Result<String> {
+        let len = u16::from_le_bytes([self.u8()?, self.u8()?]) as usize;
+        Ok(String::from_utf8(self.take(len)?.to_vec())?)
+    }
+}
+
+fn write_str(buf: &mut Vec<u8>, s: &str) {
+    buf.extend_from_slice(&(s.len() as u16).to_le_bytes());
+    buf.extend_from_slice(s.as_bytes());
+}
+
+fn write_type(buf: &mut Vec<u8>, t: &Type) {
+    match t {
+        Type::Bool(None) => buf.push(0),
+        Type::Bool(Some(b)) => buf.extend_from_slice(&[1, *b as u8]),
+        Type::Name(n) => {
+            buf.push(2);
+            write_str(buf, n);
+        }
+        Type::Num(None) => buf.push(3),
+        Type::Num(Some(n)) => {
+            buf.push(4);
+            buf.extend_from_slice(&n.to_le_bytes());
+        }
+        Type::None => buf.push(5),
+    }
+}
+
+fn read_type(r: &mut Reader) -> Result<Type> {
+    Ok(match r.u8()? {
+        0 => Type::Bool(None),
+        1 => Type::Bool(Some(r.u8()? != 0)),
+        2 => Type::Name(r.str()?),
+        3 => Type::Num(None),
+        4 => Type::Num(Some(r.u64()?)),
+        5 => Type::None,
+        t => return Err(Error(format!("unknown type tag {} in scope layout", t))),
+    })
+}
+
+fn write_reg(buf: &mut Vec<u8>, reg: &Reg) {
+    match reg {
+        Reg::Control(i, t, v) | Reg::Report(i, t, v) => {
+            let tag = if let Reg::Control(..) = reg { 0 } else { 6 };
+            buf.extend_from_slice(&[tag, *i, *v as u8]);
+            write_type(buf, t);
+        }
+        Reg::ImmNum(n) => {
+            buf.push(1);
+            buf.extend_from_slice(&n.to_le_bytes());
+        }
+        Reg::ImmBool(b) => buf.extend_from_slice(&[2, *b as u8]),
+        Reg::Implicit(i, t) | Reg::Local(i, t) | Reg::Primitive(i, t) | Reg::Tmp(i, t) => {
+            let tag = match reg {
+                Reg::Implicit(..) => 3,
+                Reg::Local(..) => 4,
+                Reg::Primitive(..) => 5,
+                _ => 7,
+            };
+            buf.extend_from_slice(&[tag, *i]);
+            write_type(buf, t);
+        }
+        Reg::None => buf.push(8),
+    }
+}
+
+fn read_reg(r: &mut Reader) -> Result<Reg> {
+    Ok(match r.u8()? {
+        tag @ 0 | tag @ 6 => {
+            let (i, v) = (r.u8()?, r.u8()? != 0);
+            let t = read_type(r)?;
+            if tag == 0 {
+                Reg::Control(i, t, v)
+            } else {
+                Reg::Report(i, t, v)
+            }
+        }
+        1 => Reg::ImmNum(r.u64()?),
+        2 => Reg::ImmBool(r.u8()? != 0),
+        tag @ 3..=5 | tag @ 7 => {
+            let i = r.u8()?;
+            let t = read_type(r)?;
+            match tag {
+                3 => Reg::Implicit(i, t),
+                4 => Reg::Local(i, t),
+                5 => Reg::Primitive(i, t),
+                _ => Reg::Tmp(i, t),
+            }
+        }
+        8 => Reg::None,
+        t => return Err(Error(format!("unknown register tag {} in scope layout", t))),
+    })
+}
+
+impl Scope {
+    /// Encode the named registers, for `Scope::from_layout`.
+    pub fn layout(&self) -> Vec<u8> {
+        let mut buf = vec![
+            LAYOUT_VERSION,
+            self.num_control,
+            self.num_local,
+            self.num_perm,
+        ];
+        buf.extend_from_slice(&(self.named.0.len() as u16).to_le_bytes());
+        for (name, reg) in &self.named.0 {
+            write_str(&mut buf, name);
+            write_reg(&mut buf, reg);
+        }
+
+        buf
+    }
+
+    /// Rebuild a `Scope` encoded by `Scope::layout`, with a new program uid.
+    pub fn from_layout(buf: &[u8]) -> Result<Self> {
+        let mut r = Reader(buf);
+        let version = r.u8()?;
+        if version != LAYOUT_VERSION {
+            return Err(Error(format!(
+                "scope layout version {}, expected {}",
+                version, LAYOUT_VERSION
+            )));
+        }
+
+        let mut sc = Scope::new();
+        sc.num_control = r.u8()?;
+        sc.num_local = r.u8()?;
+        sc.num_perm = r.u8()?;
+        let num_named = u16::from_le_bytes([r.u8()?, r.u8()?]);
+        sc.named = RegFile(
+            (0..num_named)
+                .map(|_| Ok((r.str()?, read_reg(&mut r)?)))
+                .collect::<Result<_>>()?,
+        );
+
+        Ok(sc)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Precompiled;
+    use crate::{compile, Scope};
+
+    const SRC: &str = "
+        (def (Report (volatile acked 0) (minrtt +infinity) (loss false)) (target 0))
+        (when true
+            (:= Report.acked (+ Report.acked Ack.bytes_acked))
+            (:= Report.minrtt (min Report.minrtt Flow.rtt_sample_us))
+            (bind Report.loss (|| Report.loss (> Ack.lost_pkts_sample 0)))
+            (fallthrough)
+        )
+        (when (> Micros 1000)
+            (report)
+        )
+    ";
+
+    #[test]
+    fn layout_roundtrip() {
+        let (_, sc) = compile(SRC.as_bytes(), &[]).unwrap();
+        let got = Scope::from_layout(&sc.layout()).unwrap();
+        assert_ne!(got.program_uid, sc.program_uid);
+        assert_eq!(got.named.0, sc.named.0);
+        assert_eq!(
+            (got.num_control, got.num_local, got.num_perm),
+            (sc.num_control, sc.num_local, sc.num_perm)
+        );
+
+        let layout = sc.layout();
+        for l in 0..layout.len() {
+            assert!(Scope::from_layout(&layout[..l]).is_err());
+        }
+    }
+
+    #[test]
+    fn register_and_find() {
+        static P: Precompiled = Precompiled::new("(def (Report.x 0))", b"", 0, 0, b"");
+        static Q: Precompiled = Precompiled::new("(def (Report.y 0))", b"", 0, 0, b"");
+        assert!(Precompiled::find(P.source()).is_none());
+        assert_eq!(P.register(), P.source());
+        assert_eq!(Q.register(), Q.source());
+        assert_eq!(P.register(), P.source()); // registering twice is harmless
+        assert!(std::ptr::eq(Precompiled::find(P.source()).unwrap(), &P));
+        assert!(std::ptr::eq(Precompiled::find(Q.source()).unwrap(), &Q));
+        assert!(Precompiled::find("(def (Report.z 0))").is_none());
+    }
+}
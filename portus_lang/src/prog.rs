@@ -192,9 +192,9 @@ mod tests {
     use nom;
     use nom::types::CompleteByteSlice;
 
-    use crate::lang::ast::{Expr, Op, Prim};
-    use crate::lang::datapath::{Scope, Type};
-    use crate::lang::prog::{Event, Prog};
+    use crate::ast::{Expr, Op, Prim};
+    use crate::datapath::{Scope, Type};
+    use crate::prog::{Event, Prog};
 
     #[test]
     fn defs() {
@@ -348,7 +348,7 @@ mod tests {
                 (* 9 8)
             )
         ";
-        use crate::lang::Result;
+        use crate::Result;
         use nom::Needed;
         match super::events(CompleteByteSlice(foo)) {
             Ok((r, me)) => {
@@ -404,7 +404,7 @@ mod tests {
         }
     }
 
-    impl PartialEq for crate::lang::datapath::RegFile {
+    impl PartialEq for crate::datapath::RegFile {
         fn eq(&self, other: &Self) -> bool {
             self.0.iter().zip(other.0.iter()).all(|(x, y)| x == y)
         }
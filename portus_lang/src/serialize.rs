@@ -1,7 +1,11 @@
 use super::ast::Op;
 use super::datapath::{Bin, Event, Instr, Reg};
 use super::{Error, Result};
-use crate::serialize::u32_to_u8s;
+
+// portus's byte helpers live in the crate that depends on this one.
+fn u32_to_u8s(buf: &mut [u8], num: u32) {
+    buf.copy_from_slice(&num.to_le_bytes());
+}
 
 /// Serialize a Bin to bytes for transfer to the datapath
 impl Bin {
@@ -207,9 +211,9 @@ impl Reg {
 
 #[cfg(test)]
 mod tests {
-    use crate::lang;
-    use crate::lang::ast::Op;
-    use crate::lang::datapath::{Bin, Event, Instr, Reg, Type};
+    use crate as lang;
+    use crate::ast::Op;
+    use crate::datapath::{Bin, Event, Instr, Reg, Type};
     #[test]
     fn do_ser() {
         // make a Bin to serialize
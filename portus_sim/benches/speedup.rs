@@ -0,0 +1,30 @@
+//! How much faster than real time the simulator runs: two flows sharing 48 Mbit/s with a 20 ms
+//! RTT and one BDP of buffer, for a simulated minute. Run with `cargo bench`, which builds in
+//! release mode; the speedup depends on the machine, so none is recorded here.
+
+use portus_sim::algs::{Cubic, Reno};
+use portus_sim::{simulate, Results, Scenario};
+use std::time::Duration;
+
+fn report(alg: &str, r: Results) {
+    println!(
+        "{}: {:.1}s simulated in {:.3}s ({:.0}x real time)",
+        alg,
+        r.virtual_time.as_secs_f64(),
+        r.wall_time.as_secs_f64(),
+        r.speedup(),
+    );
+}
+
+fn main() {
+    let s = Scenario::dumbbell(
+        48_000_000,
+        Duration::from_millis(20),
+        1.,
+        2,
+        Duration::from_secs(60),
+    );
+
+    report("reno", simulate(&s, Reno).expect("simulate reno"));
+    report("cubic", simulate(&s, Cubic).expect("simulate cubic"));
+}
@@ -0,0 +1,270 @@
+//! Reno and Cubic, in the style of the CCP reference algorithms, for use in scenarios.
+//!
+//! Both use the same datapath program, which reports once per RTT, or at once on loss, with the
+//! bytes acked and packets lost since the last report, the latest RTT sample, and the datapath's
+//! clock. The algorithms keep time by the datapath's clock, never the host's, so they behave the
+//! same in a simulation as on a real datapath.
+
+use portus::ipc::Ipc;
+use portus::lang::Scope;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use tracing::warn;
+
+const PROGRAM: &str = "
+    (def (Report
+        (volatile acked 0)
+        (volatile loss 0)
+        (volatile rtt 0)
+        (volatile now 0)
+    ))
+    (when true
+        (:= Report.acked (+ Report.acked Ack.bytes_acked))
+        (:= Report.loss (+ Report.loss Ack.lost_pkts_sample))
+        (:= Report.rtt Flow.rtt_sample_us)
+        (:= Report.now Ack.now)
+        (fallthrough)
+    )
+    (when (|| (> Report.loss 0) (> Micros Flow.rtt_sample_us))
+        (:= Micros 0)
+        (report)
+    )
+";
+
+fn programs() -> HashMap<&'static str, String> {
+    let mut h = HashMap::default();
+    h.insert("ack_loss", String::from(PROGRAM));
+    h
+}
+
+struct Measurement {
+    acked: u64,
+    loss: u64,
+    rtt_us: u64,
+    now_us: u64,
+}
+
+fn measure(m: &Report, sc: &Scope) -> portus::Result<Measurement> {
+    Ok(Measurement {
+        acked: m.get_field("Report.acked", sc)?,
+        loss: m.get_field("Report.loss", sc)?,
+        rtt_us: m.get_field("Report.rtt", sc)?,
+        now_us: m.get_field("Report.now", sc)?,
+    })
+}
+
+/// Per-flow state common to both algorithms: the window, slow start, and at most one window
+/// reduction per RTT.
+struct Window<I: Ipc> {
+    control: Datapath<I>,
+    sc: Scope,
+    mss: f64,
+    cwnd: f64,
+    ssthresh: f64,
+    last_cut_us: Option<u64>,
+    min_rtt_us: u64,
+}
+
+impl<I: Ipc> Window<I> {
+    fn new(mut control: Datapath<I>, info: &DatapathInfo) -> Self {
+        let sc = control.set_program("ack_loss", None).unwrap_or_else(|e| {
+            warn!(err = ?e, "could not set program");
+            Scope::default()
+        });
+        Window {
+            control,
+            sc,
+            mss: f64::from(info.mss),
+            cwnd: f64::from(info.init_cwnd),
+            ssthresh: f64::MAX,
+            last_cut_us: None,
+            min_rtt_us: u64::MAX,
+        }
+    }
+
+    fn measure(&mut self, m: &Report) -> Option<Measurement> {
+        match measure(m, &self.sc) {
+            Ok(ms) => {
+                if ms.rtt_us > 0 {
+                    self.min_rtt_us = self.min_rtt_us.min(ms.rtt_us);
+                }
+
+                Some(ms)
+            }
+            Err(e) => {
+                warn!(err = ?e, "bad report");
+                None
+            }
+        }
+    }
+
+    // Loss in the RTT after a reduction is from the window before it.
+    fn should_cut(&mut self, m: &Measurement) -> bool {
+        if m.loss == 0 {
+            return false;
+        }
+
+        let recovering = self.last_cut_us.map_or(false, |t| {
+            m.now_us.saturating_sub(t) < m.rtt_us.max(self.min_rtt_us)
+        });
+        if recovering {
+            return false;
+        }
+
+        self.last_cut_us = Some(m.now_us);
+        true
+    }
+
+    fn slow_start(&mut self, m: &Measurement) -> bool {
+        if self.cwnd < self.ssthresh {
+            self.cwnd += m.acked as f64;
+            true
+        } else {
+            false
+        }
+    }
+
+    fn send(&mut self) {
+        self.cwnd = self.cwnd.max(2. * self.mss);
+        let cwnd = self.cwnd.min(f64::from(u32::MAX)) as u32;
+        if let Err(e) = self.control.update_field(&self.sc, &[("Cwnd", cwnd)]) {
+            warn!(err = ?e, "cwnd update failed");
+        }
+    }
+}
+
+/// Reno: additive increase of one packet per window, and halving on loss.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Reno;
+
+pub struct RenoFlow<I: Ipc>(Window<I>);
+
+impl<I: Ipc> CongAlg<I> for Reno {
+    type Flow = RenoFlow<I>;
+
+    fn name() -> &'static str {
+        "reno"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        programs()
+    }
+
+    fn new_flow(&self, control: Datapath<I>, info: DatapathInfo) -> Self::Flow {
+        RenoFlow(Window::new(control, &info))
+    }
+}
+
+impl<I: Ipc> Flow for RenoFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let w = &mut self.0;
+        let m = match w.measure(&m) {
+            Some(m) => m,
+            None => return,
+        };
+
+        if w.should_cut(&m) {
+            w.cwnd /= 2.;
+            w.ssthresh = w.cwnd;
+        } else if !w.slow_start(&m) {
+            w.cwnd += w.mss * m.acked as f64 / w.cwnd;
+        }
+
+        w.send();
+    }
+}
+
+/// Cubic (RFC 8312): the window grows as a cubic function of the time since the last loss,
+/// centered on the window at that loss, and never slower than Reno would.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Cubic;
+
+const CUBIC_C: f64 = 0.4;
+const CUBIC_BETA: f64 = 0.7;
+
+pub struct CubicFlow<I: Ipc> {
+    w: Window<I>,
+    // all in packets; the epoch starts at the first increase after a loss.
+    w_max: f64,
+    epoch_start_us: Option<u64>,
+    k: f64,
+    origin: f64,
+    w_est: f64,
+}
+
+impl<I: Ipc> CongAlg<I> for Cubic {
+    type Flow = CubicFlow<I>;
+
+    fn name() -> &'static str {
+        "cubic"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        programs()
+    }
+
+    fn new_flow(&self, control: Datapath<I>, info: DatapathInfo) -> Self::Flow {
+        CubicFlow {
+            w: Window::new(control, &info),
+            w_max: 0.,
+            epoch_start_us: None,
+            k: 0.,
+            origin: 0.,
+            w_est: 0.,
+        }
+    }
+}
+
+impl<I: Ipc> CubicFlow<I> {
+    fn increase(&mut self, m: &Measurement) {
+        let cwnd = self.w.cwnd / self.w.mss;
+        let acked = m.acked as f64 / self.w.mss;
+        if self.epoch_start_us.is_none() {
+            if cwnd < self.w_max {
+                self.k = ((self.w_max - cwnd) / CUBIC_C).cbrt();
+                self.origin = self.w_max;
+            } else {
+                self.k = 0.;
+                self.origin = cwnd;
+            }
+            self.w_est = cwnd;
+            self.epoch_start_us = Some(m.now_us);
+        }
+
+        let epoch = self.epoch_start_us.unwrap_or(m.now_us);
+
+        let rtt = self.w.min_rtt_us.min(m.rtt_us.max(1)) as f64 / 1e6;
+        let t = m.now_us.saturating_sub(epoch) as f64 / 1e6 + rtt;
+        let target = self.origin + CUBIC_C * (t - self.k).powi(3);
+        let mut next = if target > cwnd {
+            cwnd + (target - cwnd) / cwnd * acked
+        } else {
+            cwnd + 0.01 * acked / cwnd
+        };
+
+        // the TCP-friendly region: at least what Reno with the same decrease would reach.
+        self.w_est += 3. * (1. - CUBIC_BETA) / (1. + CUBIC_BETA) * acked / cwnd;
+        next = next.max(self.w_est);
+        self.w.cwnd = next * self.w.mss;
+    }
+}
+
+impl<I: Ipc> Flow for CubicFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let m = match self.w.measure(&m) {
+            Some(m) => m,
+            None => return,
+        };
+
+        if self.w.should_cut(&m) {
+            self.w_max = self.w.cwnd / self.w.mss;
+            self.w.cwnd *= CUBIC_BETA;
+            self.w.ssthresh = self.w.cwnd;
+            self.epoch_start_us = None;
+        } else if !self.w.slow_start(&m) {
+            self.increase(&m);
+        }
+
+        self.w.send();
+    }
+}
@@ -0,0 +1,31 @@
+//! A bottleneck link simulator for portus congestion control algorithms.
+//!
+//! A `Scenario` describes one or more drop-tail links and the backlogged flows crossing them.
+//! `simulate` runs it in virtual time against an algorithm on a `PollRuntime` over the channel
+//! transport: the simulated datapath runs the programs CCP installs with libccp's semantics (see
+//! `machine`), and CCP sees ordinary datapath messages, on a `portus::clock::VirtualClock` that
+//! keeps the datapath's time (see `simulate_on`). Results cover each flow's throughput,
+//! RTT and loss, each link's utilization and queue, and fairness across flows.
+//!
+//! Traffic is fluid and time moves in fixed ticks (see `link`), which is coarse next to a packet
+//! simulator, but enough to compare algorithms' throughput, delay and fairness many times faster
+//! than real time.
+//!
+//! # Example
+//!
+//! ```no_run
+//! use portus_sim::{algs::Cubic, simulate, Scenario};
+//! use std::time::Duration;
+//!
+//! // two flows sharing 48 Mbit/s with a 20 ms RTT and one BDP of buffer, for a minute.
+//! let s = Scenario::dumbbell(48_000_000, Duration::from_millis(20), 1., 2, Duration::from_secs(60));
+//! let r = simulate(&s, Cubic).unwrap();
+//! println!("fairness {:.3}, {:.0}x real time", r.jain_fairness(), r.speedup());
+//! ```
+
+pub mod algs;
+pub mod link;
+pub mod machine;
+mod sim;
+
+pub use sim::*;
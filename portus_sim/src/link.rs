@@ -0,0 +1,159 @@
+//! A bottleneck link: a drop-tail FIFO queue drained at a fixed rate.
+//!
+//! Traffic is fluid: a flow's sends in one tick enter the queue as a single `Chunk`, and the link
+//! serves bytes rather than packets, splitting a chunk across ticks when it must.
+
+use std::collections::VecDeque;
+
+/// Bytes from one flow, sent in one tick.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct Chunk {
+    pub flow: usize,
+    pub bytes: u64,
+    pub sent_us: u64,
+    /// The index into the flow's path of the link this chunk is queued at.
+    pub hop: usize,
+}
+
+#[derive(Debug)]
+pub struct Link {
+    bytes_per_sec: u64,
+    limit: u64,
+    queue: VecDeque<Chunk>,
+    queued: u64,
+    // service owed but not yet whole bytes, in bytes * 10^6.
+    carry: u64,
+    pub(crate) stats: LinkStats,
+}
+
+#[derive(Clone, Debug, Default)]
+pub(crate) struct LinkStats {
+    pub(crate) served: u64,
+    pub(crate) dropped: u64,
+    pub(crate) max_queued: u64,
+    // sum over ticks of the queue length, for the time average.
+    pub(crate) queued_ticks: u128,
+    pub(crate) ticks: u64,
+}
+
+impl Link {
+    /// A link draining `bytes_per_sec` from a queue of at most `limit` bytes.
+    pub fn new(bytes_per_sec: u64, limit: u64) -> Self {
+        Link {
+            bytes_per_sec,
+            limit,
+            queue: VecDeque::new(),
+            queued: 0,
+            carry: 0,
+            stats: LinkStats::default(),
+        }
+    }
+
+    pub fn bytes_per_sec(&self) -> u64 {
+        self.bytes_per_sec
+    }
+
+    /// The bytes waiting, including any the link has started but not finished serving.
+    pub fn queued(&self) -> u64 {
+        self.queued
+    }
+
+    /// Queue as much of `c` as fits and return the number of bytes dropped.
+    pub fn enqueue(&mut self, mut c: Chunk) -> u64 {
+        let room = self.limit.saturating_sub(self.queued);
+        let dropped = c.bytes.saturating_sub(room);
+        c.bytes -= dropped;
+        self.stats.dropped += dropped;
+        if c.bytes > 0 {
+            self.queued += c.bytes;
+            self.stats.max_queued = self.stats.max_queued.max(self.queued);
+            self.queue.push_back(c);
+        }
+
+        dropped
+    }
+
+    /// Serve `dt_us` worth of the queue, oldest bytes first, appending what leaves to `out`.
+    pub fn serve(&mut self, dt_us: u64, out: &mut Vec<Chunk>) {
+        self.stats.ticks += 1;
+        self.stats.queued_ticks += u128::from(self.queued);
+
+        self.carry += self.bytes_per_sec * dt_us;
+        let mut budget = self.carry / 1_000_000;
+        self.carry %= 1_000_000;
+        while budget > 0 {
+            let head = match self.queue.front_mut() {
+                Some(c) => c,
+                None => break,
+            };
+
+            let n = head.bytes.min(budget);
+            budget -= n;
+            head.bytes -= n;
+            let mut done = *head;
+            done.bytes = n;
+            if head.bytes == 0 {
+                self.queue.pop_front();
+            }
+
+            self.queued -= n;
+            self.stats.served += n;
+            out.push(done);
+        }
+
+        // an idle link cannot save up capacity.
+        if self.queue.is_empty() {
+            self.carry = 0;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Chunk, Link};
+
+    fn chunk(flow: usize, bytes: u64) -> Chunk {
+        Chunk {
+            flow,
+            bytes,
+            sent_us: 0,
+            hop: 0,
+        }
+    }
+
+    #[test]
+    fn fifo_and_tail_drop() {
+        // 1 MB/s: 1000 bytes per millisecond.
+        let mut l = Link::new(1_000_000, 3000);
+        assert_eq!(l.enqueue(chunk(0, 2500)), 0);
+        assert_eq!(l.enqueue(chunk(1, 1000)), 500);
+        assert_eq!(l.queued(), 3000);
+
+        let mut out = vec![];
+        l.serve(1000, &mut out);
+        assert_eq!(out, vec![chunk(0, 1000)]);
+        out.clear();
+        l.serve(2000, &mut out);
+        assert_eq!(out, vec![chunk(0, 1500), chunk(1, 500)]);
+        assert_eq!(l.queued(), 0);
+
+        // an idle link does not bank the rest of its tick.
+        out.clear();
+        l.serve(1000, &mut out);
+        l.enqueue(chunk(0, 5000));
+        l.serve(1000, &mut out);
+        assert_eq!(out, vec![chunk(0, 1000)]);
+    }
+
+    #[test]
+    fn fractional_rate() {
+        // 1500 bytes per second, served in 100 ms ticks: 150 bytes each.
+        let mut l = Link::new(1500, 10_000);
+        l.enqueue(chunk(0, 10_000));
+        let mut out = vec![];
+        for _ in 0..10 {
+            l.serve(100_000, &mut out);
+        }
+        assert_eq!(out.iter().map(|c| c.bytes).sum::<u64>(), 1500);
+    }
+}
@@ -0,0 +1,637 @@
+//! An interpreter for compiled datapath programs, with libccp's semantics.
+//!
+//! Programs are decoded from the install messages portus sends, so the simulator runs exactly
+//! the instructions a real datapath would. Each call to `Machine::on_ack` is one invocation of
+//! the program: the events run in order, the first whose flag is set runs its body, and later
+//! events are skipped unless the body sets `__shouldContinue` (`(fallthrough)`). If
+//! `__shouldReport` is set afterwards, the report registers are returned for a measurement
+//! message and the volatile ones return to their defaults.
+
+use portus::serialize::RawMsg;
+use portus::{Error, Result};
+use std::rc::Rc;
+
+const INSTALL: u8 = 2;
+
+/// The primitive registers, by the index the compiler gives them (alphabetical by name). The
+/// `primitives_match_compiler` test checks them against `portus::lang::Scope`.
+pub mod prim {
+    pub const ACK_BYTES_ACKED: usize = 0;
+    pub const ACK_BYTES_MISORDERED: usize = 1;
+    pub const ACK_ECN_BYTES: usize = 2;
+    pub const ACK_ECN_PACKETS: usize = 3;
+    pub const ACK_LOST_PKTS_SAMPLE: usize = 4;
+    pub const ACK_NOW: usize = 5;
+    pub const ACK_PACKETS_ACKED: usize = 6;
+    pub const ACK_PACKETS_MISORDERED: usize = 7;
+    pub const FLOW_BYTES_IN_FLIGHT: usize = 8;
+    pub const FLOW_BYTES_PENDING: usize = 9;
+    pub const FLOW_PACKETS_IN_FLIGHT: usize = 10;
+    pub const FLOW_RATE_INCOMING: usize = 11;
+    pub const FLOW_RATE_OUTGOING: usize = 12;
+    pub const FLOW_RTT_SAMPLE_US: usize = 13;
+    pub const FLOW_WAS_TIMEOUT: usize = 14;
+    pub const NUM: usize = 15;
+}
+
+/// The values of the primitive registers for one invocation, indexed by `prim`.
+pub type Primitives = [u64; prim::NUM];
+
+// implicit registers
+const EVENT_FLAG: usize = 0;
+const SHOULD_CONTINUE: usize = 1;
+const SHOULD_REPORT: usize = 2;
+const MICROS: usize = 3;
+const CWND: usize = 4;
+const RATE: usize = 5;
+const NUM_IMPLICIT: usize = 6;
+
+// register file sizes, matching the compiler's limits
+const NUM_CONTROL: usize = 16;
+const NUM_REPORT: usize = 16;
+const NUM_LOCAL: usize = 6;
+const NUM_TMP: usize = 16;
+
+const INSTR_LEN: usize = 16;
+const EVENT_LEN: usize = 16;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Operand {
+    Control(usize),
+    Imm(u64),
+    Implicit(usize),
+    Local(usize),
+    Primitive(usize),
+    Report(usize),
+    Tmp(usize),
+}
+
+impl Operand {
+    fn decode(typ: u8, idx: u32) -> Result<Self> {
+        let i = idx as usize;
+        let (op, limit) = match typ {
+            0 | 8 => (Operand::Control(i), NUM_CONTROL),
+            // immediates are 32 bits on the wire; all ones is +infinity.
+            1 if idx == u32::max_value() => return Ok(Operand::Imm(u64::max_value())),
+            1 => return Ok(Operand::Imm(u64::from(idx))),
+            2 => (Operand::Implicit(i), NUM_IMPLICIT),
+            3 => (Operand::Local(i), NUM_LOCAL),
+            4 => (Operand::Primitive(i), prim::NUM),
+            5 | 6 => (Operand::Report(i), NUM_REPORT),
+            7 => (Operand::Tmp(i), NUM_TMP),
+            _ => return Err(Error(format!("unknown register type {}", typ))),
+        };
+
+        if i >= limit {
+            return Err(Error(format!(
+                "register index {} out of range for type {}",
+                idx, typ
+            )));
+        }
+
+        Ok(op)
+    }
+
+    fn writable(self) -> bool {
+        !matches!(self, Operand::Imm(_) | Operand::Primitive(_))
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Op {
+    Add,
+    Bind,
+    Def,
+    Div,
+    Equiv,
+    Ewma,
+    Gt,
+    If,
+    Lt,
+    Max,
+    MaxWrap,
+    Min,
+    Mul,
+    NotIf,
+    Sub,
+}
+
+impl Op {
+    fn decode(b: u8) -> Result<Self> {
+        Ok(match b {
+            0 => Op::Add,
+            1 => Op::Bind,
+            2 => Op::Def,
+            3 => Op::Div,
+            4 => Op::Equiv,
+            5 => Op::Ewma,
+            6 => Op::Gt,
+            7 => Op::If,
+            8 => Op::Lt,
+            9 => Op::Max,
+            10 => Op::MaxWrap,
+            11 => Op::Min,
+            12 => Op::Mul,
+            13 => Op::NotIf,
+            14 => Op::Sub,
+            _ => return Err(Error(format!("unknown opcode {}", b))),
+        })
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+struct Instr {
+    op: Op,
+    res: Operand,
+    left: Operand,
+    right: Operand,
+}
+
+#[derive(Clone, Debug)]
+struct Event {
+    flag: std::ops::Range<usize>,
+    body: std::ops::Range<usize>,
+}
+
+fn u32_at(buf: &[u8], off: usize) -> u32 {
+    let mut b = [0u8; 4];
+    b.copy_from_slice(&buf[off..off + 4]);
+    u32::from_le_bytes(b)
+}
+
+fn u64_at(buf: &[u8], off: usize) -> u64 {
+    let mut b = [0u8; 8];
+    b.copy_from_slice(&buf[off..off + 8]);
+    u64::from_le_bytes(b)
+}
+
+/// A decoded datapath program.
+#[derive(Clone, Debug, Default)]
+pub struct Program {
+    pub uid: u32,
+    events: Vec<Event>,
+    instrs: Vec<Instr>,
+    // one past the highest report register used: the number of fields in a report.
+    num_report: usize,
+    volatile_report: [bool; NUM_REPORT],
+}
+
+impl Program {
+    /// Decode an install message, header included.
+    pub fn from_install(buf: &[u8]) -> Result<Self> {
+        let msg = RawMsg::parse(buf)?;
+        if msg.typ != INSTALL {
+            return Err(Error(format!(
+                "expected install message (type {}), got type {}",
+                INSTALL, msg.typ
+            )));
+        }
+
+        let b = msg.payload();
+        if b.len() < 12 {
+            return Err(Error(format!("install message too short: {}", b.len())));
+        }
+
+        let uid = u32_at(b, 0);
+        let num_events = u32_at(b, 4) as usize;
+        let num_instrs = u32_at(b, 8) as usize;
+        let need = 12 + num_events * EVENT_LEN + num_instrs * INSTR_LEN;
+        if b.len() < need {
+            return Err(Error(format!(
+                "install message claims {} events and {} instructions but has {} bytes",
+                num_events,
+                num_instrs,
+                b.len()
+            )));
+        }
+
+        let mut p = Program {
+            uid,
+            ..Default::default()
+        };
+
+        let mut off = 12;
+        for _ in 0..num_events {
+            let (flag_idx, num_flag) = (u32_at(b, off) as usize, u32_at(b, off + 4) as usize);
+            let (body_idx, num_body) = (u32_at(b, off + 8) as usize, u32_at(b, off + 12) as usize);
+            if flag_idx + num_flag > num_instrs || body_idx + num_body > num_instrs {
+                return Err(Error(format!(
+                    "event instructions out of range: {} instructions",
+                    num_instrs
+                )));
+            }
+
+            p.events.push(Event {
+                flag: flag_idx..flag_idx + num_flag,
+                body: body_idx..body_idx + num_body,
+            });
+            off += EVENT_LEN;
+        }
+
+        for _ in 0..num_instrs {
+            let i = &b[off..off + INSTR_LEN];
+            let reg = |o: usize| Operand::decode(i[o], u32_at(i, o + 1));
+            let instr = Instr {
+                op: Op::decode(i[0])?,
+                res: reg(1)?,
+                left: reg(6)?,
+                right: reg(11)?,
+            };
+
+            if !instr.res.writable() {
+                return Err(Error(format!(
+                    "instruction writes a read-only register: {:?}",
+                    instr
+                )));
+            }
+
+            for (typ, r) in [(i[1], instr.res), (i[6], instr.left), (i[11], instr.right)].iter() {
+                if let Operand::Report(idx) = *r {
+                    p.num_report = p.num_report.max(idx + 1);
+                    p.volatile_report[idx] = *typ == 5;
+                }
+            }
+
+            p.instrs.push(instr);
+            off += INSTR_LEN;
+        }
+
+        Ok(p)
+    }
+}
+
+/// One flow's datapath state: its current program and register file.
+///
+/// `Cwnd` and `Rate` live here too, since programs and CCP both write them.
+#[derive(Clone, Debug)]
+pub struct Machine {
+    program: Rc<Program>,
+    control: [u64; NUM_CONTROL],
+    report: [u64; NUM_REPORT],
+    local: [u64; NUM_LOCAL],
+    tmp: [u64; NUM_TMP],
+    implicit: [u64; NUM_IMPLICIT],
+    // report register values after the program's `Def`s, to reset volatile ones to.
+    report_defaults: [u64; NUM_REPORT],
+    time_zero_us: u64,
+}
+
+impl Machine {
+    /// A flow with no program yet: acks change nothing and never report.
+    pub fn new(cwnd: u64, now_us: u64) -> Self {
+        let mut m = Machine {
+            program: Rc::new(Program::default()),
+            control: [0; NUM_CONTROL],
+            report: [0; NUM_REPORT],
+            local: [0; NUM_LOCAL],
+            tmp: [0; NUM_TMP],
+            implicit: [0; NUM_IMPLICIT],
+            report_defaults: [0; NUM_REPORT],
+            time_zero_us: now_us,
+        };
+        m.implicit[CWND] = cwnd;
+        m
+    }
+
+    pub fn program_uid(&self) -> u32 {
+        self.program.uid
+    }
+
+    /// The congestion window, in bytes.
+    pub fn cwnd(&self) -> u64 {
+        self.implicit[CWND]
+    }
+
+    /// The pacing rate in bytes per second; 0 means unpaced.
+    pub fn rate(&self) -> u64 {
+        self.implicit[RATE]
+    }
+
+    /// Switch to `program`: its registers start from their definitions and `Micros` from 0.
+    /// `Cwnd` and `Rate` carry over.
+    pub fn change_program(&mut self, program: Rc<Program>, now_us: u64) {
+        self.control = [0; NUM_CONTROL];
+        self.report = [0; NUM_REPORT];
+        self.local = [0; NUM_LOCAL];
+        self.tmp = [0; NUM_TMP];
+        self.time_zero_us = now_us;
+        for i in program.instrs.iter().filter(|i| i.op == Op::Def) {
+            let v = self.get(i.right, &[0; prim::NUM]);
+            self.set(i.res, v);
+        }
+
+        self.report_defaults = self.report;
+        self.program = program;
+    }
+
+    /// Apply the `(register, value)` pairs of a change-program or update-field message: `n`
+    /// pairs of register type (u8), index (u32) and value (u64).
+    pub fn set_fields(&mut self, tail: &[u8], n: usize) -> Result<()> {
+        if tail.len() < n * 13 {
+            return Err(Error(format!(
+                "{} fields need {} bytes, got {}",
+                n,
+                n * 13,
+                tail.len()
+            )));
+        }
+
+        for f in tail[..n * 13].chunks(13) {
+            match Operand::decode(f[0], u32_at(f, 1))? {
+                r @ Operand::Control(_) => self.set(r, u64_at(f, 5)),
+                Operand::Implicit(i) if i == CWND || i == RATE => self.implicit[i] = u64_at(f, 5),
+                r => {
+                    return Err(Error(format!("cannot update register {:?}", r)));
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Run the program once, for an ack with the given primitive values.
+    ///
+    /// Returns the report registers if the program asked to report.
+    pub fn on_ack(&mut self, prims: &Primitives, now_us: u64) -> Result<Option<Vec<u64>>> {
+        let program = self.program.clone();
+        if program.events.is_empty() {
+            return Ok(None);
+        }
+
+        self.implicit[MICROS] = now_us.saturating_sub(self.time_zero_us);
+        self.implicit[SHOULD_REPORT] = 0;
+        for ev in &program.events {
+            self.implicit[EVENT_FLAG] = 0;
+            self.exec(&program.instrs[ev.flag.clone()], prims)?;
+            if self.implicit[EVENT_FLAG] == 0 {
+                continue;
+            }
+
+            self.implicit[SHOULD_CONTINUE] = 0;
+            self.exec(&program.instrs[ev.body.clone()], prims)?;
+            if self.implicit[SHOULD_CONTINUE] == 0 {
+                break;
+            }
+        }
+
+        // a program resets Micros by writing it.
+        self.time_zero_us = now_us.saturating_sub(self.implicit[MICROS]);
+
+        if self.implicit[SHOULD_REPORT] == 0 {
+            return Ok(None);
+        }
+
+        let fields = self.report[..program.num_report].to_vec();
+        for i in 0..program.num_report {
+            if program.volatile_report[i] {
+                self.report[i] = self.report_defaults[i];
+            }
+        }
+
+        Ok(Some(fields))
+    }
+
+    fn exec(&mut self, instrs: &[Instr], prims: &Primitives) -> Result<()> {
+        for i in instrs {
+            let l = self.get(i.left, prims);
+            let r = self.get(i.right, prims);
+            let v = match i.op {
+                Op::Add => l.wrapping_add(r),
+                Op::Bind | Op::Def => r,
+                Op::Div => {
+                    if r == 0 {
+                        return Err(Error(String::from("division by zero")));
+                    }
+
+                    l / r
+                }
+                Op::Equiv => (l == r) as u64,
+                // (ewma a b): old * a/10 + b * (10-a)/10
+                Op::Ewma => {
+                    let old = self.get(i.res, prims);
+                    (old.saturating_mul(l) + r.saturating_mul(10u64.saturating_sub(l))) / 10
+                }
+                Op::Gt => (l > r) as u64,
+                Op::If if l != 0 => r,
+                Op::NotIf if l == 0 => r,
+                Op::If | Op::NotIf => continue,
+                Op::Lt => (l < r) as u64,
+                Op::Max => l.max(r),
+                // maximum of two 32-bit sequence numbers that may have wrapped
+                Op::MaxWrap => {
+                    if (r as u32).wrapping_sub(l as u32) as i32 > 0 {
+                        r
+                    } else {
+                        l
+                    }
+                }
+                Op::Min => l.min(r),
+                Op::Mul => l.wrapping_mul(r),
+                Op::Sub => l.wrapping_sub(r),
+            };
+
+            self.set(i.res, v);
+        }
+
+        Ok(())
+    }
+
+    fn get(&self, r: Operand, prims: &Primitives) -> u64 {
+        match r {
+            Operand::Control(i) => self.control[i],
+            Operand::Imm(v) => v,
+            Operand::Implicit(i) => self.implicit[i],
+            Operand::Local(i) => self.local[i],
+            Operand::Primitive(i) => prims[i],
+            Operand::Report(i) => self.report[i],
+            Operand::Tmp(i) => self.tmp[i],
+        }
+    }
+
+    // `Program::from_install` rejects writes to read-only registers.
+    fn set(&mut self, r: Operand, v: u64) {
+        match r {
+            Operand::Control(i) => self.control[i] = v,
+            Operand::Implicit(i) => self.implicit[i] = v,
+            Operand::Local(i) => self.local[i] = v,
+            Operand::Report(i) => self.report[i] = v,
+            Operand::Tmp(i) => self.tmp[i] = v,
+            Operand::Imm(_) | Operand::Primitive(_) => (),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{prim, Machine, Primitives, Program};
+    use portus::lang::{Reg, Scope};
+    use std::rc::Rc;
+
+    fn instr(op: u8, res: (u8, u32), left: (u8, u32), right: (u8, u32)) -> Vec<u8> {
+        let mut v = vec![op];
+        for (t, i) in [res, left, right].iter() {
+            v.push(*t);
+            v.extend_from_slice(&i.to_le_bytes());
+        }
+        v
+    }
+
+    fn install(uid: u32, events: &[[u32; 4]], instrs: &[Vec<u8>]) -> Vec<u8> {
+        let mut body = vec![];
+        body.extend_from_slice(&uid.to_le_bytes());
+        body.extend_from_slice(&(events.len() as u32).to_le_bytes());
+        body.extend_from_slice(&(instrs.len() as u32).to_le_bytes());
+        for e in events {
+            for x in e {
+                body.extend_from_slice(&x.to_le_bytes());
+            }
+        }
+        for i in instrs {
+            body.extend_from_slice(i);
+        }
+
+        let mut msg = vec![2, 0];
+        msg.extend_from_slice(&((body.len() + 8) as u16).to_le_bytes());
+        msg.extend_from_slice(&0u32.to_le_bytes());
+        msg.extend(body);
+        msg
+    }
+
+    // (def (Report (volatile acked 0) (minrtt +infinity)))
+    // (when true
+    //     (:= Report.acked (+ Report.acked Ack.bytes_acked))
+    //     (:= Report.minrtt (min Report.minrtt Flow.rtt_sample_us))
+    //     (fallthrough))
+    // (when (> Micros 10000)
+    //     (:= Micros 0)
+    //     (report))
+    fn counting_program() -> Vec<u8> {
+        let (report_v, report_nv, imm, prim_t, implicit, tmp) = (5, 6, 1, 4, 2, 7);
+        install(
+            7,
+            &[[2, 1, 3, 5], [8, 1, 9, 2]],
+            &[
+                instr(2, (report_v, 0), (report_v, 0), (imm, 0)),
+                instr(2, (report_nv, 1), (report_nv, 1), (imm, u32::max_value())),
+                // event 0 flag: (bind __eventFlag true)
+                instr(1, (implicit, 0), (implicit, 0), (imm, 1)),
+                instr(
+                    0,
+                    (tmp, 0),
+                    (report_v, 0),
+                    (prim_t, prim::ACK_BYTES_ACKED as u32),
+                ),
+                instr(1, (report_v, 0), (report_v, 0), (tmp, 0)),
+                instr(
+                    11,
+                    (tmp, 0),
+                    (report_nv, 1),
+                    (prim_t, prim::FLOW_RTT_SAMPLE_US as u32),
+                ),
+                instr(1, (report_nv, 1), (report_nv, 1), (tmp, 0)),
+                instr(1, (implicit, 1), (implicit, 1), (imm, 1)),
+                // event 1 flag: (> Micros 10000)
+                instr(6, (implicit, 0), (implicit, 3), (imm, 10000)),
+                instr(1, (implicit, 3), (implicit, 3), (imm, 0)),
+                instr(1, (implicit, 2), (implicit, 2), (imm, 1)),
+            ],
+        )
+    }
+
+    fn ack(bytes: u64, rtt: u64) -> Primitives {
+        let mut p = [0; prim::NUM];
+        p[prim::ACK_BYTES_ACKED] = bytes;
+        p[prim::FLOW_RTT_SAMPLE_US] = rtt;
+        p
+    }
+
+    #[test]
+    fn primitives_match_compiler() {
+        let names = [
+            ("Ack.bytes_acked", prim::ACK_BYTES_ACKED),
+            ("Ack.bytes_misordered", prim::ACK_BYTES_MISORDERED),
+            ("Ack.ecn_bytes", prim::ACK_ECN_BYTES),
+            ("Ack.ecn_packets", prim::ACK_ECN_PACKETS),
+            ("Ack.lost_pkts_sample", prim::ACK_LOST_PKTS_SAMPLE),
+            ("Ack.now", prim::ACK_NOW),
+            ("Ack.packets_acked", prim::ACK_PACKETS_ACKED),
+            ("Ack.packets_misordered", prim::ACK_PACKETS_MISORDERED),
+            ("Flow.bytes_in_flight", prim::FLOW_BYTES_IN_FLIGHT),
+            ("Flow.bytes_pending", prim::FLOW_BYTES_PENDING),
+            ("Flow.packets_in_flight", prim::FLOW_PACKETS_IN_FLIGHT),
+            ("Flow.rate_incoming", prim::FLOW_RATE_INCOMING),
+            ("Flow.rate_outgoing", prim::FLOW_RATE_OUTGOING),
+            ("Flow.rtt_sample_us", prim::FLOW_RTT_SAMPLE_US),
+            ("Flow.was_timeout", prim::FLOW_WAS_TIMEOUT),
+        ];
+        assert_eq!(names.len(), prim::NUM);
+
+        let sc = Scope::new();
+        for &(name, idx) in names.iter() {
+            match sc.get(name) {
+                Some(Reg::Primitive(i, _)) => assert_eq!(*i as usize, idx, "{}", name),
+                r => panic!("{} is {:?}, not a primitive", name, r),
+            }
+        }
+    }
+
+    #[test]
+    fn report_and_reset() {
+        let p = Program::from_install(&counting_program()).unwrap();
+        assert_eq!(p.uid, 7);
+
+        let mut m = Machine::new(14480, 0);
+        m.change_program(Rc::new(p), 0);
+        assert_eq!(m.on_ack(&ack(1448, 300), 4000).unwrap(), None);
+        assert_eq!(m.on_ack(&ack(1448, 200), 8000).unwrap(), None);
+        assert_eq!(
+            m.on_ack(&ack(1448, 250), 12000).unwrap(),
+            Some(vec![4344, 200])
+        );
+
+        // acked is volatile and minrtt is not; Micros restarted at the report.
+        assert_eq!(m.on_ack(&ack(1448, 400), 20000).unwrap(), None);
+        assert_eq!(
+            m.on_ack(&ack(1448, 400), 22001).unwrap(),
+            Some(vec![2896, 200])
+        );
+        assert_eq!(m.cwnd(), 14480);
+    }
+
+    #[test]
+    fn update_fields() {
+        let mut m = Machine::new(14480, 0);
+        m.change_program(
+            Rc::new(Program::from_install(&counting_program()).unwrap()),
+            0,
+        );
+
+        // Cwnd <- 28960, then a control register, which this program does not use.
+        let mut tail = vec![2];
+        tail.extend_from_slice(&4u32.to_le_bytes());
+        tail.extend_from_slice(&28960u64.to_le_bytes());
+        tail.push(0);
+        tail.extend_from_slice(&3u32.to_le_bytes());
+        tail.extend_from_slice(&5u64.to_le_bytes());
+        m.set_fields(&tail, 2).unwrap();
+        assert_eq!(m.cwnd(), 28960);
+
+        // report registers belong to the program.
+        let mut bad = vec![5];
+        bad.extend_from_slice(&0u32.to_le_bytes());
+        bad.extend_from_slice(&1u64.to_le_bytes());
+        assert!(m.set_fields(&bad, 1).is_err());
+    }
+
+    #[test]
+    fn reject_bad_programs() {
+        let mut msg = counting_program();
+        msg[8 + 12] = 100; // event 0 flag index
+        assert!(Program::from_install(&msg).is_err());
+
+        let mut msg = counting_program();
+        let first_instr = 8 + 12 + 2 * 16;
+        msg[first_instr + 1] = 4; // Def into a primitive
+        assert!(Program::from_install(&msg).is_err());
+    }
+}
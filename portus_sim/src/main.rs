@@ -0,0 +1,136 @@
+use clap::{value_t, Arg};
+use portus_sim::algs::{Cubic, Reno};
+use portus_sim::{simulate, Results, Scenario};
+use std::time::Duration;
+
+fn print(alg: &str, s: &Scenario, r: &Results) {
+    for f in &r.flows {
+        println!(
+            "{} flow {}: {:.2} Mbit/s, rtt mean {} us max {} us, queueing {} us, lost {} bytes",
+            alg,
+            f.sid,
+            f.throughput_bps / 1e6,
+            f.rtt.mean_ns() / 1000,
+            f.rtt.max_ns() / 1000,
+            f.mean_queueing_delay.as_micros(),
+            f.lost_bytes,
+        );
+    }
+
+    for (i, l) in r.links.iter().enumerate() {
+        println!(
+            "{} link {}: {:.1}% utilized, queue mean {:.0} max {} of {} bytes, dropped {} bytes",
+            alg,
+            i,
+            l.utilization * 100.,
+            l.mean_queue_bytes,
+            l.max_queue_bytes,
+            s.links[i].queue_bytes,
+            l.dropped_bytes,
+        );
+    }
+
+    println!(
+        "{}: fairness {:.3}, {:.1}s simulated in {:.3}s ({:.0}x real time)",
+        alg,
+        r.jain_fairness(),
+        r.virtual_time.as_secs_f64(),
+        r.wall_time.as_secs_f64(),
+        r.speedup(),
+    );
+}
+
+fn main() {
+    let matches = clap::App::new("portus-sim")
+        .version("0.1.0")
+        .about("Simulate flows sharing a bottleneck link, controlled by a CCP algorithm")
+        .arg(
+            Arg::with_name("alg")
+                .long("alg")
+                .possible_values(&["reno", "cubic"])
+                .default_value("reno"),
+        )
+        .arg(
+            Arg::with_name("bw")
+                .long("bw")
+                .help("Link bandwidth, in Mbit/s")
+                .default_value("12"),
+        )
+        .arg(
+            Arg::with_name("rtt")
+                .long("rtt")
+                .help("Base round-trip time, in ms")
+                .default_value("20"),
+        )
+        .arg(
+            Arg::with_name("bdp")
+                .long("bdp")
+                .help("Buffer size, in bandwidth-delay products")
+                .default_value("1"),
+        )
+        .arg(
+            Arg::with_name("flows")
+                .long("flows")
+                .short("n")
+                .default_value("1"),
+        )
+        .arg(
+            Arg::with_name("stagger")
+                .long("stagger")
+                .help("Seconds between flow starts")
+                .default_value("0"),
+        )
+        .arg(
+            Arg::with_name("length")
+                .long("length")
+                .short("l")
+                .help("Seconds of virtual time")
+                .default_value("60"),
+        )
+        .arg(
+            Arg::with_name("tick-us")
+                .long("tick-us")
+                .help("Virtual clock step, in us")
+                .default_value("1000"),
+        )
+        .arg(
+            Arg::with_name("ccp-delay-us")
+                .long("ccp-delay-us")
+                .help("Virtual delay from CCP to the datapath, in us")
+                .default_value("0"),
+        )
+        .get_matches();
+
+    let bw = value_t!(matches, "bw", f64).expect("bw must be a number");
+    let rtt = value_t!(matches, "rtt", u64).expect("rtt must be integral");
+    let bdp = value_t!(matches, "bdp", f64).expect("bdp must be a number");
+    let flows = value_t!(matches, "flows", usize).expect("flows must be integral");
+    let stagger = value_t!(matches, "stagger", f64).expect("stagger must be a number");
+    let length = value_t!(matches, "length", u64).expect("length must be integral");
+
+    let mut s = Scenario::dumbbell(
+        (bw * 1e6) as u64,
+        Duration::from_millis(rtt),
+        bdp,
+        flows,
+        Duration::from_secs(length),
+    );
+    for (i, f) in s.flows.iter_mut().enumerate() {
+        f.start = Duration::from_secs_f64(stagger * i as f64);
+    }
+    s.tick =
+        Duration::from_micros(value_t!(matches, "tick-us", u64).expect("tick-us must be integral"));
+    s.ccp_delay = Duration::from_micros(
+        value_t!(matches, "ccp-delay-us", u64).expect("ccp-delay-us must be integral"),
+    );
+
+    let alg = matches.value_of("alg").unwrap();
+    let r = match alg {
+        "reno" => simulate(&s, Reno),
+        "cubic" => simulate(&s, Cubic),
+        _ => unreachable!(),
+    }
+    .unwrap_or_else(|e| panic!("simulation failed: {:?}", e));
+
+    print(alg, &s, &r);
+}
@@ -0,0 +1,631 @@
+use crate::link::{Chunk, Link};
+use crate::machine::{prim, Machine, Primitives, Program};
+use crossbeam::channel;
+use portus::clock::VirtualClock;
+use portus::ipc::{chan, BackendBuilder, Nonblocking};
+use portus::latency::Histogram;
+use portus::serialize::{self, create, measure, ready, RawMsg};
+use portus::{CongAlg, Error, PollRuntime, Result};
+use std::collections::{HashMap, VecDeque};
+use std::rc::Rc;
+use std::time::{Duration, Instant};
+use tracing::{debug, warn};
+
+const INSTALL: u8 = 2;
+const UPDATE_FIELD: u8 = 3;
+const CHANGEPROG: u8 = 4;
+
+/// The socket type the simulated datapath and the algorithm under test share.
+pub type SimIpc = chan::Socket<Nonblocking>;
+
+/// A bottleneck link.
+#[derive(Clone, Debug)]
+pub struct LinkSpec {
+    /// Capacity, in bits per second.
+    pub bandwidth_bps: u64,
+    /// Drop-tail queue size, in bytes.
+    pub queue_bytes: u64,
+}
+
+/// A bulk flow, always backlogged while it runs.
+#[derive(Clone, Debug)]
+pub struct FlowSpec {
+    /// The links this flow crosses, in order, as indices into `Scenario::links`.
+    pub path: Vec<usize>,
+    /// Round-trip propagation delay, excluding queueing.
+    pub base_rtt: Duration,
+    pub start: Duration,
+    /// When the flow closes; `None` runs it to the end of the scenario.
+    pub stop: Option<Duration>,
+    pub mss: u32,
+    pub init_cwnd_pkts: u32,
+}
+
+/// Links, the flows crossing them, and how to step virtual time.
+#[derive(Clone, Debug)]
+pub struct Scenario {
+    pub links: Vec<LinkSpec>,
+    pub flows: Vec<FlowSpec>,
+    /// Virtual time to simulate.
+    pub duration: Duration,
+    /// The virtual clock's step. Acks arriving within one tick are delivered to the datapath
+    /// program together, so keep it well below the smallest RTT.
+    pub tick: Duration,
+    /// Virtual time between a message leaving CCP and the datapath applying it.
+    pub ccp_delay: Duration,
+}
+
+impl Scenario {
+    /// `flows` flows starting together through one link, with a buffer of `bdp` times the
+    /// bandwidth-delay product.
+    pub fn dumbbell(
+        bandwidth_bps: u64,
+        rtt: Duration,
+        bdp: f64,
+        flows: usize,
+        duration: Duration,
+    ) -> Self {
+        let bdp_bytes = bandwidth_bps as f64 / 8. * rtt.as_secs_f64();
+        Scenario {
+            links: vec![LinkSpec {
+                bandwidth_bps,
+                queue_bytes: (bdp_bytes * bdp).max(1500.) as u64,
+            }],
+            flows: (0..flows)
+                .map(|_| FlowSpec {
+                    path: vec![0],
+                    base_rtt: rtt,
+                    start: Duration::from_secs(0),
+                    stop: None,
+                    mss: 1448,
+                    init_cwnd_pkts: 10,
+                })
+                .collect(),
+            duration,
+            tick: Duration::from_millis(1),
+            ccp_delay: Duration::from_secs(0),
+        }
+    }
+
+    fn validate(&self) -> Result<()> {
+        if self.tick.as_micros() == 0 {
+            return Err(Error(String::from("tick must be at least 1us")));
+        }
+
+        for (i, f) in self.flows.iter().enumerate() {
+            if f.path.is_empty() || f.path.iter().any(|&l| l >= self.links.len()) {
+                return Err(Error(format!(
+                    "flow {} has an invalid path {:?}",
+                    i, f.path
+                )));
+            }
+
+            if f.mss == 0 {
+                return Err(Error(format!("flow {} has mss 0", i)));
+            }
+        }
+
+        Ok(())
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct FlowResult {
+    pub sid: u32,
+    /// Bytes acknowledged per second while the flow ran, in bits per second.
+    pub throughput_bps: f64,
+    pub delivered_bytes: u64,
+    pub lost_bytes: u64,
+    /// RTT samples, in nanoseconds to match `portus::latency`.
+    pub rtt: Histogram,
+    /// Mean RTT above the flow's base RTT.
+    pub mean_queueing_delay: Duration,
+}
+
+#[derive(Clone, Debug)]
+pub struct LinkResult {
+    /// Fraction of capacity used.
+    pub utilization: f64,
+    pub mean_queue_bytes: f64,
+    pub max_queue_bytes: u64,
+    pub dropped_bytes: u64,
+}
+
+#[derive(Clone, Debug)]
+pub struct Results {
+    pub flows: Vec<FlowResult>,
+    pub links: Vec<LinkResult>,
+    pub virtual_time: Duration,
+    pub wall_time: Duration,
+}
+
+impl Results {
+    /// Jain's fairness index over the flows' throughputs: 1 is a fair share for all.
+    pub fn jain_fairness(&self) -> f64 {
+        let (sum, sq) = self.flows.iter().fold((0., 0.), |(s, q), f| {
+            (
+                s + f.throughput_bps,
+                q + f.throughput_bps * f.throughput_bps,
+            )
+        });
+        if sq == 0. {
+            return 0.;
+        }
+
+        sum * sum / (self.flows.len() as f64 * sq)
+    }
+
+    /// How much faster than real time the simulation ran.
+    pub fn speedup(&self) -> f64 {
+        self.virtual_time.as_secs_f64() / self.wall_time.as_secs_f64().max(1e-9)
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum State {
+    Waiting,
+    Running,
+    Closed,
+}
+
+// What reaches the sender at `at_us`: acknowledged bytes and the RTT of the newest of them, and
+// bytes found lost.
+#[derive(Clone, Copy, Debug)]
+struct Arrival {
+    at_us: u64,
+    acked: u64,
+    lost: u64,
+    rtt_us: u64,
+}
+
+struct SimFlow {
+    spec: FlowSpec,
+    sid: u32,
+    state: State,
+    machine: Machine,
+    inflight: u64,
+    // ordered by arrival time: everything sent back is delayed by the same base RTT.
+    arrivals: VecDeque<Arrival>,
+    pace_credit: u64,
+    last_ack_us: u64,
+    sent_since_ack: u64,
+    rtt_us: u64,
+    delivered: u64,
+    lost: u64,
+    rtt: Histogram,
+    queueing_us: u64,
+}
+
+impl SimFlow {
+    fn arrive(&mut self, a: Arrival) {
+        match self.arrivals.back_mut() {
+            Some(last) if last.at_us == a.at_us => {
+                last.acked += a.acked;
+                last.lost += a.lost;
+                if a.rtt_us > 0 {
+                    last.rtt_us = a.rtt_us;
+                }
+            }
+            _ => self.arrivals.push_back(a),
+        }
+    }
+}
+
+// The simulated datapath: links, flows, and the programs CCP installed.
+struct World {
+    links: Vec<Link>,
+    flows: Vec<SimFlow>,
+    programs: HashMap<u32, Rc<Program>>,
+    to_ccp: channel::Sender<Vec<u8>>,
+    from_ccp: channel::Receiver<Vec<u8>>,
+    // messages from CCP, held until `ccp_delay` after they were sent.
+    replies: VecDeque<(u64, Vec<u8>)>,
+    now_us: u64,
+    tick_us: u64,
+    ccp_delay_us: u64,
+    served: Vec<Chunk>,
+}
+
+impl World {
+    fn to_ccp(&self, buf: Vec<u8>) -> Result<()> {
+        self.to_ccp.send(buf)?;
+        Ok(())
+    }
+
+    fn measure(&self, sid: u32, program_uid: u32, fields: Vec<u64>) -> Result<()> {
+        self.to_ccp(serialize::serialize(&measure::Msg {
+            sid,
+            program_uid,
+            num_fields: fields.len() as u8,
+            fields,
+        })?)
+    }
+
+    // Start and stop flows. Returns whether anything was sent to CCP.
+    fn start_stop(&mut self) -> Result<bool> {
+        let mut sent = false;
+        for i in 0..self.flows.len() {
+            let f = &self.flows[i];
+            let (start_us, stop_us) = (
+                f.spec.start.as_micros() as u64,
+                f.spec.stop.map(|s| s.as_micros() as u64),
+            );
+            if f.state == State::Waiting && self.now_us >= start_us {
+                let msg = create::Msg {
+                    sid: f.sid,
+                    init_cwnd: f.spec.init_cwnd_pkts * f.spec.mss,
+                    mss: f.spec.mss,
+                    src_ip: 0,
+                    src_port: f.sid,
+                    dst_ip: 0,
+                    dst_port: 4242,
+                    cong_alg: None,
+                };
+                let f = &mut self.flows[i];
+                f.state = State::Running;
+                f.machine = Machine::new(u64::from(msg.init_cwnd), self.now_us);
+                f.last_ack_us = self.now_us;
+                self.to_ccp(serialize::serialize(&msg)?)?;
+                sent = true;
+            } else if f.state == State::Running && stop_us.map_or(false, |s| self.now_us >= s) {
+                self.flows[i].state = State::Closed;
+                self.measure(self.flows[i].sid, 0, vec![])?;
+                sent = true;
+            }
+        }
+
+        Ok(sent)
+    }
+
+    // Drain every link for one tick, moving what it serves to the next link on the flow's path
+    // or, at the last link, back to the sender as acks.
+    fn serve_links(&mut self) {
+        let mut served = std::mem::replace(&mut self.served, vec![]);
+        for l in 0..self.links.len() {
+            served.clear();
+            self.links[l].serve(self.tick_us, &mut served);
+            for c in served.iter() {
+                let f = &mut self.flows[c.flow];
+                let at_us = self.now_us + f.spec.base_rtt.as_micros() as u64;
+                if c.hop + 1 < f.spec.path.len() {
+                    let next = Chunk {
+                        hop: c.hop + 1,
+                        ..*c
+                    };
+                    let lost = self.links[f.spec.path[next.hop]].enqueue(next);
+                    if lost > 0 {
+                        f.arrive(Arrival {
+                            at_us,
+                            acked: 0,
+                            lost,
+                            rtt_us: 0,
+                        });
+                    }
+                } else {
+                    f.arrive(Arrival {
+                        at_us,
+                        acked: c.bytes,
+                        lost: 0,
+                        rtt_us: at_us - c.sent_us,
+                    });
+                }
+            }
+        }
+
+        self.served = served;
+    }
+
+    // Run each flow's program over the acks arriving this tick. Returns whether anything was
+    // sent to CCP.
+    fn deliver_acks(&mut self) -> Result<bool> {
+        let mut sent = false;
+        for i in 0..self.flows.len() {
+            let now_us = self.now_us;
+            let f = &mut self.flows[i];
+            if f.state != State::Running {
+                continue;
+            }
+
+            let (mut acked, mut lost) = (0, 0);
+            while f.arrivals.front().map_or(false, |a| a.at_us <= now_us) {
+                let a = f.arrivals.pop_front().unwrap();
+                acked += a.acked;
+                lost += a.lost;
+                if a.rtt_us > 0 {
+                    f.rtt_us = a.rtt_us;
+                    f.rtt.record(a.rtt_us * 1000);
+                    f.queueing_us += a.rtt_us - f.spec.base_rtt.as_micros() as u64;
+                }
+            }
+
+            if acked == 0 && lost == 0 {
+                continue;
+            }
+
+            f.inflight = f.inflight.saturating_sub(acked + lost);
+            f.delivered += acked;
+            f.lost += lost;
+
+            let mss = u64::from(f.spec.mss);
+            let elapsed = (now_us - f.last_ack_us).max(1);
+            let mut p: Primitives = [0; prim::NUM];
+            p[prim::ACK_BYTES_ACKED] = acked;
+            p[prim::ACK_PACKETS_ACKED] = (acked + mss - 1) / mss;
+            p[prim::ACK_LOST_PKTS_SAMPLE] = (lost + mss - 1) / mss;
+            p[prim::ACK_NOW] = now_us;
+            p[prim::FLOW_BYTES_IN_FLIGHT] = f.inflight;
+            p[prim::FLOW_PACKETS_IN_FLIGHT] = (f.inflight + mss - 1) / mss;
+            p[prim::FLOW_RATE_INCOMING] = acked * 1_000_000 / elapsed;
+            p[prim::FLOW_RATE_OUTGOING] = f.sent_since_ack * 1_000_000 / elapsed;
+            p[prim::FLOW_RTT_SAMPLE_US] = f.rtt_us;
+            f.last_ack_us = now_us;
+            f.sent_since_ack = 0;
+
+            match f.machine.on_ack(&p, now_us) {
+                Ok(Some(fields)) => {
+                    let (sid, uid) = (f.sid, f.machine.program_uid());
+                    self.measure(sid, uid, fields)?;
+                    sent = true;
+                }
+                Ok(None) => (),
+                Err(e) => warn!(sid = f.sid, err = ?e, "datapath program failed"),
+            }
+        }
+
+        Ok(sent)
+    }
+
+    // Queue what CCP sent, and apply whatever is due.
+    fn recv_from_ccp(&mut self) {
+        while let Ok(buf) = self.from_ccp.try_recv() {
+            self.replies
+                .push_back((self.now_us + self.ccp_delay_us, buf));
+        }
+
+        while self.replies.front().map_or(false, |r| r.0 <= self.now_us) {
+            let (_, buf) = self.replies.pop_front().unwrap();
+            if let Err(e) = self.apply(&buf) {
+                warn!(err = ?e, "ignoring message from CCP");
+            }
+        }
+    }
+
+    fn apply(&mut self, buf: &[u8]) -> Result<()> {
+        let msg = RawMsg::parse(buf)?;
+        if msg.typ == INSTALL {
+            let p = Program::from_install(buf)?;
+            self.programs.insert(p.uid, Rc::new(p));
+            return Ok(());
+        }
+
+        let f = match self.flows.get_mut((msg.sid as usize).wrapping_sub(1)) {
+            Some(f) if f.state == State::Running => f,
+            _ => return Err(Error(format!("no running flow {}", msg.sid))),
+        };
+        let b = msg.payload();
+        match msg.typ {
+            CHANGEPROG if b.len() >= 8 => {
+                let uid = u32::from_le_bytes([b[0], b[1], b[2], b[3]]);
+                let n = u32::from_le_bytes([b[4], b[5], b[6], b[7]]) as usize;
+                let p = self
+                    .programs
+                    .get(&uid)
+                    .ok_or_else(|| Error(format!("unknown program {}", uid)))?;
+                f.machine.change_program(p.clone(), self.now_us);
+                f.machine.set_fields(&b[8..], n)
+            }
+            UPDATE_FIELD if b.len() >= 4 => {
+                let n = u32::from_le_bytes([b[0], b[1], b[2], b[3]]) as usize;
+                f.machine.set_fields(&b[4..], n)
+            }
+            t => {
+                debug!(typ = t, len = b.len(), "unexpected message");
+                Ok(())
+            }
+        }
+    }
+
+    // Each running flow sends what its window and pacing rate allow. The flow that sends first
+    // rotates, so no flow always finds the queue emptiest.
+    fn send(&mut self) {
+        let n = self.flows.len();
+        let first = (self.now_us / self.tick_us) as usize;
+        for i in (0..n).map(|k| (first + k) % n) {
+            let f = &mut self.flows[i];
+            if f.state != State::Running {
+                continue;
+            }
+
+            let mut n = f.machine.cwnd().saturating_sub(f.inflight);
+            let rate = f.machine.rate();
+            if rate > 0 {
+                // a paced flow may not bank more than a tick and a packet of credit.
+                let per_tick = rate.saturating_mul(self.tick_us) / 1_000_000;
+                f.pace_credit = (f.pace_credit + per_tick).min(per_tick + u64::from(f.spec.mss));
+                n = n.min(f.pace_credit);
+                f.pace_credit -= n;
+            }
+
+            if n == 0 {
+                continue;
+            }
+
+            f.inflight += n;
+            f.sent_since_ack += n;
+            let lost = self.links[f.spec.path[0]].enqueue(Chunk {
+                flow: i,
+                bytes: n,
+                sent_us: self.now_us,
+                hop: 0,
+            });
+            if lost > 0 {
+                let at_us = self.now_us + f.spec.base_rtt.as_micros() as u64;
+                f.arrive(Arrival {
+                    at_us,
+                    acked: 0,
+                    lost,
+                    rtt_us: 0,
+                });
+            }
+        }
+    }
+}
+
+/// Run `scenario` with every flow controlled by `alg`, and report what each flow and link saw.
+///
+/// The datapath is simulated in this thread against a `PollRuntime` over the channel transport.
+/// Virtual time advances one tick at a time; in each tick acks run the flows' datapath programs,
+/// CCP handles the resulting reports, the flows send, and the links drain. Since CCP runs only
+/// when the datapath has sent it something, ticks with nothing to report cost a few
+/// microseconds, and the simulation runs as fast as the host allows.
+pub fn simulate<A: CongAlg<SimIpc>>(scenario: &Scenario, alg: A) -> Result<Results> {
+    simulate_on(scenario, alg, VirtualClock::new())
+}
+
+/// Like `simulate`, with CCP reading the time from `clock`, which advances with the datapath's.
+///
+/// Reports reach the algorithm stamped with the virtual time they were sent, so an algorithm
+/// that keeps time with `Report::received_at`, or a `LoopLatency`, sees simulated time.
+pub fn simulate_on<A: CongAlg<SimIpc>>(
+    scenario: &Scenario,
+    alg: A,
+    clock: VirtualClock,
+) -> Result<Results> {
+    scenario.validate()?;
+    let wall = Instant::now();
+
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock = SimIpc::new(to_dp, from_dp);
+    let mut receive_buf = vec![0u8; 1 << 16];
+    let mut ccp =
+        PollRuntime::new(BackendBuilder { sock }, alg, &mut receive_buf)?.with_clock(clock.clone());
+
+    let mut w = World {
+        links: scenario
+            .links
+            .iter()
+            .map(|l| Link::new(l.bandwidth_bps / 8, l.queue_bytes))
+            .collect(),
+        flows: scenario
+            .flows
+            .iter()
+            .enumerate()
+            .map(|(i, spec)| SimFlow {
+                spec: spec.clone(),
+                sid: i as u32 + 1,
+                state: State::Waiting,
+                machine: Machine::new(0, 0),
+                inflight: 0,
+                arrivals: VecDeque::new(),
+                pace_credit: 0,
+                last_ack_us: 0,
+                sent_since_ack: 0,
+                rtt_us: 0,
+                delivered: 0,
+                lost: 0,
+                rtt: Histogram::default(),
+                queueing_us: 0,
+            })
+            .collect(),
+        programs: HashMap::new(),
+        to_ccp,
+        from_ccp,
+        replies: VecDeque::new(),
+        now_us: 0,
+        tick_us: scenario.tick.as_micros() as u64,
+        ccp_delay_us: scenario.ccp_delay.as_micros() as u64,
+        served: vec![],
+    };
+
+    // programs are installed before the first flow starts, whatever the CCP delay.
+    w.to_ccp(serialize::serialize(&ready::Msg { id: 0 })?)?;
+    ccp.poll()?;
+    while let Ok(buf) = w.from_ccp.try_recv() {
+        w.apply(&buf)?;
+    }
+
+    let end_us = scenario.duration.as_micros() as u64;
+    while w.now_us < end_us {
+        w.now_us += w.tick_us;
+        clock.advance(Duration::from_micros(w.tick_us));
+        let mut to_ccp = w.start_stop()?;
+        to_ccp |= w.deliver_acks()?;
+        if to_ccp {
+            ccp.poll()?;
+        }
+
+        w.recv_from_ccp();
+        w.send();
+        w.serve_links();
+    }
+
+    for f in w.flows.iter_mut().filter(|f| f.state == State::Running) {
+        f.state = State::Closed;
+        w.to_ccp.send(serialize::serialize(&measure::Msg {
+            sid: f.sid,
+            program_uid: 0,
+            num_fields: 0,
+            fields: vec![],
+        })?)?;
+    }
+    ccp.poll()?;
+    ccp.stop();
+
+    let flows = w
+        .flows
+        .iter()
+        .map(|f| {
+            let start = f.spec.start.min(scenario.duration);
+            let stop = f
+                .spec
+                .stop
+                .unwrap_or(scenario.duration)
+                .min(scenario.duration);
+            let secs = stop.checked_sub(start).unwrap_or_default().as_secs_f64();
+            let samples = f.rtt.count();
+            FlowResult {
+                sid: f.sid,
+                throughput_bps: if secs > 0. {
+                    f.delivered as f64 * 8. / secs
+                } else {
+                    0.
+                },
+                delivered_bytes: f.delivered,
+                lost_bytes: f.lost,
+                rtt: f.rtt.clone(),
+                mean_queueing_delay: Duration::from_micros(if samples > 0 {
+                    f.queueing_us / samples
+                } else {
+                    0
+                }),
+            }
+        })
+        .collect();
+
+    let links = w
+        .links
+        .iter()
+        .map(|l| {
+            let ticks = l.stats.ticks.max(1);
+            let capacity = l.bytes_per_sec() as f64 * (ticks * w.tick_us) as f64 / 1e6;
+            LinkResult {
+                utilization: if capacity > 0. {
+                    l.stats.served as f64 / capacity
+                } else {
+                    0.
+                },
+                mean_queue_bytes: l.stats.queued_ticks as f64 / ticks as f64,
+                max_queue_bytes: l.stats.max_queued,
+                dropped_bytes: l.stats.dropped,
+            }
+        })
+        .collect();
+
+    Ok(Results {
+        flows,
+        links,
+        virtual_time: Duration::from_micros(w.now_us),
+        wall_time: wall.elapsed(),
+    })
+}
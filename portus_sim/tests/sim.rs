@@ -0,0 +1,223 @@
+//! Scenarios with known outcomes, run end to end through portus.
+
+use portus::clock::VirtualClock;
+use portus::ipc::Ipc;
+use portus::lang::Scope;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use portus_sim::algs::{Cubic, Reno};
+use portus_sim::{simulate, simulate_on, FlowSpec, LinkSpec, Scenario};
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+// Installs no program, so every flow keeps its initial window.
+struct Fixed;
+
+struct FixedFlow;
+
+impl<I: Ipc> CongAlg<I> for Fixed {
+    type Flow = FixedFlow;
+
+    fn name() -> &'static str {
+        "fixed"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        HashMap::default()
+    }
+
+    fn new_flow(&self, _control: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        FixedFlow
+    }
+}
+
+impl Flow for FixedFlow {
+    fn on_report(&mut self, _sock_id: u32, _m: Report) {}
+}
+
+fn dumbbell(flows: usize) -> Scenario {
+    Scenario::dumbbell(
+        48_000_000,
+        Duration::from_millis(20),
+        1.,
+        flows,
+        Duration::from_secs(20),
+    )
+}
+
+#[test]
+fn window_limited() {
+    let r = simulate(&dumbbell(1), Fixed).unwrap();
+
+    // 10 packets per 20 ms RTT, well under the link rate, so nothing queues.
+    let f = &r.flows[0];
+    let expected = 10. * 1448. * 8. / 0.02;
+    assert!(
+        (f.throughput_bps - expected).abs() / expected < 0.01,
+        "{:?}",
+        f
+    );
+    assert_eq!(f.lost_bytes, 0);
+    assert!(f.mean_queueing_delay < Duration::from_millis(1));
+    assert_eq!(r.links[0].dropped_bytes, 0);
+    assert_eq!(r.virtual_time, Duration::from_secs(20));
+}
+
+// The program from tests/timing.rs: one report, once the flow's `Micros` passes 3 seconds.
+struct Timer {
+    clock: VirtualClock,
+    reports: Arc<Mutex<Vec<(Duration, u64)>>>,
+}
+
+struct TimerFlow {
+    sc: Scope,
+    clock: VirtualClock,
+    reports: Arc<Mutex<Vec<(Duration, u64)>>>,
+}
+
+impl<I: Ipc> CongAlg<I> for Timer {
+    type Flow = TimerFlow;
+
+    fn name() -> &'static str {
+        "timer"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestTiming",
+            "
+            (def (Report.acked 0) (Control.state 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (fallthrough)
+            )
+            (when (&& (> Micros 3000000) (== Control.state 0))
+                (:= Control.state 1)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut control: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        TimerFlow {
+            sc: control.set_program("TestTiming", None).unwrap(),
+            clock: self.clock.clone(),
+            reports: self.reports.clone(),
+        }
+    }
+}
+
+impl Flow for TimerFlow {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        self.reports
+            .lock()
+            .unwrap()
+            .push((self.clock.since_start(m.received_at()), acked));
+    }
+}
+
+#[test]
+fn micros_timer_in_virtual_time() {
+    let clock = VirtualClock::new();
+    let reports = Arc::new(Mutex::new(vec![]));
+    let mut s = dumbbell(1);
+    s.duration = Duration::from_secs(10);
+    let r = simulate_on(
+        &s,
+        Timer {
+            clock: clock.clone(),
+            reports: reports.clone(),
+        },
+        clock.clone(),
+    )
+    .unwrap();
+    assert_eq!(clock.elapsed(), r.virtual_time);
+
+    // the first ack after 3 s, from the flow's program starting in the first tick.
+    let reports = reports.lock().unwrap();
+    assert_eq!(reports.len(), 1, "{:?}", reports);
+    let (at, acked) = reports[0];
+    assert!(
+        at > Duration::from_secs(3) && at <= Duration::from_millis(3002),
+        "{:?}",
+        at
+    );
+    assert!(acked > 0);
+}
+
+#[test]
+fn reno_shares_a_link() {
+    let r = simulate(&dumbbell(2), Reno).unwrap();
+    assert!(r.links[0].utilization > 0.95, "{:?}", r.links[0]);
+    assert!(r.jain_fairness() > 0.9, "{:?}", r.flows);
+    for f in &r.flows {
+        assert!(f.lost_bytes > 0);
+        assert!(f.mean_queueing_delay > Duration::from_millis(1));
+    }
+}
+
+#[test]
+fn cubic_fills_a_link() {
+    let r = simulate(&dumbbell(4), Cubic).unwrap();
+    assert!(r.links[0].utilization > 0.95, "{:?}", r.links[0]);
+    assert!(r.jain_fairness() > 0.8, "{:?}", r.flows);
+}
+
+// A flow crossing two bottlenecks competes with a flow at each.
+#[test]
+fn parking_lot() {
+    let link = LinkSpec {
+        bandwidth_bps: 24_000_000,
+        queue_bytes: 60_000,
+    };
+    let flow = |path: Vec<usize>| FlowSpec {
+        path,
+        base_rtt: Duration::from_millis(20),
+        start: Duration::from_secs(0),
+        stop: None,
+        mss: 1448,
+        init_cwnd_pkts: 10,
+    };
+    let s = Scenario {
+        links: vec![link.clone(), link],
+        flows: vec![flow(vec![0, 1]), flow(vec![0]), flow(vec![1])],
+        duration: Duration::from_secs(20),
+        tick: Duration::from_millis(1),
+        ccp_delay: Duration::from_secs(0),
+    };
+
+    let r = simulate(&s, Reno).unwrap();
+    for l in &r.links {
+        assert!(l.utilization > 0.9, "{:?}", l);
+    }
+
+    let long = r.flows[0].throughput_bps;
+    assert!(long < r.flows[1].throughput_bps, "{:?}", r.flows);
+    assert!(long < r.flows[2].throughput_bps, "{:?}", r.flows);
+}
+
+#[test]
+fn staggered_flows() {
+    let mut s = dumbbell(2);
+    s.flows[1].start = Duration::from_secs(5);
+    s.flows[1].stop = Some(Duration::from_secs(15));
+
+    let r = simulate(&s, Reno).unwrap();
+    assert!(r.links[0].utilization > 0.95, "{:?}", r.links[0]);
+    // the second flow's throughput is over the 10 s it ran.
+    let late = &r.flows[1];
+    let expected = late.delivered_bytes as f64 * 8. / 10.;
+    assert!((late.throughput_bps - expected).abs() < 1., "{:?}", late);
+    assert!(late.throughput_bps > 10e6, "{:?}", late);
+}
+
+#[test]
+fn bad_path() {
+    let mut s = dumbbell(1);
+    s.flows[0].path = vec![1];
+    assert!(simulate(&s, Fixed).is_err());
+}
@@ -1,4 +1,4 @@
-from .pyportus import DatapathInfo, PyDatapath, PyReport, start_inner
+from .pyportus import DatapathInfo, PyDatapath, PyReport, start_inner, async_inner
 from abc import ABCMeta, abstractmethod
 import signal
 import sys
@@ -31,13 +31,55 @@ class AlgBase(object):
                         ))
             return True
 
-def start(ipc, alg):
+def _check_alg(alg):
     cls = alg.__class__
     if not issubclass(cls, object):
         raise Exception(cls.__name__ + " must be a subclass of object")
     if issubclass(cls, AlgBase):
         AlgBase.assert_implements_interface(cls)
         checker._check_datapath_programs(cls)
-        return start_inner(ipc, alg)
     else:
         raise Exception(cls.__name__ + " must be a subclass of portus.AlgBase")
+
+def start(ipc, alg):
+    _check_alg(alg)
+    return start_inner(ipc, alg)
+
+class AsyncCCP(object):
+    """
+    Runs a congestion control algorithm on an existing asyncio event loop.
+
+    Unlike `start`, this does not block or install signal handlers. `on_report` may be
+    either a plain function or a coroutine; coroutines are scheduled on the loop.
+
+        ccp = portus.AsyncCCP("unix", MyAlg())
+        ccp.start()
+        loop.run_forever()
+    """
+    def __init__(self, ipc, alg):
+        _check_alg(alg)
+        self._inner = async_inner(ipc, alg)
+        self._loop = None
+
+    def start(self, loop=None):
+        import asyncio
+        if self._loop is not None:
+            raise Exception("AsyncCCP already started")
+        if loop is None:
+            loop = asyncio.get_event_loop()
+        self._loop = loop
+        loop.add_reader(self._inner.fileno(), self._on_readable)
+
+    def _on_readable(self):
+        try:
+            self._inner.on_readable()
+        except Exception:
+            # the socket failed; stop reading rather than spin on the same error.
+            self.stop()
+            raise
+
+    def stop(self):
+        if self._loop is not None:
+            self._loop.remove_reader(self._inner.fileno())
+            self._loop = None
+        self._inner.stop()
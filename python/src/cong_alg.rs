@@ -10,6 +10,7 @@ pub struct PyFlow<'py> {
     py: Python<'py>,
     flow_obj: PyObject,
     datapath: Py<PyDatapath>,
+    is_async: bool,
 }
 
 impl<'py> Flow for PyFlow<'py> {
@@ -50,6 +51,13 @@ impl<'py> Flow for PyFlow<'py> {
 
         let args = PyTuple::new(py, &[report]);
         match self.flow_obj.call_method1(py, "on_report", args) {
+            Ok(ret) if self.is_async => {
+                // on_report may be a coroutine: schedule it on the running event loop.
+                if let Err(e) = schedule_if_coroutine(py, ret) {
+                    e.print(py);
+                    tracing::error!(sock_id, "failed to schedule on_report() coroutine");
+                }
+            }
             Ok(_ret) => {}
             Err(e) => {
                 e.print(py);
@@ -59,9 +67,21 @@ impl<'py> Flow for PyFlow<'py> {
     }
 }
 
+fn schedule_if_coroutine(py: Python, ret: PyObject) -> PyResult<()> {
+    let asyncio = py.import("asyncio")?;
+    let is_coroutine: bool = asyncio.call_method1("iscoroutine", (&ret,))?.extract()?;
+    if is_coroutine {
+        asyncio.call_method1("ensure_future", (ret,))?;
+    }
+
+    Ok(())
+}
+
 pub struct PyCongAlg<'py> {
     pub py: Python<'py>,
     pub alg_obj: PyObject,
+    /// Whether flows run under an asyncio event loop (see `AsyncCCP`).
+    pub is_async: bool,
 }
 
 impl<'py, T: Ipc> CongAlg<T> for PyCongAlg<'py> {
@@ -165,6 +185,7 @@ impl<'py, T: Ipc> CongAlg<T> for PyCongAlg<'py> {
             py: self.py,
             flow_obj,
             datapath: py_datapath,
+            is_async: self.is_async,
         }
     }
 
@@ -208,6 +208,11 @@ fn pyportus(_py: Python, m: &PyModule) -> PyResult<()> {
         py_start_inner(py, ipc_str, alg)
     }
 
+    #[pyfn(m)]
+    fn async_inner(py: Python, ipc_str: String, alg: PyObject) -> PyResult<AsyncCCP> {
+        py_async_inner(py, ipc_str, alg)
+    }
+
     #[pyfn(m)]
     fn try_compile(py: Python, prog: String) -> PyResult<String> {
         py_try_compile(py, prog)
@@ -216,6 +221,7 @@ fn pyportus(_py: Python, m: &PyModule) -> PyResult<()> {
     m.add_class::<DatapathInfo>()?;
     m.add_class::<PyDatapath>()?;
     m.add_class::<PyReport>()?;
+    m.add_class::<AsyncCCP>()?;
     Ok(())
 }
 
@@ -227,7 +233,11 @@ fn py_start_inner<'p>(py: Python<'p>, ipc: String, alg: PyObject) -> PyResult<i3
 
     tracing_subscriber::fmt::init();
 
-    let py_cong_alg = PyCongAlg { py, alg_obj: alg };
+    let py_cong_alg = PyCongAlg {
+        py,
+        alg_obj: alg,
+        is_async: false,
+    };
 
     // SAFETY: _connect will block the Python program, so really we will hold the GIL for
     // the remainder of the program's lifetime, which is 'static.
@@ -255,6 +265,134 @@ fn py_start_inner<'p>(py: Python<'p>, ipc: String, alg: PyObject) -> PyResult<i3
     Ok(0)
 }
 
+enum AsyncRuntime {
+    Unix(portus::PollRuntime<'static, ipc::unix::Socket<ipc::Nonblocking>, PyCongAlg<'static>>),
+    #[cfg(all(target_os = "linux"))]
+    Netlink(
+        portus::PollRuntime<'static, ipc::netlink::Socket<ipc::Nonblocking>, PyCongAlg<'static>>,
+    ),
+}
+
+/// A CCP runtime that shares the caller's asyncio event loop instead of blocking a thread.
+///
+/// The python wrapper registers `fileno()` with `loop.add_reader` and calls `on_readable()`
+/// whenever the IPC socket has data; no signal handlers are installed.
+#[pyclass(unsendable)]
+struct AsyncCCP {
+    // `None` only while dropping: the runtime borrows `receive_buf`, so it goes first.
+    rt: Option<AsyncRuntime>,
+    receive_buf: *mut [u8],
+}
+
+impl Drop for AsyncCCP {
+    fn drop(&mut self) {
+        self.rt.take();
+        // SAFETY: from `Box::into_raw` in `py_async_inner`, and the runtime borrowing it is gone.
+        unsafe { drop(Box::from_raw(self.receive_buf)) };
+    }
+}
+
+impl AsyncCCP {
+    fn rt(&mut self) -> &mut AsyncRuntime {
+        self.rt
+            .as_mut()
+            .expect("runtime is only taken when dropping")
+    }
+}
+
+#[pymethods]
+impl AsyncCCP {
+    fn fileno(&self) -> i32 {
+        use std::os::unix::io::AsRawFd;
+        match self.rt.as_ref() {
+            Some(AsyncRuntime::Unix(rt)) => rt.as_raw_fd(),
+            #[cfg(all(target_os = "linux"))]
+            Some(AsyncRuntime::Netlink(rt)) => rt.as_raw_fd(),
+            None => -1,
+        }
+    }
+
+    /// Drain and dispatch all pending datapath messages. Returns how many were handled.
+    fn on_readable(&mut self) -> PyResult<usize> {
+        match self.rt() {
+            AsyncRuntime::Unix(rt) => rt.poll(),
+            #[cfg(all(target_os = "linux"))]
+            AsyncRuntime::Netlink(rt) => rt.poll(),
+        }
+        .or_else(|e| raise!(PyException, format!("{:?}", e), false))
+    }
+
+    fn stop(&mut self) {
+        match self.rt() {
+            AsyncRuntime::Unix(rt) => rt.stop(),
+            #[cfg(all(target_os = "linux"))]
+            AsyncRuntime::Netlink(rt) => rt.stop(),
+        }
+    }
+}
+
+fn py_async_inner<'p>(py: Python<'p>, ipc: String, alg: PyObject) -> PyResult<AsyncCCP> {
+    if let Err(e) = portus::algs::ipc_valid(ipc.clone()) {
+        raise!(PyValueError, e);
+    };
+
+    tracing_subscriber::fmt::try_init().unwrap_or_else(|_| ());
+
+    let py_cong_alg = PyCongAlg {
+        py,
+        alg_obj: alg,
+        is_async: true,
+    };
+
+    // SAFETY: the runtime only calls into python from `AsyncCCP::on_readable`, which python
+    // invokes with the GIL held, so the token is valid whenever it is used.
+    let py_cong_alg: PyCongAlg<'static> = unsafe { std::mem::transmute(py_cong_alg) };
+    // The runtime borrows its receive buffer for as long as the `AsyncCCP` object lives, which
+    // frees it after dropping the runtime.
+    let buf_ptr = Box::into_raw(vec![0u8; ipc::MAX_MSG_LEN].into_boxed_slice());
+    tracing::info!(?ipc, "starting async CCP");
+    // SAFETY: freed only in `AsyncCCP::drop`, after the runtime, or below if there is none.
+    match async_runtime(&ipc, py_cong_alg, unsafe { &mut *buf_ptr }) {
+        Ok(rt) => Ok(AsyncCCP {
+            rt: Some(rt),
+            receive_buf: buf_ptr,
+        }),
+        Err(e) => {
+            unsafe { drop(Box::from_raw(buf_ptr)) };
+            Err(e)
+        }
+    }
+}
+
+fn async_runtime(
+    ipc: &str,
+    py_cong_alg: PyCongAlg<'static>,
+    receive_buf: &'static mut [u8],
+) -> PyResult<AsyncRuntime> {
+    match ipc {
+        "unix" => {
+            use ipc::unix::Socket;
+            let b = Socket::<ipc::Nonblocking>::new("portus")
+                .map(|sk| BackendBuilder { sock: sk })
+                .or_else(|e| raise!(PyException, format!("{:?}", e), false))?;
+            portus::PollRuntime::new(b, py_cong_alg, receive_buf).map(AsyncRuntime::Unix)
+        }
+        #[cfg(all(target_os = "linux"))]
+        "netlink" => {
+            use ipc::netlink::Socket;
+            let b = Socket::<ipc::Nonblocking>::new()
+                .map(|sk| BackendBuilder { sock: sk })
+                .or_else(|e| raise!(PyException, format!("{:?}", e), false))?;
+            portus::PollRuntime::new(b, py_cong_alg, receive_buf).map(AsyncRuntime::Netlink)
+        }
+        _ => raise!(
+            PyValueError,
+            format!("ipc {} does not support asyncio", ipc)
+        ),
+    }
+    .or_else(|e| raise!(PyException, format!("{:?}", e), false))
+}
+
 fn py_try_compile<'p>(_py: Python<'p>, prog: String) -> PyResult<String> {
     use portus::lang;
     match lang::compile(prog.as_bytes(), &[]) {
@@ -0,0 +1,496 @@
+//! Flows whose reports are handled by futures, for algorithms that wait on something outside the
+//! runtime (an inference server, a shared rate database) without stalling the other flows.
+//!
+//! An `AsyncFlow`'s `on_report` returns a future, and the flow applies what it resolves to in
+//! `on_ready`. Wrap the flow in `Async` and return that from `CongAlg::new_flow`: it is a `Flow`
+//! like any other. Each flow handles one report at a time; reports that arrive while its future
+//! is pending wait in a short queue, and the other flows' reports go on being handled.
+//!
+//! Pending futures are driven by an executor on the runtime's thread, which polls the ones that
+//! were woken after each message the runtime handles, and when the runtime's socket receive times
+//! out while waiting for one (every second for `chan` and `unix` sockets). A future woken from
+//! another thread may therefore wait that long to run if the datapath is quiet. `PollRuntime`
+//! and `DirectRuntime` run the executor at the end of each `poll` and `recv_msg`; an event loop
+//! that wakes for other reasons can also call `run_pending`.
+//!
+//! A future still pending after `AsyncPolicy::timeout` is handled as `OnTimeout` says, and the
+//! flow's `on_timeout` is called, e.g. to fall back to a conservative window. Timeouts are
+//! checked whenever the executor runs, so they fire late by up to the same interval.
+
+use crate::{Flow, Report};
+use std::cell::RefCell;
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, HashMap, VecDeque};
+use std::future::Future;
+use std::pin::Pin;
+use std::rc::Rc;
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll, Wake, Waker};
+use std::time::{Duration, Instant};
+use tracing::debug;
+
+/// What `AsyncFlow::on_report` returns. It may not borrow the flow; it resolves to a value the
+/// flow then applies in `on_ready`.
+pub type ReportFuture<T> = Pin<Box<dyn Future<Output = T>>>;
+
+/// Like `Flow`, but handling a report may wait.
+pub trait AsyncFlow {
+    type Output: 'static;
+
+    /// Start handling a report; the flow's next report is not handed over until the returned
+    /// future resolves or times out.
+    fn on_report(&mut self, sock_id: u32, m: Report) -> ReportFuture<Self::Output>;
+
+    /// Apply what the future for a report resolved to, e.g. by updating the flow's `Cwnd`.
+    fn on_ready(&mut self, sock_id: u32, out: Self::Output);
+
+    /// Called when a report's future times out. The default does nothing.
+    fn on_timeout(&mut self, _sock_id: u32) {}
+
+    /// See `Flow::close`. Any pending future is dropped first.
+    fn close(&mut self) {}
+}
+
+/// What to do with a future that is still pending after `AsyncPolicy::timeout`.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum OnTimeout {
+    /// Drop it, and go on to the next queued report.
+    Abandon,
+    /// Drop it and all but the newest queued report, and go on to that one.
+    SkipToLatest,
+    /// Keep waiting for it.
+    Wait,
+}
+
+/// How long a flow's futures may take, and how many reports may wait behind one.
+#[derive(Clone, Copy, Debug)]
+pub struct AsyncPolicy {
+    pub timeout: Duration,
+    pub on_timeout: OnTimeout,
+    /// Reports beyond this many waiting are dropped, oldest first.
+    pub max_queued: usize,
+}
+
+impl Default for AsyncPolicy {
+    fn default() -> Self {
+        AsyncPolicy {
+            timeout: Duration::from_millis(100),
+            on_timeout: OnTimeout::Abandon,
+            max_queued: 8,
+        }
+    }
+}
+
+// What a task needs from the executor after being driven.
+enum Drive {
+    Idle,
+    // waiting for its future, which times out at the deadline, if any.
+    Pending(Option<Instant>),
+}
+
+trait Task {
+    fn drive(&self, now: Instant) -> Drive;
+}
+
+// Queues the task's id to be driven when its future is woken.
+struct TaskWaker {
+    id: u64,
+    woken: Arc<Mutex<Vec<u64>>>,
+}
+
+impl Wake for TaskWaker {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+
+    fn wake_by_ref(self: &Arc<Self>) {
+        self.woken.lock().unwrap().push(self.id);
+    }
+}
+
+#[derive(Default)]
+struct Executor {
+    tasks: HashMap<u64, Rc<dyn Task>>,
+    deadlines: BinaryHeap<Reverse<(Instant, u64)>>,
+    woken: Arc<Mutex<Vec<u64>>>,
+    next_id: u64,
+}
+
+impl Executor {
+    fn settle(&mut self, id: u64, task: Rc<dyn Task>, state: Drive) {
+        match state {
+            Drive::Idle => {
+                self.tasks.remove(&id);
+            }
+            Drive::Pending(deadline) => {
+                if let Some(t) = deadline {
+                    self.deadlines.push(Reverse((t, id)));
+                }
+
+                self.tasks.insert(id, task);
+            }
+        }
+    }
+}
+
+thread_local! {
+    static EXECUTOR: RefCell<Executor> = RefCell::new(Executor::default());
+}
+
+/// Drive the futures of this thread's `Async` flows that were woken or have timed out. Returns
+/// how many were driven.
+pub fn run_pending() -> usize {
+    let now = Instant::now();
+    // the flows may start new futures while being driven, so the executor is not borrowed then.
+    let due: Vec<(u64, Rc<dyn Task>)> = EXECUTOR.with(|e| {
+        let mut e = e.borrow_mut();
+        let mut ids = std::mem::take(&mut *e.woken.lock().unwrap());
+        while let Some(Reverse((t, id))) = e.deadlines.peek().copied() {
+            if t > now {
+                break;
+            }
+
+            e.deadlines.pop();
+            ids.push(id);
+        }
+
+        ids.sort_unstable();
+        ids.dedup();
+        ids.into_iter()
+            .filter_map(|id| e.tasks.get(&id).map(|t| (id, t.clone())))
+            .collect()
+    });
+
+    let driven = due.len();
+    for (id, task) in due {
+        let state = task.drive(now);
+        EXECUTOR.with(|e| e.borrow_mut().settle(id, task, state));
+    }
+
+    driven
+}
+
+struct Inner<F: AsyncFlow> {
+    flow: F,
+    policy: AsyncPolicy,
+    waker: Waker,
+    sock_id: Option<u32>,
+    queue: VecDeque<Report>,
+    pending: Option<ReportFuture<F::Output>>,
+    deadline: Instant,
+    timed_out: bool,
+}
+
+impl<F: AsyncFlow> Inner<F> {
+    // Poll the pending future, and start the queued reports' futures as each one resolves.
+    fn drive(&mut self, now: Instant) -> Drive {
+        let sock_id = self.sock_id.unwrap_or_default();
+        loop {
+            if let Some(fut) = self.pending.as_mut() {
+                let mut cx = Context::from_waker(&self.waker);
+                if let Poll::Ready(out) = fut.as_mut().poll(&mut cx) {
+                    self.pending = None;
+                    self.flow.on_ready(sock_id, out);
+                } else if self.timed_out || now < self.deadline {
+                    let deadline = Some(self.deadline).filter(|_| !self.timed_out);
+                    return Drive::Pending(deadline);
+                } else {
+                    debug!(sid = sock_id, policy = ?self.policy.on_timeout, "report timed out");
+                    self.flow.on_timeout(sock_id);
+                    match self.policy.on_timeout {
+                        OnTimeout::Wait => self.timed_out = true,
+                        OnTimeout::Abandon => self.pending = None,
+                        OnTimeout::SkipToLatest => {
+                            self.pending = None;
+                            let skip = self.queue.len().saturating_sub(1);
+                            self.queue.drain(..skip);
+                        }
+                    }
+
+                    continue;
+                }
+            }
+
+            match self.queue.pop_front() {
+                Some(m) => {
+                    self.pending = Some(self.flow.on_report(sock_id, m));
+                    self.deadline = now + self.policy.timeout;
+                    self.timed_out = false;
+                }
+                None => return Drive::Idle,
+            }
+        }
+    }
+}
+
+impl<F: AsyncFlow> Task for RefCell<Inner<F>> {
+    fn drive(&self, now: Instant) -> Drive {
+        self.borrow_mut().drive(now)
+    }
+}
+
+/// An `AsyncFlow` as a `Flow`, whose futures run on the runtime thread's executor.
+pub struct Async<F: AsyncFlow + 'static> {
+    id: u64,
+    inner: Rc<RefCell<Inner<F>>>,
+}
+
+impl<F: AsyncFlow + 'static> Async<F> {
+    pub fn new(flow: F, policy: AsyncPolicy) -> Self {
+        let (id, woken) = EXECUTOR.with(|e| {
+            let mut e = e.borrow_mut();
+            e.next_id += 1;
+            (e.next_id, e.woken.clone())
+        });
+
+        Async {
+            id,
+            inner: Rc::new(RefCell::new(Inner {
+                flow,
+                policy,
+                waker: Waker::from(Arc::new(TaskWaker { id, woken })),
+                sock_id: None,
+                queue: VecDeque::new(),
+                pending: None,
+                deadline: Instant::now(),
+                timed_out: false,
+            })),
+        }
+    }
+
+    /// Whether a report's future is pending.
+    pub fn is_pending(&self) -> bool {
+        self.inner.borrow().pending.is_some()
+    }
+
+    fn deregister(&self) {
+        // the executor is gone if the thread is exiting.
+        let _ = EXECUTOR.try_with(|e| e.borrow_mut().tasks.remove(&self.id));
+    }
+}
+
+impl<F: AsyncFlow + 'static> Flow for Async<F> {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        let state = {
+            let mut inner = self.inner.borrow_mut();
+            inner.sock_id = Some(sock_id);
+            if inner.queue.len() >= inner.policy.max_queued.max(1) {
+                debug!(
+                    sid = sock_id,
+                    "report queue full, dropping the oldest report"
+                );
+                inner.queue.pop_front();
+            }
+
+            inner.queue.push_back(m);
+            if inner.pending.is_some() {
+                // the executor starts it when the pending future is done.
+                return;
+            }
+
+            inner.drive(Instant::now())
+        };
+
+        let task: Rc<dyn Task> = self.inner.clone();
+        EXECUTOR.with(|e| e.borrow_mut().settle(self.id, task, state));
+    }
+
+    fn close(&mut self) {
+        self.deregister();
+        let mut inner = self.inner.borrow_mut();
+        inner.pending = None;
+        inner.queue.clear();
+        inner.flow.close();
+    }
+}
+
+impl<F: AsyncFlow + 'static> Drop for Async<F> {
+    fn drop(&mut self) {
+        self.deregister();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{run_pending, Async, AsyncFlow, AsyncPolicy, OnTimeout, ReportFuture};
+    use crate::{Flow, Report};
+    use std::cell::RefCell;
+    use std::future::Future;
+    use std::pin::Pin;
+    use std::rc::Rc;
+    use std::sync::{Arc, Mutex};
+    use std::task::{Context, Poll, Waker};
+    use std::time::Duration;
+
+    // Resolves to the value `answer` is given.
+    #[derive(Clone, Default)]
+    struct Answer(Arc<Mutex<(Option<u64>, Option<Waker>)>>);
+
+    impl Answer {
+        fn give(&self, v: u64) {
+            let mut a = self.0.lock().unwrap();
+            a.0 = Some(v);
+            if let Some(w) = a.1.take() {
+                w.wake();
+            }
+        }
+    }
+
+    impl Future for Answer {
+        type Output = u64;
+
+        fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<u64> {
+            let mut a = self.0.lock().unwrap();
+            match a.0.take() {
+                Some(v) => Poll::Ready(v),
+                None => {
+                    a.1 = Some(cx.waker().clone());
+                    Poll::Pending
+                }
+            }
+        }
+    }
+
+    // Asks for an answer to each report with `program_uid` 1, and answers the others at once.
+    struct Asking {
+        asked: Rc<RefCell<Vec<Answer>>>,
+        log: Rc<RefCell<Vec<String>>>,
+    }
+
+    impl AsyncFlow for Asking {
+        type Output = u64;
+
+        fn on_report(&mut self, _sock_id: u32, m: Report) -> ReportFuture<u64> {
+            self.log
+                .borrow_mut()
+                .push(format!("report {}", m.fields[0]));
+            if m.program_uid != 1 {
+                return Box::pin(async move { m.fields[0] });
+            }
+
+            let a = Answer::default();
+            self.asked.borrow_mut().push(a.clone());
+            Box::pin(a)
+        }
+
+        fn on_ready(&mut self, _sock_id: u32, out: u64) {
+            self.log.borrow_mut().push(format!("ready {}", out));
+        }
+
+        fn on_timeout(&mut self, _sock_id: u32) {
+            self.log.borrow_mut().push(String::from("timeout"));
+        }
+    }
+
+    fn report(program_uid: u32, v: u64) -> Report {
+        Report {
+            program_uid,
+            from: String::new(),
+            fields: vec![v],
+            received_at: std::time::Instant::now(),
+        }
+    }
+
+    fn flow(
+        policy: AsyncPolicy,
+    ) -> (
+        Async<Asking>,
+        Rc<RefCell<Vec<Answer>>>,
+        Rc<RefCell<Vec<String>>>,
+    ) {
+        let asked = Rc::new(RefCell::new(vec![]));
+        let log = Rc::new(RefCell::new(vec![]));
+        let f = Async::new(
+            Asking {
+                asked: asked.clone(),
+                log: log.clone(),
+            },
+            policy,
+        );
+        (f, asked, log)
+    }
+
+    #[test]
+    fn reports_wait_for_pending_future() {
+        let (mut f, asked, log) = flow(AsyncPolicy::default());
+        let (mut g, _, glog) = flow(AsyncPolicy::default());
+
+        f.on_report(1, report(1, 10));
+        f.on_report(1, report(0, 11));
+        assert!(f.is_pending());
+        assert_eq!(*log.borrow(), vec!["report 10"]);
+
+        // other flows are not held up.
+        g.on_report(2, report(0, 20));
+        assert_eq!(*glog.borrow(), vec!["report 20", "ready 20"]);
+
+        assert_eq!(run_pending(), 0);
+        asked.borrow()[0].give(100);
+        assert_eq!(run_pending(), 1);
+        assert!(!f.is_pending());
+        assert_eq!(
+            *log.borrow(),
+            vec!["report 10", "ready 100", "report 11", "ready 11"]
+        );
+    }
+
+    #[test]
+    fn timeouts() {
+        let timeout = Duration::from_millis(10);
+        for (on_timeout, rest) in vec![
+            (
+                OnTimeout::Abandon,
+                vec!["report 11", "report 12", "ready 12"],
+            ),
+            (OnTimeout::SkipToLatest, vec!["report 12", "ready 12"]),
+            (OnTimeout::Wait, vec![]),
+        ] {
+            let (mut f, _, log) = flow(AsyncPolicy {
+                timeout,
+                on_timeout,
+                max_queued: 8,
+            });
+            f.on_report(1, report(1, 10));
+            f.on_report(1, report(1, 11));
+            f.on_report(1, report(0, 12));
+            std::thread::sleep(timeout);
+            run_pending();
+            let mut expected = vec!["report 10", "timeout"];
+            expected.extend(rest.iter());
+            // abandoning the second report's future waits for its own timeout.
+            if on_timeout == OnTimeout::Abandon {
+                std::thread::sleep(timeout);
+                run_pending();
+                expected.insert(3, "timeout");
+            }
+
+            assert_eq!(*log.borrow(), expected, "{:?}", on_timeout);
+            assert_eq!(f.is_pending(), on_timeout == OnTimeout::Wait);
+        }
+    }
+
+    #[test]
+    fn full_queue_drops_oldest() {
+        let (mut f, asked, log) = flow(AsyncPolicy {
+            max_queued: 2,
+            ..Default::default()
+        });
+        for v in 10..14 {
+            f.on_report(1, report(if v == 10 { 1 } else { 0 }, v));
+        }
+
+        asked.borrow()[0].give(100);
+        run_pending();
+        assert_eq!(
+            *log.borrow(),
+            vec![
+                "report 10",
+                "ready 100",
+                "report 12",
+                "ready 12",
+                "report 13",
+                "ready 13"
+            ]
+        );
+    }
+}
@@ -21,6 +21,7 @@ use std::process::Command;
 struct Alg {
     crate_name: String,
     crate_path: String,
+    crate_version: String,
 }
 
 use toml::Value;
@@ -74,15 +75,29 @@ fn find_algs(root: PathBuf) -> Vec<Alg> {
             });
 
             let crate_name = &config_toml["package"]["name"].as_str().unwrap();
+            let crate_version = config_toml["package"]
+                .get("version")
+                .and_then(Value::as_str)
+                .unwrap_or("");
             Some(Alg {
                 crate_name: crate_name.to_string(),
                 crate_path: crate_path.to_owned(),
+                crate_version: crate_version.to_owned(),
             })
         })
         .collect()
 }
 
+/// The generated library uses this portus, at the path `ccp` was built from. The patch makes the
+/// algorithms, which depend on portus from crates.io, build against the same copy, so that they
+/// and the shim agree on its types.
 fn generate_cargo_toml(algs: &[Alg]) -> String {
+    let portus_path = env!("CARGO_MANIFEST_DIR");
+    let portus = format!(
+        "{{ version = \"={}\", path = \"{}\" }}",
+        env!("CARGO_PKG_VERSION"),
+        portus_path
+    );
     let toml = std::iter::once(
         r#"[package]
 name = "startccp"
@@ -96,19 +111,25 @@ crate-type = ["staticlib", "cdylib"]
 [dependencies]
 libc = "0.2"
 clap = "2.32"
-portus = "^0.5"
 "#
         .to_owned(),
-    );
+    )
+    .chain(std::iter::once(format!("portus = {}\n", portus)));
 
     let algs_strs = algs.iter().map(
         |Alg {
              crate_name,
              crate_path,
+             ..
          }| { format!("{} = {{ path = \"{}\" }}\n", crate_name, crate_path).to_string() },
     );
 
-    itertools::join(toml.chain(algs_strs), "")
+    let patch = std::iter::once(format!(
+        "\n[patch.crates-io]\nportus = {{ path = \"{}\" }}\n",
+        portus_path
+    ));
+
+    itertools::join(toml.chain(algs_strs).chain(patch), "")
 }
 
 use proc_macro2::{Ident, Span};
@@ -134,7 +155,7 @@ fn generate_lib_rs(algs: &[Alg]) -> String {
         },
     );
 
-    let matches = algs.iter().map(|Alg{ crate_name, .. }| {
+    let matches = algs.iter().map(|Alg { crate_name, .. }| {
         let name = Ident::new(crate_name, Span::call_site());
         let name_key = Ident::new(&format!("{}_key", crate_name), Span::call_site());
         let name_args = Ident::new(&format!("{}_args", crate_name), Span::call_site());
@@ -143,8 +164,24 @@ fn generate_lib_rs(algs: &[Alg]) -> String {
                 let args = #name_args.arg(ipc_arg);
                 let matches = args.get_matches_from(argv);
                 let ipc = matches.value_of("ipc").unwrap();
-                let alg = #name::__ccp_alg_export::with_arg_matches(&matches, Some(log.clone())).unwrap();
-                portus::start!(ipc, Some(log), alg).unwrap()
+                let alg = #name::__ccp_alg_export::with_arg_matches(&matches).unwrap();
+                portus::start!(ipc, alg).unwrap();
+                0
+            }
+        }
+    });
+
+    let opens = algs.iter().map(|Alg { crate_name, .. }| {
+        let name = Ident::new(crate_name, Span::call_site());
+        let name_key = Ident::new(&format!("{}_key", crate_name), Span::call_site());
+        let name_args = Ident::new(&format!("{}_args", crate_name), Span::call_site());
+        quote! {
+            ref a if a == &#name_key => {
+                let matches = #name_args.arg(ipc_arg).get_matches_from(argv);
+                let alg = #name::__ccp_alg_export::with_arg_matches(&matches).ok()?;
+                portus::DirectRuntime::new(sock, alg)
+                    .ok()
+                    .map(|rt| Box::new(rt) as Box<dyn Generation>)
             }
         }
     });
@@ -155,6 +192,8 @@ fn generate_lib_rs(algs: &[Alg]) -> String {
             eprintln!("- {}", #name_key);
         }
     });
+    let alglist: Vec<_> = alglist.collect();
+    let loads: Vec<_> = loads.collect();
 
     let lib_rs = quote! {
         extern crate clap;
@@ -166,15 +205,9 @@ fn generate_lib_rs(algs: &[Alg]) -> String {
 
         use libc::c_char;
         use std::ffi::CStr;
-        use std::os::unix::io::FromRawFd;
-        use std::fs::File;
 
-        fn _start(args: String, out: Option<File>) -> u32 {
+        fn _start(args: String) -> u32 {
             let argv = args.split_whitespace();
-            let log = out.map_or_else(
-                || portus::algs::make_logger(),
-                |f| portus::algs::make_file_logger(f)
-            );
 
             #(#loads)*
 
@@ -197,10 +230,118 @@ fn generate_lib_rs(algs: &[Alg]) -> String {
         }
 
         #[no_mangle]
-        pub extern "C" fn libstartccp_run_forever(c_args: *const c_char, log_fd: i32) -> u32 {
+        pub extern "C" fn libstartccp_run_forever(c_args: *const c_char) -> u32 {
+            let args = unsafe { CStr::from_ptr(c_args) }.to_string_lossy().into_owned();
+            _start(args)
+        }
+
+        // `ccp run --hot-reload` owns the datapath socket and drives each loaded copy of this
+        // library through the functions below, as one `portus::reload::Generation`.
+
+        use portus::reload::Generation;
+        use std::os::raw::c_void;
+
+        type SendFn = extern "C" fn(*mut c_void, *const u8, usize) -> i32;
+        type OutFn = extern "C" fn(*mut c_void, *const u8, usize);
+
+        fn _open(args: String, uid_base: u32, send: SendFn, ctx: usize) -> Option<Box<dyn Generation>> {
+            let argv = args.split_whitespace();
+            #(#loads)*
+
+            let ipc_arg = Arg::with_name("ipc")
+                .long("ipc")
+                .help("Sets the type of ipc to use: (netlink|unix)")
+                .default_value("unix")
+                .validator(portus::algs::ipc_valid);
+
+            let alg_name = argv.clone().next().expect("empty argument string");
+
+            // keep this copy's program uids apart from the other loaded copies'.
+            portus::lang::set_program_uid_base(uid_base);
+            let sock = portus::ipc::direct::Socket::new(move |msg: &[u8]| {
+                if send(ctx as *mut c_void, msg.as_ptr(), msg.len()) == 0 {
+                    Ok(())
+                } else {
+                    Err(portus::Error(String::from("send to datapath failed")))
+                }
+            });
+
+            match alg_name {
+                #(#opens)*
+                _ => {
+                    eprintln!("error: algorithm '{}' not found. available algorithms are: ", alg_name);
+                    #(#alglist)*
+                    None
+                }
+            }
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_open(
+            c_args: *const c_char,
+            uid_base: u32,
+            send: SendFn,
+            ctx: *mut c_void,
+        ) -> *mut c_void {
             let args = unsafe { CStr::from_ptr(c_args) }.to_string_lossy().into_owned();
-            let f = unsafe { File::from_raw_fd(log_fd) };
-            _start(args, Some(f))
+            match _open(args, uid_base, send, ctx as usize) {
+                Some(g) => Box::into_raw(Box::new(g)) as *mut c_void,
+                None => std::ptr::null_mut(),
+            }
+        }
+
+        fn _generation<'a>(g: *mut c_void) -> &'a mut Box<dyn Generation> {
+            unsafe { &mut *(g as *mut Box<dyn Generation>) }
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_recv(g: *mut c_void, buf: *const u8, len: usize) -> i32 {
+            let msg = unsafe { std::slice::from_raw_parts(buf, len) };
+            match _generation(g).recv_msg(msg) {
+                Ok(_) => 0,
+                Err(e) => {
+                    eprintln!("error: {:?}", e);
+                    -1
+                }
+            }
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_export_flow(g: *mut c_void, sid: u32, out: OutFn, ctx: *mut c_void) -> i32 {
+            match _generation(g).export_flow(sid) {
+                Some(state) => {
+                    out(ctx, state.as_ptr(), state.len());
+                    1
+                }
+                None => 0,
+            }
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_import_flow(
+            g: *mut c_void,
+            create: *const u8,
+            create_len: usize,
+            state: *const u8,
+            state_len: usize,
+        ) -> i32 {
+            let create = unsafe { std::slice::from_raw_parts(create, create_len) };
+            let state = unsafe { std::slice::from_raw_parts(state, state_len) };
+            match _generation(g).import_flow(create, state) {
+                Ok(true) => 1,
+                Ok(false) => 0,
+                Err(_) => -1,
+            }
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_remove_flow(g: *mut c_void, sid: u32) {
+            _generation(g).remove_flow(sid)
+        }
+
+        #[no_mangle]
+        pub extern "C" fn libstartccp_close(g: *mut c_void) {
+            drop(unsafe { Box::from_raw(g as *mut Box<dyn Generation>) })
         }
     };
 
@@ -237,8 +378,134 @@ fn write_file(path: &PathBuf, code: String) {
     }
 }
 
-fn rebuild_library(root: &PathBuf, algs: Vec<Alg>) -> bool {
+/// Identifies a build of the library. It changes with the set of algorithms, an algorithm's
+/// version or checked-out commit, the portus version and commit, which also fix the generated
+/// code, and the dependency versions recorded in `lock_path` by the last build.
+/// The key is an FNV-1a hash, so it is the same across `ccp` builds and Rust versions.
+///
+/// None if an algorithm is not in a git worktree, or its worktree or that of portus has
+/// uncommitted changes, which the key cannot see: such a build is neither taken from nor put in
+/// the cache.
+fn build_key(algs: &[Alg], lock_path: &Path) -> Option<String> {
+    let git = |path: &str, args: &[&str]| {
+        Command::new("git")
+            .args(args)
+            .current_dir(path)
+            .output()
+            .ok()
+            .filter(|out| out.status.success())
+            .map(|out| String::from_utf8_lossy(&out.stdout).trim().to_owned())
+    };
+    let commit = |path: &str| {
+        if !git(path, &["status", "--porcelain"])?.is_empty() {
+            return None;
+        }
+
+        git(path, &["rev-parse", "HEAD"])
+    };
+
+    let mut algs: Vec<&Alg> = algs.iter().collect();
+    algs.sort_by(|a, b| a.crate_name.cmp(&b.crate_name));
+
+    // each part is NUL-terminated, so that adjacent parts cannot run together.
+    let mut key = Vec::new();
+    let mut put = |part: &[u8]| {
+        key.extend_from_slice(part);
+        key.push(0);
+    };
+    put(env!("CARGO_PKG_VERSION").as_bytes());
+
+    // the library builds against the portus source `ccp` was built from. A registry copy is
+    // fixed by its version, but a git checkout can move on under the same version.
+    let portus_path = env!("CARGO_MANIFEST_DIR");
+    if git(portus_path, &["rev-parse", "--is-inside-work-tree"]).is_some() {
+        put(commit(portus_path)?.as_bytes());
+    }
+
+    for alg in algs {
+        put(alg.crate_name.as_bytes());
+        put(alg.crate_path.as_bytes());
+        put(alg.crate_version.as_bytes());
+        put(commit(&alg.crate_path)?.as_bytes());
+    }
+
+    // cargo keeps the resolved versions of the other dependencies in the lock file, so a build
+    // that resolves them differently rewrites it.
+    if let Ok(lock) = std::fs::read(lock_path) {
+        put(&lock);
+    }
+
+    Some(format!("{:016x}", portus::checkpoint::digest(&key)))
+}
+
+/// Put the cached build at `from` in place at `to`. The copy is renamed into place, since a
+/// running `ccp` may have the old library mapped.
+fn restore_cached(from: &Path, to: &Path) -> std::io::Result<()> {
+    let tmp = to.with_extension("so.tmp");
+    std::fs::create_dir_all(to.parent().unwrap())?;
+    std::fs::copy(from, &tmp)?;
+    std::fs::rename(&tmp, to)
+}
+
+fn link_library(orig_path: &Path) {
+    let link_path = "/usr/lib/libstartccp.so";
+
+    log(
+        "Linking",
+        &format!("{} -> {}", orig_path.to_string_lossy(), link_path),
+    );
+
+    Command::new("sudo")
+        .arg("ln")
+        .arg("-s")
+        .arg(orig_path)
+        .arg(link_path)
+        .output()
+        .expect("failed to link into /usr/lib");
+}
+
+/// Build the library for `algs`, unless the current or a cached build already matches them.
+fn rebuild_library(root: &PathBuf, algs: Vec<Alg>, force: bool) -> bool {
     let lib_path = Path::new(root).join("lib");
+    let release_path = lib_path.join("target").join("release");
+    let orig_path = release_path.join("libstartccp.so");
+    let key_path = release_path.join("startccp.key");
+
+    let lock_path = lib_path.join("Cargo.lock");
+
+    let key = build_key(&algs, &lock_path);
+    let cache_path = |key: &str| lib_path.join("cache").join(key).join("libstartccp.so");
+    match &key {
+        None => log(
+            "Uncached",
+            "an algorithm is not a clean git checkout, building without the cache",
+        ),
+        Some(key) if !force => {
+            let current = std::fs::read_to_string(&key_path).unwrap_or_default();
+            if current == *key && orig_path.exists() {
+                log("Fresh", &format!("libstartccp ({})", key));
+                return true;
+            }
+
+            let cached_path = cache_path(key);
+            if cached_path.exists() {
+                match restore_cached(&cached_path, &orig_path) {
+                    Ok(_) => {
+                        log("Cached", &format!("libstartccp ({})", key));
+                        write_file(&key_path, key.clone());
+                        link_library(&orig_path);
+                        return true;
+                    }
+                    Err(e) => log_warn(&format!(
+                        "unable to use cached build {}: {}",
+                        cached_path.to_string_lossy(),
+                        e
+                    )),
+                }
+            }
+        }
+        Some(_) => (),
+    }
 
     let cargo_path = lib_path.clone().join("Cargo.toml");
     write_file(&cargo_path, generate_cargo_toml(&algs));
@@ -275,26 +542,26 @@ fn rebuild_library(root: &PathBuf, algs: Vec<Alg>) -> bool {
         return false;
     }
 
-    let orig_path = lib_path
-        .clone()
-        .join("target")
-        .join("release")
-        .join("libstartccp.so");
-    let link_path = "/usr/lib/libstartccp.so";
-
-    log(
-        "Linking",
-        &format!("{} -> {}", orig_path.to_string_lossy(), link_path),
-    );
+    // the build may have resolved dependencies afresh, so key it by the lock file it left.
+    match key.and_then(|_| build_key(&algs, &lock_path)) {
+        Some(key) => {
+            // a failure here only costs a rebuild later.
+            let cached_path = cache_path(&key);
+            if let Err(e) = std::fs::create_dir_all(cached_path.parent().unwrap())
+                .and_then(|_| std::fs::copy(&orig_path, &cached_path))
+            {
+                log_warn(&format!("unable to cache build: {}", e));
+            }
 
-    Command::new("sudo")
-        .arg("ln")
-        .arg("-s")
-        .arg(orig_path.clone())
-        .arg(link_path)
-        .output()
-        .expect("failed to link into /usr/lib");
+            write_file(&key_path, key);
+        }
+        // this build matches no key, so the next one must not find it fresh.
+        None => {
+            let _ = std::fs::remove_file(&key_path);
+        }
+    }
 
+    link_library(&orig_path);
     true
 }
 
@@ -344,10 +611,22 @@ enum Subcommand {
     Run {
         #[structopt(name = "algorithm")]
         alg: String,
+        #[structopt(long = "hot-reload")]
+        /// Keep running when the library is rebuilt: new flows go to the new build, and the old{n}
+        /// build is unloaded once its flows end
+        hot_reload: bool,
+        #[structopt(long = "migrate", requires = "hot-reload")]
+        /// With --hot-reload, move running flows to the new build, if the algorithm can export{n}
+        /// their state
+        migrate: bool,
     },
     #[structopt(name = "makelib")]
-    /// Force-rebuild the ccp algorithms library
-    Makelib {},
+    /// Build the ccp algorithms library, reusing a previous build if no algorithm changed
+    Makelib {
+        #[structopt(long = "force")]
+        /// Rebuild even if a previous build matches, e.g. after editing an algorithm in place
+        force: bool,
+    },
 }
 
 use std::io::ErrorKind;
@@ -440,7 +719,7 @@ fn main() {
                 .expect("git clone");
 
             let alg_paths = find_algs(root.clone());
-            let res = rebuild_library(&root, alg_paths);
+            let res = rebuild_library(&root, alg_paths, false);
             if !res {
                 Command::new("sudo")
                     .arg("rm")
@@ -455,6 +734,7 @@ fn main() {
             for Alg {
                 crate_name,
                 crate_path,
+                ..
             } in alg_paths
             {
                 let remote_cmd = Command::new("git")
@@ -484,7 +764,11 @@ fn main() {
                 );
             }
         }
-        Subcommand::Run { alg } => {
+        Subcommand::Run {
+            alg,
+            hot_reload,
+            migrate,
+        } => {
             let after_dash = std::env::args()
                 .skip_while(|a| a != "--")
                 .collect::<Vec<String>>();
@@ -496,6 +780,9 @@ fn main() {
             };
 
             log("Running", &format!("{} {}", alg, argv));
+            if hot_reload {
+                hot_reload::run(&root, format!("{} {}", alg, argv), migrate);
+            }
 
             use libc::c_char;
             use std::ffi::CString;
@@ -514,8 +801,282 @@ fn main() {
                 spawn(args.as_ptr());
             }
         }
-        Subcommand::Makelib {} => {
-            rebuild_library(&root, alg_paths);
+        Subcommand::Makelib { force } => {
+            rebuild_library(&root, alg_paths, force);
         }
     };
 }
+
+/// `ccp run --hot-reload`: own the datapath socket, and run each build of libstartccp.so as a
+/// `portus::reload::Generation` next to the builds before it.
+mod hot_reload {
+    use super::{log, log_error, log_warn};
+    use libc::c_char;
+    use portus::ipc::{Blocking, Ipc};
+    use portus::reload::{Generation, Reloader};
+    use std::cell::RefCell;
+    use std::ffi::CString;
+    use std::os::raw::c_void;
+    use std::os::unix::io::AsRawFd;
+    use std::path::{Path, PathBuf};
+    use std::time::SystemTime;
+
+    type SendFn = extern "C" fn(*mut c_void, *const u8, usize) -> i32;
+    type OutFn = extern "C" fn(*mut c_void, *const u8, usize);
+
+    // Each build allocates program uids from its own range, so that the datapath can tell the
+    // builds' programs apart.
+    const UID_RANGE: u32 = 1 << 16;
+
+    // How often to check the library for a new build while the datapath is quiet.
+    const POLL_MS: i32 = 1000;
+
+    /// Where the builds send their messages: the socket, and the datapath's address.
+    struct Outbox<I: Ipc> {
+        sock: I,
+        to: RefCell<I::Addr>,
+    }
+
+    extern "C" fn send_to_datapath<I: Ipc>(ctx: *mut c_void, buf: *const u8, len: usize) -> i32 {
+        let out = unsafe { &*(ctx as *const Outbox<I>) };
+        let msg = unsafe { std::slice::from_raw_parts(buf, len) };
+        match out.sock.send(msg, &out.to.borrow()) {
+            Ok(_) => 0,
+            Err(_) => -1,
+        }
+    }
+
+    extern "C" fn copy_out(ctx: *mut c_void, buf: *const u8, len: usize) {
+        let out = unsafe { &mut *(ctx as *mut Vec<u8>) };
+        out.extend_from_slice(unsafe { std::slice::from_raw_parts(buf, len) });
+    }
+
+    /// One loaded build of libstartccp.so.
+    struct LoadedLib {
+        handle: *mut c_void,
+        recv: unsafe extern "C" fn(*mut c_void, *const u8, usize) -> i32,
+        export_flow: unsafe extern "C" fn(*mut c_void, u32, OutFn, *mut c_void) -> i32,
+        import_flow: unsafe extern "C" fn(*mut c_void, *const u8, usize, *const u8, usize) -> i32,
+        remove_flow: unsafe extern "C" fn(*mut c_void, u32),
+        close: unsafe extern "C" fn(*mut c_void),
+        // dropped after `close`, since fields drop in order.
+        _lib: libloading::Library,
+    }
+
+    impl LoadedLib {
+        /// Load a private copy of the library at `path`: the dynamic loader would hand back the
+        /// already-loaded build for a path it has seen.
+        unsafe fn load<I: Ipc>(
+            path: &Path,
+            copy: &Path,
+            args: &str,
+            uid_base: u32,
+            out: &Outbox<I>,
+        ) -> Result<Self, String> {
+            std::fs::copy(path, copy).map_err(|e| format!("copy {:?}: {}", copy, e))?;
+            let lib = libloading::Library::new(copy);
+            // the mapping outlives the file.
+            std::fs::remove_file(copy).unwrap_or_else(|_| ());
+            let lib = lib.map_err(|e| format!("load {:?}: {}", path, e))?;
+
+            macro_rules! sym {
+                ($name:expr) => {
+                    *lib.get($name).map_err(|e| {
+                        format!(
+                            "{:?} has no {}, rebuild it with `ccp makelib`: {}",
+                            path,
+                            String::from_utf8_lossy($name),
+                            e
+                        )
+                    })?
+                };
+            }
+
+            let open: unsafe extern "C" fn(*const c_char, u32, SendFn, *mut c_void) -> *mut c_void =
+                sym!(b"libstartccp_open");
+            let recv = sym!(b"libstartccp_recv");
+            let export_flow = sym!(b"libstartccp_export_flow");
+            let import_flow = sym!(b"libstartccp_import_flow");
+            let remove_flow = sym!(b"libstartccp_remove_flow");
+            let close = sym!(b"libstartccp_close");
+
+            let c_args = CString::new(args).map_err(|e| format!("{}", e))?;
+            let handle = open(
+                c_args.as_ptr(),
+                uid_base,
+                send_to_datapath::<I>,
+                out as *const Outbox<I> as *mut c_void,
+            );
+            if handle.is_null() {
+                return Err(format!("{:?} failed to start '{}'", path, args));
+            }
+
+            Ok(LoadedLib {
+                handle,
+                recv,
+                export_flow,
+                import_flow,
+                remove_flow,
+                close,
+                _lib: lib,
+            })
+        }
+    }
+
+    impl Generation for LoadedLib {
+        fn recv_msg(&mut self, msg: &[u8]) -> portus::Result<()> {
+            match unsafe { (self.recv)(self.handle, msg.as_ptr(), msg.len()) } {
+                0 => Ok(()),
+                _ => Err(portus::Error(String::from(
+                    "algorithm failed to handle message",
+                ))),
+            }
+        }
+
+        fn export_flow(&mut self, sid: u32) -> Option<Vec<u8>> {
+            let mut state: Vec<u8> = vec![];
+            let ctx = &mut state as *mut Vec<u8> as *mut c_void;
+            match unsafe { (self.export_flow)(self.handle, sid, copy_out, ctx) } {
+                1 => Some(state),
+                _ => None,
+            }
+        }
+
+        fn import_flow(&mut self, create: &[u8], state: &[u8]) -> portus::Result<bool> {
+            match unsafe {
+                (self.import_flow)(
+                    self.handle,
+                    create.as_ptr(),
+                    create.len(),
+                    state.as_ptr(),
+                    state.len(),
+                )
+            } {
+                1 => Ok(true),
+                0 => Ok(false),
+                _ => Err(portus::Error(String::from(
+                    "algorithm failed to import flow",
+                ))),
+            }
+        }
+
+        fn remove_flow(&mut self, sid: u32) {
+            unsafe { (self.remove_flow)(self.handle, sid) }
+        }
+    }
+
+    impl Drop for LoadedLib {
+        fn drop(&mut self) {
+            unsafe { (self.close)(self.handle) }
+        }
+    }
+
+    fn modified(path: &Path) -> Option<SystemTime> {
+        std::fs::metadata(path).and_then(|m| m.modified()).ok()
+    }
+
+    /// Run `args` (the algorithm name and its arguments) until killed, loading every new build
+    /// of the library under `root`.
+    pub fn run(root: &Path, args: String, migrate: bool) -> ! {
+        let ipc = args
+            .split_whitespace()
+            .skip_while(|a| *a != "--ipc")
+            .nth(1)
+            .unwrap_or("unix")
+            .to_owned();
+        match ipc.as_str() {
+            "unix" => match portus::ipc::unix::Socket::<Blocking>::new("portus") {
+                Ok(sock) => serve(root, args, migrate, sock),
+                Err(e) => log_error(&format!("ipc initialization: {:?}", e)),
+            },
+            #[cfg(target_os = "linux")]
+            "netlink" => match portus::ipc::netlink::Socket::<Blocking>::new() {
+                Ok(sock) => serve(root, args, migrate, sock),
+                Err(e) => log_error(&format!("ipc initialization: {:?}", e)),
+            },
+            other => log_error(&format!("--hot-reload does not support ipc '{}'", other)),
+        }
+    }
+
+    fn serve<I: Ipc + AsRawFd>(root: &Path, args: String, migrate: bool, sock: I) -> ! {
+        let lib_path = root
+            .join("lib")
+            .join("target")
+            .join("release")
+            .join("libstartccp.so");
+        let gen_dir = root.join("lib").join("generations");
+        std::fs::create_dir_all(&gen_dir).unwrap_or_else(|e| {
+            log_error(&format!(
+                "unable to create {}: {}",
+                gen_dir.to_string_lossy(),
+                e
+            ))
+        });
+
+        // the builds hold pointers to `out`, which lives until the process exits.
+        let out: &'static Outbox<I> = Box::leak(Box::new(Outbox {
+            sock,
+            to: RefCell::new(Default::default()),
+        }));
+        let fd = out.sock.as_raw_fd();
+
+        let mut builds = 0u32;
+        let load = |reloader: &mut Reloader<LoadedLib>, builds: &mut u32| {
+            let uid_base = builds.checked_mul(UID_RANGE).ok_or_else(|| {
+                format!(
+                    "{} builds have used up the program uid space; restart ccp",
+                    builds
+                )
+            })?;
+            let copy: PathBuf = gen_dir.join(format!("libstartccp.{}.so", builds));
+            let g = unsafe { LoadedLib::load(&lib_path, &copy, &args, uid_base, out) }?;
+            *builds += 1;
+            reloader
+                .add_generation(g, migrate)
+                .map_err(|e| format!("{:?}", e))
+        };
+
+        let mut reloader = Reloader::new();
+        let mut loaded = modified(&lib_path);
+        load(&mut reloader, &mut builds).unwrap_or_else(|e| log_error(&e));
+
+        let mut seen = loaded;
+        let mut buf = vec![0u8; 1 << 16];
+        loop {
+            let mut pfd = libc::pollfd {
+                fd,
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            let ready = unsafe { libc::poll(&mut pfd, 1, POLL_MS) };
+            if ready > 0 {
+                match out.sock.recv(&mut buf) {
+                    Ok((len, from)) => {
+                        *out.to.borrow_mut() = from;
+                        if let Err(e) = reloader.recv(&buf[..len]) {
+                            log_warn(&format!("{:?}", e));
+                        }
+                    }
+                    Err(e) => log_warn(&format!("recv: {:?}", e)),
+                }
+            }
+
+            // load a new build once cargo has stopped writing it: its mtime has changed, and
+            // held still since the last check.
+            let now = modified(&lib_path);
+            if now != loaded && now == seen {
+                match load(&mut reloader, &mut builds) {
+                    Ok(id) => log(
+                        "Reloaded",
+                        &format!("build {} (generations: {:?})", id, reloader.generations()),
+                    ),
+                    Err(e) => log_warn(&format!("keeping the running build: {}", e)),
+                }
+
+                loaded = now;
+            }
+
+            seen = now;
+        }
+    }
+}
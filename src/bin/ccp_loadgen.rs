@@ -0,0 +1,605 @@
+//! Load generator: emulate datapaths and measure how fast CCP answers their reports.
+//!
+//! Each emulated datapath sends Ready, creates `--flows` flows, and then sends each flow's
+//! measurements at `--rate` reports per second, replacing `--churn` of its flows per second
+//! (a close followed by a create). For every report, the time until CCP sends the flow an
+//! update is recorded.
+//!
+//! With `--ipc chan` (the default), each datapath gets its own in-process CCP running the
+//! built-in algorithm, which updates the cwnd on every report. With `--ipc unix`, the datapaths
+//! share one CCP at `/tmp/ccp/<--ccp-addr>`: the built-in one, or with `--external`, a CCP
+//! started separately with any algorithm; `--fields` must then match the length of that
+//! algorithm's reports.
+//!
+//! `--find-max` repeats the run, doubling the flows each time, until CCP no longer keeps up:
+//! fewer than 95% of reports answered, or a p99 above `--slo-us`.
+
+use clap::{value_t, Arg};
+use crossbeam::channel;
+use portus::ipc::{BackendBuilder, Blocking, Ipc};
+use portus::lang::Scope;
+use portus::latency::percentile;
+use portus::serialize::{self, create, measure, ready, RawMsg};
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::{HashMap, VecDeque};
+use std::os::unix::net::UnixDatagram;
+use std::path::Path;
+use std::thread;
+use std::time::{Duration, Instant};
+
+// message types sent by CCP.
+const INSTALL: u8 = 2;
+const UPDATE_FIELD: u8 = 3;
+const CHANGEPROG: u8 = 4;
+
+// reports awaiting an update, per flow, beyond which the oldest are forgotten.
+const MAX_OUTSTANDING: usize = 64;
+
+/// The built-in algorithm: report acked bytes and RTT, and grow the cwnd on every report.
+struct LoadgenAlg;
+
+struct LoadgenFlow<I: Ipc> {
+    dp: Datapath<I>,
+    sc: Scope,
+    cwnd: u32,
+}
+
+impl<I: Ipc> CongAlg<I> for LoadgenAlg {
+    type Flow = LoadgenFlow<I>;
+
+    fn name() -> &'static str {
+        "loadgen"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "Loadgen",
+            "
+            (def (Report (volatile acked 0) (volatile rtt 0)))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (:= Report.rtt Flow.rtt_sample_us)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<I>, info: DatapathInfo) -> Self::Flow {
+        let sc = dp.set_program("Loadgen", None).unwrap();
+        LoadgenFlow {
+            dp,
+            sc,
+            cwnd: info.init_cwnd,
+        }
+    }
+}
+
+impl<I: Ipc> Flow for LoadgenFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap_or(0);
+        self.cwnd = self.cwnd.saturating_add(acked as u32).min(1 << 30);
+        self.dp
+            .update_field(&self.sc, &[("Cwnd", self.cwnd)])
+            .unwrap_or_else(|_| ());
+    }
+}
+
+/// How an emulated datapath reaches CCP.
+trait Link: Send {
+    fn send(&self, msg: &[u8]) -> bool;
+    /// The next message from CCP, if one is waiting.
+    fn try_recv(&self, buf: &mut [u8]) -> Option<usize>;
+}
+
+struct UnixLink {
+    sk: UnixDatagram,
+    ccp: String,
+}
+
+impl Link for UnixLink {
+    fn send(&self, msg: &[u8]) -> bool {
+        self.sk.send_to(msg, &self.ccp).is_ok()
+    }
+
+    fn try_recv(&self, buf: &mut [u8]) -> Option<usize> {
+        self.sk.recv(buf).ok()
+    }
+}
+
+struct ChanLink {
+    to_ccp: channel::Sender<Vec<u8>>,
+    from_ccp: channel::Receiver<Vec<u8>>,
+}
+
+impl Link for ChanLink {
+    fn send(&self, msg: &[u8]) -> bool {
+        self.to_ccp.send(msg.to_vec()).is_ok()
+    }
+
+    fn try_recv(&self, buf: &mut [u8]) -> Option<usize> {
+        let msg = self.from_ccp.try_recv().ok()?;
+        buf[..msg.len()].copy_from_slice(&msg);
+        Some(msg.len())
+    }
+}
+
+#[derive(Clone, Debug)]
+struct Config {
+    datapaths: u32,
+    flows: u32,
+    rate: f64,
+    churn: f64,
+    fields: u32,
+    duration: Duration,
+}
+
+#[derive(Default)]
+struct Stats {
+    creates: u64,
+    closes: u64,
+    reports: u64,
+    updates: u64,
+    send_errors: u64,
+    latencies_ns: Vec<u64>,
+}
+
+impl Stats {
+    fn merge(&mut self, o: Stats) {
+        self.creates += o.creates;
+        self.closes += o.closes;
+        self.reports += o.reports;
+        self.updates += o.updates;
+        self.send_errors += o.send_errors;
+        self.latencies_ns.extend(o.latencies_ns);
+    }
+}
+
+#[derive(Default)]
+struct FlowState {
+    program_uid: Option<u32>,
+    outstanding: VecDeque<Instant>,
+}
+
+struct EmulatedDatapath<L: Link> {
+    id: u32,
+    link: L,
+    flows: HashMap<u32, FlowState>,
+    // oldest first, for churn.
+    order: VecDeque<u32>,
+    next_sid: u32,
+    stats: Stats,
+}
+
+impl<L: Link> EmulatedDatapath<L> {
+    fn send(&mut self, msg: &[u8]) {
+        if !self.link.send(msg) {
+            self.stats.send_errors += 1;
+        }
+    }
+
+    fn create(&mut self) {
+        let sid = self.next_sid;
+        self.next_sid += 1;
+        let msg = serialize::serialize(&create::Msg {
+            sid,
+            init_cwnd: 10 * 1448,
+            mss: 1448,
+            src_ip: 0x0a00_0001,
+            src_port: 40000 + (sid % 20000),
+            dst_ip: 0x0a00_0002 + self.id,
+            dst_port: 443,
+            cong_alg: None,
+        })
+        .unwrap();
+        self.send(&msg);
+        self.flows.insert(sid, FlowState::default());
+        self.order.push_back(sid);
+        self.stats.creates += 1;
+    }
+
+    fn measure(&mut self, sid: u32, fields: Vec<u64>) {
+        let program_uid = match self.flows.get(&sid).and_then(|f| f.program_uid) {
+            Some(uid) => uid,
+            None => return,
+        };
+        let msg = serialize::serialize(&measure::Msg {
+            sid,
+            program_uid,
+            num_fields: fields.len() as u8,
+            fields,
+        })
+        .unwrap();
+        self.send(&msg);
+    }
+
+    fn close(&mut self) {
+        if let Some(sid) = self.order.pop_front() {
+            self.measure(sid, vec![]);
+            self.flows.remove(&sid);
+            self.stats.closes += 1;
+        }
+    }
+
+    fn recv_all(&mut self, buf: &mut [u8]) -> bool {
+        let mut any = false;
+        while let Some(len) = self.link.try_recv(buf) {
+            any = true;
+            let mut read = 0;
+            while read < len {
+                let raw = match RawMsg::parse(&buf[read..len]) {
+                    Ok(raw) => raw,
+                    Err(_) => break,
+                };
+                read += raw.len as usize;
+                self.on_msg(&raw);
+            }
+        }
+
+        any
+    }
+
+    fn on_msg(&mut self, raw: &RawMsg) {
+        let flow = match self.flows.get_mut(&raw.sid) {
+            Some(f) => f,
+            None => return,
+        };
+
+        match raw.typ {
+            CHANGEPROG => {
+                flow.program_uid = raw
+                    .payload()
+                    .get(0..4)
+                    .map(|b| u32::from_le_bytes([b[0], b[1], b[2], b[3]]));
+            }
+            UPDATE_FIELD => {
+                if let Some(sent) = flow.outstanding.pop_front() {
+                    self.stats
+                        .latencies_ns
+                        .push(sent.elapsed().as_nanos() as u64);
+                }
+
+                self.stats.updates += 1;
+            }
+            _ => (),
+        }
+    }
+
+    fn run(mut self, cfg: &Config) -> Stats {
+        let mut buf = vec![0u8; 1 << 16];
+        let rdy = serialize::serialize(&ready::Msg { id: self.id }).unwrap();
+        self.send(&rdy);
+
+        // wait for the programs before creating flows.
+        let start = Instant::now();
+        while start.elapsed() < Duration::from_secs(5) {
+            match self.link.try_recv(&mut buf) {
+                Some(len) if len > 0 && buf[0] == INSTALL => break,
+                _ => thread::sleep(Duration::from_millis(1)),
+            }
+        }
+
+        // let the remaining installs arrive, and drop them.
+        thread::sleep(Duration::from_millis(10));
+        self.recv_all(&mut buf);
+
+        for _ in 0..cfg.flows {
+            self.create();
+        }
+
+        let report: Vec<u64> = (0..cfg.fields).map(|_| 1448).collect();
+        let (mut report_due, mut churn_due) = (0f64, 0f64);
+        let mut cursor = 0;
+        let start = Instant::now();
+        let mut last = start;
+        while start.elapsed() < cfg.duration {
+            let now = Instant::now();
+            let dt = (now - last).as_secs_f64();
+            last = now;
+
+            churn_due += dt * cfg.churn * self.order.len() as f64;
+            while churn_due >= 1.0 {
+                self.close();
+                self.create();
+                churn_due -= 1.0;
+            }
+
+            report_due += dt * cfg.rate * self.order.len() as f64;
+            let mut tries = self.order.len();
+            while report_due >= 1.0 && tries > 0 {
+                cursor = (cursor + 1) % self.order.len();
+                let sid = self.order[cursor];
+                tries -= 1;
+                let flow = self.flows.get_mut(&sid).unwrap();
+                if flow.program_uid.is_none() {
+                    continue;
+                }
+
+                if flow.outstanding.len() == MAX_OUTSTANDING {
+                    flow.outstanding.pop_front();
+                }
+
+                flow.outstanding.push_back(Instant::now());
+                self.measure(sid, report.clone());
+                self.stats.reports += 1;
+                report_due -= 1.0;
+                tries = self.order.len();
+            }
+
+            if !self.recv_all(&mut buf) && report_due < 1.0 {
+                thread::sleep(Duration::from_micros(100));
+            }
+        }
+
+        while !self.order.is_empty() {
+            self.close();
+        }
+
+        self.stats
+    }
+}
+
+fn datapath<L: Link>(id: u32, link: L) -> EmulatedDatapath<L> {
+    EmulatedDatapath {
+        id,
+        link,
+        flows: HashMap::new(),
+        order: VecDeque::new(),
+        next_sid: 1,
+        stats: Stats::default(),
+    }
+}
+
+fn run_chan(cfg: &Config) -> Stats {
+    let threads: Vec<_> = (0..cfg.datapaths)
+        .map(|id| {
+            let cfg = cfg.clone();
+            thread::spawn(move || {
+                let (to_ccp, from_dp) = channel::unbounded();
+                let (to_dp, from_ccp) = channel::unbounded();
+                let sock = portus::ipc::chan::Socket::<Blocking>::new(to_dp, from_dp);
+                let handle = portus::RunBuilder::new(BackendBuilder { sock })
+                    .default_alg(LoadgenAlg)
+                    .spawn_thread()
+                    .run()
+                    .expect("start ccp");
+                let stats = datapath(id, ChanLink { to_ccp, from_ccp }).run(&cfg);
+                handle.kill();
+                handle.wait().unwrap_or_else(|_| ());
+                stats
+            })
+        })
+        .collect();
+
+    collect(threads)
+}
+
+fn run_unix(cfg: &Config, ccp_addr: &str, external: bool) -> Stats {
+    // CCP answers at `/tmp/ccp/` and the name the datapath bound, so bind relative names there.
+    std::fs::create_dir_all("/tmp/ccp").expect("create /tmp/ccp");
+    std::env::set_current_dir("/tmp/ccp").expect("cd /tmp/ccp");
+
+    let handle = if external {
+        None
+    } else {
+        let sock = portus::ipc::unix::Socket::<Blocking>::new(ccp_addr).expect("ccp socket");
+        Some(
+            portus::RunBuilder::new(BackendBuilder { sock })
+                .default_alg(LoadgenAlg)
+                .spawn_thread()
+                .run()
+                .expect("start ccp"),
+        )
+    };
+
+    let ccp = format!("/tmp/ccp/{}", ccp_addr);
+    let threads: Vec<_> = (0..cfg.datapaths)
+        .map(|id| {
+            let (cfg, ccp) = (cfg.clone(), ccp.clone());
+            thread::spawn(move || {
+                let name = format!("loadgen-{}", id);
+                if Path::new(&name).exists() {
+                    std::fs::remove_file(&name).expect("remove stale socket");
+                }
+
+                let sk = UnixDatagram::bind(&name).expect("bind datapath socket");
+                sk.set_nonblocking(true).expect("nonblocking");
+                let stats = datapath(id, UnixLink { sk, ccp }).run(&cfg);
+                std::fs::remove_file(&name).unwrap_or_else(|_| ());
+                stats
+            })
+        })
+        .collect();
+
+    let stats = collect(threads);
+    if let Some(handle) = handle {
+        handle.kill();
+        handle.wait().unwrap_or_else(|_| ());
+    }
+
+    stats
+}
+
+fn collect(threads: Vec<thread::JoinHandle<Stats>>) -> Stats {
+    let mut stats = Stats::default();
+    for t in threads {
+        stats.merge(t.join().expect("join datapath"));
+    }
+
+    stats
+}
+
+struct Summary {
+    flows: u64,
+    offered: f64,
+    answered: f64,
+    p50_us: f64,
+    p99_us: f64,
+    p999_us: f64,
+}
+
+fn summarize(cfg: &Config, mut s: Stats) -> Summary {
+    s.latencies_ns.sort_unstable();
+    let secs = cfg.duration.as_secs_f64();
+    let flows = u64::from(cfg.datapaths) * u64::from(cfg.flows);
+    let sum = Summary {
+        flows,
+        offered: flows as f64 * cfg.rate,
+        answered: if s.reports == 0 {
+            0.0
+        } else {
+            s.latencies_ns.len() as f64 / s.reports as f64
+        },
+        p50_us: percentile(&s.latencies_ns, 0.5) as f64 / 1e3,
+        p99_us: percentile(&s.latencies_ns, 0.99) as f64 / 1e3,
+        p999_us: percentile(&s.latencies_ns, 0.999) as f64 / 1e3,
+    };
+
+    println!(
+        "{} datapaths x {} flows: {:.0} reports/s offered, {:.0} sent, {:.0} updates/s, \
+         {} creates, {} closes, {} send errors; {:.1}% answered, \
+         report->update p50 {:.1} us, p99 {:.1} us, p999 {:.1} us",
+        cfg.datapaths,
+        cfg.flows,
+        sum.offered,
+        s.reports as f64 / secs,
+        s.updates as f64 / secs,
+        s.creates,
+        s.closes,
+        s.send_errors,
+        sum.answered * 100.0,
+        sum.p50_us,
+        sum.p99_us,
+        sum.p999_us,
+    );
+
+    sum
+}
+
+fn main() {
+    let matches = clap::App::new("ccp-loadgen")
+        .version("0.1.0")
+        .about("Emulate datapaths against CCP and measure report to update latency")
+        .arg(
+            Arg::with_name("ipc")
+                .long("ipc")
+                .help("chan: a built-in CCP per datapath. unix: one CCP for all datapaths")
+                .possible_values(&["chan", "unix"])
+                .default_value("chan"),
+        )
+        .arg(
+            Arg::with_name("external")
+                .long("external")
+                .help("With --ipc unix, use a CCP that is already running instead of the built-in one"),
+        )
+        .arg(
+            Arg::with_name("ccp-addr")
+                .long("ccp-addr")
+                .help("With --ipc unix, the CCP socket's name under /tmp/ccp")
+                .default_value("portus"),
+        )
+        .arg(
+            Arg::with_name("datapaths")
+                .long("datapaths")
+                .short("m")
+                .help("Emulated datapaths")
+                .default_value("1"),
+        )
+        .arg(
+            Arg::with_name("flows")
+                .long("flows")
+                .short("n")
+                .help("Flows per datapath")
+                .default_value("100"),
+        )
+        .arg(
+            Arg::with_name("rate")
+                .long("rate")
+                .help("Reports per second per flow")
+                .default_value("100"),
+        )
+        .arg(
+            Arg::with_name("churn")
+                .long("churn")
+                .help("Fraction of each datapath's flows closed and replaced per second")
+                .default_value("0"),
+        )
+        .arg(
+            Arg::with_name("fields")
+                .long("fields")
+                .help("Fields per report; must match the algorithm's program (the built-in one reports 2)")
+                .default_value("2"),
+        )
+        .arg(
+            Arg::with_name("duration")
+                .long("duration")
+                .short("d")
+                .help("Seconds per run")
+                .default_value("10"),
+        )
+        .arg(
+            Arg::with_name("find-max")
+                .long("find-max")
+                .help("Double the flows per datapath until CCP no longer keeps up"),
+        )
+        .arg(
+            Arg::with_name("slo-us")
+                .long("slo-us")
+                .help("With --find-max, the highest acceptable p99 report to update latency")
+                .default_value("1000"),
+        )
+        .get_matches();
+
+    let mut cfg = Config {
+        datapaths: value_t!(matches, "datapaths", u32).expect("datapaths must be integral"),
+        flows: value_t!(matches, "flows", u32).expect("flows must be integral"),
+        rate: value_t!(matches, "rate", f64).expect("rate must be a number"),
+        churn: value_t!(matches, "churn", f64).expect("churn must be a number"),
+        fields: value_t!(matches, "fields", u32).expect("fields must be integral"),
+        duration: Duration::from_secs(
+            value_t!(matches, "duration", u64).expect("duration must be integral"),
+        ),
+    };
+    let slo_us = value_t!(matches, "slo-us", f64).expect("slo-us must be a number");
+    let unix = matches.value_of("ipc") == Some("unix");
+    let external = matches.is_present("external");
+    let ccp_addr = matches.value_of("ccp-addr").unwrap().to_owned();
+
+    let run = |cfg: &Config| {
+        let stats = if unix {
+            run_unix(cfg, &ccp_addr, external)
+        } else {
+            run_chan(cfg)
+        };
+
+        summarize(cfg, stats)
+    };
+
+    if !matches.is_present("find-max") {
+        run(&cfg);
+        return;
+    }
+
+    let mut max = None;
+    loop {
+        let s = run(&cfg);
+        if s.answered < 0.95 || s.p99_us > slo_us {
+            break;
+        }
+
+        max = Some(s);
+        cfg.flows *= 2;
+    }
+
+    match max {
+        Some(s) => println!(
+            "max sustainable: {} flows, {:.0} reports/s, p99 {:.1} us",
+            s.flows, s.offered, s.p99_us
+        ),
+        None => println!(
+            "not sustainable at {} flows per datapath; try fewer with --flows",
+            cfg.flows
+        ),
+    }
+}
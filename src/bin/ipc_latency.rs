@@ -1,7 +1,8 @@
 use clap::Arg;
 use portus::ipc::{Backend, BackendSender, Blocking, Ipc, Nonblocking};
-use std::convert::TryInto;
-use std::sync::{atomic, Arc};
+use portus::latency::percentile;
+use std::convert::{TryFrom, TryInto};
+use std::sync::{atomic, Arc, Barrier, Mutex};
 use std::thread;
 use std::vec::Vec;
 use time::Duration;
@@ -9,13 +10,32 @@ use time::Duration;
 #[macro_use]
 extern crate clap;
 
+/// A timestamp, padded with zeros to `size` bytes so that it can stand in for a real message.
+/// The sid field says which sender it came from.
 #[derive(Debug)]
-struct TimeMsg(time::OffsetDateTime);
+struct TimeMsg {
+    sent: time::OffsetDateTime,
+    sender: u32,
+    size: u32,
+}
+
+/// The smallest `TimeMsg`: the header and the timestamp.
+const MIN_MSG_SIZE: u32 = portus::serialize::HDR_LENGTH + 16;
+
+impl TimeMsg {
+    fn now(sender: u32, size: u32) -> Self {
+        TimeMsg {
+            sent: time::OffsetDateTime::now_utc(),
+            sender,
+            size,
+        }
+    }
+}
 
 use std::io::prelude::*;
 impl portus::serialize::AsRawMsg for TimeMsg {
     fn get_hdr(&self) -> (u8, u32, u32) {
-        (0xff, portus::serialize::HDR_LENGTH + 8 + 4, 0)
+        (0xff, self.size, self.sender)
     }
 
     fn get_u32s<W: Write>(&self, _: &mut W) -> portus::Result<()> {
@@ -27,15 +47,21 @@ impl portus::serialize::AsRawMsg for TimeMsg {
     }
 
     fn get_bytes<W: Write>(&self, w: &mut W) -> portus::Result<()> {
-        let msg = self.0.unix_timestamp_nanos().to_le_bytes();
+        let msg = self.sent.unix_timestamp_nanos().to_le_bytes();
         w.write_all(&msg[..])?;
+        let padding = (self.size - MIN_MSG_SIZE) as usize;
+        w.write_all(&vec![0u8; padding])?;
         Ok(())
     }
 
     fn from_raw_msg(msg: portus::serialize::RawMsg) -> portus::Result<Self> {
         let b = msg.get_bytes()?;
         let ts = i128::from_le_bytes((&b[0..16]).try_into().unwrap());
-        Ok(TimeMsg(time::OffsetDateTime::from_unix_timestamp_nanos(ts)))
+        Ok(TimeMsg {
+            sent: time::OffsetDateTime::from_unix_timestamp_nanos(ts),
+            sender: msg.sid,
+            size: msg.len,
+        })
     }
 }
 
@@ -76,29 +102,171 @@ impl portus::serialize::AsRawMsg for NlTimeMsg {
     }
 }
 
+/// What to run: each of `senders` threads sends `iter` messages of `size` bytes, keeping up to
+/// `window` of them in flight. Thread `k` (the echo thread is 0) runs on `cpus[k % cpus.len()]`.
+#[derive(Clone, Debug)]
+struct Config {
+    iter: u32,
+    senders: u32,
+    window: u32,
+    size: u32,
+    cpus: Vec<usize>,
+}
+
+impl Config {
+    fn cpu(&self, thread: usize) -> Option<usize> {
+        if self.cpus.is_empty() {
+            None
+        } else {
+            Some(self.cpus[thread % self.cpus.len()])
+        }
+    }
+}
+
+/// The round trip time of every message, the wall time of the whole run, and the process CPU
+/// time it took.
+struct Sample {
+    rtts: Vec<Duration>,
+    wall: Duration,
+    cpu: Duration,
+}
+
+/// User and system CPU time of the whole process so far.
+fn cpu_time() -> Duration {
+    let mut ru: libc::rusage = unsafe { std::mem::zeroed() };
+    unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut ru) };
+    let tv = |t: libc::timeval| {
+        Duration::seconds(t.tv_sec as i64) + Duration::microseconds(t.tv_usec as i64)
+    };
+    tv(ru.ru_utime) + tv(ru.ru_stime)
+}
+
+#[cfg(target_os = "linux")]
+fn pin(cpu: Option<usize>) {
+    if let Some(cpu) = cpu {
+        let ok = unsafe {
+            let mut set: libc::cpu_set_t = std::mem::zeroed();
+            libc::CPU_SET(cpu, &mut set);
+            libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) == 0
+        };
+        if !ok {
+            eprintln!("warning: unable to pin to cpu {}", cpu);
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin(cpu: Option<usize>) {
+    if cpu.is_some() {
+        eprintln!("warning: core pinning is only supported on linux");
+    }
+}
+
 use portus::serialize::AsRawMsg;
 use std::sync::mpsc;
-fn bench<T: Ipc>(b: BackendSender<T>, mut l: Backend<T>, iter: u32) -> Vec<Duration> {
-    (0..iter)
-        .map(|_| {
-            let then = time::OffsetDateTime::now_utc();
-            let msg = portus::serialize::serialize(&TimeMsg(then)).expect("serialize");
-            b.send_msg(&msg[..]).expect("send ts");
-            if let (portus::serialize::Msg::Other(raw), _addr) = l.next().expect("receive echo") {
-                let then = TimeMsg::from_raw_msg(raw).expect("get time from raw");
-                time::OffsetDateTime::now_utc() - then.0
-            } else {
-                panic!("wrong type");
+
+/// Send `iter` messages as sender `id`, keeping up to `window` in flight, and return the round
+/// trip time of each.
+fn bench<T: Ipc>(
+    b: BackendSender<T>,
+    mut l: Backend<T>,
+    id: u32,
+    iter: u32,
+    window: u32,
+    size: u32,
+) -> Vec<Duration> {
+    let send = || {
+        let msg = portus::serialize::serialize(&TimeMsg::now(id, size)).expect("serialize");
+        // a nonblocking socket refuses messages while the echo's queue is full.
+        let start = time::Instant::now();
+        while let Err(e) = b.send_msg(&msg[..]) {
+            if start.elapsed() > Duration::seconds(10) {
+                panic!("send ts: {:?}", e);
             }
+
+            thread::yield_now();
+        }
+    };
+
+    let mut sent = 0;
+    while sent < window.min(iter) {
+        send();
+        sent += 1;
+    }
+
+    let mut rtts = Vec::with_capacity(iter as usize);
+    while rtts.len() < iter as usize {
+        if let (portus::serialize::Msg::Other(raw), _addr) = l.next().expect("receive echo") {
+            let then = TimeMsg::from_raw_msg(raw).expect("get time from raw");
+            rtts.push(time::OffsetDateTime::now_utc() - then.sent);
+        } else {
+            panic!("wrong type");
+        }
+
+        if sent < iter {
+            send();
+            sent += 1;
+        }
+    }
+
+    rtts
+}
+
+/// Run `echo` and `cfg.senders` threads of `sender` together. Each binds its socket and then
+/// waits on the barrier; the run is timed from there until every sender is done.
+fn run_senders<E, S>(cfg: &Config, echo: E, sender: S) -> Sample
+where
+    E: FnOnce(&Barrier) + Send + 'static,
+    S: Fn(u32, &Barrier) -> Vec<Duration> + Send + Sync + 'static,
+{
+    let ready = Arc::new(Barrier::new(cfg.senders as usize + 2));
+    let echo = {
+        let (ready, cpu) = (ready.clone(), cfg.cpu(0));
+        thread::spawn(move || {
+            pin(cpu);
+            echo(&ready);
+        })
+    };
+
+    let sender = Arc::new(sender);
+    let senders: Vec<_> = (0..cfg.senders)
+        .map(|i| {
+            let (ready, sender, cpu) = (ready.clone(), sender.clone(), cfg.cpu(i as usize + 1));
+            thread::spawn(move || {
+                pin(cpu);
+                sender(i, &ready)
+            })
         })
-        .collect()
+        .collect();
+
+    ready.wait();
+    let (start, cpu) = (time::Instant::now(), cpu_time());
+    let rtts = senders
+        .into_iter()
+        .flat_map(|s| s.join().expect("join sender thread"))
+        .collect();
+    let sample = Sample {
+        rtts,
+        wall: start.elapsed(),
+        cpu: cpu_time() - cpu,
+    };
+
+    echo.join().expect("join echo thread");
+    sample
+}
+
+/// Like `Sample`, with the kernel's timestamps for each message.
+struct NlSample {
+    durations: Vec<NlDuration>,
+    wall: Duration,
+    cpu: Duration,
 }
 
 struct NlDuration(Duration, Duration, Duration);
 macro_rules! netlink_bench {
     ($name: ident, $mode: ident) => {
         #[cfg(target_os = "linux")] // netlink is linux-only
-        fn $name(iter: u32) -> Vec<NlDuration> {
+        fn $name(cfg: &Config) -> NlSample {
             use std::process::Command;
             Command::new("sudo")
                 .arg("rmmod")
@@ -119,24 +287,28 @@ macro_rules! netlink_bench {
                 .output()
                 .expect("make failed to start");
 
-            let (tx, rx) = mpsc::channel::<Vec<NlDuration>>();
+            let (ready_tx, ready_rx) = mpsc::channel::<()>();
+            let (tx, rx) = mpsc::channel::<NlSample>();
+            let (iter, cpu) = (cfg.iter, cfg.cpu(1));
 
             // listen
             let c1 = thread::spawn(move || {
+                pin(cpu);
                 let mut buf = [0u8; 1024];
                 let mut nl = portus::ipc::netlink::Socket::<$mode>::new()
                     .map(|sk| {
                         Backend::new(sk, Arc::new(atomic::AtomicBool::new(true)), &mut buf[..])
                     })
                     .expect("nl ipc initialization");
-                tx.send(vec![]).expect("ok to insmod");
+                ready_tx.send(()).expect("ok to insmod");
                 nl.next().expect("receive echo");
                 let sender = nl.sender(());
-                let res = (0..iter)
+                let (start, start_cpu) = (time::Instant::now(), cpu_time());
+                let durations = (0..iter)
                     .map(|_| {
-                        let portus_send_time = time::OffsetDateTime::now_utc();
-                        let msg = portus::serialize::serialize(&TimeMsg(portus_send_time))
-                            .expect("serialize");
+                        let msg = TimeMsg::now(0, MIN_MSG_SIZE);
+                        let portus_send_time = msg.sent;
+                        let msg = portus::serialize::serialize(&msg).expect("serialize");
 
                         sender.send_msg(&msg[..]).expect("send ts");
                         if let (portus::serialize::Msg::Other(raw), _addr) =
@@ -155,10 +327,15 @@ macro_rules! netlink_bench {
                         };
                     })
                     .collect();
-                tx.send(res).expect("report rtts");
+                tx.send(NlSample {
+                    durations,
+                    wall: start.elapsed(),
+                    cpu: cpu_time() - start_cpu,
+                })
+                .expect("report rtts");
             });
 
-            rx.recv().expect("wait to insmod");
+            ready_rx.recv().expect("wait to insmod");
             // load kernel module
             Command::new("sudo")
                 .arg("insmod")
@@ -176,8 +353,12 @@ macro_rules! netlink_bench {
         }
 
         #[cfg(not(target_os = "linux"))] // netlink is linux-only
-        fn $name(_: u32) -> Vec<NlDuration> {
-            vec![]
+        fn $name(_: &Config) -> NlSample {
+            NlSample {
+                durations: vec![],
+                wall: Duration::zero(),
+                cpu: Duration::zero(),
+            }
         }
     };
 }
@@ -188,9 +369,9 @@ netlink_bench!(netlink_nonblocking, Nonblocking);
 macro_rules! kp_bench {
     ($name: ident, $mode: ident) => {
         #[cfg(target_os = "linux")] // kp is linux-only
-        fn $name(iter: u32) -> Vec<Duration> {
+        fn $name(cfg: &Config) -> Sample {
             use std::process::Command;
-            let (tx, rx) = mpsc::channel::<Vec<Duration>>();
+            let (tx, rx) = mpsc::channel::<Sample>();
 
             Command::new("sudo")
                 .arg("./ccp_kernel_unload")
@@ -219,8 +400,11 @@ macro_rules! kp_bench {
                 .output()
                 .expect("load failed");
 
+            // the kernel echoes, so there is one sender.
+            let cfg = cfg.clone();
             let c1 = thread::spawn(move || {
-                let mut receive_buf = [0u8; 1024];
+                pin(cfg.cpu(1));
+                let mut receive_buf = vec![0u8; 1 << 16];
                 let kp = portus::ipc::kp::Socket::<$mode>::new()
                     .map(|sk| {
                         Backend::new(
@@ -230,8 +414,14 @@ macro_rules! kp_bench {
                         )
                     })
                     .expect("kp ipc initialization");
-                tx.send(bench(kp.sender(()), kp, iter))
-                    .expect("report rtts");
+                let (start, cpu) = (time::Instant::now(), cpu_time());
+                let rtts = bench(kp.sender(()), kp, 0, cfg.iter, cfg.window, cfg.size);
+                tx.send(Sample {
+                    rtts,
+                    wall: start.elapsed(),
+                    cpu: cpu_time() - cpu,
+                })
+                .expect("report rtts");
             });
 
             c1.join().expect("join kp thread");
@@ -244,8 +434,12 @@ macro_rules! kp_bench {
         }
 
         #[cfg(not(target_os = "linux"))] // kp is linux-only
-        fn $name(_: u32) -> Vec<Duration> {
-            vec![]
+        fn $name(_: &Config) -> Sample {
+            Sample {
+                rtts: vec![],
+                wall: Duration::zero(),
+                cpu: Duration::zero(),
+            }
         }
     };
 }
@@ -255,45 +449,49 @@ kp_bench!(kp_nonblocking, Nonblocking);
 
 macro_rules! unix_bench {
     ($name: ident, $mode: ident) => {
-        fn $name(iter: u32) -> Vec<Duration> {
-            let (tx, rx) = mpsc::channel::<Vec<Duration>>();
-            let (ready_tx, ready_rx) = mpsc::channel::<bool>();
-
-            // listen
-            let c1 = thread::spawn(move || {
-                let mut receive_buf = [0u8; 1024];
-                let unix = portus::ipc::unix::Socket::<$mode>::new("bench_rx")
-                    .map(|sk| {
-                        Backend::new(
-                            sk,
-                            Arc::new(atomic::AtomicBool::new(true)),
-                            &mut receive_buf[..],
-                        )
-                    })
-                    .expect("unix ipc initialization");
-                ready_rx.recv().expect("sync");
-                tx.send(bench(
-                    unix.sender(std::path::PathBuf::from("/tmp/ccp/bench_tx")),
-                    unix,
-                    iter,
-                ))
-                .expect("report rtts");
-            });
-
-            // echo-er
-            let c2 = thread::spawn(move || {
-                let sk = portus::ipc::unix::Socket::<Blocking>::new("bench_tx").expect("sk init");
-                let mut buf = [0u8; 1024];
-                ready_tx.send(true).expect("sync");
-                for _ in 0..iter {
-                    let (rcv, addr) = sk.recv(&mut buf[..]).expect("recv");
-                    sk.send(&buf[..rcv], &addr).expect("echo");
-                }
-            });
-
-            c1.join().expect("join thread");
-            c2.join().expect("join echo thread");
-            rx.recv().expect("get rtts")
+        fn $name(cfg: &Config) -> Sample {
+            let (iter, window, size) = (cfg.iter, cfg.window, cfg.size);
+            let total = cfg.iter * cfg.senders;
+            run_senders(
+                cfg,
+                // echo-er: one socket serves every sender, as CCP serves every datapath.
+                move |ready| {
+                    let sk =
+                        portus::ipc::unix::Socket::<Blocking>::new("bench_tx").expect("sk init");
+                    let mut buf = vec![0u8; 1 << 16];
+                    ready.wait();
+                    for _ in 0..total {
+                        let (rcv, addr) = sk.recv(&mut buf[..]).expect("recv");
+                        // `send` puts the socket directory back.
+                        let addr = addr
+                            .strip_prefix("/tmp/ccp")
+                            .map(std::path::Path::to_path_buf)
+                            .unwrap_or(addr);
+                        sk.send(&buf[..rcv], &addr).expect("echo");
+                    }
+                },
+                move |i, ready| {
+                    let mut receive_buf = vec![0u8; 1 << 16];
+                    let unix = portus::ipc::unix::Socket::<$mode>::new(&format!("bench_rx{}", i))
+                        .map(|sk| {
+                            Backend::new(
+                                sk,
+                                Arc::new(atomic::AtomicBool::new(true)),
+                                &mut receive_buf[..],
+                            )
+                        })
+                        .expect("unix ipc initialization");
+                    ready.wait();
+                    bench(
+                        unix.sender(std::path::PathBuf::from("bench_tx")),
+                        unix,
+                        i,
+                        iter,
+                        window,
+                        size,
+                    )
+                },
+            )
         }
     };
 }
@@ -301,54 +499,215 @@ macro_rules! unix_bench {
 unix_bench!(unix_blocking, Blocking);
 unix_bench!(unix_nonblocking, Nonblocking);
 
+macro_rules! chan_bench {
+    ($name: ident, $mode: ident) => {
+        fn $name(cfg: &Config) -> Sample {
+            use crossbeam::channel;
+
+            let (iter, window, size) = (cfg.iter, cfg.window, cfg.size);
+            let total = cfg.iter * cfg.senders;
+            let (to_echo, from_senders) = channel::unbounded::<Vec<u8>>();
+            let (to_senders, from_echo): (Vec<_>, Vec<_>) =
+                (0..cfg.senders).map(|_| channel::unbounded()).unzip();
+            let from_echo = Mutex::new(from_echo.into_iter().map(Some).collect::<Vec<_>>());
+
+            run_senders(
+                cfg,
+                // echo-er: replies to the sender named in the message's sid.
+                move |ready| {
+                    ready.wait();
+                    for _ in 0..total {
+                        let msg = from_senders.recv().expect("recv");
+                        let sender = u32::from_le_bytes(msg[4..8].try_into().unwrap());
+                        to_senders[sender as usize].send(msg).expect("echo");
+                    }
+                },
+                move |i, ready| {
+                    let from_echo = from_echo.lock().unwrap()[i as usize].take().unwrap();
+                    let sk = portus::ipc::chan::Socket::<$mode>::new(to_echo.clone(), from_echo);
+                    let mut receive_buf = vec![0u8; 1 << 16];
+                    let chan = Backend::new(
+                        sk,
+                        Arc::new(atomic::AtomicBool::new(true)),
+                        &mut receive_buf[..],
+                    );
+                    ready.wait();
+                    bench(chan.sender(()), chan, i, iter, window, size)
+                },
+            )
+        }
+    };
+}
+
+chan_bench!(chan_blocking, Blocking);
+chan_bench!(chan_nonblocking, Nonblocking);
+
 arg_enum! {
     #[derive(PartialEq, Debug)]
     pub enum IpcType {
         Nl,
         Unix,
         Kp,
+        Chan,
     }
 }
 
-#[cfg(target_os = "linux")]
-fn nl_exp(trials: u32) {
-    for t in netlink_nonblocking(trials).iter().map(|d| {
-        (
-            d.0.whole_nanoseconds(),
-            d.1.whole_nanoseconds(),
-            d.2.whole_nanoseconds(),
-        )
-    }) {
-        println!("nl nonblk {:?} {:?} {:?}", t.0, t.1, t.2);
+arg_enum! {
+    #[derive(PartialEq, Debug)]
+    pub enum Mode {
+        Rtt,
+        Throughput,
+    }
+}
+
+arg_enum! {
+    #[derive(Clone, Copy, PartialEq, Debug)]
+    pub enum Output {
+        Raw,
+        Summary,
+        Json,
     }
+}
 
-    for t in netlink_blocking(trials).iter().map(|d| {
-        (
-            d.0.whole_nanoseconds(),
-            d.1.whole_nanoseconds(),
-            d.2.whole_nanoseconds(),
-        )
-    }) {
-        println!("nl blk {:?} {:?} {:?}", t.0, t.1, t.2);
+fn report(out: Output, imp: &str, blk: &str, cfg: &Config, s: Sample) {
+    // a round trip measured across a wall-clock step can come out negative; count it as 0.
+    let mut ns: Vec<u64> = s
+        .rtts
+        .iter()
+        .map(|d| u64::try_from(d.whole_nanoseconds()).unwrap_or(0))
+        .collect();
+    if out == Output::Raw {
+        for t in ns {
+            println!("{} {} {:?} 0 0", imp, blk, t);
+        }
+
+        return;
+    }
+
+    ns.sort_unstable();
+    let msgs = ns.len();
+    let per_sec = msgs as f64 / s.wall.as_seconds_f64();
+    let cpu_per_msg = s.cpu.whole_nanoseconds() / (msgs.max(1) as i128);
+    let (p50, p99, p999) = (
+        percentile(&ns, 0.5),
+        percentile(&ns, 0.99),
+        percentile(&ns, 0.999),
+    );
+    let max = ns.last().copied().unwrap_or(0);
+    if out == Output::Json {
+        println!(
+            "{{\"impl\":\"{}\",\"io\":\"{}\",\"senders\":{},\"window\":{},\"msg_size\":{},\
+             \"messages\":{},\"p50_ns\":{},\"p99_ns\":{},\"p999_ns\":{},\"max_ns\":{},\
+             \"msgs_per_sec\":{:.0},\"cpu_ns_per_msg\":{}}}",
+            imp,
+            blk,
+            cfg.senders,
+            cfg.window,
+            cfg.size,
+            msgs,
+            p50,
+            p99,
+            p999,
+            max,
+            per_sec,
+            cpu_per_msg
+        );
+    } else {
+        println!(
+            "{} {}: {} x {} B, p50 {} ns, p99 {} ns, p999 {} ns, max {} ns, {:.0} msgs/s, {} ns cpu/msg",
+            imp, blk, msgs, cfg.size, p50, p99, p999, max, per_sec, cpu_per_msg
+        );
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn nl_exp(out: Output, cfg: &Config) {
+    for (blk, s) in vec![
+        ("nonblk", netlink_nonblocking(cfg)),
+        ("blk", netlink_blocking(cfg)),
+    ] {
+        if out == Output::Raw {
+            for d in s.durations {
+                println!(
+                    "nl {} {:?} {:?} {:?}",
+                    blk,
+                    d.0.whole_nanoseconds(),
+                    d.1.whole_nanoseconds(),
+                    d.2.whole_nanoseconds()
+                );
+            }
+        } else {
+            let rtts = s.durations.into_iter().map(|d| d.0).collect();
+            let nl_cfg = Config {
+                senders: 1,
+                window: 1,
+                size: MIN_MSG_SIZE,
+                ..cfg.clone()
+            };
+            let sample = Sample {
+                rtts,
+                wall: s.wall,
+                cpu: s.cpu,
+            };
+            report(out, "nl", blk, &nl_cfg, sample);
+        }
     }
 }
 
 #[cfg(not(target_os = "linux"))]
-fn nl_exp(trials: u32) {
-    netlink_blocking(trials);
-    netlink_nonblocking(trials);
+fn nl_exp(_: Output, cfg: &Config) {
+    netlink_blocking(cfg);
+    netlink_nonblocking(cfg);
+}
+
+/// Message size in bytes for `--msg-size`: a number, or the size of a typical report or
+/// update message.
+fn msg_size(s: &str) -> Result<u32, String> {
+    use portus::lang::{Reg, Type};
+    use portus::serialize::{measure, serialize, update_field};
+    let size = match s {
+        // a report of six fields.
+        "measure" => serialize(&measure::Msg {
+            sid: 0,
+            program_uid: 0,
+            num_fields: 6,
+            fields: vec![0; 6],
+        })
+        .map_err(|e| format!("{:?}", e))?
+        .len() as u32,
+        // setting cwnd and rate.
+        "update" => serialize(&update_field::Msg {
+            sid: 0,
+            num_fields: 2,
+            fields: vec![
+                (Reg::Implicit(3, Type::Num(None)), 0),
+                (Reg::Implicit(4, Type::Num(None)), 0),
+            ],
+        })
+        .map_err(|e| format!("{:?}", e))?
+        .len() as u32,
+        n => n
+            .parse()
+            .map_err(|_| format!("msg-size must be measure, update, or a number: {:?}", n))?,
+    };
+
+    if size < MIN_MSG_SIZE {
+        return Err(format!("msg-size must be at least {} bytes", MIN_MSG_SIZE));
+    }
+
+    Ok(size)
 }
 
 fn main() {
     let matches = clap::App::new("IPC Latency Benchmark")
-        .version("0.2.0")
+        .version("0.3.0")
         .author("Akshay Narayan <akshayn@mit.edu>")
         .about("Benchmark of IPC Latency")
         .arg(
             Arg::with_name("iterations")
                 .long("iterations")
                 .short("i")
-                .help("Specifies how many trials to run (default 100)")
+                .help("Specifies how many messages each sender sends (default 100)")
                 .default_value("100"),
         )
         .arg(
@@ -360,38 +719,107 @@ fn main() {
                 .multiple(true)
                 .default_value("nl"),
         )
+        .arg(
+            Arg::with_name("mode")
+                .long("mode")
+                .help("rtt: one message at a time from one sender. throughput: --senders senders, each with --window messages in flight")
+                .possible_values(&Mode::variants())
+                .case_insensitive(true)
+                .default_value("rtt"),
+        )
+        .arg(
+            Arg::with_name("senders")
+                .long("senders")
+                .help("Concurrent senders in throughput mode (unix and chan only)")
+                .default_value("4"),
+        )
+        .arg(
+            Arg::with_name("window")
+                .long("window")
+                .help("Messages each sender keeps in flight in throughput mode")
+                .default_value("16"),
+        )
+        .arg(
+            Arg::with_name("msg-size")
+                .long("msg-size")
+                .help("Message size: measure, update, or a number of bytes (default: the bare timestamp)")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("pin")
+                .long("pin")
+                .help("Comma-separated cpus to pin the echo thread and then each sender to, in turn")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("output")
+                .long("output")
+                .help("raw: every round trip time. summary and json: percentiles, throughput, and CPU time per message")
+                .possible_values(&Output::variants())
+                .case_insensitive(true)
+                .default_value("raw"),
+        )
         .get_matches();
 
-    let trials = u32::from_str_radix(matches.value_of("iterations").unwrap(), 10)
+    let iter = u32::from_str_radix(matches.value_of("iterations").unwrap(), 10)
         .expect("iterations must be integral");
-
     let imps = values_t!(matches.values_of("implementation"), IpcType).unwrap();
+    let out = value_t!(matches, "output", Output).unwrap();
+    let cfg = Config {
+        iter,
+        senders: 1,
+        window: 1,
+        size: matches
+            .value_of("msg-size")
+            .map(msg_size)
+            .transpose()
+            .unwrap_or_else(|e| {
+                eprintln!("error: {}", e);
+                std::process::exit(1)
+            })
+            .unwrap_or(MIN_MSG_SIZE),
+        cpus: matches
+            .value_of("pin")
+            .map(|s| {
+                s.split(',')
+                    .map(|c| c.trim().parse().expect("pin takes cpu numbers"))
+                    .collect()
+            })
+            .unwrap_or_default(),
+    };
+    let cfg = match value_t!(matches, "mode", Mode).unwrap() {
+        Mode::Rtt => cfg,
+        Mode::Throughput => Config {
+            senders: value_t!(matches, "senders", u32).expect("senders must be integral"),
+            window: value_t!(matches, "window", u32).expect("window must be integral"),
+            ..cfg
+        },
+    };
+
+    if out == Output::Raw {
+        println!("Impl Mode Rtt To From");
+    }
 
-    println!("Impl Mode Rtt To From");
     if imps.contains(&IpcType::Unix) {
-        for t in unix_nonblocking(trials)
-            .iter()
-            .map(|d| d.whole_nanoseconds())
-        {
-            println!("unix nonblk {:?} 0 0", t);
-        }
+        report(out, "unix", "nonblk", &cfg, unix_nonblocking(&cfg));
+        report(out, "unix", "blk", &cfg, unix_blocking(&cfg));
+    }
 
-        for t in unix_blocking(trials).iter().map(|d| d.whole_nanoseconds()) {
-            println!("unix blk {:?} 0 0", t);
-        }
+    if imps.contains(&IpcType::Chan) {
+        report(out, "chan", "nonblk", &cfg, chan_nonblocking(&cfg));
+        report(out, "chan", "blk", &cfg, chan_blocking(&cfg));
     }
 
     if imps.contains(&IpcType::Nl) {
-        nl_exp(trials);
+        nl_exp(out, &cfg);
     }
 
     if imps.contains(&IpcType::Kp) && cfg!(target_os = "linux") {
-        for t in kp_nonblocking(trials).iter().map(|d| d.whole_nanoseconds()) {
-            println!("kp nonblk {:?} 0 0", t);
-        }
-
-        for t in kp_blocking(trials).iter().map(|d| d.whole_nanoseconds()) {
-            println!("kp blk {:?} 0 0", t);
-        }
+        let kp_cfg = Config {
+            senders: 1,
+            ..cfg.clone()
+        };
+        report(out, "kp", "nonblk", &kp_cfg, kp_nonblocking(&kp_cfg));
+        report(out, "kp", "blk", &kp_cfg, kp_blocking(&kp_cfg));
     }
 }
@@ -0,0 +1,550 @@
+//! Checkpoints of the flow table, so that flows survive a CCP restart.
+//!
+//! When CCP restarts, the datapath sends a new ready message, and the runtime would start every
+//! flow over. With `RunBuilder::with_checkpoint`, the runtime instead writes each flow's state
+//! (from `Flow::export_state`), the fields of its create message, and the uids of the programs it
+//! compiled to a memory-mapped file, periodically and when it stops. Writes go to the page cache,
+//! so a checkpoint survives the process crashing. The file holds two slots, and each checkpoint
+//! overwrites the older one, so a crash while writing leaves the previous checkpoint readable.
+//!
+//! A runtime started on the same file reads the checkpoint back. When a datapath in it sends a
+//! report for a flow the runtime does not know, the flow is taken over with
+//! `CongAlg::import_flow` rather than being lost, and reports that still carry the old uid of a
+//! program are delivered under the uid this runtime compiled the same program to. A create message
+//! for a checkpointed flow, or a second ready message from its datapath, means the datapath has
+//! dropped it, and the checkpointed state is discarded.
+//!
+//! Flows whose `export_state` returns `None` are not checkpointed.
+
+use crate::serialize::{self, create, Msg};
+use crate::{Error, Result};
+use byteorder::{ByteOrder, LittleEndian};
+use std::fs::{File, OpenOptions};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::sync::atomic;
+use std::time::{Duration, Instant};
+use tracing::{debug, info};
+
+const MAGIC: u32 = 0x4b50_4343; // "CCPK"
+const VERSION: u32 = 3;
+// each slot's header: magic, version, generation, body length, body digest.
+const HDR_LEN: usize = 32;
+const MIN_MAP_LEN: usize = 4096;
+
+/// A program the checkpointing runtime compiled.
+#[derive(Clone, Debug, PartialEq)]
+pub struct SavedProgram {
+    pub name: String,
+    pub program_uid: u32,
+    /// `digest` of the program's text, so a program that changed across the restart is not
+    /// mistaken for the old one.
+    pub digest: u64,
+}
+
+/// A checkpointed flow.
+#[derive(Clone, Debug, PartialEq)]
+pub struct SavedFlow {
+    /// The datapath's address, as `Ipc::addr_bytes` returns it.
+    pub addr: Vec<u8>,
+    /// The flow's create message. `cong_alg` is the name of the algorithm that ran the flow.
+    pub create: create::Msg,
+    /// What the flow's `export_state` returned.
+    pub state: Vec<u8>,
+}
+
+/// The contents of a checkpoint file.
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct Snapshot {
+    /// The addresses of the datapaths that had sent ready, as `Ipc::addr_bytes` returns them.
+    pub datapaths: Vec<Vec<u8>>,
+    pub programs: Vec<SavedProgram>,
+    pub flows: Vec<SavedFlow>,
+}
+
+impl Snapshot {
+    /// Read the checkpoint at `path`.
+    ///
+    /// A missing, partly written, or corrupt checkpoint reads as empty: the runtime then starts
+    /// every flow over, as it would without one.
+    pub fn read(path: &Path) -> Snapshot {
+        let buf = match std::fs::read(path) {
+            Ok(buf) => buf,
+            Err(e) => {
+                debug!(path = ?path, err = %e, "no checkpoint to restore");
+                return Snapshot::default();
+            }
+        };
+
+        match Snapshot::from_file(&buf) {
+            Ok(s) => {
+                info!(path = ?path, flows = s.flows.len(), "read checkpoint");
+                s
+            }
+            Err(e) => {
+                info!(path = ?path, err = ?e, "ignoring unreadable checkpoint");
+                Snapshot::default()
+            }
+        }
+    }
+
+    /// The largest program uid in the checkpoint. A runtime restoring it allocates its own uids
+    /// above this (see `lang::set_program_uid_base`), so that old and new uids are distinct.
+    pub fn max_program_uid(&self) -> u32 {
+        self.programs
+            .iter()
+            .map(|p| p.program_uid)
+            .max()
+            .unwrap_or(0)
+    }
+
+    // The newest slot in `buf` that decodes.
+    fn from_file(buf: &[u8]) -> Result<Snapshot> {
+        for (off, generation, body) in slots(buf) {
+            match Snapshot::decode(body) {
+                Ok(s) => return Ok(s),
+                Err(e) => debug!(off, generation, err = ?e, "skipping undecodable checkpoint"),
+            }
+        }
+
+        Err(Error(String::from("no valid checkpoint")))
+    }
+
+    /// The snapshot as bytes, for `decode`.
+    pub fn encode(&self) -> Result<Vec<u8>> {
+        let mut buf = vec![];
+        put_u32(&mut buf, self.datapaths.len() as u32);
+        for addr in &self.datapaths {
+            put_bytes(&mut buf, addr);
+        }
+
+        put_u32(&mut buf, self.programs.len() as u32);
+        for p in &self.programs {
+            put_bytes(&mut buf, p.name.as_bytes());
+            put_u32(&mut buf, p.program_uid);
+            buf.extend_from_slice(&p.digest.to_le_bytes());
+        }
+
+        put_u32(&mut buf, self.flows.len() as u32);
+        for f in &self.flows {
+            put_bytes(&mut buf, &f.addr);
+            put_bytes(&mut buf, &serialize::serialize(&f.create)?);
+            put_bytes(&mut buf, &f.state);
+        }
+
+        Ok(buf)
+    }
+
+    /// Read a snapshot from `encode`'s bytes.
+    pub fn decode(body: &[u8]) -> Result<Snapshot> {
+        let mut r = Reader(body);
+        let mut snap = Snapshot::default();
+        for _ in 0..r.u32()? {
+            snap.datapaths.push(r.bytes()?.to_vec());
+        }
+
+        for _ in 0..r.u32()? {
+            snap.programs.push(SavedProgram {
+                name: std::str::from_utf8(r.bytes()?)?.to_owned(),
+                program_uid: r.u32()?,
+                digest: r.u64()?,
+            });
+        }
+
+        for _ in 0..r.u32()? {
+            let addr = r.bytes()?.to_vec();
+            let create = match Msg::from_buf(r.bytes()?)?.0 {
+                Msg::Cr(c) => create::Msg::from(c),
+                _ => {
+                    return Err(Error(String::from(
+                        "checkpointed flow has no create message",
+                    )))
+                }
+            };
+            let state = r.bytes()?.to_vec();
+            snap.flows.push(SavedFlow {
+                addr,
+                create,
+                state,
+            });
+        }
+
+        Ok(snap)
+    }
+}
+
+// Where slots can start in a `len`-byte file: 0, and each power of two from half the smallest
+// mapping. The file only grows by doubling, so slots written before it grew are still found.
+fn slot_offsets(len: usize) -> impl Iterator<Item = usize> {
+    let upper = std::iter::successors(Some(MIN_MAP_LEN / 2), |o| o.checked_mul(2));
+    std::iter::once(0).chain(upper.take_while(move |&o| o < len))
+}
+
+// The generation and body of the slot at `off`, if it is complete.
+fn read_slot(buf: &[u8], off: usize) -> Result<(u64, &[u8])> {
+    let buf = buf.get(off..).unwrap_or(&[]);
+    if buf.len() < HDR_LEN || LittleEndian::read_u32(&buf[0..4]) != MAGIC {
+        return Err(Error(String::from("not a checkpoint")));
+    }
+
+    let version = LittleEndian::read_u32(&buf[4..8]);
+    if version != VERSION {
+        return Err(Error(format!("unknown checkpoint version {}", version)));
+    }
+
+    let len = LittleEndian::read_u64(&buf[16..24]) as usize;
+    let body = buf
+        .get(HDR_LEN..HDR_LEN.saturating_add(len))
+        .ok_or_else(|| Error(String::from("checkpoint truncated")))?;
+    if digest(body) != LittleEndian::read_u64(&buf[24..32]) {
+        return Err(Error(String::from("checkpoint digest mismatch")));
+    }
+
+    Ok((LittleEndian::read_u64(&buf[8..16]), body))
+}
+
+// The complete slots in `buf`, newest first, as (offset, generation, body).
+fn slots(buf: &[u8]) -> Vec<(usize, u64, &[u8])> {
+    let mut found: Vec<_> = slot_offsets(buf.len())
+        .filter_map(|off| read_slot(buf, off).ok().map(|(g, body)| (off, g, body)))
+        .collect();
+    found.sort_by(|a, b| b.1.cmp(&a.1));
+    found
+}
+
+/// FNV-1a hash of `buf`.
+pub fn digest(buf: &[u8]) -> u64 {
+    buf.iter().fold(0xcbf2_9ce4_8422_2325u64, |h, &b| {
+        (h ^ u64::from(b)).wrapping_mul(0x0100_0000_01b3)
+    })
+}
+
+fn put_u32(buf: &mut Vec<u8>, v: u32) {
+    buf.extend_from_slice(&v.to_le_bytes());
+}
+
+fn put_bytes(buf: &mut Vec<u8>, b: &[u8]) {
+    put_u32(buf, b.len() as u32);
+    buf.extend_from_slice(b);
+}
+
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8]> {
+        if self.0.len() < n {
+            return Err(Error(String::from("checkpoint truncated")));
+        }
+
+        let (b, rest) = self.0.split_at(n);
+        self.0 = rest;
+        Ok(b)
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        self.take(4).map(LittleEndian::read_u32)
+    }
+
+    fn u64(&mut self) -> Result<u64> {
+        self.take(8).map(LittleEndian::read_u64)
+    }
+
+    fn bytes(&mut self) -> Result<&'a [u8]> {
+        let n = self.u32()? as usize;
+        self.take(n)
+    }
+}
+
+/// Writes a runtime's checkpoints to a file, at most once per interval.
+pub(crate) struct Checkpointer {
+    path: PathBuf,
+    interval: Duration,
+    map: Option<Mapping>,
+    next: Option<Instant>,
+    // the generation and offset of the newest complete slot in the file.
+    generation: u64,
+    newest: Option<usize>,
+}
+
+impl Checkpointer {
+    pub(crate) fn new(path: PathBuf, interval: Duration) -> Self {
+        Checkpointer {
+            path,
+            interval,
+            map: None,
+            next: None,
+            generation: 0,
+            newest: None,
+        }
+    }
+
+    pub(crate) fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Whether the interval has passed since the last checkpoint.
+    pub(crate) fn due(&self, now: Instant) -> bool {
+        self.next.map_or(true, |next| now >= next)
+    }
+
+    /// Write `snap` to the slot that does not hold the newest checkpoint, with the next
+    /// generation.
+    ///
+    /// The slot's header is invalidated first and rewritten last, so a reader never accepts a
+    /// partly written checkpoint, and finds the previous one in the other slot meanwhile.
+    pub(crate) fn write(&mut self, snap: &Snapshot, now: Instant) -> Result<()> {
+        self.next = Some(now + self.interval);
+        let body = snap.encode()?;
+        if self.map.is_none() {
+            // continue from the checkpoints already in the file, such as the ones restored from.
+            let mut map = Mapping::open(&self.path)?;
+            map.reserve(HDR_LEN)?;
+            if let Some(&(off, generation, _)) = slots(map.bytes()).first() {
+                self.newest = Some(off);
+                self.generation = generation;
+            }
+
+            self.map = Some(map);
+        }
+
+        // the slots are the file's two halves. When the file grows, the newest slot is below
+        // the new upper half, which lies past everything written so far.
+        let map = self.map.as_mut().unwrap();
+        map.reserve(2 * (HDR_LEN + body.len()))?;
+        let half = map.len / 2;
+        let off = match self.newest {
+            Some(n) if n < half => half,
+            _ => 0,
+        };
+
+        self.generation += 1;
+        let buf = &mut map.bytes()[off..off + HDR_LEN + body.len()];
+        LittleEndian::write_u32(&mut buf[0..4], 0);
+        atomic::fence(atomic::Ordering::SeqCst);
+        buf[HDR_LEN..].copy_from_slice(&body);
+        LittleEndian::write_u32(&mut buf[4..8], VERSION);
+        LittleEndian::write_u64(&mut buf[8..16], self.generation);
+        LittleEndian::write_u64(&mut buf[16..24], body.len() as u64);
+        LittleEndian::write_u64(&mut buf[24..32], digest(&body));
+        atomic::fence(atomic::Ordering::SeqCst);
+        LittleEndian::write_u32(&mut buf[0..4], MAGIC);
+        self.newest = Some(off);
+        debug!(
+            flows = snap.flows.len(),
+            bytes = body.len(),
+            generation = self.generation,
+            slot = off,
+            "wrote checkpoint"
+        );
+        Ok(())
+    }
+}
+
+// A file mapped shared into memory.
+struct Mapping {
+    file: File,
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Mapping {
+    fn open(path: &Path) -> Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .open(path)?;
+        Ok(Mapping {
+            file,
+            ptr: std::ptr::null_mut(),
+            len: 0,
+        })
+    }
+
+    // Map at least `len` bytes, growing the file if necessary. The mapping is a power of two
+    // bytes long, and covers the whole file.
+    fn reserve(&mut self, len: usize) -> Result<()> {
+        if len <= self.len {
+            return Ok(());
+        }
+
+        let len = len
+            .max(MIN_MAP_LEN)
+            .max(self.file.metadata()?.len() as usize)
+            .next_power_of_two();
+        self.unmap();
+        self.file.set_len(len as u64)?;
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                self.file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(Error::from(std::io::Error::last_os_error()));
+        }
+
+        self.ptr = ptr as *mut u8;
+        self.len = len;
+        Ok(())
+    }
+
+    fn bytes(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+
+    fn unmap(&mut self) {
+        if !self.ptr.is_null() {
+            unsafe {
+                libc::munmap(self.ptr as *mut libc::c_void, self.len);
+            }
+            self.ptr = std::ptr::null_mut();
+            self.len = 0;
+        }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        self.unmap();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn snapshot() -> Snapshot {
+        Snapshot {
+            datapaths: vec![b"dp".to_vec()],
+            programs: vec![SavedProgram {
+                name: String::from("prog"),
+                program_uid: 7,
+                digest: digest(b"(def (Report (volatile acked 0)))"),
+            }],
+            flows: vec![SavedFlow {
+                addr: b"dp".to_vec(),
+                create: create::Msg {
+                    sid: 3,
+                    init_cwnd: 14480,
+                    mss: 1448,
+                    src_ip: 1,
+                    src_port: 4242,
+                    dst_ip: 2,
+                    dst_port: 80,
+                    cong_alg: Some(String::from("alg")),
+                },
+                state: vec![1, 2, 3],
+            }],
+        }
+    }
+
+    fn path(name: &str) -> PathBuf {
+        std::env::temp_dir().join(format!("portus-{}-{}", name, std::process::id()))
+    }
+
+    #[test]
+    fn roundtrip() {
+        let p = path("ck-roundtrip");
+        let snap = snapshot();
+        let mut w = Checkpointer::new(p.clone(), Duration::from_secs(1));
+        w.write(&snap, Instant::now()).unwrap();
+        assert_eq!(Snapshot::read(&p), snap);
+        assert_eq!(Snapshot::read(&p).max_program_uid(), 7);
+
+        // a smaller checkpoint replaces it.
+        w.write(&Snapshot::default(), Instant::now()).unwrap();
+        assert_eq!(Snapshot::read(&p), Snapshot::default());
+        std::fs::remove_file(&p).unwrap();
+    }
+
+    #[test]
+    fn corrupt_reads_empty() {
+        let p = path("ck-corrupt");
+        Checkpointer::new(p.clone(), Duration::from_secs(1))
+            .write(&snapshot(), Instant::now())
+            .unwrap();
+        let mut buf = std::fs::read(&p).unwrap();
+        buf[HDR_LEN + 2] ^= 0xff;
+        std::fs::write(&p, &buf).unwrap();
+        assert_eq!(Snapshot::read(&p), Snapshot::default());
+        assert_eq!(Snapshot::read(&path("ck-missing")), Snapshot::default());
+        std::fs::remove_file(&p).unwrap();
+    }
+
+    // Flip a byte in the body of the slot at `off`, as a crash partway through writing it might.
+    fn corrupt_slot(p: &Path, off: usize) {
+        let mut buf = std::fs::read(p).unwrap();
+        buf[off + HDR_LEN + 2] ^= 0xff;
+        std::fs::write(p, &buf).unwrap();
+    }
+
+    #[test]
+    fn torn_write_keeps_previous() {
+        let p = path("ck-torn");
+        let mut w = Checkpointer::new(p.clone(), Duration::from_secs(1));
+        let mut snap = snapshot();
+        w.write(&Snapshot::default(), Instant::now()).unwrap();
+        w.write(&snap, Instant::now()).unwrap();
+        assert_eq!(Snapshot::read(&p), snap);
+
+        // the third checkpoint goes to the first slot; losing it leaves the second.
+        snap.flows[0].state = vec![4, 5, 6];
+        w.write(&snap, Instant::now()).unwrap();
+        assert_eq!(Snapshot::read(&p), snap);
+        corrupt_slot(&p, 0);
+        assert_eq!(Snapshot::read(&p), snapshot());
+        std::fs::remove_file(&p).unwrap();
+    }
+
+    #[test]
+    fn grow_keeps_previous() {
+        let p = path("ck-grow");
+        let mut w = Checkpointer::new(p.clone(), Duration::from_secs(1));
+        let small = snapshot();
+        let mut big = snapshot();
+        big.flows[0].state = vec![7; 3 * MIN_MAP_LEN];
+        w.write(&Snapshot::default(), Instant::now()).unwrap();
+        w.write(&small, Instant::now()).unwrap();
+        w.write(&big, Instant::now()).unwrap();
+        assert_eq!(Snapshot::read(&p), big);
+
+        // the big checkpoint went past the end of the old file, leaving the small one whole.
+        let len = std::fs::metadata(&p).unwrap().len() as usize;
+        corrupt_slot(&p, len / 2);
+        assert_eq!(Snapshot::read(&p), small);
+        std::fs::remove_file(&p).unwrap();
+    }
+
+    #[test]
+    fn new_writer_continues_generations() {
+        let p = path("ck-continue");
+        let mut w = Checkpointer::new(p.clone(), Duration::from_secs(1));
+        w.write(&Snapshot::default(), Instant::now()).unwrap();
+        w.write(&Snapshot::default(), Instant::now()).unwrap();
+        drop(w);
+
+        // a restarted runtime's first checkpoint is newer than both of the old ones.
+        let snap = snapshot();
+        Checkpointer::new(p.clone(), Duration::from_secs(1))
+            .write(&snap, Instant::now())
+            .unwrap();
+        assert_eq!(Snapshot::read(&p), snap);
+        std::fs::remove_file(&p).unwrap();
+    }
+
+    #[test]
+    fn due_after_interval() {
+        let mut w = Checkpointer::new(path("ck-due"), Duration::from_secs(1));
+        let now = Instant::now();
+        assert!(w.due(now));
+        w.write(&Snapshot::default(), now).unwrap();
+        assert!(!w.due(now + Duration::from_millis(999)));
+        assert!(w.due(now + Duration::from_secs(1)));
+        std::fs::remove_file(w.path()).unwrap();
+    }
+}
@@ -0,0 +1,121 @@
+//! The runtime's source of time.
+//!
+//! The runtime reads the time to stamp each message it receives (`Report::received_at`), to
+//! measure control-loop delay (see `latency`), and to give up on a datapath that has gone quiet
+//! (`RunBuilder::with_recv_timeout`). By default that is the system's monotonic clock. Pass a
+//! `VirtualClock` to `RunBuilder::with_clock` (or the `PollRuntime` and `DirectRuntime`
+//! equivalents) instead, and time stands still until the caller advances it: tests and
+//! simulations then see the same times on every run, without sleeping.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// A monotonic clock.
+pub trait Clock: Send + Sync + 'static {
+    fn now(&self) -> Instant;
+
+    /// When a message arrived by this clock, given `at`, the arrival time the IPC socket reported
+    /// (see `Ipc::recv_at`).
+    ///
+    /// Clocks that track the system's keep the socket's time, which may be a kernel timestamp;
+    /// others use `now()`.
+    fn received(&self, at: Instant) -> Instant {
+        let _ = at;
+        self.now()
+    }
+}
+
+impl std::fmt::Debug for dyn Clock {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        f.write_str("Clock")
+    }
+}
+
+/// The system's monotonic clock, `Instant::now()`. This is the default.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct SystemClock;
+
+impl Clock for SystemClock {
+    fn now(&self) -> Instant {
+        Instant::now()
+    }
+
+    fn received(&self, at: Instant) -> Instant {
+        at
+    }
+}
+
+/// A clock that only moves when `advance` is called.
+///
+/// Clones share the same time, so a test can keep one and hand another to the runtime.
+#[derive(Clone, Debug)]
+pub struct VirtualClock {
+    start: Instant,
+    elapsed_ns: Arc<AtomicU64>,
+}
+
+impl Default for VirtualClock {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl VirtualClock {
+    pub fn new() -> Self {
+        VirtualClock {
+            start: Instant::now(),
+            elapsed_ns: Arc::new(AtomicU64::new(0)),
+        }
+    }
+
+    /// Move the clock forward by `d`.
+    pub fn advance(&self, d: Duration) {
+        self.elapsed_ns
+            .fetch_add(d.as_nanos() as u64, Ordering::SeqCst);
+    }
+
+    /// The time advanced since the clock was created.
+    pub fn elapsed(&self) -> Duration {
+        Duration::from_nanos(self.elapsed_ns.load(Ordering::SeqCst))
+    }
+
+    /// How long after the clock was created `t` is.
+    pub fn since_start(&self, t: Instant) -> Duration {
+        t.saturating_duration_since(self.start)
+    }
+}
+
+impl Clock for VirtualClock {
+    fn now(&self) -> Instant {
+        self.start + self.elapsed()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Clock, SystemClock, VirtualClock};
+    use std::time::{Duration, Instant};
+
+    #[test]
+    fn virtual_clock_moves_only_when_advanced() {
+        let c = VirtualClock::new();
+        let t0 = c.now();
+        std::thread::sleep(Duration::from_millis(2));
+        assert_eq!(c.now(), t0);
+
+        let shared = c.clone();
+        shared.advance(Duration::from_secs(3));
+        assert_eq!(c.elapsed(), Duration::from_secs(3));
+        assert_eq!(c.since_start(c.now()), Duration::from_secs(3));
+
+        // a socket's arrival time is wall time, which a virtual clock ignores.
+        assert_eq!(c.received(Instant::now()), c.now());
+    }
+
+    #[test]
+    fn system_clock_keeps_socket_timestamps() {
+        let at = Instant::now() - Duration::from_millis(5);
+        assert_eq!(SystemClock.received(at), at);
+    }
+}
@@ -3,10 +3,12 @@ use crossbeam::channel;
 use super::Error;
 use super::Result;
 use std::marker::PhantomData;
+use std::time::Duration;
 
 pub struct Socket<T> {
     send: Option<channel::Sender<Vec<u8>>>,
     recv: Option<channel::Receiver<Vec<u8>>>,
+    recv_timeout: Duration,
     _phantom: PhantomData<T>,
 }
 
@@ -15,10 +17,18 @@ impl<T> Socket<T> {
         Socket {
             send: Some(to_ccp),
             recv: Some(from_ccp),
+            recv_timeout: Duration::from_secs(1),
             _phantom: PhantomData::<T>,
         }
     }
 
+    /// How long a blocking `recv` waits before returning an error, which is how often a
+    /// `Backend` checks whether it was killed or has timed out. One second by default.
+    pub fn with_recv_timeout(mut self, timeout: Duration) -> Self {
+        self.recv_timeout = timeout;
+        self
+    }
+
     fn __name() -> String {
         String::from("channel")
     }
@@ -39,6 +49,20 @@ impl<T> Socket<T> {
     }
 }
 
+// A message that does not fit is dropped with an error, as a datagram socket would truncate it.
+fn copy_msg(msg: &mut [u8], buf: &[u8]) -> Result<(usize, ())> {
+    msg.get_mut(..buf.len())
+        .ok_or_else(|| {
+            Error(format!(
+                "{}-byte message does not fit the {}-byte receive buffer",
+                buf.len(),
+                msg.len()
+            ))
+        })?
+        .copy_from_slice(buf);
+    Ok((buf.len(), ()))
+}
+
 use super::Blocking;
 impl super::Ipc for Socket<Blocking> {
     type Addr = ();
@@ -56,9 +80,12 @@ impl super::Ipc for Socket<Blocking> {
             .recv
             .as_ref()
             .ok_or_else(|| Error(String::from("Receive channel side missing")))?;
-        let buf = r.recv_timeout(std::time::Duration::from_secs(1))?;
-        msg[..buf.len()].copy_from_slice(&buf);
-        Ok((buf.len(), ()))
+        let buf = match r.recv_timeout(self.recv_timeout) {
+            Ok(buf) => buf,
+            Err(channel::RecvTimeoutError::Timeout) => return Ok((0, ())),
+            Err(e) => return Err(Error::from(e)),
+        };
+        copy_msg(msg, &buf)
     }
 
     fn close(&mut self) -> Result<()> {
@@ -83,9 +110,12 @@ impl super::Ipc for Socket<Nonblocking> {
             .recv
             .as_ref()
             .ok_or_else(|| Error(String::from("Receive channel side missing")))?;
-        let buf = r.try_recv()?;
-        msg[..buf.len()].copy_from_slice(&buf);
-        Ok((buf.len(), ()))
+        let buf = match r.try_recv() {
+            Ok(buf) => buf,
+            Err(channel::TryRecvError::Empty) => return Ok((0, ())),
+            Err(e) => return Err(Error::from(e)),
+        };
+        copy_msg(msg, &buf)
     }
 
     fn close(&mut self) -> Result<()> {
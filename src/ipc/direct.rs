@@ -0,0 +1,79 @@
+//! In-process transport, for a datapath that links portus into its own process.
+//!
+//! There is no socket or queue. The datapath hands each message buffer to
+//! [`DirectRuntime::recv_msg`](../../struct.DirectRuntime.html), which parses it in place and
+//! dispatches it, and CCP's messages to the datapath are passed straight to the send callback
+//! given to `Socket::new`, borrowing the serialized buffer.
+
+use super::Error;
+use super::Result;
+
+type SendFn = dyn Fn(&[u8]) -> Result<()> + Send;
+
+pub struct Socket {
+    send: Option<Box<SendFn>>,
+}
+
+impl Socket {
+    /// `send` is called synchronously, on the thread calling `DirectRuntime::recv_msg`, for
+    /// every message CCP sends to the datapath. The buffer is only valid for the duration of the
+    /// call. `send` must not call back into the runtime.
+    pub fn new(send: impl Fn(&[u8]) -> Result<()> + Send + 'static) -> Self {
+        Socket {
+            send: Some(Box::new(send)),
+        }
+    }
+}
+
+impl super::Ipc for Socket {
+    type Addr = ();
+
+    fn name() -> String {
+        String::from("direct")
+    }
+
+    fn send(&self, msg: &[u8], _to: &Self::Addr) -> Result<()> {
+        let s = self
+            .send
+            .as_ref()
+            .ok_or_else(|| Error(String::from("Send callback missing")))?;
+        s(msg)
+    }
+
+    fn recv(&self, _msg: &mut [u8]) -> Result<(usize, Self::Addr)> {
+        Err(Error(String::from(
+            "direct ipc cannot be polled: deliver messages with DirectRuntime::recv_msg",
+        )))
+    }
+
+    fn close(&mut self) -> Result<()> {
+        self.send.take();
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Socket;
+    use crate::ipc::Ipc;
+    use std::sync::{Arc, Mutex};
+
+    #[test]
+    fn basic() {
+        let sent = Arc::new(Mutex::new(vec![]));
+        let s = sent.clone();
+        let mut ipc = Socket::new(move |msg| {
+            s.lock().unwrap().push(msg.to_vec());
+            Ok(())
+        });
+
+        ipc.send(&[0, 9, 1, 8], &()).unwrap();
+        assert_eq!(*sent.lock().unwrap(), vec![vec![0, 9, 1, 8]]);
+
+        let mut buf = [0u8; 8];
+        assert!(ipc.recv(&mut buf).is_err());
+
+        ipc.close().unwrap();
+        assert!(ipc.send(&[0], &()).is_err());
+    }
+}
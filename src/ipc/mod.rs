@@ -1,14 +1,19 @@
 //! A library wrapping various IPC mechanisms with a datagram-oriented
 //! messaging layer. This is how CCP communicates with the datapath.
 
+use super::clock::{Clock, SystemClock};
 use super::Error;
 use super::Result;
+use std::os::unix::io::{AsRawFd, RawFd};
 use std::rc::{Rc, Weak};
 use std::sync::{atomic, Arc};
+use std::time::{Duration, Instant, SystemTime};
 use tracing::{debug, info};
 
 /// Thread-channel implementation
 pub mod chan;
+/// In-process direct-call implementation
+pub mod direct;
 #[cfg(all(target_os = "linux"))]
 /// Character device implementation
 pub mod kp;
@@ -18,6 +23,10 @@ pub mod netlink;
 /// Unix domain socket implementation
 pub mod unix;
 
+/// The size of a receive buffer that holds any datagram: a CCP message's length is a u16, so no
+/// message is longer than this.
+pub const MAX_MSG_LEN: usize = 1 << 16;
+
 /// IPC mechanisms must implement this trait.
 ///
 /// This API enables both connection-oriented (send/recv) and connectionless (sendto/recvfrom)
@@ -34,9 +43,32 @@ pub trait Ipc: 'static + Send {
     /// Blocking listen.
     ///
     /// Returns how many bytes were read, and (if using unix sockets) the address of the sender.
+    /// Reading nothing is not an error: a nonblocking socket with nothing ready, or a blocking
+    /// one whose receive timed out, returns 0 bytes.
     ///
     /// Important: should not allocate!
     fn recv(&self, msg: &mut [u8]) -> Result<(usize, Self::Addr)>;
+    /// Like `recv`, and also when the message arrived.
+    ///
+    /// Sockets with kernel receive timestamps return those; by default this is the time `recv`
+    /// returned.
+    fn recv_at(&self, msg: &mut [u8]) -> Result<(usize, Self::Addr, Instant)> {
+        let (read, addr) = self.recv(msg)?;
+        Ok((read, addr, Instant::now()))
+    }
+    /// `addr` as bytes, for the USDT probes in `crate::probes`; empty by default.
+    fn addr_bytes(_addr: &Self::Addr) -> &[u8] {
+        &[]
+    }
+    /// The address whose `addr_bytes` are `bytes`, for `crate::checkpoint`. By default, only
+    /// empty bytes, which are the default address.
+    fn addr_from_bytes(bytes: &[u8]) -> Option<Self::Addr> {
+        if bytes.is_empty() {
+            Some(Self::Addr::default())
+        } else {
+            None
+        }
+    }
     /// Close the underlying sockets
     fn close(&mut self) -> Result<()>;
 }
@@ -70,11 +102,18 @@ impl<T: Ipc> BackendSender<T> {
     pub fn send_msg(&self, msg: &[u8]) -> Result<()> {
         let s = Weak::upgrade(&self.0)
             .ok_or_else(|| Error(String::from("Send on closed IPC socket!")))?;
+        let to = T::addr_bytes(&self.1);
+        usdt!(send, msg.len(), to.as_ptr(), to.len());
         s.send(msg, &self.1).map_err(Error::from)
     }
     pub fn clone_with_dest(&self, to: T::Addr) -> Self {
         BackendSender(self.0.clone(), to)
     }
+
+    /// A sender for a socket owned outside of a `Backend`.
+    pub(crate) fn from_sock(sock: &Rc<T>, to: T::Addr) -> Self {
+        BackendSender(Rc::downgrade(sock), to)
+    }
 }
 
 impl<T: Ipc> Clone for BackendSender<T> {
@@ -93,6 +132,12 @@ pub struct Backend<'a, T: Ipc> {
     tot_read: usize,
     read_until: usize,
     last_recv_addr: T::Addr,
+    last_recv_at: Instant,
+    clock: Arc<dyn Clock>,
+    recv_timeout: Option<Duration>,
+    timed_out: bool,
+    idle: Option<Box<dyn FnMut() + 'a>>,
+    pause: Option<Arc<atomic::AtomicBool>>,
 }
 
 use crate::serialize::Msg;
@@ -109,9 +154,62 @@ impl<'a, T: Ipc> Backend<'a, T> {
             tot_read: 0,
             read_until: 0,
             last_recv_addr: Default::default(),
+            last_recv_at: Instant::now(),
+            clock: Arc::new(SystemClock),
+            recv_timeout: None,
+            timed_out: false,
+            idle: None,
+            pause: None,
         }
     }
 
+    /// Stamp messages with `clock` rather than the system clock; see `clock::Clock::received`.
+    pub fn with_clock(mut self, clock: Arc<dyn Clock>) -> Self {
+        self.last_recv_at = clock.now();
+        self.clock = clock;
+        self
+    }
+
+    /// Stop iterating if no message arrives for `timeout` after the last one (or after the
+    /// backend was built), measured on the backend's clock.
+    ///
+    /// The clock is checked each time the socket's own receive times out (every second for
+    /// `chan` and `unix` sockets; see `chan::Socket::with_recv_timeout`).
+    pub fn with_recv_timeout(mut self, timeout: Duration) -> Self {
+        self.recv_timeout = Some(timeout);
+        self
+    }
+
+    /// Call `idle` each time the socket's receive returns without a message while `next()`
+    /// waits for one.
+    ///
+    /// `idle` is dropped before the socket is closed, so it may hold senders of this backend.
+    pub fn with_idle(mut self, idle: impl FnMut() + 'a) -> Self {
+        self.idle = Some(Box::new(idle));
+        self
+    }
+
+    /// Also stop iterating while `pause` is set, as when the stop handle is cleared but without
+    /// clearing it: the caller can clear `pause` and iterate again.
+    pub fn with_pause(mut self, pause: Arc<atomic::AtomicBool>) -> Self {
+        self.pause = Some(pause);
+        self
+    }
+
+    // Whether to read more from the socket: neither stopped nor paused.
+    fn listening(&self) -> bool {
+        self.continue_listening.load(atomic::Ordering::SeqCst)
+            && !self
+                .pause
+                .as_ref()
+                .map_or(false, |p| p.load(atomic::Ordering::SeqCst))
+    }
+
+    /// Whether iteration stopped because of `with_recv_timeout`.
+    pub fn timed_out(&self) -> bool {
+        self.timed_out
+    }
+
     pub fn sender(&self, to: T::Addr) -> BackendSender<T> {
         BackendSender(Rc::downgrade(&self.sock), to)
     }
@@ -126,40 +224,121 @@ impl<'a, T: Ipc> Backend<'a, T> {
     // This is similar to `impl Iterator`, but the returned value is tied to the lifetime
     // of `self`, so we cannot implement that trait.
     pub fn next(&mut self) -> Option<(Msg<'_>, T::Addr)> {
+        self.next_at().map(|(msg, addr, _)| (msg, addr))
+    }
+
+    /// Like `next()`, and also when the message arrived; see `Ipc::recv_at`.
+    pub fn next_at(&mut self) -> Option<(Msg<'_>, T::Addr, Instant)> {
         // if we have leftover buffer from the last read, parse another message.
         if self.read_until < self.tot_read {
-            let (msg, consumed) = Msg::from_buf(&self.receive_buf[self.read_until..]).ok()?;
+            let buf = &self.receive_buf[self.read_until..self.tot_read];
+            let (msg, consumed) = Msg::from_buf(buf).ok()?;
+            probe_msg(buf, consumed);
             self.read_until += consumed;
-            Some((msg, self.last_recv_addr.clone()))
+            Some((msg, self.last_recv_addr.clone(), self.last_recv_at))
         } else {
             self.tot_read = self.get_next_read().ok()?;
             self.read_until = 0;
-            let (msg, consumed) =
-                Msg::from_buf(&self.receive_buf[self.read_until..self.tot_read]).ok()?;
+            let buf = &self.receive_buf[..self.tot_read];
+            let (msg, consumed) = Msg::from_buf(buf).ok()?;
+            probe_msg(buf, consumed);
             self.read_until += consumed;
 
-            Some((msg, self.last_recv_addr.clone()))
+            Some((msg, self.last_recv_addr.clone(), self.last_recv_at))
         }
     }
 
+    /// Get the next IPC message if one is already available, without blocking.
+    ///
+    /// Unlike `next()`, this makes at most one call to the underlying socket and returns `None`
+    /// as soon as that call yields nothing. It is intended for `Nonblocking` sockets whose file
+    /// descriptor is registered with an external event loop.
+    ///
+    /// Errors from the socket are returned; a datagram that does not parse is discarded, and
+    /// counts as nothing.
+    pub fn try_next(&mut self) -> Result<Option<(Msg<'_>, T::Addr)>> {
+        Ok(self.try_next_at()?.map(|(msg, addr, _)| (msg, addr)))
+    }
+
+    /// Like `try_next()`, and also when the message arrived; see `Ipc::recv_at`.
+    pub fn try_next_at(&mut self) -> Result<Option<(Msg<'_>, T::Addr, Instant)>> {
+        if self.read_until >= self.tot_read {
+            if !self.listening() {
+                return Ok(None);
+            }
+
+            // nonblocking sockets read nothing, rather than failing, when nothing is ready.
+            let (read, addr, at) = self.sock.recv_at(self.receive_buf)?;
+            if read == 0 {
+                return Ok(None);
+            }
+
+            self.last_recv_addr = addr;
+            self.last_recv_at = self.clock.received(at);
+            self.tot_read = read;
+            self.read_until = 0;
+            let from = T::addr_bytes(&self.last_recv_addr);
+            usdt!(recv, read, from.as_ptr(), from.len());
+        }
+
+        let buf = &self.receive_buf[self.read_until..self.tot_read];
+        let (msg, consumed) = Msg::from_buf(buf)?;
+        if let Msg::Other(raw) = &msg {
+            if raw.unparsed() {
+                debug!(len = buf.len(), "discarding datagram that does not parse");
+                self.read_until = self.tot_read;
+                return Ok(None);
+            }
+        }
+
+        probe_msg(buf, consumed);
+        self.read_until += consumed;
+        Ok(Some((msg, self.last_recv_addr.clone(), self.last_recv_at)))
+    }
+
     // calls IPC repeatedly to read one or more messages.
     // Returns a slice into self.receive_buf covering the read data
     fn get_next_read(&mut self) -> Result<usize> {
         loop {
             // if continue_loop has been set to false, stop iterating
-            if !self.continue_listening.load(atomic::Ordering::SeqCst) {
+            if !self.listening() {
                 info!("recieved kill signal");
                 return Err(Error(String::from("Done")));
             }
 
-            let (read, addr) = match self.sock.recv(self.receive_buf) {
+            if let Some(timeout) = self.recv_timeout {
+                let waited = self
+                    .clock
+                    .now()
+                    .saturating_duration_since(self.last_recv_at);
+                if waited >= timeout {
+                    info!(?waited, "no message from the datapath, giving up");
+                    self.timed_out = true;
+                    return Err(Error(String::from("Receive timed out")));
+                }
+            }
+
+            let (read, addr, at) = match self.sock.recv_at(self.receive_buf) {
                 Ok(r) => r,
                 Err(Error(e)) => {
                     debug!(err = %format!("{:#?}", e), "recv failed" );
+                    if let Some(idle) = self.idle.as_mut() {
+                        idle();
+                    }
+
                     continue;
                 }
             };
 
+            // a receive that timed out reads nothing; it must not count as a message.
+            if read == 0 {
+                if let Some(idle) = self.idle.as_mut() {
+                    idle();
+                }
+
+                continue;
+            }
+
             // NOTE This may seem precarious, but is safe
             // In the case that `recv` returns a buffer containing multiple messages,
             // `next()` will continue to hit the first `if` branch (and thus will not
@@ -167,18 +346,130 @@ impl<'a, T: Ipc> Backend<'a, T> {
             // have been returned. So it is not possible for recvs to interleave and
             // interfere with the last_recv_addr value.
             self.last_recv_addr = addr;
+            self.last_recv_at = self.clock.received(at);
 
-            if read == 0 {
-                continue;
+            let from = T::addr_bytes(&self.last_recv_addr);
+            usdt!(recv, read, from.as_ptr(), from.len());
+            return Ok(read);
+        }
+    }
+}
+
+// `recvmsg(2)` on `fd` into `buf`, with the sender's address written to `name`. Returns the bytes
+// read, the address length, and when the message arrived: the kernel's timestamp if the socket
+// has `SO_TIMESTAMPNS` set (see `enable_rx_timestamps`), otherwise now.
+#[cfg(target_os = "linux")]
+pub(crate) fn recvmsg_at(
+    fd: RawFd,
+    buf: &mut [u8],
+    flags: libc::c_int,
+    name: *mut libc::c_void,
+    namelen: libc::socklen_t,
+) -> Result<(usize, libc::socklen_t, Instant)> {
+    let mut iov = libc::iovec {
+        iov_base: buf.as_mut_ptr() as *mut libc::c_void,
+        iov_len: buf.len(),
+    };
+    // room for one timespec control message, aligned for cmsghdr.
+    let mut control = [0u64; 8];
+    let mut hdr: libc::msghdr = unsafe { std::mem::zeroed() };
+    hdr.msg_name = name;
+    hdr.msg_namelen = namelen;
+    hdr.msg_iov = &mut iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    hdr.msg_controllen = std::mem::size_of_val(&control) as _;
+
+    let read = unsafe { libc::recvmsg(fd, &mut hdr, flags) };
+    if read < 0 {
+        let err = std::io::Error::last_os_error();
+        if would_block(&err) {
+            return Ok((0, 0, Instant::now()));
+        }
+
+        return Err(Error::from(err));
+    }
+
+    let now = Instant::now();
+    let mut at = now;
+    unsafe {
+        let mut c = libc::CMSG_FIRSTHDR(&hdr);
+        while !c.is_null() {
+            if (*c).cmsg_level == libc::SOL_SOCKET && (*c).cmsg_type == libc::SCM_TIMESTAMPNS {
+                let ts = std::ptr::read_unaligned(libc::CMSG_DATA(c) as *const libc::timespec);
+                at = realtime_to_instant(now, ts);
             }
 
-            return Ok(read);
+            c = libc::CMSG_NXTHDR(&hdr, c);
         }
     }
+
+    Ok((read as usize, hdr.msg_namelen, at))
+}
+
+// Whether `err` is a nonblocking receive finding nothing, or a blocking one timing out. Sockets
+// report these as reading nothing rather than as errors.
+pub(crate) fn would_block(err: &std::io::Error) -> bool {
+    matches!(
+        err.kind(),
+        std::io::ErrorKind::WouldBlock | std::io::ErrorKind::TimedOut
+    )
+}
+
+// Ask the kernel to timestamp each datagram `fd` receives, for `recvmsg_at`.
+#[cfg(target_os = "linux")]
+pub(crate) fn enable_rx_timestamps(fd: RawFd) -> Result<()> {
+    let on: libc::c_int = 1;
+    let res = unsafe {
+        libc::setsockopt(
+            fd,
+            libc::SOL_SOCKET,
+            libc::SO_TIMESTAMPNS,
+            &on as *const libc::c_int as *const libc::c_void,
+            std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if res < 0 {
+        return Err(Error::from(std::io::Error::last_os_error()));
+    }
+
+    Ok(())
+}
+
+// The monotonic time of the (past) wall-clock time `ts`, given the monotonic time `now`.
+#[cfg(target_os = "linux")]
+fn realtime_to_instant(now: Instant, ts: libc::timespec) -> Instant {
+    let ts = SystemTime::UNIX_EPOCH + Duration::new(ts.tv_sec as u64, ts.tv_nsec as u32);
+    SystemTime::now()
+        .duration_since(ts)
+        .ok()
+        .and_then(|ago| now.checked_sub(ago))
+        .unwrap_or(now)
+}
+
+// Fire the `msg` probe for the `len`-byte message that `Msg::from_buf` parsed from `buf`. A
+// fragment too short for a header has no type or sid, so it fires no probe.
+fn probe_msg(buf: &[u8], len: usize) {
+    if let Some(hdr) = buf.get(..8) {
+        usdt!(
+            msg,
+            hdr[0],
+            u32::from_le_bytes([hdr[4], hdr[5], hdr[6], hdr[7]]),
+            len
+        );
+    }
+}
+
+impl<'a, T: Ipc + AsRawFd> AsRawFd for Backend<'a, T> {
+    fn as_raw_fd(&self) -> RawFd {
+        self.sock.as_raw_fd()
+    }
 }
 
 impl<'a, T: Ipc> Drop for Backend<'a, T> {
     fn drop(&mut self) {
+        // release any senders the idle hook holds, which would keep the socket open.
+        self.idle.take();
         Rc::get_mut(&mut self.sock)
             .ok_or_else(|| {
                 Error(String::from(
@@ -9,6 +9,22 @@ pub struct Socket<T>(c_int, PhantomData<T>);
 const NL_CFG_F_NONROOT_RECV: c_int = 1;
 const NL_CFG_F_NONROOT_SEND: c_int = 1 << 1;
 const NLMSG_HDRSIZE: usize = 0x10;
+// a netlink header and the largest CCP message.
+const NL_BUF_LEN: usize = NLMSG_HDRSIZE + super::MAX_MSG_LEN;
+
+// Copy a received message out of its netlink framing into the caller's buffer.
+fn copy_payload(buf: &mut [u8], payload: &[u8]) -> Result<usize> {
+    buf.get_mut(..payload.len())
+        .ok_or_else(|| {
+            Error(format!(
+                "{}-byte netlink message does not fit the {}-byte receive buffer",
+                payload.len(),
+                buf.len()
+            ))
+        })?
+        .copy_from_slice(payload);
+    Ok(payload.len())
+}
 
 impl<T> Socket<T> {
     fn __new() -> Result<Self> {
@@ -58,6 +74,8 @@ impl<T> Socket<T> {
             &to as *const libc::timespec as *const libc::c_void,
             mem::size_of::<libc::timespec>() as u32,
         )?;
+
+        super::enable_rx_timestamps(s.0)?;
         Ok(s)
     }
 
@@ -78,17 +96,22 @@ impl<T> Socket<T> {
     }
 
     fn __recv(&self, buf: &mut [u8], flags: nix::sys::socket::MsgFlags) -> Result<usize> {
-        let mut nl_buf = [0u8; 1024];
-        let end = socket::recvmsg(
+        let mut nl_buf = [0u8; NL_BUF_LEN];
+        let end = match socket::recvmsg(
             self.0,
             &[nix::sys::uio::IoVec::from_mut_slice(&mut nl_buf[..])],
             None,
             flags,
-        )
-        .map(|r| r.bytes)
-        .map_err(Error::from)?;
-        buf[..(end - NLMSG_HDRSIZE)].copy_from_slice(&nl_buf[NLMSG_HDRSIZE..end]);
-        Ok(end - NLMSG_HDRSIZE)
+        ) {
+            Ok(r) => r.bytes,
+            Err(_) if nix::errno::errno() == libc::EAGAIN => return Ok(0),
+            Err(e) => return Err(Error::from(e)),
+        };
+        if end < NLMSG_HDRSIZE {
+            return Err(Error(format!("netlink message too short: {} bytes", end)));
+        }
+
+        copy_payload(buf, &nl_buf[NLMSG_HDRSIZE..end])
     }
 
     // netlink header format (RFC 3549)
@@ -103,6 +126,19 @@ impl<T> Socket<T> {
     // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
     // |                      Process ID (PID)                       |
     // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+    fn __recv_at(&self, buf: &mut [u8], flags: libc::c_int) -> Result<(usize, std::time::Instant)> {
+        let mut nl_buf = [0u8; NL_BUF_LEN];
+        let (end, _, at) =
+            super::recvmsg_at(self.0, &mut nl_buf[..], flags, std::ptr::null_mut(), 0)?;
+        if end == 0 {
+            return Ok((0, at));
+        } else if end < NLMSG_HDRSIZE {
+            return Err(Error(format!("netlink message too short: {} bytes", end)));
+        }
+
+        Ok((copy_payload(buf, &nl_buf[NLMSG_HDRSIZE..end])?, at))
+    }
+
     fn __send(&self, buf: &[u8]) -> Result<()> {
         let len = NLMSG_HDRSIZE + buf.len();
         let mut msg = Vec::<u8>::with_capacity(len);
@@ -136,6 +172,12 @@ impl<T> Socket<T> {
     }
 }
 
+impl<T> std::os::unix::io::AsRawFd for Socket<T> {
+    fn as_raw_fd(&self) -> std::os::unix::io::RawFd {
+        self.0
+    }
+}
+
 use super::Blocking;
 impl super::Ipc for Socket<Blocking> {
     type Addr = ();
@@ -149,6 +191,10 @@ impl super::Ipc for Socket<Blocking> {
             .map(|s| (s, ()))
     }
 
+    fn recv_at(&self, buf: &mut [u8]) -> Result<(usize, Self::Addr, std::time::Instant)> {
+        self.__recv_at(buf, 0).map(|(s, at)| (s, (), at))
+    }
+
     fn send(&self, buf: &[u8], _to: &Self::Addr) -> Result<()> {
         self.__send(buf)
     }
@@ -171,6 +217,11 @@ impl super::Ipc for Socket<Nonblocking> {
             .map(|s| (s, ()))
     }
 
+    fn recv_at(&self, buf: &mut [u8]) -> Result<(usize, Self::Addr, std::time::Instant)> {
+        self.__recv_at(buf, libc::MSG_DONTWAIT)
+            .map(|(s, at)| (s, (), at))
+    }
+
     fn send(&self, buf: &[u8], _to: &Self::Addr) -> Result<()> {
         self.__send(buf)
     }
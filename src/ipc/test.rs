@@ -76,6 +76,39 @@ fn test_unix() {
     c2.join().expect("join sender thread");
 }
 
+// The kernel's receive timestamp is for this datagram, and the sender's address survives recvmsg.
+#[test]
+fn test_unix_recv_at() {
+    let sk = super::unix::Socket::<Blocking>::new("portus-test-unix-at").expect("init socket");
+    let client = std::os::unix::net::UnixDatagram::bind("/tmp/ccp/portus-test-unix-at-client")
+        .or_else(|_| {
+            std::fs::remove_file("/tmp/ccp/portus-test-unix-at-client")?;
+            std::os::unix::net::UnixDatagram::bind("/tmp/ccp/portus-test-unix-at-client")
+        })
+        .expect("bind client");
+
+    let before = std::time::Instant::now();
+    client
+        .send_to(b"hello", "/tmp/ccp/portus-test-unix-at")
+        .expect("send");
+    thread::sleep(std::time::Duration::from_millis(20));
+
+    let mut buf = [0u8; 64];
+    let (read, addr, at) = sk.recv_at(&mut buf[..]).expect("recv_at");
+    let after = std::time::Instant::now();
+    assert_eq!(&buf[..read], b"hello");
+    assert_eq!(
+        addr,
+        std::path::PathBuf::from("/tmp/ccp/portus-test-unix-at-client")
+    );
+    // stamped on arrival, before the sleep, on kernels with SO_TIMESTAMPNS.
+    assert!(at + std::time::Duration::from_millis(1) >= before && at <= after);
+    #[cfg(target_os = "linux")]
+    assert!(after - at >= std::time::Duration::from_millis(15));
+
+    std::fs::remove_file("/tmp/ccp/portus-test-unix-at-client").unwrap_or_else(|_| ());
+}
+
 #[test]
 fn test_chan() {
     let (tx, rx) = crossbeam::channel::unbounded();
@@ -110,3 +143,38 @@ fn test_chan() {
 
     c2.join().expect("join sender thread");
 }
+
+// A datagram shorter than a header reaches the caller of `next` as an unparsed message, and
+// `try_next` discards it, without either panicking.
+#[test]
+fn short_datagram() {
+    use super::chan;
+    use super::Nonblocking;
+
+    let (to_ccp, from_dp) = crossbeam::channel::unbounded();
+    let (to_dp, _from_ccp) = crossbeam::channel::unbounded();
+    let sk = chan::Socket::<Blocking>::new(to_dp.clone(), from_dp);
+    let mut buf = [0u8; 1024];
+    let mut b = super::Backend::new(sk, Arc::new(atomic::AtomicBool::new(true)), &mut buf[..]);
+    to_ccp.send(vec![1, 2, 3]).unwrap();
+    match b.next().expect("receive message") {
+        (Msg::Other(r), ()) => {
+            assert!(r.unparsed());
+            assert_eq!(r.payload(), &[1, 2, 3]);
+        }
+        (m, _) => panic!("wrong type for message: {:?}", m),
+    }
+
+    let (to_ccp, from_dp) = crossbeam::channel::unbounded();
+    let sk = chan::Socket::<Nonblocking>::new(to_dp, from_dp);
+    let mut buf = [0u8; 1024];
+    let mut b = super::Backend::new(sk, Arc::new(atomic::AtomicBool::new(true)), &mut buf[..]);
+    to_ccp.send(vec![1, 2, 3]).unwrap();
+    assert!(b.try_next().unwrap().is_none());
+    let test_msg = serialize::serialize(&TestMsg(String::from("after"))).unwrap();
+    to_ccp.send(test_msg).unwrap();
+    match b.try_next().unwrap() {
+        Some((Msg::Other(r), ())) => assert_eq!(r.get_bytes().unwrap(), b"after"),
+        m => panic!("expected the next message, got {:?}", m.map(|(m, _)| m)),
+    }
+}
@@ -1,11 +1,17 @@
 use super::{Error, Result};
 use std::marker::PhantomData;
-use std::os::unix::{io::AsRawFd, net::UnixDatagram};
+use std::os::unix::{
+    io::{AsRawFd, RawFd},
+    net::UnixDatagram,
+};
 use std::path::PathBuf;
+use std::sync::{atomic, Arc};
 use tracing::trace;
 
 pub struct Socket<T> {
     sk: UnixDatagram,
+    // set once the socket is handed to another process, which then owns it; see `upgrade`.
+    released: Arc<atomic::AtomicBool>,
     _phantom: PhantomData<T>,
 }
 
@@ -51,10 +57,26 @@ impl<T> Socket<T> {
             trace!(?rcvbuf_bytes, is_ok=?rcv_res.is_ok(), "set rcv buf sockopt");
         }
 
-        Ok(Socket {
-            sk: sock,
+        #[cfg(target_os = "linux")]
+        {
+            let ts_res = super::enable_rx_timestamps(sock.as_raw_fd());
+            trace!(is_ok=?ts_res.is_ok(), "set rx timestamp sockopt");
+        }
+
+        Ok(Socket::from_std(sock))
+    }
+
+    pub(crate) fn from_std(sk: UnixDatagram) -> Self {
+        Socket {
+            sk,
+            released: Arc::new(atomic::AtomicBool::new(false)),
             _phantom: PhantomData,
-        })
+        }
+    }
+
+    /// Once set, `close` leaves the socket open for the process it was handed to.
+    pub(crate) fn released(&self) -> Arc<atomic::AtomicBool> {
+        self.released.clone()
     }
 }
 
@@ -77,21 +99,70 @@ impl<T: 'static + Sync + Send> super::Ipc for Socket<T> {
     }
 
     fn recv(&self, msg: &mut [u8]) -> Result<(usize, Self::Addr)> {
-        self.sk
-            .recv_from(msg)
-            .map_err(Error::from)
-            .and_then(|(size, addr)| match addr.as_pathname() {
-                Some(p) => Ok((size, p.to_path_buf())),
-                None => Err(Error(String::from("no recv addr"))),
-            })
+        let (size, addr) = match self.sk.recv_from(msg) {
+            Ok(r) => r,
+            Err(e) if super::would_block(&e) => return Ok((0, PathBuf::default())),
+            Err(e) => return Err(Error::from(e)),
+        };
+
+        match addr.as_pathname() {
+            Some(p) => Ok((size, p.to_path_buf())),
+            None => Err(Error(String::from("no recv addr"))),
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    fn recv_at(&self, msg: &mut [u8]) -> Result<(usize, Self::Addr, std::time::Instant)> {
+        use std::os::unix::ffi::OsStrExt;
+        let mut name: libc::sockaddr_un = unsafe { std::mem::zeroed() };
+        let (size, namelen, at) = super::recvmsg_at(
+            self.sk.as_raw_fd(),
+            msg,
+            0,
+            &mut name as *mut libc::sockaddr_un as *mut libc::c_void,
+            std::mem::size_of::<libc::sockaddr_un>() as libc::socklen_t,
+        )?;
+        if size == 0 {
+            return Ok((0, PathBuf::default(), at));
+        }
+
+        let path_len = (namelen as usize).saturating_sub(std::mem::size_of::<libc::sa_family_t>());
+        let path = &name.sun_path[..path_len.min(name.sun_path.len())];
+        let end = path.iter().position(|&c| c == 0).unwrap_or(path.len());
+        if end == 0 {
+            return Err(Error(String::from("no recv addr")));
+        }
+
+        let path: Vec<u8> = path[..end].iter().map(|&c| c as u8).collect();
+        Ok((size, PathBuf::from(std::ffi::OsStr::from_bytes(&path)), at))
+    }
+
+    fn addr_bytes(addr: &Self::Addr) -> &[u8] {
+        use std::os::unix::ffi::OsStrExt;
+        addr.as_os_str().as_bytes()
+    }
+
+    fn addr_from_bytes(bytes: &[u8]) -> Option<Self::Addr> {
+        use std::os::unix::ffi::OsStrExt;
+        Some(PathBuf::from(std::ffi::OsStr::from_bytes(bytes)))
     }
 
     fn close(&mut self) -> Result<()> {
         use std::net::Shutdown;
+        if self.released.load(atomic::Ordering::SeqCst) {
+            return Ok(());
+        }
+
         self.sk.shutdown(Shutdown::Both).map_err(Error::from)
     }
 }
 
+impl<T> AsRawFd for Socket<T> {
+    fn as_raw_fd(&self) -> RawFd {
+        self.sk.as_raw_fd()
+    }
+}
+
 use super::Blocking;
 impl Socket<Blocking> {
     pub fn new(bind_to: &str) -> Result<Self> {
@@ -110,7 +181,7 @@ impl Socket<Blocking> {
 use super::Nonblocking;
 impl Socket<Nonblocking> {
     pub fn new(bind_to: &str) -> Result<Self> {
-        Socket::__new(bind_to, None, None)
+        Self::new_with_skbuf(bind_to, None, None)
     }
 
     pub fn new_with_skbuf(
@@ -0,0 +1,222 @@
+//! Control-loop delay: from a report's arrival at CCP until the flow's next message to the
+//! datapath, usually the cwnd or rate update the report caused.
+//!
+//! Arrival is the kernel's receive timestamp on sockets that provide one (`SO_TIMESTAMPNS` on
+//! unix and netlink sockets), and otherwise the time the runtime read the message. Pass a
+//! `LoopLatency` to `RunBuilder::with_loop_latency` (or the `PollRuntime` and `DirectRuntime`
+//! equivalents) to collect a histogram per algorithm, and read it from any thread with
+//! `snapshot()`.
+//!
+//! Both ends are read from the runtime's `clock::Clock`, so under a `VirtualClock` the delay is
+//! the virtual time that passed while the flow handled the report.
+
+use crate::clock::Clock;
+use std::cell::Cell;
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
+use std::time::Instant;
+
+/// Power-of-two nanosecond buckets: bucket `i` holds delays in `[2^(i-1), 2^i)`.
+const BUCKETS: usize = 64;
+
+/// A latency histogram with power-of-two buckets.
+#[derive(Clone, Debug)]
+pub struct Histogram {
+    buckets: [u64; BUCKETS],
+    count: u64,
+    sum_ns: u64,
+    max_ns: u64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            buckets: [0; BUCKETS],
+            count: 0,
+            sum_ns: 0,
+            max_ns: 0,
+        }
+    }
+}
+
+impl Histogram {
+    pub fn record(&mut self, ns: u64) {
+        let idx = (64 - ns.leading_zeros() as usize).min(BUCKETS - 1);
+        self.buckets[idx] += 1;
+        self.count += 1;
+        self.sum_ns = self.sum_ns.saturating_add(ns);
+        self.max_ns = self.max_ns.max(ns);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn mean_ns(&self) -> u64 {
+        if self.count == 0 {
+            0
+        } else {
+            self.sum_ns / self.count
+        }
+    }
+
+    pub fn max_ns(&self) -> u64 {
+        self.max_ns
+    }
+
+    /// An upper bound on the `q` quantile (`0.0 ..= 1.0`): the top of its bucket, or the
+    /// maximum if that is lower.
+    pub fn quantile_ns(&self, q: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+
+        let rank = ((q * self.count as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                let top = if i == 0 { 0 } else { (1u64 << i) - 1 };
+                return top.min(self.max_ns);
+            }
+        }
+
+        self.max_ns
+    }
+
+    /// The non-empty buckets, as (upper bound in ns, count).
+    pub fn buckets(&self) -> impl Iterator<Item = (u64, u64)> + '_ {
+        self.buckets
+            .iter()
+            .enumerate()
+            .filter(|&(_, &n)| n > 0)
+            .map(|(i, &n)| (if i == 0 { 0 } else { (1u64 << i) - 1 }, n))
+    }
+}
+
+/// The `q` quantile (`0.0 ..= 1.0`) of `sorted_ns`, or 0 if it is empty. This is exact, for
+/// tools that keep every sample; a `Histogram` only bounds it.
+pub fn percentile(sorted_ns: &[u64], q: f64) -> u64 {
+    if sorted_ns.is_empty() {
+        return 0;
+    }
+
+    let rank = (q * sorted_ns.len() as f64).ceil() as usize;
+    sorted_ns[rank.max(1).min(sorted_ns.len()) - 1]
+}
+
+/// Control-loop delay histograms, by algorithm name. Clones share the same histograms.
+#[derive(Clone, Debug, Default)]
+pub struct LoopLatency(Arc<Mutex<HashMap<&'static str, Histogram>>>);
+
+impl LoopLatency {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// A copy of the current histograms.
+    pub fn snapshot(&self) -> HashMap<&'static str, Histogram> {
+        self.0.lock().unwrap().clone()
+    }
+
+    fn record(&self, alg: &'static str, ns: u64) {
+        self.0.lock().unwrap().entry(alg).or_default().record(ns);
+    }
+}
+
+// One flow's pending report: set when a report is delivered, recorded by the flow's next send.
+#[derive(Debug)]
+pub(crate) struct LoopTimer {
+    alg: &'static str,
+    report_at: Cell<Option<Instant>>,
+    stats: LoopLatency,
+    clock: Arc<dyn Clock>,
+}
+
+impl LoopTimer {
+    pub(crate) fn new(alg: &'static str, stats: LoopLatency, clock: Arc<dyn Clock>) -> Self {
+        LoopTimer {
+            alg,
+            report_at: Cell::new(None),
+            stats,
+            clock,
+        }
+    }
+
+    // A later report replaces one that has not been answered yet.
+    pub(crate) fn report(&self, at: Instant) {
+        self.report_at.set(Some(at));
+    }
+
+    pub(crate) fn sent(&self) {
+        if let Some(at) = self.report_at.take() {
+            let ns = self.clock.now().saturating_duration_since(at).as_nanos();
+            self.stats.record(self.alg, ns as u64);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{percentile, Histogram, LoopLatency, LoopTimer};
+    use crate::clock::{Clock, SystemClock, VirtualClock};
+    use std::sync::Arc;
+    use std::time::{Duration, Instant};
+
+    #[test]
+    fn quantiles() {
+        let mut h = Histogram::default();
+        for ns in 1..=1000 {
+            h.record(ns);
+        }
+
+        assert_eq!(h.count(), 1000);
+        assert_eq!(h.mean_ns(), 500);
+        assert_eq!(h.max_ns(), 1000);
+        // 500 falls in [256, 512), and 990 in [512, 1024), capped at the maximum.
+        assert_eq!(h.quantile_ns(0.5), 511);
+        assert_eq!(h.quantile_ns(0.99), 1000);
+        assert_eq!(h.buckets().map(|(_, n)| n).sum::<u64>(), 1000);
+    }
+
+    #[test]
+    fn exact_percentiles() {
+        let ns: Vec<u64> = (1..=1000).collect();
+        assert_eq!(percentile(&ns, 0.5), 500);
+        assert_eq!(percentile(&ns, 0.999), 999);
+        assert_eq!(percentile(&ns, 1.0), 1000);
+        assert_eq!(percentile(&ns, 0.0), 1);
+        assert_eq!(percentile(&[], 0.5), 0);
+    }
+
+    #[test]
+    fn timer_records_once_per_report() {
+        let stats = LoopLatency::new();
+        let t = LoopTimer::new("alg", stats.clone(), Arc::new(SystemClock));
+
+        // a send with no report pending, such as the first set_program, is not a control loop.
+        t.sent();
+        t.report(Instant::now() - Duration::from_millis(1));
+        t.sent();
+        t.sent();
+
+        let h = &stats.snapshot()["alg"];
+        assert_eq!(h.count(), 1);
+        assert!(h.max_ns() >= 1_000_000);
+    }
+
+    #[test]
+    fn timer_reads_the_runtime_clock() {
+        let stats = LoopLatency::new();
+        let clock = VirtualClock::new();
+        let t = LoopTimer::new("alg", stats.clone(), Arc::new(clock.clone()));
+
+        t.report(clock.now());
+        clock.advance(Duration::from_micros(250));
+        t.sent();
+
+        let h = &stats.snapshot()["alg"];
+        assert_eq!(h.count(), 1);
+        assert_eq!(h.max_ns(), 250_000);
+    }
+}
@@ -67,15 +67,31 @@
 use std::collections::HashMap;
 use std::rc::Rc;
 
+#[macro_use]
+pub mod probes;
+pub mod async_flow;
+pub mod checkpoint;
+pub mod clock;
 pub mod ipc;
-pub mod lang;
+pub mod latency;
+pub mod policy;
+pub mod reload;
 pub mod serialize;
+pub mod shadow;
+pub mod shard;
 pub mod test_helper;
+pub mod upgrade;
 #[macro_use]
 pub mod algs;
 mod errors;
 pub use crate::errors::*;
+
+// lets `#[derive(CcpMessage)]` name `::portus` inside this crate too.
+extern crate self as portus;
+pub use portus_export::datapath_program;
+pub use portus_export::datapath_report;
 pub use portus_export::register_ccp_alg;
+pub use portus_lang as lang;
 
 use crate::ipc::BackendSender;
 use crate::ipc::Ipc;
@@ -100,6 +116,9 @@ pub struct Datapath<T: Ipc> {
     sock_id: u32,
     sender: BackendSender<T>,
     programs: Rc<HashMap<String, Scope>>,
+    timer: Option<Rc<latency::LoopTimer>>,
+    // set on the flows of a runtime with a shadow algorithm; see `shadow`.
+    tap: Option<Rc<shadow::Tap>>,
 }
 
 impl<T: Ipc> DatapathTrait for Datapath<T> {
@@ -116,39 +135,8 @@ impl<T: Ipc> DatapathTrait for Datapath<T> {
         match self.programs.get(program_name) {
             Some(sc) => {
                 // apply optional updates to values of registers in this scope
-                let fields: Vec<(Reg, u64)> = fields
-                    .unwrap_or_else(|| &[])
-                    .iter()
-                    .map(|&(reg_name, new_value)| {
-                        if reg_name.starts_with("__") {
-                            return Err(Error(format!(
-                                "Cannot update reserved field: {:?}",
-                                reg_name
-                            )));
-                        }
-
-                        sc.get(reg_name)
-                            .ok_or_else(|| Error(format!("Unknown field: {:?}", reg_name)))
-                            .and_then(|reg| match *reg {
-                                Reg::Control(idx, ref t, v) => {
-                                    Ok((Reg::Control(idx, t.clone(), v), u64::from(new_value)))
-                                }
-                                Reg::Implicit(idx, ref t) if idx == 4 || idx == 5 => {
-                                    Ok((Reg::Implicit(idx, t.clone()), u64::from(new_value)))
-                                }
-                                _ => Err(Error(format!("Cannot update field: {:?}", reg_name))),
-                            })
-                    })
-                    .collect::<Result<_>>()?;
-                let msg = serialize::changeprog::Msg {
-                    sid: self.sock_id,
-                    program_uid: sc.program_uid,
-                    num_fields: fields.len() as u32,
-                    fields,
-                };
-                let buf = serialize::serialize(&msg)?;
-                self.sender.send_msg(&buf[..])?;
-                Ok(sc.clone())
+                let fields = resolve_updates(sc, fields.unwrap_or_else(|| &[]))?;
+                self.set_program_regs(program_name, fields)
             }
             _ => Err(Error(format!(
                 "Map does not contain datapath program with key: {:?}",
@@ -158,29 +146,53 @@ impl<T: Ipc> DatapathTrait for Datapath<T> {
     }
 
     fn update_field(&self, sc: &Scope, update: &[(&str, u32)]) -> Result<()> {
-        let fields: Vec<(Reg, u64)> = update
-            .iter()
-            .map(|&(reg_name, new_value)| {
-                if reg_name.starts_with("__") {
-                    return Err(Error(format!(
-                        "Cannot update reserved field: {:?}",
-                        reg_name
-                    )));
-                }
+        let fields = resolve_updates(sc, update)?;
+        self.update_regs(fields)
+    }
+}
 
-                sc.get(reg_name)
-                    .ok_or_else(|| Error(format!("Unknown field: {:?}", reg_name)))
-                    .and_then(|reg| match *reg {
-                        Reg::Control(idx, ref t, v) => {
-                            Ok((Reg::Control(idx, t.clone(), v), u64::from(new_value)))
-                        }
-                        Reg::Implicit(idx, ref t) if idx == 4 || idx == 5 => {
-                            Ok((Reg::Implicit(idx, t.clone()), u64::from(new_value)))
-                        }
-                        _ => Err(Error(format!("Cannot update field: {:?}", reg_name))),
-                    })
-            })
-            .collect::<Result<_>>()?;
+impl<T: Ipc> Datapath<T> {
+    /// Like `set_program`, but with the registers to update already resolved from the program's
+    /// `Scope`, so no name lookups happen per call.
+    ///
+    /// The registers must be `Reg::Control` or the `Cwnd`/`Rate` implicit registers of the
+    /// named program.
+    pub fn set_program_regs(
+        &mut self,
+        program_name: &str,
+        fields: Vec<(Reg, u64)>,
+    ) -> Result<Scope> {
+        let sc = self.programs.get(program_name).ok_or_else(|| {
+            Error(format!(
+                "Map does not contain datapath program with key: {:?}",
+                program_name
+            ))
+        })?;
+
+        if let Some(t) = &self.tap {
+            if !t.record(Some(sc.program_uid), &fields) {
+                return Ok(sc.clone());
+            }
+        }
+
+        let msg = serialize::changeprog::Msg {
+            sid: self.sock_id,
+            program_uid: sc.program_uid,
+            num_fields: fields.len() as u32,
+            fields,
+        };
+        let buf = serialize::serialize(&msg)?;
+        self.send(&buf[..])?;
+        Ok(sc.clone())
+    }
+
+    /// Like `update_field`, but with the registers already resolved from the program's `Scope`.
+    pub fn update_regs(&self, fields: Vec<(Reg, u64)>) -> Result<()> {
+        if let Some(t) = &self.tap {
+            if !t.record(None, &fields) {
+                return Ok(());
+            }
+        }
 
         let msg = serialize::update_field::Msg {
             sid: self.sock_id,
@@ -189,11 +201,47 @@ impl<T: Ipc> DatapathTrait for Datapath<T> {
         };
 
         let buf = serialize::serialize(&msg)?;
-        self.sender.send_msg(&buf[..])?;
+        self.send(&buf[..])
+    }
+
+    // Every message to the datapath ends the control loop of the flow's last report.
+    fn send(&self, buf: &[u8]) -> Result<()> {
+        self.sender.send_msg(buf)?;
+        if let Some(t) = &self.timer {
+            t.sent();
+        }
+
         Ok(())
     }
 }
 
+/// Look up the register for an updatable field: a control register, or `Cwnd`/`Rate`.
+pub fn resolve_update_reg(sc: &Scope, reg_name: &str) -> Result<Reg> {
+    if reg_name.starts_with("__") {
+        return Err(Error(format!(
+            "Cannot update reserved field: {:?}",
+            reg_name
+        )));
+    }
+
+    sc.get(reg_name)
+        .ok_or_else(|| Error(format!("Unknown field: {:?}", reg_name)))
+        .and_then(|reg| match *reg {
+            Reg::Control(idx, ref t, v) => Ok(Reg::Control(idx, t.clone(), v)),
+            Reg::Implicit(idx, ref t) if idx == 4 || idx == 5 => Ok(Reg::Implicit(idx, t.clone())),
+            _ => Err(Error(format!("Cannot update field: {:?}", reg_name))),
+        })
+}
+
+fn resolve_updates(sc: &Scope, update: &[(&str, u32)]) -> Result<Vec<(Reg, u64)>> {
+    update
+        .iter()
+        .map(|&(reg_name, new_value)| {
+            resolve_update_reg(sc, reg_name).map(|reg| (reg, u64::from(new_value)))
+        })
+        .collect()
+}
+
 /// The set of information passed by the datapath to CCP
 /// when a connection starts. It includes a unique 5-tuple (CCP socket id + source and destination
 /// IP and port), the initial congestion window (`init_cwnd`), and flow MSS.
@@ -214,9 +262,18 @@ pub struct Report {
     pub program_uid: u32,
     pub from: String,
     fields: Vec<u64>,
+    received_at: std::time::Instant,
 }
 
 impl Report {
+    /// When the report reached CCP: the kernel's receive timestamp where the IPC socket
+    /// provides one, otherwise when the runtime read it. See `latency`.
+    ///
+    /// Under a `clock::VirtualClock`, this is the virtual time the runtime read it.
+    pub fn received_at(&self) -> std::time::Instant {
+        self.received_at
+    }
+
     /// Uses the `Scope` returned by `lang::compile` (or `install`) to query
     /// the `Report` for its values.
     pub fn get_field(&self, field: &str, sc: &Scope) -> Result<u64> {
@@ -238,6 +295,60 @@ impl Report {
             None => Err(Error::from(FieldNotFoundError)),
         }
     }
+
+    /// The raw report values, in register order.
+    ///
+    /// Index this with the `Reg::Report` index of a field in the program's `Scope` to avoid a
+    /// name lookup per access; check `program_uid` first, since a stale report has a
+    /// different layout.
+    pub fn fields(&self) -> &[u64] {
+        &self.fields
+    }
+
+    /// Decode every field at once into a struct generated by
+    /// [`datapath_report!`](./macro.datapath_report.html).
+    ///
+    /// The program uid and report length are checked once, rather than per field.
+    pub fn decode<T: ReportStruct>(&self, sc: &Scope) -> Result<T> {
+        if sc.program_uid != self.program_uid {
+            return Err(Error::from(StaleProgramError));
+        }
+
+        if self.fields.len() < T::FIELDS.len() {
+            return Err(Error::from(InvalidReportError));
+        }
+
+        Ok(T::from_fields(&self.fields))
+    }
+}
+
+/// A struct holding one program's report fields, generated by
+/// [`datapath_report!`](./macro.datapath_report.html) from the program's `(def (Report ...))`.
+pub trait ReportStruct: Sized {
+    /// The report field names, in the order the datapath sends their values.
+    const FIELDS: &'static [&'static str];
+
+    /// Build the struct from report values. `fields` holds at least `FIELDS.len()` values.
+    fn from_fields(fields: &[u64]) -> Self;
+
+    /// Check that `sc` is a scope of the program this struct was generated from, i.e. that each
+    /// field is the report register at its position.
+    fn check_scope(sc: &Scope) -> Result<()> {
+        for (i, name) in Self::FIELDS.iter().enumerate() {
+            match sc.get(name) {
+                Some(Reg::Report(idx, _, _)) if *idx as usize == i => (),
+                Some(_) => {
+                    return Err(Error(format!(
+                        "{} is not report field {} in this scope",
+                        name, i
+                    )))
+                }
+                None => return Err(Error::from(FieldNotFoundError)),
+            }
+        }
+
+        Ok(())
+    }
 }
 
 /// Implement this trait, [`portus::CongAlg`](./trait.CongAlg.html), and
@@ -257,6 +368,13 @@ pub trait Flow {
     /// e.g., clean up any external resources.
     /// The default implementation does nothing.
     fn close(&mut self) {}
+
+    /// Serialize this flow's state so that a newer version of the algorithm can take the flow
+    /// over with [`CongAlg::import_flow`](./trait.CongAlg.html#method.import_flow).
+    /// The default, `None`, keeps the flow on the version that created it.
+    fn export_state(&self) -> Option<Vec<u8>> {
+        None
+    }
 }
 
 impl<T> Flow for Box<T>
@@ -270,6 +388,10 @@ where
     fn close(&mut self) {
         T::close(self)
     }
+
+    fn export_state(&self) -> Option<Vec<u8>> {
+        T::export_state(self)
+    }
 }
 
 /// implement this trait, [`portus::CongAlgBuilder`](./trait.CongAlgBuilder.html) and
@@ -295,6 +417,8 @@ pub trait CongAlg<I: Ipc> {
     /// identifying the program, and the second string is the code for the program itself.
     ///
     /// The Portus runtime will panic if any of the datapath programs do not compile.
+    /// Programs written with [`datapath_program!`](./macro.datapath_program.html) are instead
+    /// compiled when the algorithm is built, and are installed without being parsed again.
     ///
     /// For example,
     /// ```
@@ -308,6 +432,20 @@ pub trait CongAlg<I: Ipc> {
     /// Create a new instance of the CongAlg to manage a new flow.
     /// Optionally copy any configuration parameters from `&self`.
     fn new_flow(&self, control: Datapath<I>, info: DatapathInfo) -> Self::Flow;
+
+    /// Take over a running flow from an older version of this algorithm, given the state that
+    /// version's `Flow::export_state` returned. The flow should install its program on `control`
+    /// as `new_flow` does.
+    ///
+    /// The default, `None`, declines: the flow stays on the older version until it ends.
+    fn import_flow(
+        &self,
+        _control: Datapath<I>,
+        _info: DatapathInfo,
+        _state: &[u8],
+    ) -> Option<Self::Flow> {
+        None
+    }
 }
 
 /// Tell `portus` how to construct instances of your `impl` [`portus::CongAlg`].
@@ -0,0 +1,392 @@
+//! Choose each flow's algorithm by its destination address and port.
+//!
+//! A policy is a table of rules, one per line:
+//!
+//! ```text
+//! # destination   ports       algorithm
+//! 10.0.0.0/8      *           bbr
+//! 10.1.0.0/16     443         cubic
+//! *               8000-8100   reno
+//! ```
+//!
+//! The destination is an IPv4 prefix, a single address, or `*` for any; the ports are a port, an
+//! inclusive range, or `*`. A flow gets the algorithm of the rule with the longest prefix that
+//! matches both its destination address and port; of rules with the same prefix, the first one
+//! listed wins. Flows no rule matches get the algorithm the datapath asked for, as without a
+//! policy. A rule naming an algorithm the runtime does not have picks the default algorithm.
+//!
+//! The table is compiled into a binary trie over the address bits, whose nodes hold the port
+//! ranges of the rules with that prefix as sorted, disjoint intervals. A lookup follows at most 32
+//! nodes and does one binary search per node with rules.
+//!
+//! Pass a `PolicyHandle` to `RunBuilder::with_policy`. `PolicyHandle::reload` (or `store`) swaps
+//! in a new table, which applies to the flows created from then on.
+//!
+//! Addresses are matched as libccp sends them in the create message: in network byte order, so
+//! that the first octet is the low byte of `dst_ip`.
+
+use crate::{Error, Result};
+use std::net::Ipv4Addr;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use tracing::info;
+
+const NONE: u32 = u32::MAX;
+
+#[derive(Clone, Copy, Debug)]
+struct Node {
+    child: [u32; 2],
+    // index into `Policy::sets`, or `NONE` if no rule has this prefix.
+    ports: u32,
+}
+
+impl Default for Node {
+    fn default() -> Self {
+        Node {
+            child: [NONE; 2],
+            ports: NONE,
+        }
+    }
+}
+
+// Ports `lo..=hi` pick `Policy::algs[alg]`.
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct Range {
+    lo: u32,
+    hi: u32,
+    alg: u32,
+}
+
+/// A compiled policy table; see the module documentation.
+#[derive(Clone, Debug)]
+pub struct Policy {
+    nodes: Vec<Node>,
+    // (start, len) of each node's ranges in `ranges`.
+    sets: Vec<(u32, u32)>,
+    ranges: Vec<Range>,
+    algs: Vec<String>,
+    rules: usize,
+}
+
+impl Default for Policy {
+    fn default() -> Self {
+        Policy {
+            nodes: vec![Node::default()],
+            sets: vec![],
+            ranges: vec![],
+            algs: vec![],
+            rules: 0,
+        }
+    }
+}
+
+fn parse_prefix(s: &str) -> std::result::Result<(u32, u8), String> {
+    if s == "*" {
+        return Ok((0, 0));
+    }
+
+    let (addr, len) = match s.find('/') {
+        Some(i) => (
+            &s[..i],
+            s[i + 1..].parse::<u8>().map_err(|e| e.to_string())?,
+        ),
+        None => (s, 32),
+    };
+    let addr: Ipv4Addr = addr.parse().map_err(|e| format!("{}", e))?;
+    if len > 32 {
+        return Err(format!("prefix length {} is over 32", len));
+    }
+
+    let mask = if len == 0 { 0 } else { u32::MAX << (32 - len) };
+    Ok((u32::from(addr) & mask, len))
+}
+
+fn parse_ports(s: &str) -> std::result::Result<(u32, u32), String> {
+    if s == "*" {
+        return Ok((0, u32::MAX));
+    }
+
+    let port = |p: &str| p.parse::<u16>().map(u32::from).map_err(|e| e.to_string());
+    let (lo, hi) = match s.find('-') {
+        Some(i) => (port(&s[..i])?, port(&s[i + 1..])?),
+        None => (port(s)?, port(s)?),
+    };
+    if lo > hi {
+        return Err(format!("empty port range {}", s));
+    }
+
+    Ok((lo, hi))
+}
+
+// Add the parts of `lo..=hi` that `set` does not cover yet, as `alg`.
+fn add_uncovered(set: &mut Vec<Range>, lo: u32, hi: u32, alg: u32) {
+    let mut next = u64::from(lo);
+    let mut add = vec![];
+    for r in set.iter() {
+        if u64::from(r.hi) < next || r.lo > hi {
+            continue;
+        }
+
+        if u64::from(r.lo) > next {
+            add.push(Range {
+                lo: next as u32,
+                hi: r.lo - 1,
+                alg,
+            });
+        }
+
+        next = u64::from(r.hi) + 1;
+    }
+
+    if next <= u64::from(hi) {
+        add.push(Range {
+            lo: next as u32,
+            hi,
+            alg,
+        });
+    }
+
+    set.extend(add);
+    set.sort_unstable_by_key(|r| r.lo);
+}
+
+impl Policy {
+    /// Compile a policy table.
+    pub fn parse(table: &str) -> Result<Self> {
+        let mut p = Policy::default();
+        // each node's rules, in table order, until they are flattened into `ranges`.
+        let mut sets: Vec<Vec<Range>> = vec![];
+        for (n, line) in table.lines().enumerate() {
+            let line = line.split('#').next().unwrap_or("").trim();
+            if line.is_empty() {
+                continue;
+            }
+
+            let cols: Vec<&str> = line.split_whitespace().collect();
+            let rule = match cols[..] {
+                [dst, ports, alg] => parse_prefix(dst)
+                    .and_then(|dst| parse_ports(ports).map(|ports| (dst, ports, alg))),
+                _ => Err(String::from("expected: destination ports algorithm")),
+            };
+            let ((addr, len), (lo, hi), alg) =
+                rule.map_err(|e| Error(format!("policy line {}: {}", n + 1, e)))?;
+
+            let alg = match p.algs.iter().position(|a| a == alg) {
+                Some(i) => i,
+                None => {
+                    p.algs.push(alg.to_owned());
+                    p.algs.len() - 1
+                }
+            } as u32;
+
+            let node = p.insert(addr, len);
+            if p.nodes[node].ports == NONE {
+                p.nodes[node].ports = sets.len() as u32;
+                sets.push(vec![]);
+            }
+
+            add_uncovered(&mut sets[p.nodes[node].ports as usize], lo, hi, alg);
+            p.rules += 1;
+        }
+
+        for set in sets {
+            p.sets.push((p.ranges.len() as u32, set.len() as u32));
+            p.ranges.extend(set);
+        }
+
+        Ok(p)
+    }
+
+    /// Read and compile the policy table at `path`.
+    pub fn load(path: impl AsRef<Path>) -> Result<Self> {
+        Self::parse(&std::fs::read_to_string(path)?)
+    }
+
+    // The trie node for prefix `addr/len`, adding it and its parents as needed.
+    fn insert(&mut self, addr: u32, len: u8) -> usize {
+        let mut n = 0;
+        for depth in 0..len {
+            let bit = ((addr >> (31 - depth)) & 1) as usize;
+            if self.nodes[n].child[bit] == NONE {
+                self.nodes[n].child[bit] = self.nodes.len() as u32;
+                self.nodes.push(Node::default());
+            }
+
+            n = self.nodes[n].child[bit] as usize;
+        }
+
+        n
+    }
+
+    fn port_match(&self, set: u32, port: u32) -> Option<u32> {
+        if set == NONE {
+            return None;
+        }
+
+        let (start, len) = self.sets[set as usize];
+        let ranges = &self.ranges[start as usize..(start + len) as usize];
+        let i = ranges.partition_point(|r| r.lo <= port);
+        match i.checked_sub(1).map(|i| ranges[i]) {
+            Some(r) if port <= r.hi => Some(r.alg),
+            _ => None,
+        }
+    }
+
+    /// The algorithm for a flow to `dst_ip` and `dst_port`, as the create message gives them, if
+    /// a rule matches.
+    pub fn lookup(&self, dst_ip: u32, dst_port: u32) -> Option<&str> {
+        let addr = u32::from_be_bytes(dst_ip.to_le_bytes());
+        let mut best = self.port_match(self.nodes[0].ports, dst_port);
+        let mut n = 0;
+        for depth in 0..32 {
+            let bit = ((addr >> (31 - depth)) & 1) as usize;
+            n = match self.nodes[n].child[bit] {
+                NONE => break,
+                c => c as usize,
+            };
+
+            if let Some(alg) = self.port_match(self.nodes[n].ports, dst_port) {
+                best = Some(alg);
+            }
+        }
+
+        best.map(|a| self.algs[a as usize].as_str())
+    }
+
+    /// The number of rules in the table.
+    pub fn len(&self) -> usize {
+        self.rules
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.rules == 0
+    }
+}
+
+/// A policy that can be replaced while runtimes use it. Clones share the same policy.
+#[derive(Clone, Debug)]
+pub struct PolicyHandle(Arc<(AtomicU64, Mutex<Arc<Policy>>)>);
+
+impl PolicyHandle {
+    pub fn new(policy: Policy) -> Self {
+        PolicyHandle(Arc::new((AtomicU64::new(0), Mutex::new(Arc::new(policy)))))
+    }
+
+    /// Use `policy` for the flows created from now on.
+    pub fn store(&self, policy: Policy) {
+        *(self.0).1.lock().unwrap() = Arc::new(policy);
+        (self.0).0.fetch_add(1, Ordering::Release);
+    }
+
+    /// Read the table at `path` again, and use it from now on. If it does not compile, the
+    /// current policy stays.
+    pub fn reload(&self, path: impl AsRef<Path>) -> Result<()> {
+        let policy = Policy::load(path.as_ref())?;
+        info!(path = ?path.as_ref(), rules = policy.len(), "reloaded policy");
+        self.store(policy);
+        Ok(())
+    }
+
+    /// The policy in use.
+    pub fn current(&self) -> Arc<Policy> {
+        (self.0).1.lock().unwrap().clone()
+    }
+
+    fn version(&self) -> u64 {
+        (self.0).0.load(Ordering::Acquire)
+    }
+}
+
+// A runtime's copy of the policy in a `PolicyHandle`, which takes the lock only after a reload.
+pub(crate) struct PolicyCache {
+    handle: PolicyHandle,
+    version: u64,
+    policy: Arc<Policy>,
+}
+
+impl PolicyCache {
+    pub(crate) fn new(handle: PolicyHandle) -> Self {
+        let version = handle.version();
+        let policy = handle.current();
+        PolicyCache {
+            handle,
+            version,
+            policy,
+        }
+    }
+
+    pub(crate) fn refresh(&mut self) {
+        let version = self.handle.version();
+        if version != self.version {
+            self.policy = self.handle.current();
+            self.version = version;
+        }
+    }
+
+    pub(crate) fn lookup(&self, dst_ip: u32, dst_port: u32) -> Option<&str> {
+        self.policy.lookup(dst_ip, dst_port)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Policy, PolicyCache, PolicyHandle};
+
+    fn ip(a: u8, b: u8, c: u8, d: u8) -> u32 {
+        u32::from_le_bytes([a, b, c, d])
+    }
+
+    #[test]
+    fn longest_prefix_then_first_rule() {
+        let p = Policy::parse(
+            "
+            # dst          ports      alg
+            10.0.0.0/8     *          bbr
+            10.1.0.0/16    443        cubic
+            10.1.0.0/16    400-500    vegas   # 443 is cubic's
+            10.1.2.3       *          copa
+            *              8000-8100  reno
+            ",
+        )
+        .unwrap();
+        assert_eq!(p.len(), 5);
+
+        assert_eq!(p.lookup(ip(10, 9, 9, 9), 80), Some("bbr"));
+        assert_eq!(p.lookup(ip(10, 1, 9, 9), 443), Some("cubic"));
+        assert_eq!(p.lookup(ip(10, 1, 9, 9), 442), Some("vegas"));
+        assert_eq!(p.lookup(ip(10, 1, 9, 9), 444), Some("vegas"));
+        // no port matches in 10.1/16, so the shorter prefix applies.
+        assert_eq!(p.lookup(ip(10, 1, 9, 9), 80), Some("bbr"));
+        assert_eq!(p.lookup(ip(10, 1, 2, 3), 443), Some("copa"));
+        assert_eq!(p.lookup(ip(192, 168, 0, 1), 8050), Some("reno"));
+        assert_eq!(p.lookup(ip(192, 168, 0, 1), 80), None);
+        assert_eq!(p.lookup(ip(10, 1, 9, 9), 8050), Some("bbr"));
+    }
+
+    #[test]
+    fn bad_lines() {
+        for table in &[
+            "10.0.0.0/33 * bbr",
+            "10.0.0/8 * bbr",
+            "* 500-400 bbr",
+            "* 70000 bbr",
+            "* * bbr extra",
+        ] {
+            let e = Policy::parse(table).unwrap_err();
+            assert!(e.0.starts_with("policy line 1:"), "{}: {}", table, e.0);
+        }
+    }
+
+    #[test]
+    fn reload_reaches_caches() {
+        let h = PolicyHandle::new(Policy::parse("* * bbr").unwrap());
+        let mut cache = PolicyCache::new(h.clone());
+        assert_eq!(cache.lookup(0, 0), Some("bbr"));
+
+        h.store(Policy::parse("* * cubic").unwrap());
+        assert_eq!(cache.lookup(0, 0), Some("bbr"));
+        cache.refresh();
+        assert_eq!(cache.lookup(0, 0), Some("cubic"));
+    }
+}
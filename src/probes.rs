@@ -0,0 +1,34 @@
+//! USDT (statically defined) tracepoints, for profiling with `bpftrace`, `perf` or SystemTap
+//! without rebuilding or turning up `tracing` levels.
+//!
+//! Each probe compiles to a single `nop` plus an entry in the binary's `.note.stapsdt` section,
+//! so it costs nothing until a tracer attaches. All probes are under the `portus` provider; list
+//! them with `readelf -n <binary>` or `bpftrace -l 'usdt:<binary>:portus:*'`.
+//!
+//! Addresses are passed as a pointer and a length, and are empty for connection-oriented IPC:
+//!
+//! ```text
+//! bpftrace -e 'usdt:./target/release/ccp:portus:send { printf("%d bytes to %s\n", arg0, str(arg1, arg2)); }'
+//! ```
+
+/// Every probe, with its arguments in order.
+pub const CATALOG: &[(&str, &[&str])] = &[
+    // A read from the IPC socket, which may hold several messages.
+    ("recv", &["len", "addr", "addr_len"]),
+    // A message from the datapath, before it is dispatched.
+    ("msg", &["typ", "sid", "len"]),
+    ("create", &["sid", "init_cwnd", "mss"]),
+    ("close", &["sid"]),
+    // Around a flow's `on_report`.
+    ("dispatch_begin", &["sid", "num_fields"]),
+    ("dispatch_end", &["sid"]),
+    // A message to the datapath.
+    ("send", &["len", "addr", "addr_len"]),
+];
+
+// Fire a probe in the `portus` provider; arguments are passed as machine words.
+macro_rules! usdt {
+    ($name:ident $(, $arg:expr)*) => {
+        probe::probe!(portus, $name $(, ($arg) as usize)*)
+    };
+}
@@ -0,0 +1,509 @@
+//! Several versions of an algorithm sharing one datapath, for upgrades that keep flows running.
+//!
+//! A `Reloader` sits between the datapath's IPC socket and a list of *generations*, each one
+//! runtime of one version of the algorithm. The newest generation gets every new flow; each
+//! existing flow keeps reporting to the generation that created it, unless it migrates to the
+//! newest one through `Flow::export_state` and `CongAlg::import_flow`. A generation other than the
+//! newest is dropped (and so unloaded, for a shared library) once its last flow ends.
+//!
+//! Generations send to the datapath themselves, so the `Reloader` only routes what the datapath
+//! sends. Generations loaded from separate copies of portus must not share program uids; see
+//! `lang::set_program_uid_base`.
+
+use super::run::DirectRuntime;
+use super::serialize::{self, batch_measure, create, measure, ready, BatchMeasureView, RawMsg};
+use super::{CongAlg, Error, Result};
+use crate::ipc::direct;
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use tracing::{debug, info, warn};
+
+/// One version of an algorithm, running against the datapath.
+pub trait Generation {
+    /// Handle one message from the datapath.
+    fn recv_msg(&mut self, msg: &[u8]) -> Result<()>;
+
+    /// The state of flow `sid`, if it can move to a newer generation.
+    fn export_flow(&mut self, sid: u32) -> Option<Vec<u8>>;
+
+    /// Take over a flow exported by an older generation. `create` is the flow's create message.
+    /// Returns false if this generation declined the flow.
+    fn import_flow(&mut self, create: &[u8], state: &[u8]) -> Result<bool>;
+
+    /// Forget flow `sid`, which a newer generation has taken over.
+    fn remove_flow(&mut self, sid: u32);
+}
+
+impl<A: CongAlg<direct::Socket>> Generation for DirectRuntime<A> {
+    fn recv_msg(&mut self, msg: &[u8]) -> Result<()> {
+        DirectRuntime::recv_msg(self, msg).map(|_| ())
+    }
+
+    fn export_flow(&mut self, sid: u32) -> Option<Vec<u8>> {
+        DirectRuntime::export_flow(self, sid)
+    }
+
+    fn import_flow(&mut self, create: &[u8], state: &[u8]) -> Result<bool> {
+        DirectRuntime::import_flow(self, create, state)
+    }
+
+    fn remove_flow(&mut self, sid: u32) {
+        DirectRuntime::remove_flow(self, sid);
+    }
+}
+
+struct Flow {
+    generation: usize,
+    create: Vec<u8>,
+}
+
+/// Routes datapath messages among generations.
+pub struct Reloader<G: Generation> {
+    // (id, generation), oldest first. The last one gets new flows.
+    generations: Vec<(usize, G)>,
+    next_id: usize,
+    flows: HashMap<u32, Flow>,
+    // whether the datapath has sent ready, so that new generations should install their programs.
+    ready: bool,
+}
+
+impl<G: Generation> Default for Reloader<G> {
+    fn default() -> Self {
+        Reloader {
+            generations: vec![],
+            next_id: 0,
+            flows: HashMap::new(),
+            ready: false,
+        }
+    }
+}
+
+impl<G: Generation> Reloader<G> {
+    pub fn new() -> Self {
+        Default::default()
+    }
+
+    /// Start routing new flows to `g`, and return its id.
+    ///
+    /// If the datapath is already up, `g` is sent a ready message so that it installs its
+    /// programs. With `migrate`, every existing flow is then offered to `g`; the flows it
+    /// accepts leave their old generations, and generations left without flows are dropped.
+    pub fn add_generation(&mut self, mut g: G, migrate: bool) -> Result<usize> {
+        if self.ready {
+            g.recv_msg(&serialize::serialize(&ready::Msg { id: 0 })?)?;
+        }
+
+        let id = self.next_id;
+        self.next_id += 1;
+        self.generations.push((id, g));
+        info!(generation = id, "loaded new generation");
+
+        if migrate {
+            let mut sids: Vec<u32> = self
+                .flows
+                .iter()
+                .filter(|(_, f)| f.generation != id)
+                .map(|(sid, _)| *sid)
+                .collect();
+            sids.sort_unstable();
+            for sid in sids {
+                self.migrate(sid, id)?;
+            }
+        }
+
+        self.unload_drained();
+        Ok(id)
+    }
+
+    fn migrate(&mut self, sid: u32, to: usize) -> Result<()> {
+        let from = self.flows[&sid].generation;
+        let state = match self.generation(from).and_then(|g| g.export_flow(sid)) {
+            Some(state) => state,
+            None => {
+                debug!(
+                    sid,
+                    generation = from,
+                    "flow does not export its state, not migrating"
+                );
+                return Ok(());
+            }
+        };
+
+        let create = &self.flows[&sid].create;
+        let new = self
+            .generations
+            .iter_mut()
+            .find(|(i, _)| *i == to)
+            .map(|(_, g)| g)
+            .ok_or_else(|| Error(format!("no generation {}", to)))?;
+        if new.import_flow(create, &state)? {
+            if let Some(old) = self.generation(from) {
+                old.remove_flow(sid);
+            }
+
+            self.flows.get_mut(&sid).unwrap().generation = to;
+            debug!(sid, from, to, "migrated flow");
+        } else {
+            debug!(sid, generation = to, "new generation declined flow");
+        }
+
+        Ok(())
+    }
+
+    fn generation(&mut self, id: usize) -> Option<&mut G> {
+        self.generations
+            .iter_mut()
+            .find(|(i, _)| *i == id)
+            .map(|(_, g)| g)
+    }
+
+    fn newest(&mut self) -> Result<(usize, &mut G)> {
+        self.generations
+            .last_mut()
+            .map(|(id, g)| (*id, g))
+            .ok_or_else(|| Error(String::from("no algorithm generation loaded")))
+    }
+
+    // Drop every generation but the newest that has no flows left.
+    fn unload_drained(&mut self) {
+        let newest = match self.generations.last() {
+            Some((id, _)) => *id,
+            None => return,
+        };
+
+        let flows = &self.flows;
+        self.generations.retain(|(id, _)| {
+            let keep = *id == newest || flows.values().any(|f| f.generation == *id);
+            if !keep {
+                info!(generation = id, "generation drained, unloading");
+            }
+
+            keep
+        });
+    }
+
+    /// The ids of the loaded generations, oldest first, and how many flows each has.
+    pub fn generations(&self) -> Vec<(usize, usize)> {
+        self.generations
+            .iter()
+            .map(|(id, _)| {
+                let n = self.flows.values().filter(|f| f.generation == *id).count();
+                (*id, n)
+            })
+            .collect()
+    }
+
+    /// Route every message in `buf`, which may hold several back-to-back messages.
+    ///
+    /// A generation's error handling a message is logged, and routing continues. Only a message
+    /// that cannot be parsed or routed at all stops it.
+    pub fn recv(&mut self, buf: &[u8]) -> Result<()> {
+        let mut read = 0;
+        while read < buf.len() {
+            let raw = RawMsg::parse(&buf[read..])?;
+            let msg = &buf[read..read + raw.len as usize];
+            read += raw.len as usize;
+            self.route(raw, msg)?;
+        }
+
+        self.unload_drained();
+        Ok(())
+    }
+
+    fn route(&mut self, raw: RawMsg, msg: &[u8]) -> Result<()> {
+        match raw.typ {
+            ready::READY => {
+                // the datapath (re)started: every generation reinstalls, and all flows are gone.
+                self.ready = true;
+                self.flows.clear();
+                for (id, g) in &mut self.generations {
+                    deliver(*id, g, msg);
+                }
+            }
+            create::CREATE => {
+                if let Some(old) = self.flows.remove(&raw.sid) {
+                    if let Some(g) = self.generation(old.generation) {
+                        g.remove_flow(raw.sid);
+                    }
+                }
+
+                let (id, g) = self.newest()?;
+                deliver(id, g, msg);
+                self.flows.insert(
+                    raw.sid,
+                    Flow {
+                        generation: id,
+                        create: msg.to_vec(),
+                    },
+                );
+            }
+            measure::MEASURE => {
+                let id = self.owner(raw.sid)?;
+                if let Some(g) = self.generation(id) {
+                    deliver(id, g, msg);
+                }
+
+                // no fields: the flow ended.
+                if raw.payload().get(4..8).map_or(false, |n| n == [0; 4]) {
+                    self.flows.remove(&raw.sid);
+                }
+            }
+            batch_measure::BATCH_MEASURE => self.route_batch(BatchMeasureView::new(&raw)?)?,
+            _ => {
+                let (id, g) = self.newest()?;
+                deliver(id, g, msg);
+            }
+        }
+
+        Ok(())
+    }
+
+    // The generation of flow `sid`, or the newest for flows this `Reloader` has not seen.
+    fn owner(&mut self, sid: u32) -> Result<usize> {
+        match self.flows.get(&sid) {
+            Some(f) => Ok(f.generation),
+            None => self.newest().map(|(id, _)| id),
+        }
+    }
+
+    // Split a batch by generation, keeping each generation's reports in order.
+    fn route_batch(&mut self, batch: BatchMeasureView) -> Result<()> {
+        let mut per_gen: Vec<(usize, Vec<measure::Msg>)> = vec![];
+        for r in batch {
+            let id = self.owner(r.sid())?;
+            if r.num_fields() == 0 {
+                self.flows.remove(&r.sid());
+            }
+
+            let r = measure::Msg::try_from(r)?;
+            match per_gen.iter_mut().find(|(g, _)| *g == id) {
+                Some((_, reports)) => reports.push(r),
+                None => per_gen.push((id, vec![r])),
+            }
+        }
+
+        for (id, reports) in per_gen {
+            let msg = serialize::serialize(&batch_measure::Msg {
+                num_reports: reports.len() as u32,
+                reports,
+            })?;
+            if let Some(g) = self.generation(id) {
+                deliver(id, g, &msg);
+            }
+        }
+
+        Ok(())
+    }
+}
+
+// A generation that fails to handle a message only affects its own flows, so log the error and
+// keep routing to the others.
+fn deliver<G: Generation>(id: usize, g: &mut G, msg: &[u8]) {
+    if let Err(e) = g.recv_msg(msg) {
+        warn!(generation = id, err = ?e, "generation failed to handle message");
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Generation, Reloader};
+    use crate::serialize::{self, create, measure, ready, Msg};
+    use crate::{Error, Result};
+    use std::cell::RefCell;
+    use std::collections::HashMap;
+    use std::rc::Rc;
+
+    // Records what it is sent; its flows export their sid as their state.
+    #[derive(Default)]
+    struct TestGen {
+        log: Rc<RefCell<Vec<String>>>,
+        flows: HashMap<u32, Vec<u64>>,
+        accept: bool,
+    }
+
+    impl Generation for TestGen {
+        fn recv_msg(&mut self, msg: &[u8]) -> Result<()> {
+            let entry = match Msg::from_buf(msg)?.0 {
+                Msg::Rdy(_) => String::from("ready"),
+                Msg::Cr(c) => {
+                    self.flows.insert(c.sid(), vec![]);
+                    format!("create {}", c.sid())
+                }
+                Msg::Ms(m) => {
+                    self.flows
+                        .get_mut(&m.sid())
+                        .ok_or_else(|| Error(format!("unknown flow {}", m.sid())))?
+                        .extend(m.fields());
+                    format!("measure {}", m.sid())
+                }
+                Msg::BatchMs(b) => {
+                    let sids: Vec<String> = b.iter().map(|r| r.sid().to_string()).collect();
+                    format!("batch {}", sids.join(","))
+                }
+                _ => String::from("other"),
+            };
+
+            self.log.borrow_mut().push(entry);
+            Ok(())
+        }
+
+        fn export_flow(&mut self, sid: u32) -> Option<Vec<u8>> {
+            self.flows.get(&sid).map(|_| sid.to_le_bytes().to_vec())
+        }
+
+        fn import_flow(&mut self, create: &[u8], state: &[u8]) -> Result<bool> {
+            if let (Msg::Cr(c), true) = (Msg::from_buf(create)?.0, self.accept) {
+                assert_eq!(state, &c.sid().to_le_bytes()[..]);
+                self.flows.insert(c.sid(), vec![]);
+                self.log.borrow_mut().push(format!("import {}", c.sid()));
+                return Ok(true);
+            }
+
+            Ok(false)
+        }
+
+        fn remove_flow(&mut self, sid: u32) {
+            self.flows.remove(&sid);
+        }
+    }
+
+    fn gen(accept: bool) -> (TestGen, Rc<RefCell<Vec<String>>>) {
+        let log = Rc::new(RefCell::new(vec![]));
+        (
+            TestGen {
+                log: log.clone(),
+                flows: HashMap::new(),
+                accept,
+            },
+            log,
+        )
+    }
+
+    fn create(sid: u32) -> Vec<u8> {
+        serialize::serialize(&create::Msg {
+            sid,
+            init_cwnd: 14480,
+            mss: 1448,
+            src_ip: 0,
+            src_port: 0,
+            dst_ip: 0,
+            dst_port: 0,
+            cong_alg: None,
+        })
+        .unwrap()
+    }
+
+    fn measure(sid: u32, fields: Vec<u64>) -> Vec<u8> {
+        serialize::serialize(&measure::Msg {
+            sid,
+            program_uid: 1,
+            num_fields: fields.len() as u8,
+            fields,
+        })
+        .unwrap()
+    }
+
+    fn log(l: &Rc<RefCell<Vec<String>>>) -> Vec<String> {
+        l.borrow_mut().drain(..).collect()
+    }
+
+    #[test]
+    fn new_flows_to_newest_and_drain() {
+        let mut r = Reloader::new();
+        let (g0, l0) = gen(false);
+        r.add_generation(g0, false).unwrap();
+        r.recv(&serialize::serialize(&ready::Msg { id: 0 }).unwrap())
+            .unwrap();
+        r.recv(&create(1)).unwrap();
+        assert_eq!(log(&l0), vec!["ready", "create 1"]);
+
+        // the new generation installs its programs; flow 1 stays put.
+        let (g1, l1) = gen(false);
+        r.add_generation(g1, true).unwrap();
+        assert_eq!(log(&l1), vec!["ready"]);
+        r.recv(&create(2)).unwrap();
+        let mut both = measure(1, vec![10]);
+        both.extend(measure(2, vec![20]));
+        r.recv(&both).unwrap();
+        assert_eq!(log(&l0), vec!["measure 1"]);
+        assert_eq!(log(&l1), vec!["create 2", "measure 2"]);
+        assert_eq!(r.generations(), vec![(0, 1), (1, 1)]);
+
+        // a batch is split between the generations.
+        r.recv(
+            &serialize::serialize(&serialize::batch_measure::Msg {
+                num_reports: 2,
+                reports: vec![
+                    measure::Msg {
+                        sid: 2,
+                        program_uid: 1,
+                        num_fields: 1,
+                        fields: vec![21],
+                    },
+                    measure::Msg {
+                        sid: 1,
+                        program_uid: 1,
+                        num_fields: 0,
+                        fields: vec![],
+                    },
+                ],
+            })
+            .unwrap(),
+        )
+        .unwrap();
+        assert_eq!(log(&l0), vec!["batch 1"]);
+        assert_eq!(log(&l1), vec!["batch 2"]);
+
+        // flow 1 ended, so generation 0 is unloaded.
+        assert_eq!(r.generations(), vec![(1, 1)]);
+    }
+
+    #[test]
+    fn generation_error_does_not_stop_routing() {
+        let mut r = Reloader::new();
+        let (g0, l0) = gen(false);
+        r.add_generation(g0, false).unwrap();
+        r.recv(&serialize::serialize(&ready::Msg { id: 0 }).unwrap())
+            .unwrap();
+        r.recv(&create(1)).unwrap();
+        let (g1, l1) = gen(false);
+        r.add_generation(g1, false).unwrap();
+        r.recv(&create(2)).unwrap();
+        log(&l0);
+        log(&l1);
+
+        // generation 1 does not know flow 3, but the measurements after it are still routed.
+        let mut buf = measure(3, vec![30]);
+        buf.extend(measure(1, vec![10]));
+        buf.extend(measure(2, vec![20]));
+        r.recv(&buf).unwrap();
+        assert_eq!(log(&l0), vec!["measure 1"]);
+        assert_eq!(log(&l1), vec!["measure 2"]);
+    }
+
+    #[test]
+    fn migrate() {
+        let mut r = Reloader::new();
+        let (g0, _l0) = gen(false);
+        r.add_generation(g0, false).unwrap();
+        r.recv(&serialize::serialize(&ready::Msg { id: 0 }).unwrap())
+            .unwrap();
+        r.recv(&create(1)).unwrap();
+        r.recv(&create(2)).unwrap();
+
+        // a generation that declines keeps the old one loaded.
+        let (g1, l1) = gen(false);
+        r.add_generation(g1, true).unwrap();
+        assert_eq!(log(&l1), vec!["ready"]);
+        assert_eq!(r.generations(), vec![(0, 2), (1, 0)]);
+
+        // this one takes both flows, and both older generations go.
+        let (g2, l2) = gen(true);
+        r.add_generation(g2, true).unwrap();
+        assert_eq!(log(&l2), vec!["ready", "import 1", "import 2"]);
+        assert_eq!(r.generations(), vec![(2, 2)]);
+
+        r.recv(&measure(1, vec![10])).unwrap();
+        assert_eq!(log(&l2), vec!["measure 1"]);
+    }
+}
@@ -1,15 +1,26 @@
 //! Utilities to start a CCP processing worker.
 
-use crate::ipc::BackendBuilder;
-use crate::ipc::Ipc;
+use crate::async_flow;
+use crate::checkpoint::{self, Checkpointer, SavedFlow, SavedProgram, Snapshot};
+use crate::clock::{Clock, SystemClock};
+use crate::ipc::{direct, unix, Ipc};
+use crate::ipc::{Backend, BackendBuilder, BackendSender};
 use crate::lang::Scope;
+use crate::latency::{LoopLatency, LoopTimer};
+use crate::policy::{PolicyCache, PolicyHandle};
 use crate::serialize;
-use crate::serialize::Msg;
+use crate::serialize::{CreateView, MeasureView, Msg};
+use crate::shadow::{Shadow, ShadowAlg, ShadowFlow, ShadowStats};
+use crate::upgrade;
 use crate::{lang, CongAlg, Datapath, DatapathInfo, Error, Flow, Report, Result};
+use std::cell::RefCell;
 use std::collections::HashMap;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::path::PathBuf;
 use std::rc::Rc;
 use std::sync::{atomic, Arc};
 use std::thread;
+use std::time::{Duration, Instant};
 use tracing::{debug, info};
 
 /// A handle to manage running instances of the CCP execution loop.
@@ -76,6 +87,14 @@ mod sealed {
                 Right(r) => r.close(),
             }
         }
+
+        fn export_state(&self) -> Option<Vec<u8>> {
+            use Either::*;
+            match self {
+                Left(l) => l.export_state(),
+                Right(r) => r.export_state(),
+            }
+        }
     }
 
     impl<L, R, I> CongAlg<I> for Either<L, R>
@@ -105,6 +124,19 @@ mod sealed {
                 Right(r) => Right(r.new_flow(control, info)),
             }
         }
+
+        fn import_flow(
+            &self,
+            control: Datapath<I>,
+            info: DatapathInfo,
+            state: &[u8],
+        ) -> Option<Self::Flow> {
+            use Either::*;
+            match self {
+                Left(l) => l.import_flow(control, info, state).map(Left),
+                Right(r) => r.import_flow(control, info, state).map(Right),
+            }
+        }
     }
 
     impl<T, I> CongAlg<I> for &T
@@ -125,11 +157,22 @@ mod sealed {
         fn new_flow(&self, control: Datapath<I>, info: DatapathInfo) -> Self::Flow {
             T::new_flow(self, control, info)
         }
+
+        fn import_flow(
+            &self,
+            control: Datapath<I>,
+            info: DatapathInfo,
+            state: &[u8],
+        ) -> Option<Self::Flow> {
+            T::import_flow(self, control, info, state)
+        }
     }
 
     pub trait Pick<'a, I: Ipc> {
         type Picked: CongAlg<I> + 'a;
         fn pick(&'a self, name: &str) -> Self::Picked;
+        /// The `CongAlg::name()` of the algorithm `pick(name)` returns.
+        fn picked_name(&'a self, name: &str) -> &'static str;
     }
 
     impl<'a, I: Ipc, T: CongAlg<I> + 'a> Pick<'a, I> for AlgListNil<T> {
@@ -137,6 +180,9 @@ mod sealed {
         fn pick(&'a self, _: &str) -> Self::Picked {
             &self.0
         }
+        fn picked_name(&'a self, _: &str) -> &'static str {
+            T::name()
+        }
     }
 
     impl<'a, I: Ipc, T: CongAlg<I> + 'a> Pick<'a, I> for &'a AlgListNil<T> {
@@ -144,6 +190,9 @@ mod sealed {
         fn pick(&'a self, _: &str) -> Self::Picked {
             &self.0
         }
+        fn picked_name(&'a self, _: &str) -> &'static str {
+            T::name()
+        }
     }
 
     impl<'a, I: Ipc, T: CongAlg<I> + 'a, U> Pick<'a, I> for AlgList<Option<T>, U>
@@ -158,6 +207,12 @@ mod sealed {
                 _ => Either::Right(self.tail.pick(name)),
             }
         }
+        fn picked_name(&'a self, name: &str) -> &'static str {
+            match self.head {
+                Some(_) if self.head_name == name => T::name(),
+                _ => self.tail.picked_name(name),
+            }
+        }
     }
 
     impl<'a, I: Ipc, T: CongAlg<I> + 'a, U> Pick<'a, I> for &'a AlgList<Option<T>, U>
@@ -172,6 +227,12 @@ mod sealed {
                 _ => Either::Right(self.tail.pick(name)),
             }
         }
+        fn picked_name(&'a self, name: &str) -> &'static str {
+            match self.head {
+                Some(_) if self.head_name == name => T::name(),
+                _ => self.tail.picked_name(name),
+            }
+        }
     }
 
     pub trait CollectDps<I> {
@@ -333,9 +394,41 @@ pub struct RunBuilder<I: Ipc, U, Spawnness> {
     backend_builder: BackendBuilder<I>,
     alg: U,
     stop_handle: Option<*const atomic::AtomicBool>,
+    opts: RunOptions<I>,
     _phantom: std::marker::PhantomData<Spawnness>,
 }
 
+// Everything about how `run_inner` runs besides its socket and algorithms, set by `RunBuilder`.
+struct RunOptions<I: Ipc> {
+    loop_latency: Option<LoopLatency>,
+    clock: Arc<dyn Clock>,
+    recv_timeout: Option<Duration>,
+    checkpoint: Option<(PathBuf, Duration)>,
+    // where a successor asks for this runtime's socket, and what a predecessor handed over.
+    upgrade: Option<upgrade::Listener>,
+    handoff: Option<Snapshot>,
+    shadow: Option<(Box<dyn ShadowAlg<I>>, f64, ShadowStats)>,
+    policy: Option<PolicyHandle>,
+    // the maximum age and default program of lazy flows.
+    lazy: Option<(Duration, &'static str)>,
+}
+
+impl<I: Ipc> Default for RunOptions<I> {
+    fn default() -> Self {
+        RunOptions {
+            loop_latency: None,
+            clock: Arc::new(SystemClock),
+            recv_timeout: None,
+            checkpoint: None,
+            upgrade: None,
+            handoff: None,
+            shadow: None,
+            policy: None,
+            lazy: None,
+        }
+    }
+}
+
 pub struct Spawn;
 pub struct NoSpawn;
 
@@ -345,6 +438,7 @@ impl<I: Ipc> RunBuilder<I, (), NoSpawn> {
             backend_builder,
             alg: (),
             stop_handle: None,
+            opts: Default::default(),
             _phantom: Default::default(),
         }
     }
@@ -360,6 +454,7 @@ impl<I: Ipc, S> RunBuilder<I, (), S> {
             alg: AlgListNil(alg),
             backend_builder: self.backend_builder,
             stop_handle: self.stop_handle,
+            opts: self.opts,
             _phantom: Default::default(),
         }
     }
@@ -373,16 +468,7 @@ impl<I: Ipc, U, S> RunBuilder<I, U, S> {
         self,
         alg: O,
     ) -> RunBuilder<I, AlgList<Option<A>, U>, S> {
-        RunBuilder {
-            alg: AlgList {
-                head_name: A::name().to_owned(),
-                head: alg.into(),
-                tail: self.alg,
-            },
-            backend_builder: self.backend_builder,
-            stop_handle: self.stop_handle,
-            _phantom: Default::default(),
-        }
+        self.try_additional_alg(alg.into())
     }
 
     pub fn try_additional_alg<A: CongAlg<I>>(
@@ -397,6 +483,7 @@ impl<I: Ipc, U, S> RunBuilder<I, U, S> {
             },
             backend_builder: self.backend_builder,
             stop_handle: self.stop_handle,
+            opts: self.opts,
             _phantom: Default::default(),
         }
     }
@@ -409,6 +496,75 @@ impl<I: Ipc, U, S> RunBuilder<I, U, S> {
         }
     }
 
+    /// Record the control-loop delay of every flow into `stats`; see `latency`.
+    pub fn with_loop_latency(mut self, stats: LoopLatency) -> Self {
+        self.opts.loop_latency = Some(stats);
+        self
+    }
+
+    /// Read the time from `clock` rather than the system clock; see `clock`.
+    pub fn with_clock<C: Clock>(mut self, clock: C) -> Self {
+        self.opts.clock = Arc::new(clock);
+        self
+    }
+
+    /// Stop, with an error, if the datapath sends nothing for `timeout` by the runtime's clock.
+    ///
+    /// See `Backend::with_recv_timeout`.
+    pub fn with_recv_timeout(mut self, timeout: Duration) -> Self {
+        self.opts.recv_timeout = Some(timeout);
+        self
+    }
+
+    /// Checkpoint the flows to the file at `path` every `interval` by the runtime's clock, and
+    /// restore the flows in it when starting; see `checkpoint`.
+    pub fn with_checkpoint(mut self, path: impl Into<PathBuf>, interval: Duration) -> Self {
+        self.opts.checkpoint = Some((path.into(), interval));
+        self
+    }
+
+    /// Continue from the runtime whose socket `upgrade::take_over` returned, given the snapshot
+    /// it returned along with it; see `upgrade`.
+    pub fn taking_over(mut self, snap: Snapshot) -> Self {
+        self.opts.handoff = Some(snap);
+        self
+    }
+
+    /// Run `alg` in shadow alongside the algorithm controlling each flow, recording how their
+    /// decisions and costs compare into `stats`; see `shadow`.
+    ///
+    /// The shadow may use up to `cpu_share` (e.g. 0.1) of the control thread's time; reports
+    /// beyond that are not handed to it.
+    pub fn with_shadow_alg<A>(mut self, alg: A, cpu_share: f64, stats: ShadowStats) -> Self
+    where
+        A: CongAlg<I> + Send + 'static,
+        A::Flow: 'static,
+    {
+        self.opts.shadow = Some((Box::new(alg), cpu_share, stats));
+        self
+    }
+
+    /// Choose each new flow's algorithm by its destination with `policy`, rather than only by
+    /// the name the datapath asks for; see `policy`.
+    pub fn with_policy(mut self, policy: PolicyHandle) -> Self {
+        self.opts.policy = Some(policy);
+        self
+    }
+
+    /// Create each flow's `Flow` only when the flow first reports, or once it is `max_age` old,
+    /// rather than when the datapath creates the flow. Flows that end before either never get
+    /// one: the algorithm's `new_flow` is not called, and so neither is `close`.
+    ///
+    /// Until then, the runtime keeps only the flow's `DatapathInfo`, and sets the flow's program
+    /// to `default_program`, one of the algorithms' `datapath_programs`, so that the flow reports.
+    /// A flow's first report therefore comes from the default program rather than one it set.
+    /// Age is checked as messages arrive and while the runtime waits for them. Flows not yet
+    /// created are not checkpointed.
+    pub fn with_lazy_flows(mut self, max_age: Duration, default_program: &'static str) -> Self {
+        self.opts.lazy = Some((max_age, default_program));
+        self
+    }
+
     /// Pass a raw pointer to an `AtomicBool` stop handle.
     ///
     /// # Safety
@@ -436,6 +592,15 @@ impl<I: Ipc, U, S> RunBuilder<I, U, S> {
     }
 }
 
+impl<T: 'static + Sync + Send, U, S> RunBuilder<unix::Socket<T>, U, S> {
+    /// Hand the IPC socket and the flows to a successor that calls `upgrade::take_over(name)`,
+    /// instead of closing the socket when this runtime stops; see `upgrade`.
+    pub fn with_upgrade(mut self, name: &str) -> Result<Self> {
+        self.opts.upgrade = Some(upgrade::Listener::bind(name, &self.backend_builder.sock)?);
+        Ok(self)
+    }
+}
+
 impl<I: Ipc, U> RunBuilder<I, U, NoSpawn> {
     /// Spawn a thread which will perform the CCP execution loop. Returns
     /// a `CCPHandle`, which the caller can use to cause the execution loop
@@ -450,6 +615,7 @@ impl<I: Ipc, U> RunBuilder<I, U, NoSpawn> {
         RunBuilder {
             backend_builder: self.backend_builder,
             stop_handle: self.stop_handle,
+            opts: self.opts,
             alg: self.alg,
             _phantom: Default::default(),
         }
@@ -463,7 +629,7 @@ where
 {
     pub fn run(self) -> Result<()> {
         let h = self.stop_handle()?;
-        run_inner(h, self.backend_builder, self.alg)
+        run_inner(h, self.backend_builder, self.alg, self.opts)
     }
 }
 
@@ -475,173 +641,875 @@ where
 {
     pub fn run(self) -> Result<CCPHandle> {
         let stop_signal = self.stop_handle()?;
-        let bb = self.backend_builder;
-        let alg = self.alg;
+        let (bb, alg, opts) = (self.backend_builder, self.alg, self.opts);
         Ok(CCPHandle {
             continue_listening: stop_signal.clone(),
-            join_handle: thread::spawn(move || run_inner(stop_signal, bb, alg)),
+            join_handle: thread::spawn(move || run_inner(stop_signal, bb, alg, opts)),
         })
     }
 }
 
-// Main execution inner loop of ccp.
-// Blocks "forever", or until the iterator stops iterating.
-//
-// `run_inner()`:
-// 1. listens for messages from the datapath
-// 2. call the appropriate message in `U: impl CongAlg`
-// The function can return for two reasons: an error, or the iterator returned None.
-// The latter should only happen for spawn(), and not for run().
-// It returns any error, either from:
-// 1. the IPC channel failing
-// 2. Receiving an install control message (only the datapath should receive these).
-fn run_inner<I, U>(
-    continue_listening: Arc<atomic::AtomicBool>,
-    backend_builder: BackendBuilder<I>,
-    algs: U,
-) -> Result<()>
-where
-    I: Ipc,
-    for<'a> &'a U: Pick<'a, I> + CollectDps<I>,
-{
-    let mut receive_buf = [0u8; 1024];
-    let mut b = backend_builder.build(continue_listening.clone(), &mut receive_buf[..]);
-    // the borrow has to before the HashMap, to guarantee that the HashMap is dropped first
-    let algs2 = &algs;
-    let mut dp_to_flowmap = HashMap::<
-        I::Addr,
-        HashMap<u32, <<&'_ U as Pick<'_, I>>::Picked as CongAlg<I>>::Flow>,
-    >::new();
+/// A CCP execution loop driven by the caller rather than by a dedicated thread.
+///
+/// `run()` blocks in `Backend::next()` until the runtime is killed. `PollRuntime` instead
+/// exposes `poll()`, which dispatches every message that is already available on the IPC socket
+/// and then returns. Pair it with a `Nonblocking` socket, register the socket's file descriptor
+/// (see `AsRawFd`) with an external event loop, and call `poll()` whenever it is readable.
+///
+/// Unlike `RunBuilder`, a `PollRuntime` manages a single congestion control algorithm.
+pub struct PollRuntime<'a, I: Ipc, A: CongAlg<I>> {
+    backend: Backend<'a, I>,
+    sender: BackendSender<I>,
+    alg: A,
+    dispatcher: Dispatcher<I, A::Flow>,
+}
 
-    info!(ipc = ?I::name(), "starting CCP");
+impl<'a, I: Ipc, A: CongAlg<I>> PollRuntime<'a, I, A> {
+    /// Compile `alg`'s datapath programs and prepare to receive messages into `receive_buf`.
+    pub fn new(
+        backend_builder: BackendBuilder<I>,
+        alg: A,
+        receive_buf: &'a mut [u8],
+    ) -> Result<Self> {
+        let dispatcher = Dispatcher::new(alg.datapath_programs())?;
+        let backend = backend_builder.build(Arc::new(atomic::AtomicBool::new(true)), receive_buf);
+        let sender = backend.sender(Default::default());
+        info!(ipc = ?I::name(), "starting CCP");
+        Ok(PollRuntime {
+            backend,
+            sender,
+            alg,
+            dispatcher,
+        })
+    }
+
+    /// Record the control-loop delay of every flow into `stats`; see `latency`.
+    pub fn with_loop_latency(mut self, stats: LoopLatency) -> Self {
+        self.dispatcher.loop_latency = Some(stats);
+        self
+    }
+
+    /// Read the time from `clock` rather than the system clock; see `clock`.
+    pub fn with_clock<C: Clock>(mut self, clock: C) -> Self {
+        let clock: Arc<dyn Clock> = Arc::new(clock);
+        self.backend = self.backend.with_clock(clock.clone());
+        self.dispatcher.clock = clock;
+        self
+    }
+
+    /// Dispatch all currently available messages without blocking.
+    ///
+    /// Returns the number of messages handled.
+    pub fn poll(&mut self) -> Result<usize> {
+        let alg = &self.alg;
+        let mut handled = 0;
+        while let Some((msg, recv_addr, at)) = self.backend.try_next_at()? {
+            self.dispatcher.dispatch(
+                msg,
+                recv_addr,
+                at,
+                &self.sender,
+                |_| A::name(),
+                |_, dp, info| alg.new_flow(dp, info),
+                |_, dp, info, state| alg.import_flow(dp, info, state),
+            )?;
+            handled += 1;
+        }
+
+        async_flow::run_pending();
+        Ok(handled)
+    }
+
+    /// Stop dispatching messages: subsequent calls to `poll()` return immediately.
+    pub fn stop(&self) {
+        self.backend
+            .clone_atomic_bool()
+            .store(false, atomic::Ordering::SeqCst);
+    }
+}
+
+impl<'a, I: Ipc + AsRawFd, A: CongAlg<I>> AsRawFd for PollRuntime<'a, I, A> {
+    fn as_raw_fd(&self) -> RawFd {
+        self.backend.as_raw_fd()
+    }
+}
+
+/// A CCP runtime for a datapath in the same process, using the `ipc::direct` transport.
+///
+/// The datapath passes each buffer of messages to `recv_msg`, which parses and dispatches them
+/// before returning; messages to the datapath go to the `direct::Socket`'s send callback during
+/// that call. There is no runtime thread, queue, or intermediate copy.
+///
+/// Like `PollRuntime`, a `DirectRuntime` manages a single congestion control algorithm.
+pub struct DirectRuntime<A: CongAlg<direct::Socket>> {
+    sock: Rc<direct::Socket>,
+    sender: BackendSender<direct::Socket>,
+    alg: A,
+    dispatcher: Dispatcher<direct::Socket, A::Flow>,
+}
+
+impl<A: CongAlg<direct::Socket>> DirectRuntime<A> {
+    /// Compile `alg`'s datapath programs. Nothing is sent until the datapath delivers its
+    /// ready message.
+    pub fn new(sock: direct::Socket, alg: A) -> Result<Self> {
+        let dispatcher = Dispatcher::new(alg.datapath_programs())?;
+        let sock = Rc::new(sock);
+        let sender = BackendSender::from_sock(&sock, ());
+        info!(ipc = ?direct::Socket::name(), "starting CCP");
+        Ok(DirectRuntime {
+            sock,
+            sender,
+            alg,
+            dispatcher,
+        })
+    }
+
+    /// Record the control-loop delay of every flow into `stats`; see `latency`.
+    pub fn with_loop_latency(mut self, stats: LoopLatency) -> Self {
+        self.dispatcher.loop_latency = Some(stats);
+        self
+    }
+
+    /// Read the time from `clock` rather than the system clock; see `clock`.
+    pub fn with_clock<C: Clock>(mut self, clock: C) -> Self {
+        self.dispatcher.clock = Arc::new(clock);
+        self
+    }
+
+    /// Dispatch every message in `buf`, which may hold several back-to-back messages.
+    ///
+    /// Returns the number of messages handled.
+    pub fn recv_msg(&mut self, buf: &[u8]) -> Result<usize> {
+        let alg = &self.alg;
+        let at = self.dispatcher.clock.now();
+        let mut read = 0;
+        let mut handled = 0;
+        while read < buf.len() {
+            let (msg, consumed) = Msg::from_buf(&buf[read..])?;
+            self.dispatcher.dispatch(
+                msg,
+                (),
+                at,
+                &self.sender,
+                |_| A::name(),
+                |_, dp, info| alg.new_flow(dp, info),
+                |_, dp, info, state| alg.import_flow(dp, info, state),
+            )?;
+            read += consumed;
+            handled += 1;
+        }
+
+        async_flow::run_pending();
+        Ok(handled)
+    }
+
+    /// The state of flow `sid` from `Flow::export_state`, for another runtime's `import_flow`.
+    pub fn export_flow(&self, sid: u32) -> Option<Vec<u8>> {
+        self.dispatcher
+            .dp_to_flowmap
+            .get(&())
+            .and_then(|flows| flows.get(&sid))
+            .and_then(|f| f.flow.export_state())
+    }
+
+    /// Take over a flow from another runtime with `CongAlg::import_flow`.
+    ///
+    /// `create` is the datapath's create message for the flow, and `state` is what the other
+    /// runtime's `export_flow` returned. Returns false if the algorithm declined the flow.
+    pub fn import_flow(&mut self, create: &[u8], state: &[u8]) -> Result<bool> {
+        let c = match Msg::from_buf(create)?.0 {
+            Msg::Cr(c) => c,
+            _ => return Err(Error(String::from("import_flow needs a create message"))),
+        };
+
+        let alg = &self.alg;
+        self.dispatcher
+            .insert_flow(c, (), &self.sender, A::name(), |dp, info| {
+                alg.import_flow(dp, info, state)
+            })
+    }
+
+    /// Forget flow `sid` without closing it, once another runtime has taken it over.
+    pub fn remove_flow(&mut self, sid: u32) -> bool {
+        self.dispatcher
+            .flows(&())
+            .map(|flows| flows.remove(&sid).is_some())
+            .unwrap_or(false)
+    }
+
+    pub fn num_flows(&self) -> usize {
+        self.dispatcher
+            .dp_to_flowmap
+            .get(&())
+            .map_or(0, HashMap::len)
+    }
+}
+
+impl<A: CongAlg<direct::Socket>> Drop for DirectRuntime<A> {
+    fn drop(&mut self) {
+        if let Some(sock) = Rc::get_mut(&mut self.sock) {
+            sock.close().unwrap_or_else(|_| ());
+        }
+    }
+}
+
+// Flow table and compiled programs, shared by `run_inner` and `PollRuntime`.
+struct Dispatcher<I: Ipc, F: Flow> {
+    dp_to_flowmap: HashMap<I::Addr, HashMap<u32, FlowEntry<F>>>,
+    scope_map: Rc<HashMap<String, Scope>>,
+    install_msgs: Vec<Vec<u8>>,
+    loop_latency: Option<LoopLatency>,
+    clock: Arc<dyn Clock>,
+    // what a checkpoint records of the programs in `scope_map`.
+    programs: Vec<SavedProgram>,
+    // flows in the checkpoint the runtime started from that have not reported yet, and the
+    // checkpoint's programs that are unchanged, with their old uids; see `checkpoint`.
+    restored: HashMap<I::Addr, HashMap<u32, SavedFlow>>,
+    restored_programs: Vec<SavedProgram>,
+    // old program uid to the uid of the same program in `scope_map`.
+    uid_remap: HashMap<u32, u32>,
+    shadow: Option<Shadow<I>>,
+    policy: Option<PolicyCache>,
+    // with lazy flows, the flows whose `Flow` has not been created yet; see `set_lazy`.
+    lazy: Option<LazyFlows>,
+    pending: HashMap<I::Addr, HashMap<u32, PendingFlow>>,
+}
+
+// A flow, and its control-loop timer if the runtime records `LoopLatency`.
+struct FlowEntry<F> {
+    flow: F,
+    timer: Option<Rc<LoopTimer>>,
+    // for checkpoints: how the flow was created, and the `CongAlg::name()` running it.
+    info: DatapathInfo,
+    alg: &'static str,
+    shadow: Option<ShadowFlow>,
+}
+
+// What the runtime keeps of a flow until its `Flow` is created.
+struct PendingFlow {
+    info: DatapathInfo,
+    alg: &'static str,
+    created_at: Instant,
+}
 
-    let mut scope_map = Rc::new(HashMap::<String, Scope>::default());
+struct LazyFlows {
+    max_age: Duration,
+    // a changeprog to the default program, sent to each new flow with its sid patched in.
+    changeprog: Vec<u8>,
+    next_sweep: Option<Instant>,
+}
+
+// Compile `programs`, returning their scopes by name, the messages that install them, and what a
+// checkpoint records of them.
+fn compile_programs(
+    programs: &HashMap<&'static str, String>,
+) -> Result<(HashMap<String, Scope>, Vec<Vec<u8>>, Vec<SavedProgram>)> {
+    let mut scope_map = HashMap::<String, Scope>::default();
     let mut install_msgs = vec![];
+    let mut saved_programs = vec![];
 
-    let programs = algs2.datapath_programs();
     for (program_name, program) in programs.iter() {
-        match lang::compile(program.as_bytes(), &[]) {
-            Ok((bin, sc)) => {
-                let msg = serialize::install::Msg {
+        let (buf, sc) = match lang::Precompiled::find(program) {
+            // compiled by `datapath_program!` when the algorithm was built.
+            Some(p) => {
+                let sc = p.scope()?;
+                let msg = serialize::install::PrecompiledMsg {
                     sid: 0,
                     program_uid: sc.program_uid,
-                    num_events: bin.events.len() as u32,
-                    num_instrs: bin.instrs.len() as u32,
-                    instrs: bin,
+                    num_events: p.num_events(),
+                    num_instrs: p.num_instrs(),
+                    instrs: p.bin(),
                 };
-                let buf = serialize::serialize(&msg)?;
-                install_msgs.push(buf);
+                (serialize::serialize(&msg)?, sc)
+            }
+            None => match lang::compile(program.as_bytes(), &[]) {
+                Ok((bin, sc)) => {
+                    let msg = serialize::install::Msg {
+                        sid: 0,
+                        program_uid: sc.program_uid,
+                        num_events: bin.events.len() as u32,
+                        num_instrs: bin.instrs.len() as u32,
+                        instrs: bin,
+                    };
+                    (serialize::serialize(&msg)?, sc)
+                }
+                Err(e) => {
+                    return Err(Error(format!(
+                        "Datapath program \"{}\" failed to compile: {:?}",
+                        program_name, e
+                    )));
+                }
+            },
+        };
 
-                Rc::get_mut(&mut scope_map)
-                    .unwrap()
-                    .insert(program_name.to_string(), sc.clone());
+        install_msgs.push(buf);
+        saved_programs.push(SavedProgram {
+            name: program_name.to_string(),
+            program_uid: sc.program_uid,
+            digest: checkpoint::digest(program.as_bytes()),
+        });
+        scope_map.insert(program_name.to_string(), sc);
+    }
+
+    Ok((scope_map, install_msgs, saved_programs))
+}
+
+impl<I: Ipc, F: Flow> Dispatcher<I, F> {
+    fn new(programs: HashMap<&'static str, String>) -> Result<Self> {
+        let (scope_map, install_msgs, saved_programs) = compile_programs(&programs)?;
+        debug!(programs = %format!("{:#?}", programs.keys()), "compiled all datapath programs, ccp ready");
+        Ok(Dispatcher {
+            dp_to_flowmap: HashMap::new(),
+            scope_map: Rc::new(scope_map),
+            install_msgs,
+            loop_latency: None,
+            clock: Arc::new(SystemClock),
+            programs: saved_programs,
+            restored: HashMap::new(),
+            restored_programs: vec![],
+            uid_remap: HashMap::new(),
+            shadow: None,
+            policy: None,
+            lazy: None,
+            pending: HashMap::new(),
+        })
+    }
+
+    // Create flows' `Flow`s on their first report, or once they are `max_age` old, and set new
+    // flows' program to `default_program` until then.
+    fn set_lazy(&mut self, max_age: Duration, default_program: &'static str) -> Result<()> {
+        let sc = self.scope_map.get(default_program).ok_or_else(|| {
+            Error(format!(
+                "default program {:?} is not a datapath program",
+                default_program
+            ))
+        })?;
+        let changeprog = serialize::serialize(&serialize::changeprog::Msg {
+            sid: 0,
+            program_uid: sc.program_uid,
+            num_fields: 0,
+            fields: vec![],
+        })?;
+
+        self.lazy = Some(LazyFlows {
+            max_age,
+            changeprog,
+            next_sweep: None,
+        });
+        Ok(())
+    }
+
+    // Run `alg` in shadow of the flows created from here on; see `shadow`. Its programs are
+    // compiled, but not installed.
+    fn set_shadow(
+        &mut self,
+        alg: Box<dyn ShadowAlg<I>>,
+        share: f64,
+        stats: ShadowStats,
+    ) -> Result<()> {
+        let (programs, _, _) = compile_programs(&alg.datapath_programs())?;
+        self.shadow = Some(Shadow::new(alg, programs, &self.scope_map, share, stats));
+        Ok(())
+    }
+
+    // Reattach the flows in `snap` when their datapaths report on them.
+    fn restore(&mut self, snap: Snapshot) {
+        for old in snap.programs {
+            match self
+                .programs
+                .iter()
+                .find(|p| p.name == old.name && p.digest == old.digest)
+            {
+                Some(p) => {
+                    self.uid_remap.insert(old.program_uid, p.program_uid);
+                    self.restored_programs.push(old);
+                }
+                None => {
+                    debug!(program = %old.name, "checkpointed program changed, dropping its reports")
+                }
             }
-            Err(e) => {
-                return Err(Error(format!(
-                    "Datapath program \"{}\" failed to compile: {:?}",
-                    program_name, e
-                )));
+        }
+
+        for f in snap.flows {
+            match I::addr_from_bytes(&f.addr) {
+                Some(addr) => {
+                    self.restored
+                        .entry(addr)
+                        .or_default()
+                        .insert(f.create.sid, f);
+                }
+                None => debug!(
+                    sid = f.create.sid,
+                    "checkpointed flow has an invalid address"
+                ),
+            }
+        }
+    }
+
+    // The flows that export their state, including restored flows that have yet to report.
+    fn snapshot(&self) -> Snapshot {
+        let running = self.dp_to_flowmap.iter().flat_map(|(addr, flows)| {
+            flows.iter().filter_map(move |(_, e)| {
+                e.flow.export_state().map(|state| SavedFlow {
+                    addr: I::addr_bytes(addr).to_vec(),
+                    create: create_msg(&e.info, e.alg),
+                    state,
+                })
+            })
+        });
+        let pending = self
+            .restored
+            .values()
+            .flat_map(|flows| flows.values().cloned());
+        Snapshot {
+            datapaths: self
+                .dp_to_flowmap
+                .keys()
+                .map(|addr| I::addr_bytes(addr).to_vec())
+                .collect(),
+            programs: self
+                .programs
+                .iter()
+                .chain(self.restored_programs.iter())
+                .cloned()
+                .collect(),
+            flows: running.chain(pending).collect(),
+        }
+    }
+
+    // A report from a flow that still runs a program from the checkpoint carries its old uid.
+    fn program_uid(&self, uid: u32) -> u32 {
+        if self.uid_remap.is_empty() {
+            uid
+        } else {
+            self.uid_remap.get(&uid).copied().unwrap_or(uid)
+        }
+    }
+
+    // Continue from a runtime that handed its socket over. Its datapaths will not send ready
+    // again, so they get this runtime's programs now; flows are reattached as from a checkpoint.
+    fn take_over(&mut self, snap: Snapshot, sender: &BackendSender<I>) -> Result<()> {
+        for addr in snap.datapaths.iter().filter_map(|a| I::addr_from_bytes(a)) {
+            let backend = sender.clone_with_dest(addr.clone());
+            for buf in &self.install_msgs {
+                backend.send_msg(&buf[..])?;
+            }
+
+            self.dp_to_flowmap.entry(addr).or_default();
+        }
+
+        self.restore(snap);
+        Ok(())
+    }
+
+    // Take over flow `sid` from the checkpoint, if it is there and has not ended (`closed`).
+    fn reattach(
+        &mut self,
+        addr: &I::Addr,
+        sid: u32,
+        closed: bool,
+        sender: &BackendSender<I>,
+        alg_name: &impl Fn(&str) -> &'static str,
+        import_flow: &mut impl FnMut(&str, Datapath<I>, DatapathInfo, &[u8]) -> Option<F>,
+    ) -> Result<()> {
+        let saved = match self.restored.get_mut(addr).and_then(|f| f.remove(&sid)) {
+            Some(saved) => saved,
+            None => return Ok(()),
+        };
+
+        if closed || self.flows(addr)?.contains_key(&sid) {
+            return Ok(());
+        }
+
+        let requested = saved.create.cong_alg.as_deref().unwrap_or("");
+        let alg = alg_name(requested);
+        let timer = self.timer(alg);
+        let (dp, info, shadow) = flow_handles(
+            saved_flow_info(&saved.create),
+            addr.clone(),
+            sender,
+            &self.scope_map,
+            &timer,
+            self.shadow.as_ref(),
+        );
+        match import_flow(requested, dp, info.clone(), &saved.state) {
+            Some(flow) => {
+                info!(sid, alg, "restored flow from checkpoint");
+                let entry = FlowEntry {
+                    flow,
+                    timer,
+                    info,
+                    alg,
+                    shadow,
+                };
+                self.flows(addr)?.insert(sid, entry);
+            }
+            None => debug!(sid, alg, "algorithm declined checkpointed flow"),
+        }
+
+        Ok(())
+    }
+
+    fn flows(&mut self, addr: &I::Addr) -> Result<&mut HashMap<u32, FlowEntry<F>>> {
+        self.dp_to_flowmap
+            .get_mut(addr)
+            .ok_or_else(|| Error(format!("unknown datapath {:#?}", addr)))
+    }
+
+    // Add the flow `c` creates, from `make` rather than the algorithm's `new_flow`.
+    // Returns false, adding nothing, if `make` does.
+    fn insert_flow(
+        &mut self,
+        c: CreateView,
+        recv_addr: I::Addr,
+        sender: &BackendSender<I>,
+        alg: &'static str,
+        make: impl FnOnce(Datapath<I>, DatapathInfo) -> Option<F>,
+    ) -> Result<bool> {
+        let timer = self.timer(alg);
+        let (dp, info, shadow) = flow_handles(
+            flow_info(c),
+            recv_addr.clone(),
+            sender,
+            &self.scope_map,
+            &timer,
+            self.shadow.as_ref(),
+        );
+        let flowmap = self.flows(&recv_addr)?;
+        match make(dp, info.clone()) {
+            Some(flow) => {
+                let entry = FlowEntry {
+                    flow,
+                    timer,
+                    info,
+                    alg,
+                    shadow,
+                };
+                flowmap.insert(c.sid(), entry);
+                Ok(true)
             }
+            None => Ok(false),
+        }
+    }
+
+    // Record the flow `c` creates without creating its `Flow`, and set its program to the
+    // default program.
+    fn defer_flow(
+        &mut self,
+        c: CreateView,
+        recv_addr: I::Addr,
+        alg: &'static str,
+        received_at: Instant,
+        sender: &BackendSender<I>,
+    ) -> Result<()> {
+        let flowmap = match self.dp_to_flowmap.get_mut(&recv_addr) {
+            Some(fm) => fm,
+            None => {
+                debug!(addr = %format!("{:#?}", recv_addr), "received create from unknown datapath, ignoring");
+                return Ok(());
+            }
+        };
+
+        if flowmap.remove(&c.sid()).is_some() {
+            debug!(sid = ?c.sid(), "re-creating already created flow");
         }
+
+        if let Some(restored) = self.restored.get_mut(&recv_addr) {
+            restored.remove(&c.sid());
+        }
+
+        debug!(sid = ?c.sid(), alg, "deferring new flow");
+        usdt!(create, c.sid(), c.init_cwnd(), c.mss());
+        if let Some(l) = self.lazy.as_mut() {
+            l.changeprog[4..8].copy_from_slice(&c.sid().to_le_bytes());
+            sender
+                .clone_with_dest(recv_addr.clone())
+                .send_msg(&l.changeprog[..])?;
+        }
+
+        self.pending.entry(recv_addr).or_default().insert(
+            c.sid(),
+            PendingFlow {
+                info: flow_info(c),
+                alg,
+                created_at: received_at,
+            },
+        );
+        Ok(())
     }
 
-    debug!(programs = %format!("{:#?}", programs.keys()), "compiled all datapath programs, ccp ready");
-    while let Some((msg, recv_addr)) = b.next() {
+    // Create the `Flow` of pending flow `sid`, if it is pending and has not ended (`closed`).
+    fn create_pending(
+        &mut self,
+        addr: &I::Addr,
+        sid: u32,
+        closed: bool,
+        sender: &BackendSender<I>,
+        new_flow: &mut impl FnMut(&str, Datapath<I>, DatapathInfo) -> F,
+    ) -> Result<()> {
+        let p = match self.pending.get_mut(addr).and_then(|f| f.remove(&sid)) {
+            Some(p) => p,
+            None => return Ok(()),
+        };
+
+        if closed {
+            usdt!(close, sid);
+            debug!(sid, alg = p.alg, "flow ended before it was created");
+            return Ok(());
+        }
+
+        let timer = self.timer(p.alg);
+        let (dp, info, shadow) = flow_handles(
+            p.info,
+            addr.clone(),
+            sender,
+            &self.scope_map,
+            &timer,
+            self.shadow.as_ref(),
+        );
+        // `alg_name` gives back the name of an algorithm it picked.
+        let flow = new_flow(p.alg, dp, info.clone());
+        let entry = FlowEntry {
+            flow,
+            timer,
+            info,
+            alg: p.alg,
+            shadow,
+        };
+        self.flows(addr)?.insert(sid, entry);
+        Ok(())
+    }
+
+    // Create the `Flow`s of the pending flows that are at least `max_age` old at `now`. Checks
+    // a few times per `max_age`, rather than on every message.
+    fn create_aged(
+        &mut self,
+        now: Instant,
+        sender: &BackendSender<I>,
+        new_flow: &mut impl FnMut(&str, Datapath<I>, DatapathInfo) -> F,
+    ) -> Result<()> {
+        let max_age = match self.lazy.as_mut() {
+            Some(l) if l.next_sweep.map_or(true, |t| t <= now) => {
+                l.next_sweep = Some(now + l.max_age / 4);
+                l.max_age
+            }
+            _ => return Ok(()),
+        };
+
+        let aged: Vec<(I::Addr, u32)> = self
+            .pending
+            .iter()
+            .flat_map(|(addr, flows)| {
+                flows
+                    .iter()
+                    .filter(|(_, p)| now.saturating_duration_since(p.created_at) >= max_age)
+                    .map(move |(sid, _)| (addr.clone(), *sid))
+            })
+            .collect();
+        for (addr, sid) in aged {
+            self.create_pending(&addr, sid, false, sender, new_flow)?;
+        }
+
+        Ok(())
+    }
+
+    fn timer(&self, alg: &'static str) -> Option<Rc<LoopTimer>> {
+        self.loop_latency
+            .as_ref()
+            .map(|stats| Rc::new(LoopTimer::new(alg, stats.clone(), self.clock.clone())))
+    }
+
+    // Handle one message from the datapath at `recv_addr`, which arrived at `received_at`.
+    // `sender` may be addressed to anywhere; it is re-addressed to `recv_addr` as needed.
+    // `new_flow` is called with the requested algorithm name to create flows, and `alg_name`
+    // with the same name gives the `CongAlg::name()` of the algorithm it will pick.
+    // `import_flow` likewise takes over flows from a checkpoint; see `restore`.
+    fn dispatch(
+        &mut self,
+        msg: Msg,
+        recv_addr: I::Addr,
+        received_at: Instant,
+        sender: &BackendSender<I>,
+        alg_name: impl Fn(&str) -> &'static str,
+        mut new_flow: impl FnMut(&str, Datapath<I>, DatapathInfo) -> F,
+        mut import_flow: impl FnMut(&str, Datapath<I>, DatapathInfo, &[u8]) -> Option<F>,
+    ) -> Result<()> {
+        if self.lazy.is_some() {
+            self.create_aged(received_at, sender, &mut new_flow)?;
+        }
+
         match msg {
             Msg::Rdy(_r) => {
-                if dp_to_flowmap.remove(&recv_addr).is_some() {
+                if self.dp_to_flowmap.remove(&recv_addr).is_some() {
                     info!(
                         "new ready from old datapath, clearing old flows and installing programs"
                     );
+                    self.restored.remove(&recv_addr);
+                    self.pending.remove(&recv_addr);
                 } else {
                     info!(addr = %format!("{:#?}", recv_addr), "found new datapath, installing programs");
                 }
 
-                dp_to_flowmap.insert(
-                    recv_addr.clone(),
-                    HashMap::<u32, <<&'_ U as Pick<'_, I>>::Picked as CongAlg<I>>::Flow>::default(),
-                );
+                self.dp_to_flowmap
+                    .insert(recv_addr.clone(), HashMap::default());
 
-                let backend = b.sender(recv_addr);
-                for buf in &install_msgs {
+                let backend = sender.clone_with_dest(recv_addr);
+                for buf in &self.install_msgs {
                     backend.send_msg(&buf[..])?;
                 }
             }
             Msg::Cr(c) => {
-                let flowmap = match dp_to_flowmap.get_mut(&recv_addr) {
+                if let Some(p) = self.policy.as_mut() {
+                    p.refresh();
+                }
+
+                // a policy rule for the flow's destination overrides what the datapath asked for.
+                let requested = self
+                    .policy
+                    .as_ref()
+                    .and_then(|p| p.lookup(c.dst_ip(), c.dst_port()))
+                    .or_else(|| c.cong_alg())
+                    .unwrap_or("");
+                let alg = alg_name(requested);
+                if self.lazy.is_some() {
+                    return self.defer_flow(c, recv_addr, alg, received_at, sender);
+                }
+
+                let timer = self.timer(alg);
+                let flowmap = match self.dp_to_flowmap.get_mut(&recv_addr) {
                     Some(fm) => fm,
                     None => {
                         debug!(addr = %format!("{:#?}", recv_addr), "received create from unknown datapath, ignoring");
-                        continue;
+                        return Ok(());
                     }
                 };
 
-                if flowmap.remove(&c.sid).is_some() {
-                    debug!(sid = ?c.sid, "re-creating already created flow");
+                if flowmap.remove(&c.sid()).is_some() {
+                    debug!(sid = ?c.sid(), "re-creating already created flow");
+                }
+
+                if let Some(restored) = self.restored.get_mut(&recv_addr) {
+                    restored.remove(&c.sid());
                 }
 
                 debug!(
-                    sid        = ?c.sid,
-                    init_cwnd  = ?c.init_cwnd,
-                    mss        = ?c.mss,
-                    src_ip     = ?c.src_ip,
-                    src_port   = ?c.src_port,
-                    dst_ip     = ?c.dst_ip,
-                    dst_port   = ?c.dst_port,
-                    alg        = ?c.cong_alg.as_ref(),
+                    sid        = ?c.sid(),
+                    init_cwnd  = ?c.init_cwnd(),
+                    mss        = ?c.mss(),
+                    src_ip     = ?c.src_ip(),
+                    src_port   = ?c.src_port(),
+                    dst_ip     = ?c.dst_ip(),
+                    dst_port   = ?c.dst_port(),
+                    alg        = ?c.cong_alg(),
                     "creating new flow"
                 );
 
-                let alg = algs2.pick(c.cong_alg.as_ref().map(String::as_str).unwrap_or(""));
-                let f = alg.new_flow(
-                    Datapath {
-                        sock_id: c.sid,
-                        sender: b.sender(recv_addr),
-                        programs: scope_map.clone(),
-                    },
-                    DatapathInfo {
-                        sock_id: c.sid,
-                        init_cwnd: c.init_cwnd,
-                        mss: c.mss,
-                        src_ip: c.src_ip,
-                        src_port: c.src_port,
-                        dst_ip: c.dst_ip,
-                        dst_port: c.dst_port,
-                    },
+                usdt!(create, c.sid(), c.init_cwnd(), c.mss());
+                let (dp, info, shadow) = flow_handles(
+                    flow_info(c),
+                    recv_addr,
+                    sender,
+                    &self.scope_map,
+                    &timer,
+                    self.shadow.as_ref(),
                 );
-                flowmap.insert(c.sid, f);
+                let flow = new_flow(requested, dp, info.clone());
+                let entry = FlowEntry {
+                    flow,
+                    timer,
+                    info,
+                    alg,
+                    shadow,
+                };
+                flowmap.insert(c.sid(), entry);
             }
             Msg::Ms(m) => {
-                let flowmap = match dp_to_flowmap.get_mut(&recv_addr) {
+                if self.lazy.is_some() {
+                    let closed = m.num_fields() == 0;
+                    self.create_pending(&recv_addr, m.sid(), closed, sender, &mut new_flow)?;
+                }
+
+                if !self.restored.is_empty() && self.dp_to_flowmap.contains_key(&recv_addr) {
+                    let closed = m.num_fields() == 0;
+                    self.reattach(
+                        &recv_addr,
+                        m.sid(),
+                        closed,
+                        sender,
+                        &alg_name,
+                        &mut import_flow,
+                    )?;
+                }
+
+                let program_uid = self.program_uid(m.program_uid());
+                let flowmap = match self.dp_to_flowmap.get_mut(&recv_addr) {
                     Some(fm) => fm,
                     None => {
-                        info!(addr = %format!("{:#?}", recv_addr), "received create from unknown datapath, ignoring");
-                        continue;
+                        info!(addr = %format!("{:#?}", recv_addr), "received measurement from unknown datapath, ignoring");
+                        return Ok(());
                     }
                 };
 
-                if flowmap.contains_key(&m.sid) {
-                    if m.num_fields == 0 {
-                        let mut flow = flowmap.remove(&m.sid).unwrap();
-                        flow.close();
-                    } else {
-                        let flow = flowmap.get_mut(&m.sid).unwrap();
-                        flow.on_report(
-                            m.sid,
-                            Report {
-                                program_uid: m.program_uid,
-                                from: format!("{:#?}", recv_addr),
-                                fields: m.fields,
-                            },
-                        )
+                deliver_report(
+                    flowmap,
+                    &mut self.shadow,
+                    m,
+                    program_uid,
+                    format!("{:#?}", recv_addr),
+                    received_at,
+                );
+            }
+            Msg::BatchMs(batch) => {
+                if self.lazy.is_some() {
+                    for m in batch.iter() {
+                        let closed = m.num_fields() == 0;
+                        self.create_pending(&recv_addr, m.sid(), closed, sender, &mut new_flow)?;
                     }
-                } else {
-                    debug!(sid = m.sid, "measurement for unknown flow");
                 }
-            }
-            Msg::Ins(_) => {
-                // The start() listener should never receive an install message, since it is on the CCP side.
-                unreachable!()
+
+                if !self.restored.is_empty() && self.dp_to_flowmap.contains_key(&recv_addr) {
+                    for m in batch.iter() {
+                        let closed = m.num_fields() == 0;
+                        self.reattach(
+                            &recv_addr,
+                            m.sid(),
+                            closed,
+                            sender,
+                            &alg_name,
+                            &mut import_flow,
+                        )?;
+                    }
+                }
+
+                let remap = !self.uid_remap.is_empty();
+                let uid_remap = &self.uid_remap;
+                let flowmap = match self.dp_to_flowmap.get_mut(&recv_addr) {
+                    Some(fm) => fm,
+                    None => {
+                        info!(addr = %format!("{:#?}", recv_addr), "received measurement from unknown datapath, ignoring");
+                        return Ok(());
+                    }
+                };
+
+                let from = format!("{:#?}", recv_addr);
+                for m in batch {
+                    let program_uid = if remap {
+                        uid_remap
+                            .get(&m.program_uid())
+                            .copied()
+                            .unwrap_or(m.program_uid())
+                    } else {
+                        m.program_uid()
+                    };
+                    deliver_report(
+                        flowmap,
+                        &mut self.shadow,
+                        m,
+                        program_uid,
+                        from.clone(),
+                        received_at,
+                    );
+                }
             }
             Msg::Other(m) => {
                 debug!(
@@ -651,15 +1519,312 @@ where
                     addr = %format!("{:#?}", recv_addr),
                     "got unknown message"
                 );
-                continue;
             }
         }
+
+        Ok(())
+    }
+}
+
+// The create message for a flow, as a checkpoint records it.
+fn create_msg(info: &DatapathInfo, alg: &str) -> serialize::create::Msg {
+    serialize::create::Msg {
+        sid: info.sock_id,
+        init_cwnd: info.init_cwnd,
+        mss: info.mss,
+        src_ip: info.src_ip,
+        src_port: info.src_port,
+        dst_ip: info.dst_ip,
+        dst_port: info.dst_port,
+        // a name too long for the message restores with the default algorithm.
+        cong_alg: Some(alg.to_owned()).filter(|a| a.len() < 64),
+    }
+}
+
+// The `Datapath` for the flow `info` describes, and its shadow if the runtime has a shadow
+// algorithm.
+fn flow_handles<I: Ipc>(
+    info: DatapathInfo,
+    recv_addr: I::Addr,
+    sender: &BackendSender<I>,
+    programs: &Rc<HashMap<String, Scope>>,
+    timer: &Option<Rc<LoopTimer>>,
+    shadow: Option<&Shadow<I>>,
+) -> (Datapath<I>, DatapathInfo, Option<ShadowFlow>) {
+    let mut dp = Datapath {
+        sock_id: info.sock_id,
+        sender: sender.clone_with_dest(recv_addr),
+        programs: programs.clone(),
+        timer: timer.clone(),
+        tap: None,
+    };
+    let shadow = shadow.map(|s| s.new_flow(&mut dp, &info));
+    (dp, info, shadow)
+}
+
+fn flow_info(c: CreateView) -> DatapathInfo {
+    DatapathInfo {
+        sock_id: c.sid(),
+        init_cwnd: c.init_cwnd(),
+        mss: c.mss(),
+        src_ip: c.src_ip(),
+        src_port: c.src_port(),
+        dst_ip: c.dst_ip(),
+        dst_port: c.dst_port(),
+    }
+}
+
+// A checkpointed flow keeps its create message decoded, since the buffer it came in is gone.
+fn saved_flow_info(c: &serialize::create::Msg) -> DatapathInfo {
+    DatapathInfo {
+        sock_id: c.sid,
+        init_cwnd: c.init_cwnd,
+        mss: c.mss,
+        src_ip: c.src_ip,
+        src_port: c.src_port,
+        dst_ip: c.dst_ip,
+        dst_port: c.dst_port,
+    }
+}
+
+// A measurement with no fields means the flow has ended. The fields are copied out of the
+// receive buffer only for a report that will be delivered.
+fn deliver_report<I: Ipc, F: Flow>(
+    flowmap: &mut HashMap<u32, FlowEntry<F>>,
+    shadow: &mut Option<Shadow<I>>,
+    m: MeasureView,
+    program_uid: u32,
+    from: String,
+    received_at: Instant,
+) {
+    let sid = m.sid();
+    if !flowmap.contains_key(&sid) {
+        debug!(sid, "measurement for unknown flow");
+    } else if m.num_fields() == 0 {
+        usdt!(close, sid);
+        let mut entry = flowmap.remove(&sid).unwrap();
+        entry.flow.close();
+        if let Some(s) = entry.shadow.as_mut() {
+            s.close();
+        }
+    } else {
+        let entry = flowmap.get_mut(&sid).unwrap();
+        if let Some(t) = &entry.timer {
+            t.report(received_at);
+        }
+
+        let fields: Vec<u64> = m.fields().collect();
+
+        // the shadow gets its own copy of the report, if it may run at all.
+        let alg = entry.alg;
+        let shadowed = match (shadow.as_mut(), entry.shadow.as_mut()) {
+            (Some(s), Some(sf)) => {
+                if s.admit(alg, sf) {
+                    let report = Report {
+                        program_uid,
+                        from: from.clone(),
+                        fields: fields.clone(),
+                        received_at,
+                    };
+                    Some((s, sf, report, Instant::now()))
+                } else {
+                    None
+                }
+            }
+            _ => None,
+        };
+
+        usdt!(dispatch_begin, sid, fields.len());
+        entry.flow.on_report(
+            sid,
+            Report {
+                program_uid,
+                from,
+                fields,
+                received_at,
+            },
+        );
+        usdt!(dispatch_end, sid);
+
+        if let Some((s, sf, report, start)) = shadowed {
+            s.report(alg, start.elapsed(), sf, sid, report);
+        }
+    }
+}
+
+// A checkpoint that cannot be written is logged rather than stopping the runtime.
+fn write_checkpoint<I: Ipc, F: Flow>(ck: &mut Checkpointer, d: &Dispatcher<I, F>, now: Instant) {
+    if let Err(e) = ck.write(&d.snapshot(), now) {
+        info!(path = ?ck.path(), err = ?e, "could not write checkpoint");
+    }
+}
+
+// Main execution inner loop of ccp.
+// Blocks "forever", or until the iterator stops iterating.
+//
+// `run_inner()`:
+// 1. listens for messages from the datapath
+// 2. call the appropriate message in `U: impl CongAlg`
+// The function can return for two reasons: an error, or the iterator returned None.
+// The latter should only happen for spawn(), and not for run().
+// It returns any error, either from:
+// 1. the IPC channel failing
+// 2. Receiving an install control message (only the datapath should receive these).
+fn run_inner<I, U>(
+    continue_listening: Arc<atomic::AtomicBool>,
+    backend_builder: BackendBuilder<I>,
+    algs: U,
+    opts: RunOptions<I>,
+) -> Result<()>
+where
+    I: Ipc,
+    for<'a> &'a U: Pick<'a, I> + CollectDps<I>,
+{
+    let RunOptions {
+        loop_latency,
+        clock,
+        recv_timeout,
+        checkpoint,
+        upgrade,
+        handoff,
+        shadow,
+        policy,
+        lazy,
+    } = opts;
+    let mut receive_buf = vec![0u8; crate::ipc::MAX_MSG_LEN];
+    let mut b = backend_builder
+        .build(continue_listening.clone(), &mut receive_buf[..])
+        .with_clock(clock.clone());
+    if let Some(timeout) = recv_timeout {
+        b = b.with_recv_timeout(timeout);
+    }
+
+    let sender = b.sender(Default::default());
+    // the borrow has to before the Dispatcher, to guarantee that the flows are dropped first
+    let algs2 = &algs;
+
+    info!(ipc = ?I::name(), "starting CCP");
+
+    // a handoff is newer than any checkpoint. Programs compiled from here on must not reuse
+    // the uids of the snapshot's programs.
+    let restored = match handoff {
+        Some(snap) => Some((snap, true)),
+        None => checkpoint
+            .as_ref()
+            .map(|(path, _)| (Snapshot::read(path), false)),
+    };
+    if let Some((snap, _)) = &restored {
+        lang::set_program_uid_base(snap.max_program_uid());
+    }
+
+    let mut dispatcher = Dispatcher::new(algs2.datapath_programs())?;
+    dispatcher.loop_latency = loop_latency;
+    dispatcher.clock = clock.clone();
+    if let Some((alg, share, stats)) = shadow {
+        info!(shadow = alg.name(), "running shadow algorithm");
+        dispatcher.set_shadow(alg, share, stats)?;
+    }
+
+    dispatcher.policy = policy.map(PolicyCache::new);
+    if let Some((max_age, default_program)) = lazy {
+        dispatcher.set_lazy(max_age, default_program)?;
+    }
+
+    match restored {
+        Some((snap, true)) => dispatcher.take_over(snap, &sender)?,
+        Some((snap, false)) => dispatcher.restore(snap),
+        None => (),
+    }
+
+    // shared with the idle hook, which the backend drops before closing the socket.
+    let dispatcher = Rc::new(RefCell::new(dispatcher));
+    let (idle_dispatcher, idle_sender, idle_clock) =
+        (dispatcher.clone(), sender.clone(), clock.clone());
+    b = b.with_idle(move || {
+        // drive the futures of `async_flow::Async` flows while waiting for the datapath.
+        async_flow::run_pending();
+
+        // lazy flows come of age even if the datapath sends nothing.
+        let mut d = idle_dispatcher.borrow_mut();
+        if d.lazy.is_some() {
+            let now = idle_clock.now();
+            let mut new_flow = |alg_name: &str, dp, info| algs2.pick(alg_name).new_flow(dp, info);
+            if let Err(e) = d.create_aged(now, &idle_sender, &mut new_flow) {
+                info!(err = ?e, "could not create aged flows");
+            }
+        }
+    });
+
+    let mut checkpointer = checkpoint.map(|(path, interval)| Checkpointer::new(path, interval));
+    // a successor pauses the backend, rather than stopping it, so that `kill` still stops it.
+    let pause = Arc::new(atomic::AtomicBool::new(false));
+    let upgrade = match upgrade {
+        Some(l) => {
+            b = b.with_pause(pause.clone());
+            Some(l.watch(pause.clone()))
+        }
+        None => None,
+    };
+    loop {
+        while let Some((msg, recv_addr, at)) = b.next_at() {
+            let mut dispatcher = dispatcher.borrow_mut();
+            dispatcher.dispatch(
+                msg,
+                recv_addr,
+                at,
+                &sender,
+                |alg_name| algs2.picked_name(alg_name),
+                |alg_name, dp, info| algs2.pick(alg_name).new_flow(dp, info),
+                |alg_name, dp, info, state| algs2.pick(alg_name).import_flow(dp, info, state),
+            )?;
+            async_flow::run_pending();
+
+            if let Some(ck) = checkpointer.as_mut() {
+                let now = clock.now();
+                if ck.due(now) {
+                    write_checkpoint(ck, &dispatcher, now);
+                }
+            }
+        }
+
+        // everything read from the socket has been handled; the rest is the successor's.
+        let successor = match upgrade.as_ref().and_then(|u| u.successor().map(|s| (u, s))) {
+            Some(s) => s,
+            None => break,
+        };
+
+        let snap = dispatcher.borrow().snapshot();
+        match successor.0.hand_off(successor.1, &snap) {
+            Ok(()) => {
+                info!("handed off to successor, exiting");
+                return Ok(());
+            }
+            Err(upgrade::HandoffError::NotSent(e)) => {
+                info!(err = ?e, "upgrade failed, resuming");
+                pause.store(false, atomic::Ordering::SeqCst);
+            }
+            Err(upgrade::HandoffError::Sent(e)) => {
+                return Err(Error(format!(
+                    "upgrade failed after handing off the IPC socket: {}",
+                    e.0
+                )));
+            }
+        }
+    }
+
+    if let Some(ck) = checkpointer.as_mut() {
+        write_checkpoint(ck, &dispatcher.borrow(), clock.now());
     }
 
     // if the thread has been killed, return that as error
     if !continue_listening.load(atomic::Ordering::SeqCst) {
         info!("portus shutting down");
         Ok(())
+    } else if b.timed_out() {
+        Err(Error(format!(
+            "No message from the datapath in {:?}.",
+            recv_timeout.unwrap_or_default()
+        )))
     } else {
         Err(Error(String::from("The IPC channel has closed.")))
     }
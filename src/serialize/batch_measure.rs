@@ -0,0 +1,338 @@
+//! A datapath reporting for many flows at once sends one batch measurement message instead of one
+//! measure message per flow.
+//!
+//! ```text
+//! | CCP header (sid 0) | num_reports: u32 |
+//! then num_reports times:
+//! | sid: u32 | program_uid: u32 | num_fields: u32 | fields: num_fields * u64 |
+//! ```
+//!
+//! Each report costs 12 bytes of framing rather than a measure message's 16, and the whole batch
+//! is one message for `Backend` to receive and parse. Decode it with `BatchMeasureView`, which
+//! iterates the reports in place.
+
+use super::{measure, u32_from_u8s, CcpMessage, MeasureView, RawMsg};
+use crate::{Error, Result};
+use std::convert::TryFrom;
+
+pub(crate) const BATCH_MEASURE: u8 = 6;
+
+#[derive(Clone, Debug, PartialEq, CcpMessage)]
+#[ccp(typ = BATCH_MEASURE)]
+pub struct Msg {
+    pub num_reports: u32,
+    #[ccp(tail = reports)]
+    pub reports: Vec<measure::Msg>,
+}
+
+impl Msg {
+    /// `reports` in order, as batch messages that each fit in the CCP header's 16-bit length.
+    ///
+    /// A report too large for any batch gets a batch of its own, which fails to serialize.
+    pub fn batches(reports: Vec<measure::Msg>) -> Vec<Msg> {
+        let max = u32::from(u16::max_value());
+        let mut batches = vec![];
+        let mut batch = vec![];
+        let mut len = Self::FIXED_LEN;
+        for m in reports {
+            let l = reports::report_len(&m);
+            if !batch.is_empty() && len.saturating_add(l) > max {
+                batches.push(Msg {
+                    num_reports: batch.len() as u32,
+                    reports: std::mem::take(&mut batch),
+                });
+                len = Self::FIXED_LEN;
+            }
+
+            len = len.saturating_add(l);
+            batch.push(m);
+        }
+
+        if !batch.is_empty() {
+            batches.push(Msg {
+                num_reports: batch.len() as u32,
+                reports: batch,
+            });
+        }
+
+        batches
+    }
+}
+
+mod reports {
+    use super::super::{measure, u32_to_u8s, u64_to_u8s};
+    use super::BatchMeasureView;
+    use crate::Result;
+    use std::io::prelude::*;
+
+    pub fn report_len(m: &measure::Msg) -> u32 {
+        (m.fields.len() as u32).saturating_mul(8).saturating_add(12)
+    }
+
+    pub fn tail_len(reports: &[measure::Msg]) -> u32 {
+        reports
+            .iter()
+            .map(report_len)
+            .fold(0, |a, l| a.saturating_add(l))
+    }
+
+    pub fn write_tail<W: Write>(reports: &[measure::Msg], w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 12];
+        let mut field = [0u8; 8];
+        for m in reports {
+            u32_to_u8s(&mut buf[0..4], m.sid);
+            u32_to_u8s(&mut buf[4..8], m.program_uid);
+            u32_to_u8s(&mut buf[8..12], m.fields.len() as u32);
+            w.write_all(&buf[..])?;
+            for f in &m.fields {
+                u64_to_u8s(&mut field, *f);
+                w.write_all(&field[..])?;
+            }
+        }
+
+        Ok(())
+    }
+
+    pub fn read_tail(b: &[u8]) -> Result<Vec<measure::Msg>> {
+        BatchMeasureView::from_reports(b, None)?
+            .iter()
+            .map(measure::Msg::try_from)
+            .collect()
+    }
+}
+
+/// A validated view of a batch measurement message.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct BatchMeasureView<'a> {
+    num_reports: usize,
+    buf: &'a [u8],
+}
+
+impl<'a> BatchMeasureView<'a> {
+    pub fn new(msg: &RawMsg<'a>) -> Result<Self> {
+        if msg.typ != BATCH_MEASURE {
+            return Err(Error(format!(
+                "expected batch measure message (type {}), got type {}",
+                BATCH_MEASURE, msg.typ
+            )));
+        }
+
+        let b = msg.payload();
+        if b.len() < 4 {
+            return Err(Error(format!(
+                "batch measure message too short: {}",
+                b.len()
+            )));
+        }
+
+        Self::from_reports(&b[4..], Some(u32_from_u8s(&b[0..4]) as usize))
+    }
+
+    // Walk the report framing once so that iterating afterwards cannot fail.
+    fn from_reports(buf: &'a [u8], expected: Option<usize>) -> Result<Self> {
+        let mut off = 0;
+        let mut num_reports = 0;
+        while off < buf.len() {
+            let len = buf
+                .get(off + 8..off + 12)
+                .map(|n| u32_from_u8s(n) as usize)
+                .and_then(|n| n.checked_mul(8))
+                .and_then(|n| n.checked_add(12))
+                .filter(|&l| off + l <= buf.len())
+                .ok_or_else(|| {
+                    Error(format!(
+                        "batch measure report {} overruns the message",
+                        num_reports
+                    ))
+                })?;
+            off += len;
+            num_reports += 1;
+        }
+
+        match expected {
+            Some(n) if n != num_reports => Err(Error(format!(
+                "batch measure message claims {} reports but has {}",
+                n, num_reports
+            ))),
+            _ => Ok(BatchMeasureView { num_reports, buf }),
+        }
+    }
+
+    pub fn num_reports(&self) -> usize {
+        self.num_reports
+    }
+
+    /// The reports in the batch, each borrowed from the message buffer.
+    pub fn iter(&self) -> BatchMeasureIter<'a> {
+        BatchMeasureIter {
+            remaining: self.num_reports,
+            buf: self.buf,
+        }
+    }
+}
+
+impl<'a> IntoIterator for BatchMeasureView<'a> {
+    type Item = MeasureView<'a>;
+    type IntoIter = BatchMeasureIter<'a>;
+
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter()
+    }
+}
+
+pub struct BatchMeasureIter<'a> {
+    remaining: usize,
+    buf: &'a [u8],
+}
+
+impl<'a> Iterator for BatchMeasureIter<'a> {
+    type Item = MeasureView<'a>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.remaining == 0 {
+            return None;
+        }
+
+        // lengths were checked by `BatchMeasureView::from_reports`.
+        let len = 12 + u32_from_u8s(&self.buf[8..12]) as usize * 8;
+        let (report, rest) = self.buf.split_at(len);
+        self.buf = rest;
+        self.remaining -= 1;
+        Some(MeasureView::from_parts(
+            u32_from_u8s(&report[0..4]),
+            &report[4..],
+        ))
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) {
+        (self.remaining, Some(self.remaining))
+    }
+}
+
+impl<'a> ExactSizeIterator for BatchMeasureIter<'a> {}
+
+#[cfg(test)]
+mod tests {
+    use super::BatchMeasureView;
+    use crate::serialize::{self, measure, Msg, RawMsg};
+    use std::convert::TryFrom;
+
+    fn batch() -> super::Msg {
+        let reports = vec![
+            measure::Msg {
+                sid: 1,
+                program_uid: 7,
+                num_fields: 2,
+                fields: vec![1448, 20000],
+            },
+            measure::Msg {
+                sid: 2,
+                program_uid: 7,
+                num_fields: 0,
+                fields: vec![],
+            },
+            measure::Msg {
+                sid: 3,
+                program_uid: 8,
+                num_fields: 1,
+                fields: vec![u64::max_value()],
+            },
+        ];
+
+        super::Msg {
+            num_reports: reports.len() as u32,
+            reports,
+        }
+    }
+
+    #[test]
+    fn batch_view() {
+        let m = batch();
+        let buf = serialize::serialize(&m).unwrap();
+        assert_eq!(buf.len(), 8 + 4 + 3 * 12 + 3 * 8);
+
+        // misaligned, as when packed after another message
+        let mut b = vec![0u8; 3];
+        b.extend_from_slice(&buf);
+        let raw = RawMsg::parse(&b[3..]).unwrap();
+        let v = BatchMeasureView::new(&raw).unwrap();
+        assert_eq!(v.num_reports(), 3);
+        assert_eq!(v.iter().len(), 3);
+        let got: Vec<measure::Msg> = v
+            .iter()
+            .map(|r| measure::Msg::try_from(r).unwrap())
+            .collect();
+        assert_eq!(got, m.reports);
+    }
+
+    #[test]
+    fn batch_from_buf() {
+        let m = batch();
+        let buf = serialize::serialize(&m).unwrap();
+        match Msg::from_buf(&buf).unwrap() {
+            (Msg::BatchMs(v), len) => {
+                assert_eq!(len, buf.len());
+                assert_eq!(v.iter().map(|r| r.sid()).collect::<Vec<_>>(), vec![1, 2, 3]);
+            }
+            _ => panic!("wrong type for message"),
+        }
+    }
+
+    #[test]
+    fn batches_fit() {
+        let reports: Vec<measure::Msg> = (0..5000)
+            .map(|sid| measure::Msg {
+                sid,
+                program_uid: 7,
+                num_fields: 2,
+                fields: vec![1448, 20000],
+            })
+            .collect();
+
+        // 28 bytes a report: too many for one message.
+        let batches = super::Msg::batches(reports.clone());
+        assert_eq!(batches.len(), 3);
+        let mut got = vec![];
+        for b in batches {
+            assert_eq!(b.num_reports as usize, b.reports.len());
+            let buf = serialize::serialize(&b).unwrap();
+            assert!(buf.len() <= u16::max_value() as usize);
+            let raw = RawMsg::parse(&buf).unwrap();
+            got.extend(
+                BatchMeasureView::new(&raw)
+                    .unwrap()
+                    .iter()
+                    .map(|r| measure::Msg::try_from(r).unwrap()),
+            );
+        }
+        assert_eq!(got, reports);
+
+        assert!(serialize::serialize(&super::Msg {
+            num_reports: reports.len() as u32,
+            reports,
+        })
+        .is_err());
+    }
+
+    #[test]
+    fn batch_truncated() {
+        let mut m = batch();
+        let buf = serialize::serialize(&m).unwrap();
+        for l in 12..buf.len() {
+            // rewrite the header length so the truncation is inside the reports.
+            let mut b = buf[..l].to_vec();
+            b[2..4].copy_from_slice(&(l as u16).to_le_bytes());
+            let raw = RawMsg::parse(&b).unwrap();
+            assert!(BatchMeasureView::new(&raw).is_err(), "len {}", l);
+            // and the receive loop sees a raw message rather than an error.
+            match Msg::from_buf(&b).unwrap() {
+                (Msg::Other(raw), len) => assert_eq!((raw.typ, len), (super::BATCH_MEASURE, l)),
+                _ => panic!("len {}: truncated batch decoded", l),
+            }
+        }
+
+        m.num_reports = 4;
+        let buf = serialize::serialize(&m).unwrap();
+        assert!(BatchMeasureView::new(&RawMsg::parse(&buf).unwrap()).is_err());
+    }
+}
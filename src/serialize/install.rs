@@ -1,51 +1,33 @@
 //! CCP sends this message containing a datapath program.
 
-use super::{u32_to_u8s, AsRawMsg, RawMsg, HDR_LENGTH};
+use super::CcpMessage;
 use crate::lang::Bin;
-use crate::Result;
-use std::io::prelude::*;
 
 pub(crate) const INSTALL: u8 = 2;
 
-#[derive(Clone, Debug, PartialEq)]
+#[derive(Clone, Debug, PartialEq, CcpMessage)]
+#[ccp(typ = INSTALL)]
 pub struct Msg {
+    #[ccp(sid)]
     pub sid: u32,
     pub program_uid: u32,
     pub num_events: u32,
     pub num_instrs: u32,
+    #[ccp(tail)]
     pub instrs: Bin,
 }
 
-impl AsRawMsg for Msg {
-    fn get_hdr(&self) -> (u8, u32, u32) {
-        (
-            INSTALL,
-            HDR_LENGTH + 12 + (self.num_events * 16 + self.num_instrs * 16),
-            self.sid,
-        )
-    }
-
-    fn get_u32s<W: Write>(&self, w: &mut W) -> Result<()> {
-        let mut buf = [0u8; 4];
-        u32_to_u8s(&mut buf, self.program_uid);
-        w.write_all(&buf[..])?;
-        u32_to_u8s(&mut buf, self.num_events);
-        w.write_all(&buf[..])?;
-        u32_to_u8s(&mut buf, self.num_instrs);
-        w.write_all(&buf[..])?;
-        Ok(())
-    }
-
-    fn get_bytes<W: Write>(&self, w: &mut W) -> Result<()> {
-        let buf = self.instrs.serialize()?;
-        w.write_all(&buf[..])?;
-        Ok(())
-    }
-
-    // at least for now, portus doesn't have to worry about deserializing this
-    fn from_raw_msg(_msg: RawMsg) -> Result<Self> {
-        unimplemented!();
-    }
+/// Install a program compiled at build time, whose instructions are already serialized.
+#[derive(Clone, Debug, PartialEq, CcpMessage)]
+#[ccp(typ = INSTALL)]
+pub struct PrecompiledMsg {
+    #[ccp(sid)]
+    pub sid: u32,
+    pub program_uid: u32,
+    pub num_events: u32,
+    pub num_instrs: u32,
+    #[ccp(tail)]
+    pub instrs: &'static [u8],
 }
 
 #[cfg(test)]
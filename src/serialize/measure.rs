@@ -1,92 +1,45 @@
 //! When the datapath program specifies, the datapath sends a Report message containing
 //! measurements to CCP. Use the `Scope` returned from compiling the program to query the values.
 
-use super::{u32_to_u8s, u64_from_u8s, u64_to_u8s, AsRawMsg, RawMsg, HDR_LENGTH};
-use crate::{Error, Result};
-use std::io::prelude::*;
+use super::CcpMessage;
 
 pub(crate) const MEASURE: u8 = 1;
 
-#[derive(Clone, Debug, PartialEq)]
+#[derive(Clone, Debug, PartialEq, CcpMessage)]
+#[ccp(typ = MEASURE)]
 pub struct Msg {
+    #[ccp(sid)]
     pub sid: u32,
     pub program_uid: u32,
     // This is actually a u32 in libccp for struct alignment purposes. It *should* be a u8
     // (as it is here), to help enforce the maximum number of fields, but it's much easier
     // to keep everything 4-byte-aligned for de-serialization.
     pub num_fields: u8,
+    #[ccp(tail)]
     pub fields: Vec<u64>,
 }
 
-fn deserialize_fields(buf: &[u8]) -> Result<Vec<u64>> {
-    buf.chunks(8)
-        .map(|sl| {
-            if sl.len() < 8 {
-                Err(Error(format!("not long enough: {:?}", sl)))
-            } else {
-                Ok(u64_from_u8s(sl))
-            }
-        })
-        .collect()
-}
-
-impl AsRawMsg for Msg {
-    fn get_hdr(&self) -> (u8, u32, u32) {
-        (
-            MEASURE,
-            HDR_LENGTH + 8 + u32::from(self.num_fields) * 8,
-            self.sid,
-        )
-    }
-
-    fn get_u32s<W: Write>(&self, w: &mut W) -> Result<()> {
-        let mut buf = [0u8; 4];
-        u32_to_u8s(&mut buf, self.program_uid);
-        w.write_all(&buf[..])?;
-        u32_to_u8s(&mut buf, u32::from(self.num_fields));
-        w.write_all(&buf[..])?;
-        Ok(())
-    }
-
-    fn get_bytes<W: Write>(&self, w: &mut W) -> Result<()> {
-        let mut buf = [0u8; 8];
-        for f in &self.fields {
-            u64_to_u8s(&mut buf, *f);
-            w.write_all(&buf[..])?;
-        }
-
-        Ok(())
-    }
-
-    fn from_raw_msg(msg: RawMsg) -> Result<Self> {
-        let u32s = unsafe { msg.get_u32s() }?;
-        let b = msg.get_bytes()?;
-
-        Ok(Msg {
-            sid: msg.sid,
-            program_uid: u32s[0],
-            num_fields: u32s[1] as u8,
-            fields: deserialize_fields(b)?,
-        })
-    }
-}
-
 #[cfg(test)]
 mod tests {
     macro_rules! check_measure_msg {
         ($id: ident, $sid:expr, $program_uid:expr, $fields:expr) => {
-            check_msg!(
-                $id,
-                super::Msg,
-                super::Msg {
+            #[test]
+            fn $id() {
+                use std::convert::TryFrom;
+                let m = super::Msg {
                     sid: $sid,
                     program_uid: $program_uid,
                     num_fields: $fields.len() as u8,
                     fields: $fields,
-                },
-                crate::serialize::Msg::Ms(mes),
-                mes
-            );
+                };
+                let buf = crate::serialize::serialize(&m).expect("serialize");
+                match crate::serialize::Msg::from_buf(&buf).expect("deserialize") {
+                    (crate::serialize::Msg::Ms(v), _) => {
+                        assert_eq!(super::Msg::try_from(v).expect("convert"), m)
+                    }
+                    (m, _) => panic!("wrong type for message: {:?}", m),
+                }
+            }
         };
     }
 
@@ -113,4 +66,23 @@ mod tests {
             42424242, 42424242, 42424242, 42424242, 42424242, 42424242, 42424242, 42424242
         ]
     );
+
+    #[test]
+    fn num_fields_out_of_range() {
+        use crate::serialize::AsRawMsg;
+        let m = super::Msg {
+            sid: 1,
+            program_uid: 2,
+            num_fields: 0,
+            fields: vec![],
+        };
+        let mut buf = crate::serialize::serialize(&m).expect("serialize");
+        crate::serialize::u32_to_u8s(&mut buf[12..16], 300);
+        match crate::serialize::Msg::from_buf(&buf).expect("deserialize") {
+            (crate::serialize::Msg::Other(raw), _) => {
+                assert!(super::Msg::from_raw_msg(raw).is_err())
+            }
+            (m, _) => panic!("wrong type for message: {:?}", m),
+        }
+    }
 }
@@ -25,7 +25,9 @@
 //! In these cases, there is little deserialization overhead from the u32 and u64 parts of the message.
 
 use super::Result;
+use crate::lang::{Bin, Reg};
 use byteorder::{ByteOrder, LittleEndian};
+use std::convert::TryFrom;
 use std::io::prelude::*;
 use std::io::Cursor;
 use std::vec::Vec;
@@ -56,12 +58,19 @@ pub(crate) fn u64_from_u8s(buf: &[u8]) -> u64 {
 }
 
 pub const HDR_LENGTH: u32 = 8;
-fn serialize_header(typ: u8, len: u32, sid: u32) -> Vec<u8> {
+fn serialize_header(typ: u8, len: u32, sid: u32) -> Result<[u8; 8]> {
+    let len = u16::try_from(len).map_err(|_| {
+        super::Error(format!(
+            "message of type {} is {} bytes, more than the header can describe",
+            typ, len
+        ))
+    })?;
+
     let mut hdr = [0u8; 8];
     u16_to_u8s(&mut hdr[0..2], u16::from(typ));
-    u16_to_u8s(&mut hdr[2..4], len as u16);
+    u16_to_u8s(&mut hdr[2..4], len);
     u32_to_u8s(&mut hdr[4..], sid);
-    hdr.to_vec()
+    Ok(hdr)
 }
 
 fn deserialize_header<R: Read>(buf: &mut R) -> Result<(u8, u32, u32)> {
@@ -84,35 +93,47 @@ pub struct RawMsg<'a> {
 }
 
 impl<'a> RawMsg<'a> {
-    /// For predefined messages, get u32s separately for convenience
-    pub(crate) unsafe fn get_u32s(&self) -> Result<&'a [u32]> {
-        use std::mem;
-        match self.typ {
-            create::CREATE => Ok(mem::transmute(&self.bytes[0..(4 * 6)])),
-            measure::MEASURE => Ok(mem::transmute(&self.bytes[0..8])),
-            update_field::UPDATE_FIELD => Ok(mem::transmute(&self.bytes[0..4])),
-            ready::READY => Ok(mem::transmute(&self.bytes[0..(4 * 1)])),
-            _ => Ok(&[]),
-        }
+    /// Parse the CCP header at the start of `buf`, without interpreting the rest of the message.
+    pub fn parse(buf: &'a [u8]) -> Result<Self> {
+        deserialize(buf)
+    }
+
+    /// Whether this is the rest of a buffer `Msg::from_buf` could not parse a header from, rather
+    /// than a message. Real messages are at least a header long.
+    pub fn unparsed(&self) -> bool {
+        self.len == 0
+    }
+
+    /// The message after the header: fixed fields followed by any variable-length part.
+    pub fn payload(&self) -> &'a [u8] {
+        self.bytes
     }
 
     /// For predefined messages, bytes blob is whatever's left (may be nothing)
     /// For other message types, just return the bytes blob
     pub fn get_bytes(&self) -> Result<&'a [u8]> {
-        match self.typ {
-            create::CREATE => Ok(&self.bytes[(4 * 6)..(self.len as usize - HDR_LENGTH as usize)]),
-            measure::MEASURE => Ok(&self.bytes[8..(self.len as usize - HDR_LENGTH as usize)]),
-            update_field::UPDATE_FIELD => {
-                Ok(&self.bytes[4..(self.len as usize - HDR_LENGTH as usize)])
-            }
-            _ => Ok(self.bytes),
-        }
+        let fixed = match self.typ {
+            create::CREATE => create::Msg::FIXED_LEN,
+            measure::MEASURE => measure::Msg::FIXED_LEN,
+            batch_measure::BATCH_MEASURE => batch_measure::Msg::FIXED_LEN,
+            update_field::UPDATE_FIELD => update_field::Msg::FIXED_LEN,
+            _ => HDR_LENGTH,
+        };
+        let fixed = (fixed - HDR_LENGTH) as usize;
+
+        self.bytes.get(fixed..).ok_or_else(|| {
+            super::Error(format!(
+                "message of type {} too short: {} bytes",
+                self.typ,
+                self.bytes.len()
+            ))
+        })
     }
 }
 
 /// Types that can be serialized.
-// Message types wanting to become "predefined" (and as such take advantage of `get_u32s()` and
-// `get_u64s()` below) should edit this file accordingly (see `impl RawMsg`)
+///
+/// Fixed-layout messages should `#[derive(CcpMessage)]` rather than implementing this by hand.
 pub trait AsRawMsg {
     fn get_hdr(&self) -> (u8, u32, u32);
     fn get_u32s<W: Write>(&self, _: &mut W) -> Result<()> {
@@ -135,7 +156,7 @@ mod test_helper {
     /// and verifies the message is unchanged.
     #[macro_export]
     macro_rules! check_msg {
-        ($id: ident, $typ: ty, $m: expr, $got: pat, $x: ident) => {
+        ($id: ident, $typ: ty, $m: expr, $got: pat, $x: expr) => {
             #[test]
             fn $id() {
                 let m = $m;
@@ -152,6 +173,7 @@ mod test_helper {
     }
 }
 
+pub mod batch_measure;
 pub mod changeprog;
 pub mod create;
 pub mod install;
@@ -159,11 +181,126 @@ pub mod measure;
 pub mod ready;
 mod testmsg;
 pub mod update_field;
+mod view;
+pub use batch_measure::BatchMeasureView;
+pub use view::{CreateView, MeasureView};
+
+pub use portus_export::CcpMessage;
+
+/// The variable-length last field of a `#[derive(CcpMessage)]` message.
+pub trait MsgTail: Sized {
+    /// Serialized length in bytes.
+    fn tail_len(&self) -> u32;
+    fn write_tail<W: Write>(&self, w: &mut W) -> Result<()>;
+    /// Parse from the rest of the message after the fixed fields.
+    fn read_tail(buf: &[u8]) -> Result<Self>;
+}
+
+/// Report fields.
+impl MsgTail for Vec<u64> {
+    fn tail_len(&self) -> u32 {
+        self.len() as u32 * 8
+    }
+
+    fn write_tail<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 8];
+        for f in self {
+            u64_to_u8s(&mut buf, *f);
+            w.write_all(&buf[..])?;
+        }
+
+        Ok(())
+    }
+
+    fn read_tail(buf: &[u8]) -> Result<Self> {
+        buf.chunks(8)
+            .map(|sl| {
+                if sl.len() < 8 {
+                    Err(super::Error(format!("not long enough: {:?}", sl)))
+                } else {
+                    Ok(u64_from_u8s(sl))
+                }
+            })
+            .collect()
+    }
+}
+
+/// Register updates.
+impl MsgTail for Vec<(Reg, u64)> {
+    fn tail_len(&self) -> u32 {
+        self.len() as u32 * 13 // Reg size = 5, u64 size = 8
+    }
+
+    fn write_tail<W: Write>(&self, w: &mut W) -> Result<()> {
+        let mut buf = [0u8; 8];
+        for f in self {
+            let reg =
+                f.0.clone()
+                    .into_iter()
+                    .map(|e| e.map_err(super::Error::from))
+                    .collect::<Result<Vec<u8>>>()?;
+            w.write_all(&reg[..])?;
+            u64_to_u8s(&mut buf, f.1);
+            w.write_all(&buf[..])?;
+        }
+
+        Ok(())
+    }
+
+    // at least for now, portus does not have to worry about deserializing register updates
+    fn read_tail(_buf: &[u8]) -> Result<Self> {
+        Err(super::Error(String::from(
+            "deserializing register updates is not supported",
+        )))
+    }
+}
+
+/// A datapath program.
+impl MsgTail for Bin {
+    fn tail_len(&self) -> u32 {
+        (self.events.len() as u32 + self.instrs.len() as u32) * 16
+    }
+
+    fn write_tail<W: Write>(&self, w: &mut W) -> Result<()> {
+        let buf = self.serialize()?;
+        w.write_all(&buf[..])?;
+        Ok(())
+    }
+
+    // at least for now, portus doesn't have to worry about deserializing programs
+    fn read_tail(_buf: &[u8]) -> Result<Self> {
+        Err(super::Error(String::from(
+            "deserializing datapath programs is not supported",
+        )))
+    }
+}
+
+/// A datapath program serialized at build time; see `lang::Precompiled`.
+impl MsgTail for &'static [u8] {
+    fn tail_len(&self) -> u32 {
+        self.len() as u32
+    }
+
+    fn write_tail<W: Write>(&self, w: &mut W) -> Result<()> {
+        w.write_all(self)?;
+        Ok(())
+    }
+
+    fn read_tail(_buf: &[u8]) -> Result<Self> {
+        Err(super::Error(String::from(
+            "cannot borrow a message tail for 'static",
+        )))
+    }
+}
 
 /// Serialize a serializable message.
+///
+/// Fails if the message is longer than the header's 16-bit length allows.
 pub fn serialize<T: AsRawMsg>(m: &T) -> Result<Vec<u8>> {
     let (a, b, c) = m.get_hdr();
-    let mut msg = serialize_header(a, b, c);
+    let hdr = serialize_header(a, b, c)?;
+    let mut msg = Vec::with_capacity(b as usize);
+    msg.extend_from_slice(&hdr);
     m.get_u32s(&mut msg)?;
     m.get_u64s(&mut msg)?;
     m.get_bytes(&mut msg)?;
@@ -200,27 +337,41 @@ fn deserialize(buf: &[u8]) -> Result<RawMsg> {
 /// Reads message type in the header of the input buffer and returns
 /// a Msg of the corresponding type. If the message type is unkown, returns a
 /// wrapper with direct access to the message bytes.
+/// Create messages and measurements, alone or batched, are views into the input buffer and are
+/// not copied.
 #[derive(Debug, PartialEq)]
 pub enum Msg<'a> {
-    Cr(create::Msg),
-    Ms(measure::Msg),
-    Ins(install::Msg),
+    Cr(CreateView<'a>),
+    Ms(MeasureView<'a>),
+    BatchMs(BatchMeasureView<'a>),
     Rdy(ready::Msg),
     Other(RawMsg<'a>),
 }
 
 impl<'a> Msg<'a> {
+    // A message whose body does not decode is surfaced as a raw message, like one of an unknown
+    // type, so that one bad message does not stop the receive loop.
     fn from_raw_msg(m: RawMsg) -> Result<Msg> {
-        match m.typ {
-            create::CREATE => Ok(Msg::Cr(create::Msg::from_raw_msg(m)?)),
-            measure::MEASURE => Ok(Msg::Ms(measure::Msg::from_raw_msg(m)?)),
-            install::INSTALL => Ok(Msg::Ins(install::Msg::from_raw_msg(m)?)),
-            ready::READY => Ok(Msg::Rdy(ready::Msg::from_raw_msg(m)?)),
-            update_field::UPDATE_FIELD => unimplemented!(),
-            _ => Ok(Msg::Other(m)),
-        }
+        let typ = m.typ;
+        let decoded = match typ {
+            create::CREATE => CreateView::new(&m).map(Msg::Cr),
+            measure::MEASURE => MeasureView::new(&m).map(Msg::Ms),
+            batch_measure::BATCH_MEASURE => BatchMeasureView::new(&m).map(Msg::BatchMs),
+            ready::READY => ready::Msg::from_raw_msg(m.clone()).map(Msg::Rdy),
+            // CCP only sends install and update_field messages, and portus does not
+            // deserialize their bodies; surface them as raw messages rather than failing.
+            _ => return Ok(Msg::Other(m)),
+        };
+
+        Ok(decoded.unwrap_or_else(|e| {
+            debug!(typ, err = ?e, "failed to decode message body");
+            Msg::Other(m)
+        }))
     }
 
+    /// Parse the message at the start of `buf`, and return how many bytes it took. A buffer that
+    /// does not start with a valid header is returned whole, as a `Msg::Other` whose
+    /// `RawMsg::unparsed` is true.
     pub fn from_buf(buf: &[u8]) -> Result<(Msg, usize)> {
         deserialize(buf)
             .map_or_else(
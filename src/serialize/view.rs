@@ -0,0 +1,333 @@
+//! Zero-copy, read-only views of datapath messages.
+//!
+//! A view checks the message length once and then reads each field straight out of the receive
+//! buffer with unaligned little-endian loads. Messages packed back-to-back in one buffer can start
+//! at any offset, so nothing here assumes alignment.
+
+use super::{create, measure, u32_from_u8s, u64_from_u8s, RawMsg};
+use crate::{Error, Result};
+use std::convert::TryFrom;
+
+fn check_typ(msg: &RawMsg, typ: u8, name: &str) -> Result<()> {
+    if msg.typ != typ {
+        return Err(Error(format!(
+            "expected {} message (type {}), got type {}",
+            name, typ, msg.typ
+        )));
+    }
+
+    Ok(())
+}
+
+/// A view of a measurement message.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct MeasureView<'a> {
+    sid: u32,
+    // program_uid, num_fields, then exactly num_fields u64s.
+    buf: &'a [u8],
+}
+
+impl<'a> MeasureView<'a> {
+    pub fn new(msg: &RawMsg<'a>) -> Result<Self> {
+        check_typ(msg, measure::MEASURE, "measure")?;
+        let b = msg.payload();
+        if b.len() < 8 {
+            return Err(Error(format!("measure message too short: {}", b.len())));
+        }
+
+        let num_fields = u32_from_u8s(&b[4..8]) as usize;
+        let len = num_fields
+            .checked_mul(8)
+            .and_then(|l| l.checked_add(8))
+            .filter(|&l| l <= b.len())
+            .ok_or_else(|| {
+                Error(format!(
+                    "measure message claims {} fields but has {} bytes",
+                    num_fields,
+                    b.len()
+                ))
+            })?;
+
+        Ok(MeasureView {
+            sid: msg.sid,
+            buf: &b[..len],
+        })
+    }
+
+    // `buf` must already be checked to hold exactly `num_fields` fields.
+    pub(super) fn from_parts(sid: u32, buf: &'a [u8]) -> Self {
+        MeasureView { sid, buf }
+    }
+
+    pub fn sid(&self) -> u32 {
+        self.sid
+    }
+
+    pub fn program_uid(&self) -> u32 {
+        u32_from_u8s(&self.buf[0..4])
+    }
+
+    pub fn num_fields(&self) -> usize {
+        (self.buf.len() - 8) / 8
+    }
+
+    pub fn field(&self, idx: usize) -> Option<u64> {
+        let start = 8 + idx.checked_mul(8)?;
+        self.buf.get(start..start + 8).map(u64_from_u8s)
+    }
+
+    pub fn fields(&self) -> impl ExactSizeIterator<Item = u64> + 'a {
+        self.buf[8..].chunks_exact(8).map(u64_from_u8s)
+    }
+}
+
+// The owned message counts its fields in a u8; a view may hold more.
+impl<'a> TryFrom<MeasureView<'a>> for measure::Msg {
+    type Error = Error;
+
+    fn try_from(v: MeasureView<'a>) -> Result<Self> {
+        let num_fields = u8::try_from(v.num_fields())
+            .map_err(|_| Error(format!("measure message has {} fields", v.num_fields())))?;
+        Ok(measure::Msg {
+            sid: v.sid(),
+            program_uid: v.program_uid(),
+            num_fields,
+            fields: v.fields().collect(),
+        })
+    }
+}
+
+/// A view of a flow creation message.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct CreateView<'a> {
+    sid: u32,
+    // six u32s, then the (possibly absent) 64-byte algorithm name.
+    buf: &'a [u8],
+}
+
+impl<'a> CreateView<'a> {
+    pub fn new(msg: &RawMsg<'a>) -> Result<Self> {
+        check_typ(msg, create::CREATE, "create")?;
+        let b = msg.payload();
+        if b.len() < 24 {
+            return Err(Error(format!("create message too short: {}", b.len())));
+        }
+
+        Ok(CreateView {
+            sid: msg.sid,
+            buf: b,
+        })
+    }
+
+    pub fn sid(&self) -> u32 {
+        self.sid
+    }
+
+    pub fn init_cwnd(&self) -> u32 {
+        u32_from_u8s(&self.buf[0..4])
+    }
+
+    pub fn mss(&self) -> u32 {
+        u32_from_u8s(&self.buf[4..8])
+    }
+
+    pub fn src_ip(&self) -> u32 {
+        u32_from_u8s(&self.buf[8..12])
+    }
+
+    pub fn src_port(&self) -> u32 {
+        u32_from_u8s(&self.buf[12..16])
+    }
+
+    pub fn dst_ip(&self) -> u32 {
+        u32_from_u8s(&self.buf[16..20])
+    }
+
+    pub fn dst_port(&self) -> u32 {
+        u32_from_u8s(&self.buf[20..24])
+    }
+
+    /// The requested algorithm, if the datapath named one and it is valid UTF-8.
+    pub fn cong_alg(&self) -> Option<&'a str> {
+        let name = &self.buf[24..];
+        let end = name.iter().position(|&c| c == b'\0').unwrap_or(name.len());
+        if end == 0 {
+            return None;
+        }
+
+        std::str::from_utf8(&name[..end]).ok()
+    }
+}
+
+impl<'a> From<CreateView<'a>> for create::Msg {
+    fn from(v: CreateView<'a>) -> Self {
+        create::Msg {
+            sid: v.sid(),
+            init_cwnd: v.init_cwnd(),
+            mss: v.mss(),
+            src_ip: v.src_ip(),
+            src_port: v.src_port(),
+            dst_ip: v.dst_ip(),
+            dst_port: v.dst_port(),
+            cong_alg: v.cong_alg().map(String::from),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{CreateView, MeasureView};
+    use crate::serialize::{self, create, measure, Msg, RawMsg};
+    use std::convert::TryFrom;
+
+    fn measure_msg() -> measure::Msg {
+        measure::Msg {
+            sid: 15,
+            program_uid: 72,
+            num_fields: 3,
+            fields: vec![424242, 65535, u64::max_value()],
+        }
+    }
+
+    fn create_msg() -> create::Msg {
+        create::Msg {
+            sid: 15,
+            init_cwnd: 1448 * 10,
+            mss: 1448,
+            src_ip: 1,
+            src_port: 4242,
+            dst_ip: 2,
+            dst_port: 4343,
+            cong_alg: Some(String::from("reno")),
+        }
+    }
+
+    // Copy `msg` to every offset 0..8 in a fresh buffer, so most copies are misaligned.
+    fn at_offsets(msg: &[u8]) -> Vec<(usize, Vec<u8>)> {
+        (0..8)
+            .map(|off| {
+                let mut buf = vec![0xa5; off];
+                buf.extend_from_slice(msg);
+                (off, buf)
+            })
+            .collect()
+    }
+
+    #[test]
+    fn measure_view_unaligned() {
+        let m = measure_msg();
+        let buf = serialize::serialize(&m).unwrap();
+        for (off, b) in at_offsets(&buf) {
+            let raw = RawMsg::parse(&b[off..]).unwrap();
+            let v = MeasureView::new(&raw).unwrap();
+            assert_eq!(v.sid(), 15);
+            assert_eq!(v.program_uid(), 72);
+            assert_eq!(v.num_fields(), 3);
+            assert_eq!(v.field(2), Some(u64::max_value()));
+            assert_eq!(v.field(3), None);
+            assert_eq!(v.fields().collect::<Vec<_>>(), m.fields);
+            assert_eq!(measure::Msg::try_from(v).unwrap(), m);
+        }
+    }
+
+    #[test]
+    fn measure_view_too_many_fields() {
+        let m = measure::Msg {
+            sid: 15,
+            program_uid: 72,
+            num_fields: 0,
+            fields: vec![7; 300],
+        };
+        let mut buf = serialize::serialize(&m).unwrap();
+        serialize::u32_to_u8s(&mut buf[12..16], 300);
+        let raw = RawMsg::parse(&buf).unwrap();
+        let v = MeasureView::new(&raw).unwrap();
+        assert_eq!(v.num_fields(), 300);
+        assert!(measure::Msg::try_from(v).is_err());
+    }
+
+    #[test]
+    fn create_view_unaligned() {
+        let m = create_msg();
+        let buf = serialize::serialize(&m).unwrap();
+        for (off, b) in at_offsets(&buf) {
+            let raw = RawMsg::parse(&b[off..]).unwrap();
+            let v = CreateView::new(&raw).unwrap();
+            assert_eq!(v.cong_alg(), Some("reno"));
+            assert_eq!(create::Msg::from(v), m);
+        }
+    }
+
+    #[test]
+    fn measure_view_short() {
+        let mut m = measure_msg();
+        m.num_fields = 4; // claims one more field than it has
+        let buf = serialize::serialize(&m).unwrap();
+        let raw = RawMsg::parse(&buf).unwrap();
+        assert!(MeasureView::new(&raw).is_err());
+        assert!(CreateView::new(&raw).is_err());
+    }
+
+    // Deterministic fuzzing of `Msg::from_buf`: valid messages, truncated and corrupted at
+    // random, must parse or fail without panicking. See also `fuzz/`.
+    #[test]
+    fn from_buf_fuzz() {
+        let seeds = vec![
+            serialize::serialize(&measure_msg()).unwrap(),
+            serialize::serialize(&create_msg()).unwrap(),
+            serialize::serialize(&serialize::ready::Msg { id: 3 }).unwrap(),
+            serialize::serialize(&serialize::batch_measure::Msg {
+                num_reports: 2,
+                reports: vec![measure_msg(), measure_msg()],
+            })
+            .unwrap(),
+        ];
+
+        // xorshift, so failures are reproducible without extra dependencies.
+        let mut state = 0x2545_f491_4f6c_dd1du64;
+        let mut rand = move || {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state
+        };
+
+        for _ in 0..10_000 {
+            let mut buf = seeds[rand() as usize % seeds.len()].clone();
+            for _ in 0..(rand() % 4) {
+                let i = rand() as usize % buf.len();
+                buf[i] = rand() as u8;
+            }
+            buf.truncate(rand() as usize % (buf.len() + 1));
+
+            let mut rest = &buf[..];
+            while let Ok((msg, consumed)) = Msg::from_buf(rest) {
+                match msg {
+                    Msg::Other(raw) => {
+                        let _ = raw.get_bytes();
+                    }
+                    Msg::Ms(m) => assert_eq!(m.fields().len(), m.num_fields()),
+                    Msg::BatchMs(batch) => {
+                        for r in batch {
+                            assert_eq!(r.fields().len(), r.num_fields());
+                        }
+                    }
+                    _ => (),
+                }
+                if consumed == 0 || consumed >= rest.len() {
+                    break;
+                }
+                rest = &rest[consumed..];
+            }
+
+            if let Ok(raw) = RawMsg::parse(&buf) {
+                if let Ok(v) = MeasureView::new(&raw) {
+                    assert_eq!(v.fields().len(), v.num_fields());
+                }
+                if let Ok(v) = CreateView::new(&raw) {
+                    let _ = v.cong_alg();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,328 @@
+//! Shadow (A/B) execution: run a second algorithm on live flows without letting it control them.
+//!
+//! With `RunBuilder::with_shadow_alg`, every flow also gets a flow of the shadow algorithm. The
+//! primary flow controls the datapath as usual; the shadow flow receives the same reports, and
+//! what it sends is recorded rather than sent. The shadow's datapath programs are compiled but
+//! never installed, so reports come from the primary's program: each is handed to the shadow
+//! flow with its fields rearranged, by name, into the layout of the program the shadow flow last
+//! set. Reports without all of the fields the shadow's program reports are not handed to it.
+//!
+//! After each report both flows handle, their decisions are compared: the `Cwnd` and `Rate`
+//! each set in response (if any). `ShadowStats` counts the reports on which they differ, and keeps
+//! histograms of the time each algorithm spent handling a report.
+//!
+//! The shadow runs after the primary has handled the report, so the primary's updates are sent
+//! first. Its time is budgeted as a share of the control thread's wall-clock time; reports that
+//! arrive while the budget is spent are not handed to the shadow, which therefore sees a sample
+//! of its flows' reports under load.
+
+use crate::ipc::Ipc;
+use crate::lang::{Reg, Scope};
+use crate::latency::Histogram;
+use crate::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::cell::Cell;
+use std::collections::HashMap;
+use std::rc::Rc;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+// How much unused budget the shadow may save up.
+const BURST: Duration = Duration::from_millis(10);
+
+/// What the primary and shadow algorithms did with one algorithm's flows.
+#[derive(Clone, Debug, Default)]
+pub struct ShadowSummary {
+    /// `CongAlg::name()` of the shadow algorithm.
+    pub shadow: &'static str,
+    /// Reports both algorithms handled.
+    pub compared: u64,
+    /// Of those, reports after which they set a different `Cwnd` or `Rate`.
+    pub diverged: u64,
+    /// Reports not handed to the shadow because its budget was spent.
+    pub skipped: u64,
+    /// Reports not handed to the shadow because they lack fields its program reports.
+    pub unmapped: u64,
+    /// Time each algorithm spent handling a compared report.
+    pub primary_cost: Histogram,
+    pub shadow_cost: Histogram,
+}
+
+/// Shadow execution results, by the `CongAlg::name()` of the primary algorithm. Clones share the
+/// same results.
+#[derive(Clone, Debug, Default)]
+pub struct ShadowStats(Arc<Mutex<HashMap<&'static str, ShadowSummary>>>);
+
+impl ShadowStats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// A copy of the current results.
+    pub fn snapshot(&self) -> HashMap<&'static str, ShadowSummary> {
+        self.0.lock().unwrap().clone()
+    }
+
+    fn update(
+        &self,
+        primary: &'static str,
+        shadow: &'static str,
+        f: impl FnOnce(&mut ShadowSummary),
+    ) {
+        let mut s = self.0.lock().unwrap();
+        let e = s.entry(primary).or_insert_with(|| ShadowSummary {
+            shadow,
+            ..Default::default()
+        });
+        f(e);
+    }
+}
+
+// `CongAlg` without its associated types, so the shadow algorithm can be any algorithm.
+pub(crate) trait ShadowAlg<I: Ipc>: Send {
+    fn name(&self) -> &'static str;
+    fn datapath_programs(&self) -> HashMap<&'static str, String>;
+    fn new_flow(&self, dp: Datapath<I>, info: DatapathInfo) -> Box<dyn Flow>;
+}
+
+impl<I: Ipc, A: CongAlg<I> + Send + 'static> ShadowAlg<I> for A
+where
+    A::Flow: 'static,
+{
+    fn name(&self) -> &'static str {
+        <A as CongAlg<I>>::name()
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        <A as CongAlg<I>>::datapath_programs(self)
+    }
+
+    fn new_flow(&self, dp: Datapath<I>, info: DatapathInfo) -> Box<dyn Flow> {
+        Box::new(<A as CongAlg<I>>::new_flow(self, dp, info))
+    }
+}
+
+/// The `Cwnd` and `Rate` a flow set in response to a report.
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+struct Decision {
+    cwnd: Option<u64>,
+    rate: Option<u64>,
+}
+
+// Records what a flow's `Datapath` sends. A capturing tap also stops it from being sent.
+#[derive(Debug)]
+pub(crate) struct Tap {
+    capture: bool,
+    // `Reg::Implicit` indices of `Cwnd` and `Rate`.
+    regs: (u8, u8),
+    program: Cell<Option<u32>>,
+    decision: Cell<Decision>,
+}
+
+impl Tap {
+    fn new(capture: bool, regs: (u8, u8)) -> Self {
+        Tap {
+            capture,
+            regs,
+            program: Cell::new(None),
+            decision: Cell::new(Decision::default()),
+        }
+    }
+
+    // Record a program change to `program` (if any) that updates `fields`, and return whether
+    // to send it.
+    pub(crate) fn record(&self, program: Option<u32>, fields: &[(Reg, u64)]) -> bool {
+        if program.is_some() {
+            self.program.set(program);
+        }
+
+        let mut d = self.decision.get();
+        for (reg, v) in fields {
+            match *reg {
+                Reg::Implicit(i, _) if i == self.regs.0 => d.cwnd = Some(*v),
+                Reg::Implicit(i, _) if i == self.regs.1 => d.rate = Some(*v),
+                _ => (),
+            }
+        }
+
+        self.decision.set(d);
+        !self.capture
+    }
+
+    fn take(&self) -> Decision {
+        self.decision.replace(Decision::default())
+    }
+}
+
+// A flow's shadow, and the taps on the primary and shadow flows' datapaths.
+pub(crate) struct ShadowFlow {
+    flow: Box<dyn Flow>,
+    tap: Rc<Tap>,
+    primary: Rc<Tap>,
+}
+
+impl ShadowFlow {
+    pub(crate) fn close(&mut self) {
+        self.flow.close();
+    }
+}
+
+// The shadow algorithm and its programs, and the budget of its time.
+pub(crate) struct Shadow<I: Ipc> {
+    alg: Box<dyn ShadowAlg<I>>,
+    name: &'static str,
+    programs: Rc<HashMap<String, Scope>>,
+    // each algorithm's programs by uid, and for a (primary, shadow) program pair, where each of
+    // the shadow program's report fields is in the primary program's reports.
+    shadow_scopes: HashMap<u32, Scope>,
+    primary_scopes: HashMap<u32, Scope>,
+    layouts: HashMap<(u32, u32), Option<Vec<usize>>>,
+    regs: (u8, u8),
+    share: f64,
+    credit_ns: f64,
+    last: Instant,
+    stats: ShadowStats,
+}
+
+// The `Reg::Implicit` indices of `Cwnd` and `Rate`, which are the same in every program.
+fn decision_regs<'a>(mut scopes: impl Iterator<Item = &'a Scope>) -> (u8, u8) {
+    let regs = |sc: &Scope| match (sc.get("Cwnd"), sc.get("Rate")) {
+        (Some(Reg::Implicit(c, _)), Some(Reg::Implicit(r, _))) => Some((*c, *r)),
+        _ => None,
+    };
+    scopes
+        .find_map(regs)
+        .or_else(|| regs(&Scope::new()))
+        .unwrap_or_default()
+}
+
+impl<I: Ipc> Shadow<I> {
+    // `programs` are the shadow's compiled programs, and `primary` the primary's.
+    pub(crate) fn new(
+        alg: Box<dyn ShadowAlg<I>>,
+        programs: HashMap<String, Scope>,
+        primary: &HashMap<String, Scope>,
+        share: f64,
+        stats: ShadowStats,
+    ) -> Self {
+        let regs = decision_regs(primary.values().chain(programs.values()));
+        Shadow {
+            name: alg.name(),
+            alg,
+            shadow_scopes: programs
+                .values()
+                .map(|sc| (sc.program_uid, sc.clone()))
+                .collect(),
+            primary_scopes: primary
+                .values()
+                .map(|sc| (sc.program_uid, sc.clone()))
+                .collect(),
+            programs: Rc::new(programs),
+            layouts: HashMap::new(),
+            regs,
+            share: share.max(0.0),
+            credit_ns: BURST.as_nanos() as f64,
+            last: Instant::now(),
+            stats,
+        }
+    }
+
+    // The shadow of the flow that `primary` controls. Call before the primary flow is created,
+    // so that its decisions are recorded too.
+    pub(crate) fn new_flow(&self, primary: &mut Datapath<I>, info: &DatapathInfo) -> ShadowFlow {
+        let tap = Rc::new(Tap::new(true, self.regs));
+        let primary_tap = Rc::new(Tap::new(false, self.regs));
+        primary.tap = Some(primary_tap.clone());
+        let dp = Datapath {
+            sock_id: info.sock_id,
+            sender: primary.sender.clone(),
+            programs: self.programs.clone(),
+            timer: None,
+            tap: Some(tap.clone()),
+        };
+
+        ShadowFlow {
+            flow: self.alg.new_flow(dp, info.clone()),
+            tap,
+            primary: primary_tap,
+        }
+    }
+
+    // Whether the shadow of a flow of `primary` may handle the next report, which is then about
+    // to be handed to the primary flow.
+    pub(crate) fn admit(&mut self, primary: &'static str, flow: &ShadowFlow) -> bool {
+        let now = Instant::now();
+        let earned = now.duration_since(self.last).as_nanos() as f64 * self.share;
+        self.credit_ns = (self.credit_ns + earned).min(BURST.as_nanos() as f64);
+        self.last = now;
+        if self.credit_ns <= 0.0 {
+            self.stats.update(primary, self.name, |s| s.skipped += 1);
+            return false;
+        }
+
+        flow.primary.take();
+        true
+    }
+
+    // Hand a report the primary flow of algorithm `primary` handled, in `primary_cost`, to its
+    // shadow, and compare their decisions.
+    pub(crate) fn report(
+        &mut self,
+        primary: &'static str,
+        primary_cost: Duration,
+        flow: &mut ShadowFlow,
+        sock_id: u32,
+        mut report: Report,
+    ) {
+        if let Some(uid) = flow.tap.program.get() {
+            if uid != report.program_uid {
+                let fields = &report.fields;
+                let mapped = self
+                    .layout(report.program_uid, uid)
+                    .filter(|idx| idx.iter().all(|&i| i < fields.len()))
+                    .map(|idx| idx.iter().map(|&i| fields[i]).collect());
+                match mapped {
+                    Some(fields) => {
+                        report.fields = fields;
+                        report.program_uid = uid;
+                    }
+                    None => {
+                        self.stats.update(primary, self.name, |s| s.unmapped += 1);
+                        return;
+                    }
+                }
+            }
+        }
+
+        let start = Instant::now();
+        flow.flow.on_report(sock_id, report);
+        let cost = start.elapsed();
+        self.credit_ns -= cost.as_nanos() as f64;
+
+        let diverged = flow.primary.take() != flow.tap.take();
+        self.stats.update(primary, self.name, |s| {
+            s.compared += 1;
+            s.diverged += diverged as u64;
+            s.primary_cost.record(primary_cost.as_nanos() as u64);
+            s.shadow_cost.record(cost.as_nanos() as u64);
+        });
+    }
+
+    fn layout(&mut self, primary: u32, shadow: u32) -> Option<&Vec<usize>> {
+        let (primary_scopes, shadow_scopes) = (&self.primary_scopes, &self.shadow_scopes);
+        self.layouts
+            .entry((primary, shadow))
+            .or_insert_with(|| {
+                let from = primary_scopes.get(&primary)?;
+                shadow_scopes
+                    .get(&shadow)?
+                    .report_regs()
+                    .into_iter()
+                    .map(|(name, _)| match from.get(name) {
+                        Some(Reg::Report(i, _, _)) => Some(*i as usize),
+                        _ => None,
+                    })
+                    .collect()
+            })
+            .as_ref()
+    }
+}
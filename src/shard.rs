@@ -0,0 +1,536 @@
+//! Spread the datapaths on a host across several CCP worker processes.
+//!
+//! A `Frontend` binds the unix socket that datapaths send to, and forwards each datagram to one of
+//! N workers, each a separate CCP runtime (`RunBuilder`) on a `WorkerSocket`. A datapath is
+//! assigned to a worker by consistent hashing of its address when it sends ready, and its later
+//! messages follow it there. The forwarded datagram carries the datapath's address, and workers
+//! send to the datapath directly, so replies do not pass through the front-end.
+//!
+//! A worker that cannot be sent to is marked down, and its datapaths move to the next worker on the
+//! ring: each gets a ready message on its behalf at the new worker, which installs its programs.
+//! Flows the datapath had on the old worker are unknown to the new one (as after a CCP restart;
+//! see `checkpoint`) until the datapath creates them again. Workers that are down are probed
+//! periodically, and take new datapaths again once they answer. The front-end never waits on a
+//! worker: a datagram for a worker whose queue is full is dropped, as the kernel would drop it
+//! for a datapath sending to a busy CCP. `ShardStats` reports how many datapaths and messages each
+//! worker has, and how many were dropped.
+
+use crate::ipc::{would_block, MAX_MSG_LEN};
+use crate::run::CCPHandle;
+use crate::serialize::{self, ready};
+use crate::{checkpoint, Error, Result};
+use std::collections::{HashMap, HashSet};
+use std::ffi::OsStr;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixDatagram;
+use std::path::{Path, PathBuf};
+use std::sync::{atomic, Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use tracing::{debug, info};
+
+// Each forwarded datagram starts with the datapath's address: its length, then the
+// path, padded to the longest unix socket path.
+const FRAME_HDR: usize = 2 + 108;
+// Points per worker on the hash ring.
+const VNODES: usize = 64;
+
+fn bind(name: &str) -> Result<UnixDatagram> {
+    let path = format!("/tmp/ccp/{}", name);
+    match std::fs::create_dir_all("/tmp/ccp/").err() {
+        Some(ref e) if e.kind() == std::io::ErrorKind::AlreadyExists => Ok(()),
+        Some(e) => Err(e),
+        None => Ok(()),
+    }?;
+
+    match std::fs::remove_file(&path).err() {
+        Some(ref e) if e.kind() == std::io::ErrorKind::NotFound => Ok(()),
+        Some(e) => Err(e),
+        None => Ok(()),
+    }?;
+
+    let sock = UnixDatagram::bind(path)?;
+    sock.set_read_timeout(Some(Duration::from_secs(1)))?;
+    Ok(sock)
+}
+
+/// The IPC socket of a worker behind a `Frontend`.
+///
+/// Like a `unix::Socket`, its `Addr` is the datapath's address, taken from each forwarded
+/// datagram rather than from its sender.
+pub struct WorkerSocket {
+    sk: UnixDatagram,
+}
+
+impl WorkerSocket {
+    /// Bind `/tmp/ccp/<name>`, one of the worker names given to `Frontend::new`.
+    pub fn new(name: &str) -> Result<Self> {
+        Ok(WorkerSocket { sk: bind(name)? })
+    }
+}
+
+impl super::ipc::Ipc for WorkerSocket {
+    type Addr = PathBuf;
+
+    fn name() -> String {
+        String::from("shard")
+    }
+
+    fn send(&self, msg: &[u8], to: &Self::Addr) -> Result<()> {
+        let to = format!(
+            "/tmp/ccp/{}",
+            to.as_path()
+                .as_os_str()
+                .to_str()
+                .ok_or_else(|| Error("invalid addrress".to_owned()))?
+        );
+        self.sk.send_to(msg, to).map(|_| ()).map_err(Error::from)
+    }
+
+    // The frame header and the message are read into separate buffers, so the message needs no
+    // copy. A datagram with no message is the front-end's probe, and reads as empty.
+    fn recv(&self, msg: &mut [u8]) -> Result<(usize, Self::Addr)> {
+        let mut hdr = [0u8; FRAME_HDR];
+        let mut iov = [
+            libc::iovec {
+                iov_base: hdr.as_mut_ptr() as *mut libc::c_void,
+                iov_len: hdr.len(),
+            },
+            libc::iovec {
+                iov_base: msg.as_mut_ptr() as *mut libc::c_void,
+                iov_len: msg.len(),
+            },
+        ];
+        let mut mh: libc::msghdr = unsafe { std::mem::zeroed() };
+        mh.msg_iov = iov.as_mut_ptr();
+        mh.msg_iovlen = iov.len() as _;
+
+        let read = unsafe { libc::recvmsg(self.sk.as_raw_fd(), &mut mh, 0) };
+        if read < 0 {
+            let err = std::io::Error::last_os_error();
+            if would_block(&err) {
+                return Ok((0, PathBuf::new()));
+            }
+
+            return Err(Error::from(err));
+        }
+
+        if mh.msg_flags & libc::MSG_TRUNC != 0 {
+            return Err(Error(format!(
+                "forwarded datagram truncated to the {}-byte receive buffer",
+                msg.len()
+            )));
+        }
+
+        let read = read as usize;
+        if read <= FRAME_HDR {
+            return Ok((0, PathBuf::new()));
+        }
+
+        let len = (u16::from_le_bytes([hdr[0], hdr[1]]) as usize).min(FRAME_HDR - 2);
+        let addr = PathBuf::from(OsStr::from_bytes(&hdr[2..2 + len]));
+        Ok((read - FRAME_HDR, addr))
+    }
+
+    fn addr_bytes(addr: &Self::Addr) -> &[u8] {
+        addr.as_os_str().as_bytes()
+    }
+
+    fn addr_from_bytes(bytes: &[u8]) -> Option<Self::Addr> {
+        Some(PathBuf::from(OsStr::from_bytes(bytes)))
+    }
+
+    fn close(&mut self) -> Result<()> {
+        use std::net::Shutdown;
+        self.sk.shutdown(Shutdown::Both).map_err(Error::from)
+    }
+}
+
+impl AsRawFd for WorkerSocket {
+    fn as_raw_fd(&self) -> RawFd {
+        self.sk.as_raw_fd()
+    }
+}
+
+/// Load on one worker.
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct WorkerStats {
+    pub name: String,
+    pub up: bool,
+    /// Datapaths assigned to the worker now.
+    pub datapaths: usize,
+    /// Datagrams and bytes forwarded to the worker.
+    pub msgs: u64,
+    pub bytes: u64,
+    /// Datagrams dropped because the worker's queue was full.
+    pub dropped: u64,
+    /// Times the worker was found down.
+    pub failures: u64,
+    /// Datapaths moved off the worker because it was down.
+    pub reassigned: u64,
+}
+
+/// Per-worker load of a `Frontend`, readable from any thread.
+#[derive(Clone, Debug, Default)]
+pub struct ShardStats(Arc<Mutex<Vec<WorkerStats>>>);
+
+impl ShardStats {
+    pub fn new() -> Self {
+        Default::default()
+    }
+
+    pub fn snapshot(&self) -> Vec<WorkerStats> {
+        self.0.lock().unwrap().clone()
+    }
+
+    /// The most datapaths on one worker over the mean across workers that are up: 1.0 is a
+    /// perfect balance.
+    pub fn imbalance(&self) -> f64 {
+        let s = self.0.lock().unwrap();
+        let up: Vec<_> = s.iter().filter(|w| w.up).map(|w| w.datapaths).collect();
+        let total: usize = up.iter().sum();
+        if total == 0 {
+            return 1.0;
+        }
+
+        let mean = total as f64 / up.len() as f64;
+        *up.iter().max().unwrap() as f64 / mean
+    }
+
+    fn update(&self, w: usize, f: impl FnOnce(&mut WorkerStats)) {
+        if let Some(s) = self.0.lock().unwrap().get_mut(w) {
+            f(s);
+        }
+    }
+}
+
+// Worker choice by consistent hashing: each worker owns the ring arcs ending at its points, so a
+// worker going down moves only its own datapaths.
+struct Ring(Vec<(u64, usize)>);
+
+// FNV-1a, with murmur3's finalizer so that keys differing only in their last bytes (as datapath
+// and worker names do) land far apart on the ring.
+fn ring_hash(key: &[u8]) -> u64 {
+    let mut h = checkpoint::digest(key);
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xff51_afd7_ed55_8ccd);
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xc4ce_b9fe_1a85_ec53);
+    h ^ (h >> 33)
+}
+
+impl Ring {
+    fn new(workers: &[&str]) -> Self {
+        let mut points: Vec<(u64, usize)> = workers
+            .iter()
+            .enumerate()
+            .flat_map(|(i, name)| {
+                (0..VNODES).map(move |v| (ring_hash(format!("{}#{}", name, v).as_bytes()), i))
+            })
+            .collect();
+        points.sort_unstable();
+        Ring(points)
+    }
+
+    // The first worker at or after `key`'s point that `up` accepts.
+    fn pick(&self, key: &[u8], up: impl Fn(usize) -> bool) -> Option<usize> {
+        let h = ring_hash(key);
+        let start = self.0.partition_point(|&(p, _)| p < h);
+        self.0[start..]
+            .iter()
+            .chain(self.0[..start].iter())
+            .map(|&(_, w)| w)
+            .find(|&w| up(w))
+    }
+}
+
+struct Worker {
+    path: PathBuf,
+    up: bool,
+}
+
+/// Forwards datapath messages to CCP workers; see the module documentation.
+pub struct Frontend {
+    sock: UnixDatagram,
+    // sends to workers without blocking.
+    out: UnixDatagram,
+    workers: Vec<Worker>,
+    ring: Ring,
+    assigned: HashMap<PathBuf, usize>,
+    // datapaths whose worker went down, which need a ready at their new worker.
+    orphaned: HashSet<PathBuf>,
+    stats: ShardStats,
+    probe_interval: Duration,
+    last_probe: Instant,
+}
+
+impl Frontend {
+    /// Bind `/tmp/ccp/<bind_to>`, where datapaths send, and forward to the workers bound at
+    /// `/tmp/ccp/<worker>` (see `WorkerSocket::new`).
+    pub fn new(bind_to: &str, workers: &[&str]) -> Result<Self> {
+        if workers.is_empty() {
+            return Err(Error(String::from("no workers to forward to")));
+        }
+
+        let stats = ShardStats::new();
+        *stats.0.lock().unwrap() = workers
+            .iter()
+            .map(|name| WorkerStats {
+                name: name.to_string(),
+                up: true,
+                ..Default::default()
+            })
+            .collect();
+        let out = UnixDatagram::unbound()?;
+        out.set_nonblocking(true)?;
+        Ok(Frontend {
+            sock: bind(bind_to)?,
+            out,
+            workers: workers
+                .iter()
+                .map(|name| Worker {
+                    path: PathBuf::from(format!("/tmp/ccp/{}", name)),
+                    up: true,
+                })
+                .collect(),
+            ring: Ring::new(workers),
+            assigned: HashMap::new(),
+            orphaned: HashSet::new(),
+            stats,
+            probe_interval: Duration::from_secs(1),
+            last_probe: Instant::now(),
+        })
+    }
+
+    /// Record per-worker load into `stats`.
+    pub fn with_stats(mut self, stats: ShardStats) -> Self {
+        *stats.0.lock().unwrap() = self.stats.snapshot();
+        self.stats = stats;
+        self
+    }
+
+    /// How often to check whether workers that are down have come back. One second by default.
+    pub fn with_probe_interval(mut self, interval: Duration) -> Self {
+        self.probe_interval = interval;
+        self
+    }
+
+    /// Forward messages until `continue_listening` is cleared.
+    pub fn run(mut self, continue_listening: Arc<atomic::AtomicBool>) -> Result<()> {
+        info!(workers = self.workers.len(), "starting CCP front-end");
+        let mut buf = vec![0u8; FRAME_HDR + MAX_MSG_LEN];
+        while continue_listening.load(atomic::Ordering::SeqCst) {
+            if self.last_probe.elapsed() >= self.probe_interval {
+                self.probe();
+            }
+
+            let (read, from) = match self.sock.recv_from(&mut buf[FRAME_HDR..]) {
+                Ok(r) => r,
+                Err(e) => {
+                    debug!(err = %e, "recv failed");
+                    continue;
+                }
+            };
+
+            // no CCP message fills the buffer, so one that does was truncated.
+            if read == MAX_MSG_LEN {
+                debug!(addr = ?from, "oversized datagram, dropping");
+                continue;
+            }
+
+            let addr = match from.as_pathname() {
+                Some(p) if p.as_os_str().len() <= FRAME_HDR - 2 => p.to_path_buf(),
+                _ => {
+                    debug!(addr = ?from, "message from an unnamed datapath, dropping");
+                    continue;
+                }
+            };
+
+            frame_header(&mut buf[..FRAME_HDR], &addr);
+            let is_ready = read >= 2 && buf[FRAME_HDR..FRAME_HDR + 2] == [ready::READY, 0];
+            self.forward(&addr, &buf[..FRAME_HDR + read], is_ready);
+        }
+
+        info!("front-end shutting down");
+        Ok(())
+    }
+
+    /// Run on a new thread.
+    pub fn spawn(self) -> CCPHandle {
+        let continue_listening = Arc::new(atomic::AtomicBool::new(true));
+        let stop = continue_listening.clone();
+        CCPHandle {
+            continue_listening,
+            join_handle: thread::spawn(move || self.run(stop)),
+        }
+    }
+
+    // Send `frame` from the datapath at `addr` to its worker, moving the datapath to another
+    // worker if that one is down.
+    fn forward(&mut self, addr: &Path, frame: &[u8], is_ready: bool) {
+        let mut moved = !is_ready && self.orphaned.contains(addr);
+        let mut w = match self.assigned.get(addr) {
+            Some(&w) if !is_ready => Some(w),
+            _ => self.assign(addr),
+        };
+
+        while let Some(to) = w {
+            let sent = if moved {
+                self.send_ready(to, addr)
+            } else {
+                Ok(true)
+            }
+            .and_then(|ready_sent| {
+                if ready_sent {
+                    self.send(to, frame)
+                } else {
+                    Ok(false)
+                }
+            });
+            match sent {
+                Ok(true) => return,
+                Ok(false) => {
+                    debug!(worker = ?self.workers[to].path, "worker overloaded, dropping message");
+                    self.stats.update(to, |s| s.dropped += 1);
+                    // the datapath still needs its ready at the new worker.
+                    if moved {
+                        self.orphaned.insert(addr.to_path_buf());
+                    }
+
+                    return;
+                }
+                Err(e) => {
+                    info!(worker = ?self.workers[to].path, err = ?e, "worker down, moving its datapaths");
+                    self.worker_down(to);
+                    moved = !is_ready;
+                    w = self.assign(addr);
+                }
+            }
+        }
+
+        info!(addr = ?addr, "no worker up, dropping message");
+    }
+
+    // Give the datapath at `addr` a worker from the ring.
+    fn assign(&mut self, addr: &Path) -> Option<usize> {
+        let workers = &self.workers;
+        let w = self
+            .ring
+            .pick(addr.as_os_str().as_bytes(), |w| workers[w].up)?;
+        self.orphaned.remove(addr);
+        if let Some(old) = self.assigned.insert(addr.to_path_buf(), w) {
+            self.stats.update(old, |s| s.datapaths -= 1);
+        }
+
+        self.stats.update(w, |s| s.datapaths += 1);
+        debug!(addr = ?addr, worker = ?self.workers[w].path, "assigned datapath");
+        Some(w)
+    }
+
+    fn worker_down(&mut self, w: usize) {
+        self.workers[w].up = false;
+        let moved: Vec<PathBuf> = self
+            .assigned
+            .iter()
+            .filter(|&(_, &to)| to == w)
+            .map(|(addr, _)| addr.clone())
+            .collect();
+        for addr in &moved {
+            self.assigned.remove(addr);
+        }
+
+        let n = moved.len();
+        self.orphaned.extend(moved);
+        self.stats.update(w, |s| {
+            s.up = false;
+            s.failures += 1;
+            s.datapaths = 0;
+            s.reassigned += n as u64;
+        });
+    }
+
+    // Whether `frame` was sent: false if worker `w`'s queue is full. Errors mean it is down.
+    fn send(&self, w: usize, frame: &[u8]) -> Result<bool> {
+        match self.out.send_to(frame, &self.workers[w].path) {
+            Ok(_) => (),
+            Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => return Ok(false),
+            Err(e) => return Err(Error::from(e)),
+        }
+
+        self.stats.update(w, |s| {
+            s.msgs += 1;
+            s.bytes += frame.len() as u64;
+        });
+        Ok(true)
+    }
+
+    // A ready message from the datapath at `addr`, so that worker `w` installs its programs.
+    fn send_ready(&self, w: usize, addr: &Path) -> Result<bool> {
+        let msg = serialize::serialize(&ready::Msg { id: 0 })?;
+        let mut frame = vec![0u8; FRAME_HDR + msg.len()];
+        frame_header(&mut frame[..FRAME_HDR], addr);
+        frame[FRAME_HDR..].copy_from_slice(&msg);
+        self.send(w, &frame)
+    }
+
+    // An empty frame reaches a worker that is up, which ignores it. A worker whose queue is full
+    // is up too.
+    fn probe(&mut self) {
+        self.last_probe = Instant::now();
+        let probe = [0u8; FRAME_HDR];
+        for (w, worker) in self.workers.iter_mut().enumerate() {
+            if worker.up {
+                continue;
+            }
+
+            let answered = match self.out.send_to(&probe, &worker.path) {
+                Ok(_) => true,
+                Err(e) => e.kind() == std::io::ErrorKind::WouldBlock,
+            };
+            if answered {
+                info!(worker = ?worker.path, "worker up again");
+                worker.up = true;
+                self.stats.update(w, |s| s.up = true);
+            }
+        }
+    }
+}
+
+fn frame_header(hdr: &mut [u8], addr: &Path) {
+    let addr = addr.as_os_str().as_bytes();
+    hdr[..2].copy_from_slice(&(addr.len() as u16).to_le_bytes());
+    hdr[2..2 + addr.len()].copy_from_slice(addr);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Ring;
+
+    #[test]
+    fn ring_spreads_and_moves_only_down_workers() {
+        let ring = Ring::new(&["w0", "w1", "w2", "w3"]);
+        let keys: Vec<String> = (0..4000).map(|i| format!("dp-{}", i)).collect();
+        let before: Vec<usize> = keys
+            .iter()
+            .map(|k| ring.pick(k.as_bytes(), |_| true).unwrap())
+            .collect();
+
+        for w in 0..4 {
+            let n = before.iter().filter(|&&b| b == w).count();
+            assert!(n > 500 && n < 1500, "worker {} has {} of 4000", w, n);
+        }
+
+        // with w2 down, only its datapaths move.
+        for (k, &b) in keys.iter().zip(&before) {
+            let after = ring.pick(k.as_bytes(), |w| w != 2).unwrap();
+            if b == 2 {
+                assert_ne!(after, 2);
+            } else {
+                assert_eq!(after, b);
+            }
+        }
+
+        assert_eq!(ring.pick(b"dp", |_| false), None);
+    }
+}
@@ -13,15 +13,13 @@ fn test_ser_over_ipc() {
         let mut b1 = ipc::Backend::new(sk1, Arc::new(atomic::AtomicBool::new(true)), &mut buf[..]);
         tx.send(true).expect("ready chan send");
         let (msg, _) = b1.next().expect("receive message");
-        assert_eq!(
-            msg,
-            serialize::Msg::Ms(serialize::measure::Msg {
-                sid: 42,
-                program_uid: 7,
-                num_fields: 1,
-                fields: vec![0],
-            })
-        );
+        match msg {
+            serialize::Msg::Ms(m) => {
+                assert_eq!((m.sid(), m.program_uid()), (42, 7));
+                assert_eq!(m.fields().collect::<Vec<_>>(), vec![0]);
+            }
+            m => panic!("wrong type for message: {:?}", m),
+        }
     });
 
     let sk2 = sk.clone();
@@ -45,3 +43,60 @@ fn test_ser_over_ipc() {
     c2.join().expect("join sender thread");
     c1.join().expect("join rcvr thread");
 }
+
+#[test]
+fn test_report_decode() {
+    use super::lang;
+    use super::{Report, ReportStruct};
+
+    #[derive(Debug, PartialEq)]
+    struct TestReport {
+        acked: u64,
+        loss: bool,
+    }
+
+    impl ReportStruct for TestReport {
+        const FIELDS: &'static [&'static str] = &["Report.acked", "Report.loss"];
+
+        fn from_fields(fields: &[u64]) -> Self {
+            TestReport {
+                acked: fields[0],
+                loss: fields[1] != 0,
+            }
+        }
+    }
+
+    let (_, sc) = lang::compile(
+        b"(def (Report (volatile acked 0) (loss false))) (when true (report))",
+        &[],
+    )
+    .expect("compile");
+    TestReport::check_scope(&sc).expect("scope matches");
+
+    let mut r = Report {
+        program_uid: sc.program_uid,
+        from: String::new(),
+        fields: vec![1448, 1],
+        received_at: std::time::Instant::now(),
+    };
+    assert_eq!(
+        r.decode::<TestReport>(&sc).unwrap(),
+        TestReport {
+            acked: 1448,
+            loss: true
+        }
+    );
+
+    r.fields.pop();
+    assert!(r.decode::<TestReport>(&sc).is_err());
+    r.program_uid += 1;
+    assert!(r.decode::<TestReport>(&sc).is_err());
+
+    // the fields in the other order are a different layout.
+    let (_, other) = lang::compile(
+        b"(def (Report (loss false) (volatile acked 0))) (when true (report))",
+        &[],
+    )
+    .expect("compile");
+    assert!(TestReport::check_scope(&other).is_err());
+}
@@ -1,10 +1,16 @@
-//! Helper type for writing unit tests.
+//! Helpers for writing tests.
+
+use super::ipc::{chan, Blocking};
+use super::serialize;
+use super::Error;
+use crossbeam::channel;
+use std::collections::HashMap;
+use std::io::prelude::*;
+use std::time::Duration;
 
 #[derive(Clone, Debug, PartialEq)]
 pub struct TestMsg(pub String);
 
-use super::serialize;
-use std::io::prelude::*;
 impl serialize::AsRawMsg for TestMsg {
     fn get_hdr(&self) -> (u8, u32, u32) {
         (0xff, serialize::HDR_LENGTH + self.0.len() as u32, 0)
@@ -25,3 +31,121 @@ impl serialize::AsRawMsg for TestMsg {
         Ok(TestMsg(got))
     }
 }
+
+/// A stand-in datapath for tests of the CCP side.
+///
+/// It speaks the datapath half of the protocol over a `chan` socket but runs no programs: the
+/// test decides what each flow measures, and sends it either as one measure message per flow or
+/// as a single batch measure message.
+pub struct StandInDatapath {
+    to_ccp: channel::Sender<Vec<u8>>,
+    from_ccp: channel::Receiver<Vec<u8>>,
+    // the program each flow was last switched to.
+    program_uids: HashMap<u32, u32>,
+}
+
+impl StandInDatapath {
+    /// Returns the datapath and the socket to give to `BackendBuilder`.
+    ///
+    /// The socket's receive times out every 10 ms rather than every second, so a runtime on it
+    /// notices `CCPHandle::kill` (or a `VirtualClock` passing its receive timeout) promptly.
+    pub fn new() -> (Self, chan::Socket<Blocking>) {
+        let (to_dp, from_ccp) = channel::unbounded();
+        let (to_ccp, from_dp) = channel::unbounded();
+        (
+            StandInDatapath {
+                to_ccp,
+                from_ccp,
+                program_uids: HashMap::new(),
+            },
+            chan::Socket::new(to_dp, from_dp).with_recv_timeout(Duration::from_millis(10)),
+        )
+    }
+
+    /// A new socket, for a restarted CCP. The flows keep their programs, as they do in a real
+    /// datapath when CCP restarts.
+    pub fn reconnect(&mut self) -> chan::Socket<Blocking> {
+        let (dp, sock) = Self::new();
+        self.to_ccp = dp.to_ccp;
+        self.from_ccp = dp.from_ccp;
+        sock
+    }
+
+    fn send<M: serialize::AsRawMsg>(&self, msg: &M) -> super::Result<()> {
+        self.to_ccp.send(serialize::serialize(msg)?)?;
+        Ok(())
+    }
+
+    pub fn ready(&self) -> super::Result<()> {
+        self.send(&serialize::ready::Msg { id: 0 })
+    }
+
+    pub fn create(&self, sid: u32) -> super::Result<()> {
+        self.send(&serialize::create::Msg {
+            sid,
+            init_cwnd: 14480,
+            mss: 1448,
+            src_ip: 0,
+            src_port: 4242,
+            dst_ip: 0,
+            dst_port: sid,
+            cong_alg: None,
+        })
+    }
+
+    pub fn program_uid(&self, sid: u32) -> Option<u32> {
+        self.program_uids.get(&sid).copied()
+    }
+
+    /// Receive messages from CCP until one of type `typ` arrives, and return it.
+    ///
+    /// Program changes received along the way are applied to their flows.
+    pub fn recv_until(&mut self, typ: u8, timeout: Duration) -> super::Result<Vec<u8>> {
+        loop {
+            let buf = self.from_ccp.recv_timeout(timeout)?;
+            let msg = serialize::RawMsg::parse(&buf)?;
+            if msg.typ == serialize::changeprog::CHANGEPROG {
+                let uid = msg
+                    .payload()
+                    .get(0..4)
+                    .ok_or_else(|| Error(String::from("change program message too short")))?;
+                self.program_uids
+                    .insert(msg.sid, serialize::u32_from_u8s(uid));
+            }
+
+            if msg.typ == typ {
+                return Ok(buf);
+            }
+        }
+    }
+
+    fn report(&self, sid: u32, fields: Vec<u64>) -> super::Result<serialize::measure::Msg> {
+        let program_uid = self
+            .program_uid(sid)
+            .ok_or_else(|| Error(format!("flow {} has no program", sid)))?;
+        Ok(serialize::measure::Msg {
+            sid,
+            program_uid,
+            num_fields: fields.len() as u8,
+            fields,
+        })
+    }
+
+    /// Report `fields` for flow `sid`. No fields closes the flow.
+    pub fn measure(&self, sid: u32, fields: Vec<u64>) -> super::Result<()> {
+        self.send(&self.report(sid, fields)?)
+    }
+
+    /// Report for several flows in one batch measure message, or in as few as fit.
+    pub fn batch_measure(&self, reports: Vec<(u32, Vec<u64>)>) -> super::Result<()> {
+        let reports = reports
+            .into_iter()
+            .map(|(sid, fields)| self.report(sid, fields))
+            .collect::<super::Result<Vec<_>>>()?;
+        for batch in serialize::batch_measure::Msg::batches(reports) {
+            self.send(&batch)?;
+        }
+
+        Ok(())
+    }
+}
@@ -0,0 +1,258 @@
+//! Upgrades that hand the IPC socket from a running CCP to its successor, so the datapath never
+//! sees the socket close.
+//!
+//! A runtime built with `RunBuilder::with_upgrade(name)` listens on the unix stream socket
+//! `/tmp/ccp/<name>.upgrade`. The successor calls `take_over(name)`, which connects there. The
+//! running runtime then stops reading from its IPC socket, handles the messages it has already
+//! read, and sends the socket's file descriptor (with `SCM_RIGHTS`) and a `checkpoint::Snapshot`
+//! of its flows to the successor. Once the successor acknowledges them, the old runtime returns
+//! without shutting the socket down. If the handoff fails before the descriptor is sent, it carries
+//! on as before; once the successor may have the socket, it stops, with an error, rather than
+//! reading from the socket alongside it.
+//!
+//! Messages the datapath sends meanwhile wait in the socket's queue for the successor. Pass the
+//! socket and snapshot `take_over` returns to `RunBuilder::taking_over`: the successor installs its
+//! programs on the datapaths in the snapshot, and takes each flow over, as it does from a
+//! checkpoint, when the flow next reports. Flows whose `Flow::export_state` returns `None` do not
+//! survive the upgrade.
+
+use crate::checkpoint::Snapshot;
+use crate::ipc::unix;
+use crate::{Error, Result};
+use std::io::prelude::*;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::{UnixDatagram, UnixListener, UnixStream};
+use std::sync::{atomic, Arc, Mutex};
+use std::thread;
+use std::time::Duration;
+use tracing::{debug, info};
+
+// How long each side waits for the other during a handoff.
+const HANDOFF_TIMEOUT: Duration = Duration::from_secs(5);
+// How often the listener checks for a successor.
+const ACCEPT_INTERVAL: Duration = Duration::from_millis(50);
+
+fn control_path(name: &str) -> String {
+    format!("/tmp/ccp/{}.upgrade", name)
+}
+
+/// Connect to the runtime upgrading from, and take over its IPC socket and flows.
+///
+/// `name` is the name that runtime passed to `RunBuilder::with_upgrade`.
+pub fn take_over(name: &str) -> Result<(unix::Socket<crate::ipc::Blocking>, Snapshot)> {
+    let mut stream = UnixStream::connect(control_path(name))?;
+    stream.set_read_timeout(Some(HANDOFF_TIMEOUT))?;
+
+    let mut len = [0u8; 8];
+    let fd = recv_fd(stream.as_raw_fd(), &mut len)?;
+    // own the descriptor before anything else can fail, so that it is closed if something does.
+    let sk = unsafe { UnixDatagram::from_raw_fd(fd) };
+    let mut state = vec![0u8; u64::from_le_bytes(len) as usize];
+    stream.read_exact(&mut state)?;
+    let snap = Snapshot::decode(&state)?;
+
+    stream.write_all(&[1])?;
+    info!(
+        name,
+        datapaths = snap.datapaths.len(),
+        flows = snap.flows.len(),
+        "took over IPC socket"
+    );
+    Ok((unix::Socket::from_std(sk), snap))
+}
+
+// The upgrade listener of a runtime, bound by `RunBuilder::with_upgrade`.
+pub(crate) struct Listener {
+    listener: UnixListener,
+    fd: RawFd,
+    released: Arc<atomic::AtomicBool>,
+}
+
+impl Listener {
+    pub(crate) fn bind<T>(name: &str, sock: &unix::Socket<T>) -> Result<Self> {
+        let path = control_path(name);
+        match std::fs::remove_file(&path).err() {
+            Some(ref e) if e.kind() == std::io::ErrorKind::NotFound => Ok(()),
+            Some(e) => Err(e),
+            None => Ok(()),
+        }?;
+
+        let listener = UnixListener::bind(&path)?;
+        listener.set_nonblocking(true)?;
+        Ok(Listener {
+            listener,
+            fd: sock.as_raw_fd(),
+            released: sock.released(),
+        })
+    }
+
+    // Wait for a successor on another thread. When one connects, `pause` is set, so that the
+    // runtime stops reading and calls `Watcher::successor`. It is separate from the runtime's stop
+    // handle, so that a failed handoff does not undo `CCPHandle::kill`.
+    pub(crate) fn watch(self, pause: Arc<atomic::AtomicBool>) -> Watcher {
+        let successor = Arc::new(Mutex::new(None));
+        let done = Arc::new(atomic::AtomicBool::new(false));
+        let thread = {
+            let successor = successor.clone();
+            let done = done.clone();
+            let listener = self.listener;
+            thread::spawn(move || {
+                while !done.load(atomic::Ordering::SeqCst) {
+                    match listener.accept() {
+                        Ok((stream, _)) => {
+                            info!("successor connected, handing off");
+                            *successor.lock().unwrap() = Some(stream);
+                            pause.store(true, atomic::Ordering::SeqCst);
+                        }
+                        Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => (),
+                        Err(e) => debug!(err = %e, "upgrade accept failed"),
+                    }
+
+                    thread::sleep(ACCEPT_INTERVAL);
+                }
+            })
+        };
+
+        Watcher {
+            successor,
+            done,
+            thread: Some(thread),
+            fd: self.fd,
+            released: self.released,
+        }
+    }
+}
+
+/// How a handoff failed.
+#[derive(Debug)]
+pub(crate) enum HandoffError {
+    /// Before the socket was sent: the runtime still has it to itself.
+    NotSent(Error),
+    /// After: the successor may be reading from the socket.
+    Sent(Error),
+}
+
+pub(crate) struct Watcher {
+    successor: Arc<Mutex<Option<UnixStream>>>,
+    done: Arc<atomic::AtomicBool>,
+    thread: Option<thread::JoinHandle<()>>,
+    fd: RawFd,
+    released: Arc<atomic::AtomicBool>,
+}
+
+impl Watcher {
+    /// The successor that connected, if one has.
+    pub(crate) fn successor(&self) -> Option<UnixStream> {
+        self.successor.lock().unwrap().take()
+    }
+
+    /// Send the IPC socket and `snap` to `successor`, and release the socket once it has them.
+    ///
+    /// The socket is released too if the handoff fails after sending it, so that closing it here
+    /// does not shut it down under the successor.
+    pub(crate) fn hand_off(
+        &self,
+        mut successor: UnixStream,
+        snap: &Snapshot,
+    ) -> std::result::Result<(), HandoffError> {
+        let state = snap.encode().map_err(HandoffError::NotSent)?;
+        successor
+            .set_nonblocking(false)
+            .and_then(|_| successor.set_read_timeout(Some(HANDOFF_TIMEOUT)))
+            .map_err(|e| HandoffError::NotSent(Error::from(e)))?;
+        let len = (state.len() as u64).to_le_bytes();
+        let sent = send_fd(successor.as_raw_fd(), &len, self.fd).map_err(HandoffError::NotSent)?;
+
+        self.released.store(true, atomic::Ordering::SeqCst);
+        if sent != len.len() {
+            return Err(HandoffError::Sent(Error(String::from(
+                "short write handing off socket",
+            ))));
+        }
+
+        let mut ack = [0u8; 1];
+        successor
+            .write_all(&state)
+            .and_then(|_| successor.read_exact(&mut ack))
+            .map_err(|e| HandoffError::Sent(Error::from(e)))
+    }
+}
+
+impl Drop for Watcher {
+    fn drop(&mut self) {
+        self.done.store(true, atomic::Ordering::SeqCst);
+        if let Some(t) = self.thread.take() {
+            t.join().unwrap_or_else(|_| ());
+        }
+    }
+}
+
+// `sendmsg(2)` `buf` on `sock`, passing `fd` along with it. Returns how much of `buf` was sent;
+// if any was, so was `fd`.
+fn send_fd(sock: RawFd, buf: &[u8], fd: RawFd) -> Result<usize> {
+    let mut iov = libc::iovec {
+        iov_base: buf.as_ptr() as *mut libc::c_void,
+        iov_len: buf.len(),
+    };
+    // room for one descriptor's control message, aligned for cmsghdr.
+    let mut control = [0u64; 4];
+    let fd_len = std::mem::size_of::<RawFd>() as libc::c_uint;
+    let mut hdr: libc::msghdr = unsafe { std::mem::zeroed() };
+    hdr.msg_iov = &mut iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+
+    let sent = unsafe {
+        hdr.msg_controllen = libc::CMSG_SPACE(fd_len) as _;
+        let c = libc::CMSG_FIRSTHDR(&hdr);
+        (*c).cmsg_level = libc::SOL_SOCKET;
+        (*c).cmsg_type = libc::SCM_RIGHTS;
+        (*c).cmsg_len = libc::CMSG_LEN(fd_len) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(c) as *mut RawFd, fd);
+        libc::sendmsg(sock, &hdr, 0)
+    };
+    if sent < 0 {
+        return Err(Error::from(std::io::Error::last_os_error()));
+    }
+
+    Ok(sent as usize)
+}
+
+// `recvmsg(2)` exactly `buf.len()` bytes from `sock`, and the descriptor passed along with them.
+fn recv_fd(sock: RawFd, buf: &mut [u8]) -> Result<RawFd> {
+    let mut iov = libc::iovec {
+        iov_base: buf.as_mut_ptr() as *mut libc::c_void,
+        iov_len: buf.len(),
+    };
+    let mut control = [0u64; 4];
+    let mut hdr: libc::msghdr = unsafe { std::mem::zeroed() };
+    hdr.msg_iov = &mut iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    hdr.msg_controllen = std::mem::size_of_val(&control) as _;
+
+    let read = unsafe { libc::recvmsg(sock, &mut hdr, 0) };
+    if read < 0 {
+        return Err(Error::from(std::io::Error::last_os_error()));
+    }
+
+    let mut fd = None;
+    unsafe {
+        let mut c = libc::CMSG_FIRSTHDR(&hdr);
+        while !c.is_null() {
+            if (*c).cmsg_level == libc::SOL_SOCKET && (*c).cmsg_type == libc::SCM_RIGHTS {
+                fd = Some(std::ptr::read_unaligned(libc::CMSG_DATA(c) as *const RawFd));
+            }
+
+            c = libc::CMSG_NXTHDR(&hdr, c);
+        }
+    }
+
+    let fd = fd.ok_or_else(|| Error(String::from("no socket in handoff")))?;
+    if read as usize != buf.len() {
+        unsafe { libc::close(fd) };
+        return Err(Error(String::from("short read taking over socket")));
+    }
+
+    Ok(fd)
+}
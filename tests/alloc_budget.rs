@@ -0,0 +1,540 @@
+//! Allocation budgets for the report path: receive, dispatch, `on_report`, and the flow's
+//! `update_field`, per IPC backend and report message type.
+//!
+//! A counting global allocator tallies allocations per thread. The flow under test reads the
+//! tally of the thread running it after a warmup and again `REPORTS` reports later, so the count
+//! covers exactly that many steady-state round trips on the runtime's thread, and nothing the
+//! test's stand-in datapath does elsewhere. A budget is allocations per report, at most. When
+//! one is exceeded, the case runs again briefly with a backtrace taken at every allocation, and
+//! the allocation sites are printed before the test fails.
+
+use crossbeam::channel;
+use portus::ipc::{chan, direct, unix, BackendBuilder, Blocking, Ipc, Nonblocking};
+use portus::lang::Scope;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::{Cell, RefCell};
+use std::collections::HashMap;
+use std::os::unix::net::UnixDatagram;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+const WARMUP: u64 = 1_000;
+const REPORTS: u64 = 100_000;
+// reports per run when looking for allocation sites.
+const TRACE_REPORTS: u64 = 100;
+// flows per batch measure message, one report each.
+const BATCH: u32 = 10;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(10);
+
+struct Counting;
+
+#[global_allocator]
+static ALLOC: Counting = Counting;
+
+// Set while re-running a case over budget: record a backtrace per allocation in the window.
+static TRACE: AtomicBool = AtomicBool::new(false);
+
+thread_local! {
+    static ALLOCS: Cell<u64> = Cell::new(0);
+    // whether this thread is inside a measured window.
+    static WINDOW: Cell<bool> = Cell::new(false);
+    // set while recording a site, whose own allocations are not counted.
+    static BUSY: Cell<bool> = Cell::new(false);
+    static SITES: RefCell<HashMap<String, u64>> = RefCell::new(HashMap::new());
+}
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        note();
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        note();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        note();
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+// `try_with` throughout: the allocator runs during thread-local teardown too.
+fn note() {
+    if BUSY.try_with(Cell::get).unwrap_or(true) {
+        return;
+    }
+
+    let _ = ALLOCS.try_with(|n| n.set(n.get() + 1));
+    if TRACE.load(Ordering::Relaxed) && WINDOW.try_with(Cell::get).unwrap_or(false) {
+        BUSY.with(|b| b.set(true));
+        let bt = std::backtrace::Backtrace::force_capture().to_string();
+        let site = call_site(&bt);
+        SITES.with(|s| *s.borrow_mut().entry(site).or_insert(0) += 1);
+        BUSY.with(|b| b.set(false));
+    }
+}
+
+// The innermost frames in portus or crossbeam, with the first one's location: past the
+// allocator, and short of the test's own flow.
+fn call_site(bt: &str) -> String {
+    let mut frames = vec![];
+    let mut lines = bt.lines().peekable();
+    while let Some(l) = lines.next() {
+        let sym = match l.trim_start().split_once(": ") {
+            Some((i, sym)) if i.chars().all(|c| c.is_ascii_digit()) => sym,
+            _ => continue,
+        };
+
+        if !(sym.contains("portus::") || sym.contains("crossbeam")) {
+            if frames.is_empty() {
+                continue;
+            } else {
+                break;
+            }
+        }
+
+        let mut f = sym.to_owned();
+        if frames.is_empty() {
+            if let Some(at) = lines
+                .peek()
+                .and_then(|l| l.trim_start().strip_prefix("at "))
+            {
+                f = format!("{} ({})", f, at);
+            }
+        }
+
+        frames.push(f);
+        if frames.len() == 3 {
+            break;
+        }
+    }
+
+    if frames.is_empty() {
+        String::from("<outside portus>")
+    } else {
+        frames.join("\n        <- ")
+    }
+}
+
+fn allocs() -> u64 {
+    ALLOCS.with(Cell::get)
+}
+
+#[derive(Debug, Default)]
+struct Measured {
+    allocs: u64,
+    sites: Vec<(String, u64)>,
+}
+
+// Shared by every flow of a run, which all report on the runtime's thread.
+struct Window {
+    reports: u64,
+    measure: u64,
+    start: u64,
+    done: Option<Measured>,
+}
+
+impl Window {
+    fn new(measure: u64) -> Arc<Mutex<Self>> {
+        Arc::new(Mutex::new(Window {
+            reports: 0,
+            measure,
+            start: 0,
+            done: None,
+        }))
+    }
+
+    fn report(&mut self) {
+        self.reports += 1;
+        if self.reports == WARMUP {
+            WINDOW.with(|w| w.set(true));
+            self.start = allocs();
+        } else if self.reports == WARMUP + self.measure {
+            let allocs = allocs() - self.start;
+            WINDOW.with(|w| w.set(false));
+            let mut sites: Vec<_> = SITES.with(|s| s.borrow_mut().drain().collect());
+            sites.sort_by(|a, b| b.1.cmp(&a.1));
+            self.done = Some(Measured { allocs, sites });
+        }
+    }
+}
+
+fn done(w: &Mutex<Window>) -> Option<Measured> {
+    w.lock().unwrap().done.take()
+}
+
+// For runtimes on their own thread, whose last update may arrive before its report is tallied.
+fn await_done(w: &Mutex<Window>, mut idle: impl FnMut()) -> Measured {
+    let deadline = Instant::now() + TIMEOUT;
+    loop {
+        if let Some(m) = done(w) {
+            return m;
+        }
+
+        assert!(Instant::now() < deadline, "reports stopped");
+        idle();
+    }
+}
+
+// Answers every report with a window update, as a typical algorithm does.
+struct Budget(Arc<Mutex<Window>>);
+
+struct BudgetFlow<I: Ipc> {
+    dp: Datapath<I>,
+    sc: Scope,
+    window: Arc<Mutex<Window>>,
+}
+
+impl<I: Ipc> CongAlg<I> for Budget {
+    type Flow = BudgetFlow<I>;
+
+    fn name() -> &'static str {
+        "alloc-budget"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "AllocBudget",
+            "
+            (def (Report (volatile acked 0)))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        let sc = dp.set_program("AllocBudget", None).unwrap();
+        BudgetFlow {
+            dp,
+            sc,
+            window: self.0.clone(),
+        }
+    }
+}
+
+impl<I: Ipc> Flow for BudgetFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        self.dp
+            .update_field(&self.sc, &[("Cwnd", 10 * acked as u32)])
+            .unwrap();
+        self.window.lock().unwrap().report();
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+enum Kind {
+    // one flow, one report per measure message.
+    Measure,
+    // `BATCH` flows, one report each per batch measure message.
+    Batch,
+}
+
+impl Kind {
+    fn flows(self) -> u32 {
+        match self {
+            Kind::Measure => 1,
+            Kind::Batch => BATCH,
+        }
+    }
+
+    // Every message the datapath sends: ready, a create per flow, and then enough reports to
+    // warm up and measure `n`.
+    fn setup(self) -> Vec<Vec<u8>> {
+        let mut msgs = vec![serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap()];
+        for sid in 1..=self.flows() {
+            msgs.push(
+                serialize::serialize(&serialize::create::Msg {
+                    sid,
+                    init_cwnd: 14480,
+                    mss: 1448,
+                    src_ip: 0,
+                    src_port: 4242,
+                    dst_ip: 0,
+                    dst_port: sid,
+                    cong_alg: None,
+                })
+                .unwrap(),
+            );
+        }
+
+        msgs
+    }
+
+    fn reports(self, program_uid: u32, n: u64) -> Vec<Vec<u8>> {
+        let report = |sid| serialize::measure::Msg {
+            sid,
+            program_uid,
+            num_fields: 1,
+            fields: vec![1448],
+        };
+
+        let msgs = (WARMUP + n) / u64::from(self.flows());
+        (0..msgs)
+            .map(|_| match self {
+                Kind::Measure => serialize::serialize(&report(1)).unwrap(),
+                Kind::Batch => serialize::serialize(&serialize::batch_measure::Msg {
+                    num_reports: BATCH,
+                    reports: (1..=BATCH).map(report).collect(),
+                })
+                .unwrap(),
+            })
+            .collect()
+    }
+}
+
+// The program uid in a change program message from CCP.
+fn changeprog_uid(buf: &[u8]) -> Option<u32> {
+    let msg = serialize::RawMsg::parse(buf).ok()?;
+    if msg.typ != CHANGEPROG {
+        return None;
+    }
+
+    let uid = msg.payload().get(0..4)?;
+    Some(u32::from_le_bytes([uid[0], uid[1], uid[2], uid[3]]))
+}
+
+// `run_inner` on its own thread, over a blocking channel. The reports are all queued up front.
+fn chan_blocking(kind: Kind, n: u64) -> Measured {
+    let window = Window::new(n);
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock =
+        chan::Socket::<Blocking>::new(to_dp, from_dp).with_recv_timeout(Duration::from_millis(10));
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Budget(window.clone()))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    for m in kind.setup() {
+        to_ccp.send(m).unwrap();
+    }
+
+    let uid = loop {
+        let buf = from_ccp.recv_timeout(TIMEOUT).unwrap();
+        if let Some(uid) = changeprog_uid(&buf) {
+            break uid;
+        }
+    };
+
+    for m in kind.reports(uid, n) {
+        to_ccp.send(m).unwrap();
+    }
+
+    let measured = await_done(&window, || {
+        from_ccp.recv_timeout(Duration::from_millis(10)).ok();
+    });
+
+    handle.kill();
+    handle.wait().unwrap();
+    measured
+}
+
+// A `PollRuntime` over a nonblocking channel, polled on this thread.
+fn chan_poll(kind: Kind, n: u64) -> Measured {
+    let window = Window::new(n);
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock = chan::Socket::<Nonblocking>::new(to_dp, from_dp);
+    let mut buf = vec![0u8; 1 << 16];
+    let mut ccp =
+        portus::PollRuntime::new(BackendBuilder { sock }, Budget(window.clone()), &mut buf)
+            .unwrap();
+
+    for m in kind.setup() {
+        to_ccp.send(m).unwrap();
+    }
+
+    ccp.poll().unwrap();
+    let uid = from_ccp
+        .try_iter()
+        .find_map(|buf| changeprog_uid(&buf))
+        .unwrap();
+
+    // queued before polling, so that sending them is not counted.
+    for m in kind.reports(uid, n) {
+        to_ccp.send(m).unwrap();
+    }
+
+    loop {
+        ccp.poll().unwrap();
+        while from_ccp.try_recv().is_ok() {}
+        if let Some(m) = done(&window) {
+            break m;
+        }
+    }
+}
+
+// A `DirectRuntime`, fed on this thread; its send callback only notes the program uid.
+fn direct(kind: Kind, n: u64) -> Measured {
+    let window = Window::new(n);
+    let uid = Arc::new(AtomicU32::new(0));
+    let u = uid.clone();
+    let sock = direct::Socket::new(move |msg| {
+        if let Some(id) = changeprog_uid(msg) {
+            u.store(id, Ordering::SeqCst);
+        }
+
+        Ok(())
+    });
+    let mut ccp = portus::DirectRuntime::new(sock, Budget(window.clone())).unwrap();
+
+    for m in kind.setup() {
+        ccp.recv_msg(&m).unwrap();
+    }
+
+    for m in kind.reports(uid.load(Ordering::SeqCst), n) {
+        ccp.recv_msg(&m).unwrap();
+    }
+
+    done(&window).unwrap()
+}
+
+// `run_inner` on its own thread, over unix datagram sockets. Each message waits for its
+// replies, since a datagram socket holds only a few.
+fn unix(kind: Kind, n: u64) -> Measured {
+    let name = format!("alloc-budget-{:?}", kind).to_lowercase();
+    let window = Window::new(n);
+    let sock = unix::Socket::<Blocking>::new(&name).unwrap();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Budget(window.clone()))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    // CCP answers at `/tmp/ccp/` and the name the datapath bound, so bind a relative name there.
+    std::env::set_current_dir("/tmp/ccp").unwrap();
+    let dp_name = format!("{}-dp", name);
+    std::fs::remove_file(&dp_name).unwrap_or_else(|_| ());
+    let dp = UnixDatagram::bind(&dp_name).unwrap();
+    dp.set_read_timeout(Some(TIMEOUT)).unwrap();
+    let ccp = format!("/tmp/ccp/{}", name);
+    let mut buf = [0u8; 1024];
+    let mut recv = || {
+        let read = dp.recv(&mut buf).unwrap();
+        buf[..read].to_vec()
+    };
+
+    let setup = kind.setup();
+    for m in &setup {
+        dp.send_to(m, &ccp).unwrap();
+    }
+
+    let uid = loop {
+        if let Some(uid) = changeprog_uid(&recv()) {
+            break uid;
+        }
+    };
+
+    // the rest of the change program messages, one per flow.
+    for _ in 1..kind.flows() {
+        recv();
+    }
+
+    for m in kind.reports(uid, n) {
+        dp.send_to(&m, &ccp).unwrap();
+        for _ in 0..kind.flows() {
+            recv();
+        }
+    }
+
+    let measured = await_done(&window, || std::thread::sleep(Duration::from_millis(1)));
+    handle.kill();
+    handle.wait().unwrap();
+    std::fs::remove_file(&dp_name).unwrap_or_else(|_| ());
+    measured
+}
+
+fn check(name: &str, kind: Kind, budget: f64, run: fn(Kind, u64) -> Measured) {
+    let m = run(kind, REPORTS);
+    let per_report = m.allocs as f64 / REPORTS as f64;
+    if per_report <= budget + 1e-9 {
+        return;
+    }
+
+    TRACE.store(true, Ordering::SeqCst);
+    let traced = run(kind, TRACE_REPORTS);
+    TRACE.store(false, Ordering::SeqCst);
+
+    eprintln!(
+        "{} {:?}: {:.3} allocations per report, over the budget of {}. Allocation sites over {} reports:",
+        name, kind, per_report, budget, TRACE_REPORTS
+    );
+    for (site, count) in &traced.sites {
+        eprintln!(
+            "  {:>8.2}/report  {}",
+            *count as f64 / TRACE_REPORTS as f64,
+            site
+        );
+    }
+
+    panic!(
+        "{} {:?}: {:.3} allocations per report, budget {}",
+        name, kind, per_report, budget
+    );
+}
+
+// Allocations per report. Through `direct`, with one report per measure message, there are
+// six: the report's fields, `Report::from`, and in `update_field` the resolved registers, two
+// copies of the updated register's encoding, and the serialized message. A batch adds a copy of
+// `Report::from` per report, less the one string per batch. The chan transport copies each
+// update into the channel, whose blocks add a share of an allocation; unix sockets allocate the
+// sender's path on receive and the destination's on send. Lower a budget when a change
+// removes allocations.
+
+#[test]
+fn chan_blocking_measure() {
+    check("chan blocking", Kind::Measure, 7.05, chan_blocking);
+}
+
+#[test]
+fn chan_blocking_batch() {
+    check("chan blocking", Kind::Batch, 7.15, chan_blocking);
+}
+
+#[test]
+fn chan_poll_measure() {
+    check("chan poll", Kind::Measure, 7.05, chan_poll);
+}
+
+#[test]
+fn chan_poll_batch() {
+    check("chan poll", Kind::Batch, 7.15, chan_poll);
+}
+
+#[test]
+fn direct_measure() {
+    check("direct", Kind::Measure, 6.0, direct);
+}
+
+#[test]
+fn direct_batch() {
+    check("direct", Kind::Batch, 6.1, direct);
+}
+
+#[test]
+fn unix_measure() {
+    check("unix", Kind::Measure, 13.0, unix);
+}
+
+#[test]
+fn unix_batch() {
+    check("unix", Kind::Batch, 8.6, unix);
+}
@@ -0,0 +1,173 @@
+//! An `AsyncFlow` waiting on a slow answer holds up only its own reports, and falls back when the
+//! answer takes too long.
+
+use portus::async_flow::{Async, AsyncFlow, AsyncPolicy, OnTimeout, ReportFuture};
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::lang::Scope;
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Report};
+use std::collections::HashMap;
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::{mpsc, Arc, Mutex};
+use std::task::{Context, Poll, Waker};
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const UPDATE_FIELD: u8 = 3;
+const TIMEOUT: Duration = Duration::from_secs(5);
+const FALLBACK: u64 = 2000;
+
+type Sock = chan::Socket<Blocking>;
+
+// A cwnd the test thread gives.
+#[derive(Clone, Default)]
+struct Answer(Arc<Mutex<(Option<u64>, Option<Waker>)>>);
+
+impl Answer {
+    fn give(&self, cwnd: u64) {
+        let mut a = self.0.lock().unwrap();
+        a.0 = Some(cwnd);
+        if let Some(w) = a.1.take() {
+            w.wake();
+        }
+    }
+}
+
+impl Future for Answer {
+    type Output = u64;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<u64> {
+        let mut a = self.0.lock().unwrap();
+        match a.0.take() {
+            Some(v) => Poll::Ready(v),
+            None => {
+                a.1 = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+// Flow 1 asks the test thread for its cwnd; the others set ten times the bytes acked at once.
+struct TestAsync(mpsc::Sender<Answer>);
+
+struct TestFlow {
+    dp: Datapath<Sock>,
+    sc: Scope,
+    ask: mpsc::Sender<Answer>,
+}
+
+impl CongAlg<Sock> for TestAsync {
+    type Flow = Async<TestFlow>;
+
+    fn name() -> &'static str {
+        "async"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestAsync",
+            "
+            (def (Report.acked 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, _info: DatapathInfo) -> Async<TestFlow> {
+        let flow = TestFlow {
+            sc: dp.set_program("TestAsync", None).unwrap(),
+            dp,
+            ask: self.0.clone(),
+        };
+        Async::new(
+            flow,
+            AsyncPolicy {
+                timeout: Duration::from_millis(100),
+                on_timeout: OnTimeout::Abandon,
+                max_queued: 8,
+            },
+        )
+    }
+}
+
+impl AsyncFlow for TestFlow {
+    type Output = u64;
+
+    fn on_report(&mut self, sock_id: u32, m: Report) -> ReportFuture<u64> {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        if sock_id != 1 {
+            return Box::pin(async move { acked * 10 });
+        }
+
+        let a = Answer::default();
+        self.ask.send(a.clone()).unwrap();
+        Box::pin(a)
+    }
+
+    fn on_ready(&mut self, _sock_id: u32, cwnd: u64) {
+        self.dp
+            .update_field(&self.sc, &[("Cwnd", cwnd as u32)])
+            .unwrap();
+    }
+
+    fn on_timeout(&mut self, sock_id: u32) {
+        self.on_ready(sock_id, FALLBACK);
+    }
+}
+
+// The flow and cwnd of an update.
+fn update(buf: &[u8]) -> (u32, u64) {
+    let mut sid = [0u8; 4];
+    sid.copy_from_slice(&buf[4..8]);
+    let mut cwnd = [0u8; 8];
+    cwnd.copy_from_slice(&buf[buf.len() - 8..]);
+    (u32::from_le_bytes(sid), u64::from_le_bytes(cwnd))
+}
+
+#[test]
+fn slow_flow_does_not_block_others() {
+    let (ask, answers) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    // the runtime drives woken futures each time its receive times out.
+    let sock = sock.with_recv_timeout(Duration::from_millis(10));
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAsync(ask))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    for sid in 1..=2 {
+        dp.create(sid).unwrap();
+        dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+    }
+
+    // flow 1 waits for its answer, with its second report queued behind it.
+    dp.measure(1, vec![1448]).unwrap();
+    let first: Answer = answers.recv_timeout(TIMEOUT).unwrap();
+    dp.measure(1, vec![2896]).unwrap();
+
+    dp.measure(2, vec![1448]).unwrap();
+    let u = dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+    assert_eq!(update(&u), (2, 14480));
+
+    // the answer is applied, and the queued report is handed over.
+    first.give(5000);
+    let u = dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+    assert_eq!(update(&u), (1, 5000));
+    let _second = answers.recv_timeout(TIMEOUT).unwrap();
+
+    // the second answer never comes.
+    let u = dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+    assert_eq!(update(&u), (1, FALLBACK));
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
@@ -0,0 +1,172 @@
+//! Reports for several flows in one batch measure message reach each flow through `run_inner`.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::lang::Scope;
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const UPDATE_FIELD: u8 = 3;
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+#[derive(Debug, PartialEq)]
+enum Event {
+    Report(u32, u64),
+    Close(u32),
+}
+
+struct TestAlg(mpsc::Sender<Event>);
+
+struct TestFlow {
+    dp: Datapath<chan::Socket<Blocking>>,
+    sc: Scope,
+    sid: u32,
+    events: mpsc::Sender<Event>,
+}
+
+impl CongAlg<chan::Socket<Blocking>> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "batch-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestBatch",
+            "
+            (def (Report.acked 0) (target 0))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<chan::Socket<Blocking>>, info: DatapathInfo) -> TestFlow {
+        let sc = dp.set_program("TestBatch", None).unwrap();
+        TestFlow {
+            dp,
+            sc,
+            sid: info.sock_id,
+            events: self.0.clone(),
+        }
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        self.events.send(Event::Report(sock_id, acked)).unwrap();
+        self.dp
+            .update_field(&self.sc, &[("target", acked as u32)])
+            .unwrap();
+    }
+
+    fn close(&mut self) {
+        self.events.send(Event::Close(self.sid)).unwrap();
+    }
+}
+
+#[test]
+fn batch_measure() {
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events_tx))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    for sid in 1..=3 {
+        dp.create(sid).unwrap();
+        dp.recv_until(4, TIMEOUT).unwrap(); // change program
+        assert!(dp.program_uid(sid).is_some());
+    }
+
+    // one message: reports for flows 1 and 2, and flow 3 closing.
+    dp.batch_measure(vec![(1, vec![1448]), (2, vec![2896]), (3, vec![])])
+        .unwrap();
+
+    let got: Vec<Event> = (0..3)
+        .map(|_| events.recv_timeout(TIMEOUT).unwrap())
+        .collect();
+    assert_eq!(
+        got,
+        vec![
+            Event::Report(1, 1448),
+            Event::Report(2, 2896),
+            Event::Close(3)
+        ]
+    );
+
+    // each report was answered as if it had arrived on its own.
+    dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+    dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+
+    // flow 3 is gone; single measurements still work alongside batches.
+    dp.batch_measure(vec![(3, vec![1]), (1, vec![4344])])
+        .unwrap();
+    dp.measure(2, vec![5792]).unwrap();
+    assert_eq!(
+        events.recv_timeout(TIMEOUT).unwrap(),
+        Event::Report(1, 4344)
+    );
+    assert_eq!(
+        events.recv_timeout(TIMEOUT).unwrap(),
+        Event::Report(2, 5792)
+    );
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
+
+#[test]
+fn many_flows_in_one_batch() {
+    const FLOWS: u32 = 500;
+
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events_tx))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    for sid in 1..=FLOWS {
+        dp.create(sid).unwrap();
+        dp.recv_until(4, TIMEOUT).unwrap(); // change program
+    }
+
+    // one 10 KB message, many times the size of a single report.
+    dp.batch_measure((1..=FLOWS).map(|sid| (sid, vec![u64::from(sid)])).collect())
+        .unwrap();
+    for sid in 1..=FLOWS {
+        assert_eq!(
+            events.recv_timeout(TIMEOUT).unwrap(),
+            Event::Report(sid, u64::from(sid))
+        );
+    }
+
+    // too many reports for one message: the datapath sends them as several batches, in order.
+    let reports: Vec<(u32, Vec<u64>)> = (0..8)
+        .flat_map(|_| (1..=FLOWS).map(|sid| (sid, vec![1])))
+        .collect();
+    assert!(reports.len() * 20 > u16::max_value() as usize);
+    dp.batch_measure(reports).unwrap();
+    for _ in 0..8 {
+        for sid in 1..=FLOWS {
+            assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), Event::Report(sid, 1));
+        }
+    }
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
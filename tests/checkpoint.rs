@@ -0,0 +1,137 @@
+//! Flows checkpointed by one runtime are taken over by the next one on the same file.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::lang::Scope;
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::path::Path;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+type Sock = chan::Socket<Blocking>;
+
+// Reports each flow's total bytes acked so far, which is the state that survives a restart.
+struct TestAlg(mpsc::Sender<(u32, u64)>);
+
+struct TestFlow {
+    sc: Scope,
+    total: u64,
+    events: mpsc::Sender<(u32, u64)>,
+}
+
+impl CongAlg<Sock> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "checkpoint-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestCheckpoint",
+            "
+            (def (Report.acked 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, _info: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestCheckpoint", None).unwrap(),
+            total: 0,
+            events: self.0.clone(),
+        }
+    }
+
+    fn import_flow(
+        &self,
+        mut dp: Datapath<Sock>,
+        _info: DatapathInfo,
+        state: &[u8],
+    ) -> Option<TestFlow> {
+        Some(TestFlow {
+            sc: dp.set_program("TestCheckpoint", None).ok()?,
+            total: u64::from_le_bytes(state.try_into().ok()?),
+            events: self.0.clone(),
+        })
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        self.total += m.get_field("Report.acked", &self.sc).unwrap();
+        self.events.send((sock_id, self.total)).unwrap();
+    }
+
+    fn export_state(&self) -> Option<Vec<u8>> {
+        Some(self.total.to_le_bytes().to_vec())
+    }
+}
+
+fn start(sock: Sock, path: &Path, events: mpsc::Sender<(u32, u64)>) -> portus::CCPHandle {
+    portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events))
+        .with_checkpoint(path, Duration::from_secs(60))
+        .spawn_thread()
+        .run()
+        .unwrap()
+}
+
+#[test]
+fn flows_survive_restart() {
+    let path = std::env::temp_dir().join(format!("portus-checkpoint-{}", std::process::id()));
+    std::fs::remove_file(&path).unwrap_or_else(|_| ());
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+
+    let handle = start(sock, &path, events_tx.clone());
+    dp.ready().unwrap();
+    for sid in 1..=2 {
+        dp.create(sid).unwrap();
+        dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+        dp.measure(sid, vec![1448]).unwrap();
+        assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (sid, 1448));
+    }
+
+    dp.measure(1, vec![1448]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 2896));
+    let old_uid = dp.program_uid(1).unwrap();
+
+    // stopping writes a last checkpoint.
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+
+    let handle = start(dp.reconnect(), &path, events_tx);
+    dp.ready().unwrap();
+
+    // flow 1 still runs the old program when it next reports, and picks up where it left off.
+    dp.measure(1, vec![1448]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 4344));
+    dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+    assert_ne!(dp.program_uid(1).unwrap(), old_uid);
+
+    // the datapath re-created flow 2, so it starts over.
+    dp.create(2).unwrap();
+    dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+    dp.measure(2, vec![1448]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (2, 1448));
+
+    // flow 1 now reports under its new program.
+    dp.measure(1, vec![1448]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 5792));
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+    std::fs::remove_file(&path).unwrap();
+}
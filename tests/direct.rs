@@ -0,0 +1,122 @@
+//! Drive a `DirectRuntime` from a Rust stand-in datapath over the in-process transport.
+
+use portus::ipc::direct;
+use portus::lang::Scope;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, DirectRuntime, Flow, Report};
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
+
+struct TestAlg(Arc<Mutex<Vec<u64>>>);
+
+struct TestFlow {
+    dp: Datapath<direct::Socket>,
+    sc: Scope,
+    reports: Arc<Mutex<Vec<u64>>>,
+}
+
+impl CongAlg<direct::Socket> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "direct-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestDirect",
+            "
+            (def (Report.acked 0) (target 0))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<direct::Socket>, _info: DatapathInfo) -> Self::Flow {
+        let sc = dp.set_program("TestDirect", None).unwrap();
+        TestFlow {
+            dp,
+            sc,
+            reports: self.0.clone(),
+        }
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        self.reports.lock().unwrap().push(acked);
+        self.dp
+            .update_field(&self.sc, &[("target", acked as u32)])
+            .unwrap();
+    }
+}
+
+// The message type of each message the datapath received, in order.
+fn msg_types(sent: &Mutex<Vec<Vec<u8>>>) -> Vec<u8> {
+    sent.lock().unwrap().iter().map(|m| m[0]).collect()
+}
+
+#[test]
+fn direct() {
+    let reports = Arc::new(Mutex::new(vec![]));
+
+    // the stand-in datapath records what CCP sends it.
+    let sent = Arc::new(Mutex::new(Vec::<Vec<u8>>::new()));
+    let s = sent.clone();
+    let sock = direct::Socket::new(move |msg| {
+        s.lock().unwrap().push(msg.to_vec());
+        Ok(())
+    });
+
+    let mut rt = DirectRuntime::new(sock, TestAlg(reports.clone())).unwrap();
+
+    // ready: CCP installs its programs.
+    let rdy = serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap();
+    assert_eq!(rt.recv_msg(&rdy).unwrap(), 1);
+    assert_eq!(msg_types(&sent), vec![2]);
+
+    // create: the flow switches to its program.
+    let cr = serialize::serialize(&serialize::create::Msg {
+        sid: 1,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap();
+    assert_eq!(rt.recv_msg(&cr).unwrap(), 1);
+    assert_eq!(msg_types(&sent), vec![2, 4]);
+
+    // the datapath learns the program uid from the change-program message.
+    let program_uid = u32::from_le_bytes({
+        let buf = &sent.lock().unwrap()[1];
+        [buf[8], buf[9], buf[10], buf[11]]
+    });
+
+    // two measurements in one buffer: both are dispatched, and each report triggers an update.
+    let mut buf = vec![];
+    for acked in &[1448, 2896] {
+        buf.extend(
+            serialize::serialize(&serialize::measure::Msg {
+                sid: 1,
+                program_uid,
+                num_fields: 1,
+                fields: vec![*acked],
+            })
+            .unwrap(),
+        );
+    }
+
+    assert_eq!(rt.recv_msg(&buf).unwrap(), 2);
+    assert_eq!(*reports.lock().unwrap(), vec![1448, 2896]);
+    assert_eq!(msg_types(&sent), vec![2, 4, 3, 3]);
+}
@@ -0,0 +1,95 @@
+//! Control-loop delay is recorded per algorithm, from each report's arrival until the flow's
+//! update for it.
+
+use crossbeam::channel;
+use portus::ipc::{chan, BackendBuilder, Blocking, Ipc};
+use portus::latency::LoopLatency;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::collections::HashMap;
+use std::time::Duration;
+
+// No programs, so nothing needs compiling; each report is answered with an empty update.
+struct Answer;
+
+struct AnswerFlow<I: Ipc>(Datapath<I>);
+
+impl<I: Ipc> CongAlg<I> for Answer {
+    type Flow = AnswerFlow<I>;
+
+    fn name() -> &'static str {
+        "answer"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        HashMap::default()
+    }
+
+    fn new_flow(&self, control: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        AnswerFlow(control)
+    }
+}
+
+impl<I: Ipc> Flow for AnswerFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        assert!(m.received_at().elapsed() < Duration::from_secs(5));
+        self.0.update_regs(vec![]).unwrap();
+    }
+}
+
+#[test]
+fn loop_latency_per_alg() {
+    let stats = LoopLatency::new();
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock = chan::Socket::<Blocking>::new(to_dp, from_dp);
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Answer)
+        .with_loop_latency(stats.clone())
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    to_ccp
+        .send(serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+        .unwrap();
+    to_ccp
+        .send(
+            serialize::serialize(&serialize::create::Msg {
+                sid: 1,
+                init_cwnd: 14480,
+                mss: 1448,
+                src_ip: 0,
+                src_port: 4242,
+                dst_ip: 0,
+                dst_port: 4242,
+                cong_alg: None,
+            })
+            .unwrap(),
+        )
+        .unwrap();
+
+    for _ in 0..10 {
+        to_ccp
+            .send(
+                serialize::serialize(&serialize::measure::Msg {
+                    sid: 1,
+                    program_uid: 0,
+                    num_fields: 1,
+                    fields: vec![1448],
+                })
+                .unwrap(),
+            )
+            .unwrap();
+        let update = from_ccp.recv_timeout(Duration::from_secs(5)).unwrap();
+        assert_eq!(update[0], 3);
+    }
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+
+    let h = &stats.snapshot()["answer"];
+    assert_eq!(h.count(), 10);
+    assert!(h.quantile_ns(0.5) <= h.max_ns());
+    assert!(h.max_ns() > 0);
+}
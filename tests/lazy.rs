@@ -0,0 +1,100 @@
+//! With lazy flows, a flow's `Flow` is created on its first report or once it is old enough, even
+//! if the datapath is quiet, and never for a flow that ends before either.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(5);
+const MAX_AGE: Duration = Duration::from_millis(200);
+
+type Sock = chan::Socket<Blocking>;
+type Events = mpsc::Sender<(&'static str, u32)>;
+
+struct TestLazy(Events);
+
+struct TestFlow(Events);
+
+impl CongAlg<Sock> for TestLazy {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "lazy"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestLazy",
+            "
+            (def (Report.acked 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, _dp: Datapath<Sock>, info: DatapathInfo) -> TestFlow {
+        self.0.send(("new", info.sock_id)).unwrap();
+        TestFlow(self.0.clone())
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, _m: Report) {
+        self.0.send(("report", sock_id)).unwrap();
+    }
+
+    fn close(&mut self) {
+        self.0.send(("close", 0)).unwrap();
+    }
+}
+
+#[test]
+fn lazy_flows() {
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestLazy(events_tx))
+        .with_lazy_flows(MAX_AGE, "TestLazy")
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    let mut create = |sid| {
+        dp.create(sid).unwrap();
+        // the default program, set without creating the flow.
+        dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+    };
+
+    create(1);
+    create(2);
+    create(3);
+    assert!(events.recv_timeout(Duration::from_millis(50)).is_err());
+
+    // the first report creates the flow, then reaches it.
+    dp.measure(1, vec![1448]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("new", 1));
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("report", 1));
+
+    // flow 2 ends before it is created.
+    dp.measure(2, vec![]).unwrap();
+
+    // flow 3 is created once it is old, though no further message arrives.
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("new", 3));
+
+    dp.batch_measure(vec![(1, vec![2896])]).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("report", 1));
+    assert!(events.recv_timeout(Duration::from_millis(50)).is_err());
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
@@ -0,0 +1,108 @@
+//! A policy picks each new flow's algorithm by its destination, and a reloaded policy applies to
+//! the flows created after it.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::policy::{Policy, PolicyHandle};
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+type Sock = chan::Socket<Blocking>;
+type Events = mpsc::Sender<(u32, &'static str)>;
+
+// Each reports which algorithm created a flow.
+struct AlgA(Events);
+struct AlgB(Events);
+
+struct TestFlow;
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, _sock_id: u32, _m: Report) {}
+}
+
+fn program() -> String {
+    "
+    (def (Report.acked 0))
+    (when true
+        (:= Report.acked Ack.bytes_acked)
+        (report)
+    )"
+    .to_owned()
+}
+
+impl CongAlg<Sock> for AlgA {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "policy-a"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("TestPolicyA", program());
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, info: DatapathInfo) -> TestFlow {
+        dp.set_program("TestPolicyA", None).unwrap();
+        self.0.send((info.sock_id, Self::name())).unwrap();
+        TestFlow
+    }
+}
+
+impl CongAlg<Sock> for AlgB {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "policy-b"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("TestPolicyB", program());
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, info: DatapathInfo) -> TestFlow {
+        dp.set_program("TestPolicyB", None).unwrap();
+        self.0.send((info.sock_id, Self::name())).unwrap();
+        TestFlow
+    }
+}
+
+#[test]
+fn policy_picks_algorithm() {
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    // the stand-in datapath's flows go to port `sid`.
+    let policy = PolicyHandle::new(Policy::parse("* 443 policy-b").unwrap());
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(AlgA(events_tx.clone()))
+        .additional_alg(AlgB(events_tx))
+        .with_policy(policy.clone())
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    let mut create = |sid| {
+        dp.create(sid).unwrap();
+        dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+        events.recv_timeout(TIMEOUT).unwrap()
+    };
+
+    assert_eq!(create(1), (1, "policy-a"));
+    assert_eq!(create(443), (443, "policy-b"));
+
+    policy.store(Policy::parse("* 1-100 policy-b").unwrap());
+    assert_eq!(create(2), (2, "policy-b"));
+    assert_eq!(create(444), (444, "policy-a"));
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
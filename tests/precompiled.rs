@@ -0,0 +1,134 @@
+//! Programs compiled at build time by `datapath_program!` install and report like programs
+//! compiled at startup.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::lang::{self, Precompiled, Scope};
+use portus::test_helper::StandInDatapath;
+use portus::{
+    datapath_program, datapath_report, CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow,
+    Report, ReportStruct,
+};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const INSTALL: u8 = 2;
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+fn program() -> String {
+    datapath_program!(
+        "
+        (def (Report (volatile acked 0) (minrtt +infinity)) (target 0))
+        (when true
+            (:= Report.acked (+ Report.acked Ack.bytes_acked))
+            (:= Report.minrtt (min Report.minrtt Flow.rtt_sample_us))
+            (report)
+        )"
+    )
+}
+
+datapath_report! {
+    /// What the program in `program()` reports.
+    struct TestReport = "
+        (def (Report (volatile acked 0) (minrtt +infinity)) (target 0))
+        (when true
+            (:= Report.acked (+ Report.acked Ack.bytes_acked))
+            (:= Report.minrtt (min Report.minrtt Flow.rtt_sample_us))
+            (report)
+        )";
+}
+
+#[test]
+fn matches_runtime_compile() {
+    let src = program();
+    let p = Precompiled::find(&src).expect("datapath_program! registers its program");
+    let (bin, sc) = lang::compile(src.as_bytes(), &[]).unwrap();
+    assert_eq!(p.bin(), &bin.serialize().unwrap()[..]);
+    assert_eq!(p.num_events(), bin.events.len() as u32);
+    assert_eq!(p.num_instrs(), bin.instrs.len() as u32);
+
+    let pre = p.scope().unwrap();
+    assert_ne!(pre.program_uid, sc.program_uid);
+    for name in &["Report.acked", "Report.minrtt", "target", "Ack.bytes_acked"] {
+        assert_eq!(pre.get(name), sc.get(name), "{}", name);
+    }
+}
+
+#[test]
+fn report_struct() {
+    assert_eq!(TestReport::FIELDS, &["Report.acked", "Report.minrtt"]);
+    let (_, sc) = lang::compile(TestReport::program().as_bytes(), &[]).unwrap();
+    TestReport::check_scope(&sc).unwrap();
+    assert_eq!(
+        TestReport::from_fields(&[1448, 20_000]),
+        TestReport {
+            acked: 1448,
+            minrtt: 20_000
+        }
+    );
+}
+
+struct TestAlg(mpsc::Sender<(u64, u64)>);
+
+struct TestFlow {
+    sc: Scope,
+    reports: mpsc::Sender<(u64, u64)>,
+}
+
+impl CongAlg<chan::Socket<Blocking>> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "precompiled-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("TestPrecompiled", program());
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<chan::Socket<Blocking>>, _: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestPrecompiled", None).unwrap(),
+            reports: self.0.clone(),
+        }
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        let minrtt = m.get_field("Report.minrtt", &self.sc).unwrap();
+
+        // the generated struct reads the same values.
+        let r: TestReport = m.decode(&self.sc).unwrap();
+        assert_eq!((r.acked, r.minrtt), (acked, minrtt));
+        self.reports.send((acked, minrtt)).unwrap();
+    }
+}
+
+#[test]
+fn install_and_report() {
+    let (reports_tx, reports) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(reports_tx))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    let install = dp.recv_until(INSTALL, TIMEOUT).unwrap();
+    let (bin, _) = lang::compile(program().as_bytes(), &[]).unwrap();
+    // the instructions follow the header, program uid, and event and instruction counts.
+    assert_eq!(&install[20..], &bin.serialize().unwrap()[..]);
+
+    dp.create(1).unwrap();
+    dp.recv_until(4, TIMEOUT).unwrap(); // change program
+    dp.measure(1, vec![1448, 20_000]).unwrap();
+    assert_eq!(reports.recv_timeout(TIMEOUT).unwrap(), (1448, 20_000));
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+}
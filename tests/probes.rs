@@ -0,0 +1,126 @@
+//! The USDT probes in this test binary, as `readelf -n` lists them, are those in
+//! `portus::probes::CATALOG`.
+
+use crossbeam::channel;
+use portus::ipc::{chan, BackendBuilder, Blocking, Ipc};
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::collections::{BTreeSet, HashMap};
+use std::process::Command;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+// No programs, so that a report reaches the flow without compiling anything.
+struct ProbeAlg(Arc<Mutex<Vec<&'static str>>>);
+
+struct ProbeFlow(Arc<Mutex<Vec<&'static str>>>);
+
+impl<I: Ipc> CongAlg<I> for ProbeAlg {
+    type Flow = ProbeFlow;
+
+    fn name() -> &'static str {
+        "probe-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        HashMap::default()
+    }
+
+    fn new_flow(&self, _control: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        ProbeFlow(self.0.clone())
+    }
+}
+
+impl Flow for ProbeFlow {
+    fn on_report(&mut self, _sock_id: u32, _m: Report) {
+        self.0.lock().unwrap().push("report");
+    }
+
+    fn close(&mut self) {
+        self.0.lock().unwrap().push("close");
+    }
+}
+
+// Drive a flow through create, report and close, so every probe site is part of this binary.
+fn run_flow() {
+    let seen = Arc::new(Mutex::new(vec![]));
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, _from_ccp) = channel::unbounded();
+    let sock = chan::Socket::<Blocking>::new(to_dp, from_dp);
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(ProbeAlg(seen.clone()))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    let measure = |fields: Vec<u64>| {
+        serialize::serialize(&serialize::measure::Msg {
+            sid: 1,
+            program_uid: 0,
+            num_fields: fields.len() as u8,
+            fields,
+        })
+        .unwrap()
+    };
+    to_ccp
+        .send(serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+        .unwrap();
+    to_ccp
+        .send(
+            serialize::serialize(&serialize::create::Msg {
+                sid: 1,
+                init_cwnd: 14480,
+                mss: 1448,
+                src_ip: 0,
+                src_port: 4242,
+                dst_ip: 0,
+                dst_port: 4242,
+                cong_alg: None,
+            })
+            .unwrap(),
+        )
+        .unwrap();
+    to_ccp.send(measure(vec![1448])).unwrap();
+    to_ccp.send(measure(vec![])).unwrap();
+
+    let start = Instant::now();
+    while seen.lock().unwrap().len() < 2 && start.elapsed() < Duration::from_secs(5) {
+        std::thread::sleep(Duration::from_millis(10));
+    }
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+    assert_eq!(*seen.lock().unwrap(), vec!["report", "close"]);
+}
+
+#[test]
+fn probe_catalog() {
+    run_flow();
+
+    let exe = std::env::current_exe().unwrap();
+    let out = match Command::new("readelf").arg("-n").arg(&exe).output() {
+        Ok(out) => out,
+        Err(e) => {
+            eprintln!("skipping: cannot run readelf: {}", e);
+            return;
+        }
+    };
+    let notes = String::from_utf8_lossy(&out.stdout);
+
+    // stapsdt notes read "Provider: portus" then "Name: <probe>".
+    let mut found = BTreeSet::new();
+    let mut lines = notes.lines().map(str::trim);
+    while let Some(l) = lines.next() {
+        if l == "Provider: portus" {
+            if let Some(name) = lines.next().and_then(|l| l.strip_prefix("Name: ")) {
+                found.insert(name.to_owned());
+            }
+        }
+    }
+
+    let catalog: BTreeSet<_> = portus::probes::CATALOG
+        .iter()
+        .map(|(name, _)| (*name).to_owned())
+        .collect();
+    assert_eq!(found, catalog);
+}
@@ -0,0 +1,164 @@
+//! Upgrade an algorithm under a `Reloader`: a second `DirectRuntime` takes new flows, and takes
+//! over a running flow through `Flow::export_state` and `CongAlg::import_flow`.
+
+use portus::ipc::direct;
+use portus::lang::Scope;
+use portus::reload::Reloader;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, DirectRuntime, Flow, Report};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::sync::{Arc, Mutex};
+
+// Each flow counts the bytes acked over its lifetime; `version` tags the reports of each build.
+struct TestAlg {
+    version: u32,
+    totals: Arc<Mutex<Vec<(u32, u32, u64)>>>,
+}
+
+struct TestFlow {
+    sc: Scope,
+    version: u32,
+    total: u64,
+    totals: Arc<Mutex<Vec<(u32, u32, u64)>>>,
+}
+
+impl CongAlg<direct::Socket> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "reload-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestReload",
+            "
+            (def (Report (volatile acked 0)))
+            (when true
+                (:= Report.acked (+ Report.acked Ack.bytes_acked))
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<direct::Socket>, _info: DatapathInfo) -> Self::Flow {
+        TestFlow {
+            sc: dp.set_program("TestReload", None).unwrap(),
+            version: self.version,
+            total: 0,
+            totals: self.totals.clone(),
+        }
+    }
+
+    fn import_flow(
+        &self,
+        control: Datapath<direct::Socket>,
+        info: DatapathInfo,
+        state: &[u8],
+    ) -> Option<Self::Flow> {
+        let mut f = self.new_flow(control, info);
+        f.total = u64::from_le_bytes(state.try_into().ok()?);
+        Some(f)
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        self.total += m.get_field("Report.acked", &self.sc).unwrap();
+        self.totals
+            .lock()
+            .unwrap()
+            .push((self.version, sock_id, self.total));
+    }
+
+    fn export_state(&self) -> Option<Vec<u8>> {
+        Some(self.total.to_le_bytes().to_vec())
+    }
+}
+
+fn generation(
+    version: u32,
+    totals: &Arc<Mutex<Vec<(u32, u32, u64)>>>,
+    sent: &Arc<Mutex<Vec<Vec<u8>>>>,
+) -> DirectRuntime<TestAlg> {
+    let s = sent.clone();
+    let sock = direct::Socket::new(move |msg| {
+        s.lock().unwrap().push(msg.to_vec());
+        Ok(())
+    });
+
+    DirectRuntime::new(
+        sock,
+        TestAlg {
+            version,
+            totals: totals.clone(),
+        },
+    )
+    .unwrap()
+}
+
+fn create(sid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::create::Msg {
+        sid,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap()
+}
+
+// The datapath's report for `sid`, with the program uid from the last change-program message.
+fn measure(sid: u32, acked: u64, sent: &Mutex<Vec<Vec<u8>>>) -> Vec<u8> {
+    let program_uid = sent
+        .lock()
+        .unwrap()
+        .iter()
+        .rev()
+        .find(|m| m[0] == 4 && m[4..8] == sid.to_le_bytes())
+        .map(|m| u32::from_le_bytes([m[8], m[9], m[10], m[11]]))
+        .unwrap();
+    serialize::serialize(&serialize::measure::Msg {
+        sid,
+        program_uid,
+        num_fields: 1,
+        fields: vec![acked],
+    })
+    .unwrap()
+}
+
+#[test]
+fn migrate_running_flow() {
+    let totals = Arc::new(Mutex::new(vec![]));
+    let sent = Arc::new(Mutex::new(vec![]));
+
+    let mut r = Reloader::new();
+    r.add_generation(generation(1, &totals, &sent), false)
+        .unwrap();
+    r.recv(&serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+        .unwrap();
+    r.recv(&create(1)).unwrap();
+    r.recv(&measure(1, 1448, &sent)).unwrap();
+
+    // the new build installs its program and takes over flow 1, keeping its count.
+    r.add_generation(generation(2, &totals, &sent), true)
+        .unwrap();
+    assert_eq!(r.generations(), vec![(1, 1)]);
+    r.recv(&measure(1, 1448, &sent)).unwrap();
+
+    // new flows start on the new build.
+    r.recv(&create(2)).unwrap();
+    r.recv(&measure(2, 100, &sent)).unwrap();
+
+    assert_eq!(
+        *totals.lock().unwrap(),
+        vec![(1, 1, 1448), (2, 1, 2896), (2, 2, 100)]
+    );
+}
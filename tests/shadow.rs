@@ -0,0 +1,145 @@
+//! A shadow algorithm sees every report of the flows, but only the primary algorithm's updates
+//! reach the datapath.
+
+use portus::ipc::{chan, BackendBuilder, Blocking};
+use portus::lang::Scope;
+use portus::shadow::ShadowStats;
+use portus::test_helper::StandInDatapath;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const UPDATE_FIELD: u8 = 3;
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+type Sock = chan::Socket<Blocking>;
+type Events = mpsc::Sender<(&'static str, u64)>;
+
+// Sets the cwnd to ten times the bytes acked. The shadow does the same while the rtt is low, and
+// halves that when it is not; its program reports the same fields in another order.
+struct Primary(Events);
+struct Shadow(Events);
+
+struct TestFlow {
+    dp: Datapath<Sock>,
+    sc: Scope,
+    name: &'static str,
+    events: Events,
+}
+
+fn program(fields: &str) -> String {
+    format!(
+        "
+        (def {})
+        (when true
+            (:= Report.acked Ack.bytes_acked)
+            (:= Report.rtt Flow.rtt_sample_us)
+            (report)
+        )",
+        fields
+    )
+}
+
+impl CongAlg<Sock> for Primary {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "shadow-test-primary"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("TestPrimary", program("(Report.acked 0) (Report.rtt 0)"));
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, _info: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestPrimary", None).unwrap(),
+            dp,
+            name: "primary",
+            events: self.0.clone(),
+        }
+    }
+}
+
+impl CongAlg<Sock> for Shadow {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "shadow-test-shadow"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert("TestShadow", program("(Report.rtt 0) (Report.acked 0)"));
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, _info: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestShadow", None).unwrap(),
+            dp,
+            name: "shadow",
+            events: self.0.clone(),
+        }
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        let acked = m.get_field("Report.acked", &self.sc).unwrap();
+        let rtt = m.get_field("Report.rtt", &self.sc).unwrap();
+        let cwnd = if self.name == "shadow" && rtt >= 100 {
+            acked * 5
+        } else {
+            acked * 10
+        };
+        self.dp
+            .update_field(&self.sc, &[("Cwnd", cwnd as u32)])
+            .unwrap();
+        self.events.send((self.name, acked)).unwrap();
+    }
+}
+
+#[test]
+fn shadow_sees_reports_but_does_not_send() {
+    let (events_tx, events) = mpsc::channel();
+    let (mut dp, sock) = StandInDatapath::new();
+    let stats = ShadowStats::new();
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Primary(events_tx.clone()))
+        .with_shadow_alg(Shadow(events_tx), 1.0, stats.clone())
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    dp.ready().unwrap();
+    dp.create(1).unwrap();
+    dp.recv_until(CHANGEPROG, TIMEOUT).unwrap();
+
+    for (i, rtt) in [50, 200].iter().enumerate() {
+        let acked = 1448 * (i as u64 + 1);
+        dp.measure(1, vec![acked, *rtt]).unwrap();
+        assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("primary", acked));
+        assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), ("shadow", acked));
+        dp.recv_until(UPDATE_FIELD, TIMEOUT).unwrap();
+    }
+
+    // the shadow's program change and updates were never sent.
+    assert!(dp
+        .recv_until(CHANGEPROG, Duration::from_millis(100))
+        .is_err());
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+
+    let s = stats.snapshot()["shadow-test-primary"].clone();
+    assert_eq!(s.shadow, "shadow-test-shadow");
+    assert_eq!((s.compared, s.diverged), (2, 1));
+    assert_eq!((s.skipped, s.unmapped), (0, 0));
+    assert_eq!(s.primary_cost.count(), 2);
+    assert_eq!(s.shadow_cost.count(), 2);
+}
@@ -0,0 +1,234 @@
+//! A front-end spreads datapaths across two CCP workers, and moves a worker's datapaths to the
+//! other when it goes down; a worker that falls behind has messages dropped rather than holding
+//! up the front-end.
+
+use portus::ipc::BackendBuilder;
+use portus::lang::Scope;
+use portus::serialize;
+use portus::shard::{Frontend, ShardStats, WorkerSocket};
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::os::unix::net::UnixDatagram;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(5);
+const NAME: &str = "shard-test";
+const WORKERS: [&str; 2] = ["shard-test-w0", "shard-test-w1"];
+
+// Reports which worker each report reached.
+struct TestAlg(usize, mpsc::Sender<(usize, u32)>);
+
+struct TestFlow {
+    sc: Scope,
+    worker: usize,
+    events: mpsc::Sender<(usize, u32)>,
+}
+
+impl CongAlg<WorkerSocket> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "shard-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestShard",
+            "
+            (def (Report.acked 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<WorkerSocket>, _info: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestShard", None).unwrap(),
+            worker: self.0,
+            events: self.1.clone(),
+        }
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        m.get_field("Report.acked", &self.sc).unwrap();
+        self.events.send((self.worker, sock_id)).unwrap();
+    }
+}
+
+fn worker(i: usize, events: mpsc::Sender<(usize, u32)>) -> portus::CCPHandle {
+    let sock = WorkerSocket::new(WORKERS[i]).unwrap();
+    portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(i, events))
+        .spawn_thread()
+        .run()
+        .unwrap()
+}
+
+fn create(sid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::create::Msg {
+        sid,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap()
+}
+
+fn measure(sid: u32, program_uid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::measure::Msg {
+        sid,
+        program_uid,
+        num_fields: 1,
+        fields: vec![1448],
+    })
+    .unwrap()
+}
+
+// Receive until a change program message, and return its program uid.
+fn recv_changeprog(dp: &UnixDatagram) -> u32 {
+    let mut buf = [0u8; 1024];
+    loop {
+        let read = dp.recv(&mut buf).unwrap();
+        let msg = serialize::RawMsg::parse(&buf[..read]).unwrap();
+        if msg.typ == CHANGEPROG {
+            return u32::from_le_bytes(msg.payload()[0..4].try_into().unwrap());
+        }
+    }
+}
+
+#[test]
+fn spread_and_move_datapaths() {
+    let (events_tx, events) = mpsc::channel();
+    let mut workers: Vec<_> = (0..2).map(|i| Some(worker(i, events_tx.clone()))).collect();
+    let stats = ShardStats::new();
+    let frontend = Frontend::new(NAME, &WORKERS)
+        .unwrap()
+        .with_stats(stats.clone())
+        .spawn();
+
+    // workers answer at `/tmp/ccp/` and the name the datapath bound, so bind relative names there.
+    std::env::set_current_dir("/tmp/ccp").unwrap();
+    let ccp = format!("/tmp/ccp/{}", NAME);
+    let names: Vec<String> = (0..8).map(|i| format!("{}-dp{}", NAME, i)).collect();
+    let dps: Vec<UnixDatagram> = names
+        .iter()
+        .map(|name| {
+            std::fs::remove_file(name).unwrap_or_else(|_| ());
+            let dp = UnixDatagram::bind(name).unwrap();
+            dp.set_read_timeout(Some(TIMEOUT)).unwrap();
+            dp
+        })
+        .collect();
+
+    let ready = serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap();
+    let mut on = vec![];
+    for dp in &dps {
+        dp.send_to(&ready, &ccp).unwrap();
+        dp.send_to(&create(1), &ccp).unwrap();
+        let uid = recv_changeprog(dp);
+        dp.send_to(&measure(1, uid), &ccp).unwrap();
+        on.push(events.recv_timeout(TIMEOUT).unwrap().0);
+    }
+
+    let s = stats.snapshot();
+    assert_eq!(s[0].datapaths + s[1].datapaths, dps.len());
+    assert!(
+        on.contains(&0) && on.contains(&1),
+        "all on one worker: {:?}",
+        on
+    );
+    for (w, ws) in s.iter().enumerate() {
+        assert_eq!(ws.datapaths, on.iter().filter(|&&o| o == w).count());
+    }
+
+    // take the first datapath's worker down; its next message moves it to the other worker,
+    // which knows nothing of its flow until the datapath creates it again.
+    let down = on[0];
+    let h = workers[down].take().unwrap();
+    h.kill();
+    h.wait().unwrap_or_else(|_| ());
+
+    dps[0].send_to(&measure(1, 0), &ccp).unwrap();
+    dps[0].send_to(&create(2), &ccp).unwrap();
+    let uid = recv_changeprog(&dps[0]);
+    dps[0].send_to(&measure(2, uid), &ccp).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1 - down, 2));
+
+    let s = stats.snapshot();
+    assert!(!s[down].up);
+    assert_eq!(s[down].failures, 1);
+    assert_eq!(s[down].datapaths, 0);
+    assert_eq!(
+        s[down].reassigned as usize,
+        on.iter().filter(|&&o| o == down).count()
+    );
+    assert_eq!(
+        s[1 - down].datapaths,
+        1 + on.iter().filter(|&&o| o != down).count()
+    );
+
+    frontend.kill();
+    frontend.wait().unwrap();
+    for h in workers.into_iter().flatten() {
+        h.kill();
+        h.wait().unwrap_or_else(|_| ());
+    }
+
+    for name in &names {
+        std::fs::remove_file(name).unwrap_or_else(|_| ());
+    }
+}
+
+#[test]
+fn full_worker_drops_instead_of_blocking() {
+    const MSGS: u64 = 2000;
+
+    // a worker that never reads, so its queue fills.
+    let _stuck = WorkerSocket::new("shard-test-full-w").unwrap();
+    let stats = ShardStats::new();
+    let frontend = Frontend::new("shard-test-full", &["shard-test-full-w"])
+        .unwrap()
+        .with_stats(stats.clone())
+        .spawn();
+
+    let name = "/tmp/ccp/shard-test-full-dp";
+    std::fs::remove_file(name).unwrap_or_else(|_| ());
+    let dp = UnixDatagram::bind(name).unwrap();
+    for _ in 0..MSGS {
+        dp.send_to(&measure(1, 0), "/tmp/ccp/shard-test-full")
+            .unwrap();
+    }
+
+    // every message is either forwarded or counted as dropped, and the worker stays up.
+    let start = std::time::Instant::now();
+    let s = loop {
+        let s = stats.snapshot().remove(0);
+        if s.msgs + s.dropped == MSGS || start.elapsed() > TIMEOUT {
+            break s;
+        }
+
+        std::thread::sleep(Duration::from_millis(10));
+    };
+    assert_eq!(s.msgs + s.dropped, MSGS);
+    assert!(s.dropped > 0);
+    assert!(s.up);
+    assert_eq!(s.failures, 0);
+
+    frontend.kill();
+    frontend.wait().unwrap();
+    std::fs::remove_file(name).unwrap_or_else(|_| ());
+}
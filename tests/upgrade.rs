@@ -0,0 +1,198 @@
+//! A successor takes the IPC socket and the flows over from a running CCP, while the datapath
+//! keeps sending to the same socket. A handoff that fails once the socket is sent stops the old
+//! CCP.
+
+use portus::ipc::{unix, BackendBuilder, Blocking};
+use portus::lang::Scope;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, DatapathTrait, Flow, Report};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::os::unix::net::UnixDatagram;
+use std::sync::mpsc;
+use std::time::Duration;
+
+const CHANGEPROG: u8 = 4;
+const TIMEOUT: Duration = Duration::from_secs(5);
+const NAME: &str = "upgrade-test";
+
+type Sock = unix::Socket<Blocking>;
+
+// Reports each flow's total bytes acked so far, which is the state that moves to the successor.
+struct TestAlg(mpsc::Sender<(u32, u64)>);
+
+struct TestFlow {
+    sc: Scope,
+    total: u64,
+    events: mpsc::Sender<(u32, u64)>,
+}
+
+impl CongAlg<Sock> for TestAlg {
+    type Flow = TestFlow;
+
+    fn name() -> &'static str {
+        "upgrade-test"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        let mut h = HashMap::default();
+        h.insert(
+            "TestUpgrade",
+            "
+            (def (Report.acked 0))
+            (when true
+                (:= Report.acked Ack.bytes_acked)
+                (report)
+            )"
+            .to_owned(),
+        );
+        h
+    }
+
+    fn new_flow(&self, mut dp: Datapath<Sock>, _info: DatapathInfo) -> TestFlow {
+        TestFlow {
+            sc: dp.set_program("TestUpgrade", None).unwrap(),
+            total: 0,
+            events: self.0.clone(),
+        }
+    }
+
+    fn import_flow(
+        &self,
+        mut dp: Datapath<Sock>,
+        _info: DatapathInfo,
+        state: &[u8],
+    ) -> Option<TestFlow> {
+        Some(TestFlow {
+            sc: dp.set_program("TestUpgrade", None).ok()?,
+            total: u64::from_le_bytes(state.try_into().ok()?),
+            events: self.0.clone(),
+        })
+    }
+}
+
+impl Flow for TestFlow {
+    fn on_report(&mut self, sock_id: u32, m: Report) {
+        self.total += m.get_field("Report.acked", &self.sc).unwrap();
+        self.events.send((sock_id, self.total)).unwrap();
+    }
+
+    fn export_state(&self) -> Option<Vec<u8>> {
+        Some(self.total.to_le_bytes().to_vec())
+    }
+}
+
+fn measure(sid: u32, program_uid: u32, acked: u64) -> Vec<u8> {
+    serialize::serialize(&serialize::measure::Msg {
+        sid,
+        program_uid,
+        num_fields: 1,
+        fields: vec![acked],
+    })
+    .unwrap()
+}
+
+// Receive until a change program message, and return its program uid.
+fn recv_changeprog(dp: &UnixDatagram) -> u32 {
+    let mut buf = [0u8; 1024];
+    loop {
+        let read = dp.recv(&mut buf).unwrap();
+        let msg = serialize::RawMsg::parse(&buf[..read]).unwrap();
+        if msg.typ == CHANGEPROG {
+            return u32::from_le_bytes(msg.payload()[0..4].try_into().unwrap());
+        }
+    }
+}
+
+#[test]
+fn hand_off_socket_and_flows() {
+    let (events_tx, events) = mpsc::channel();
+    let sock = unix::Socket::<Blocking>::new(NAME).unwrap();
+    let old = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events_tx.clone()))
+        .with_upgrade(NAME)
+        .unwrap()
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    // CCP answers at `/tmp/ccp/` and the name the datapath bound, so bind a relative name there.
+    std::env::set_current_dir("/tmp/ccp").unwrap();
+    let dp_name = format!("{}-dp", NAME);
+    std::fs::remove_file(&dp_name).unwrap_or_else(|_| ());
+    let dp = UnixDatagram::bind(&dp_name).unwrap();
+    dp.set_read_timeout(Some(TIMEOUT)).unwrap();
+    let ccp = format!("/tmp/ccp/{}", NAME);
+
+    dp.send_to(
+        &serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap(),
+        &ccp,
+    )
+    .unwrap();
+    let create = serialize::serialize(&serialize::create::Msg {
+        sid: 1,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap();
+    dp.send_to(&create, &ccp).unwrap();
+    let old_uid = recv_changeprog(&dp);
+    dp.send_to(&measure(1, old_uid, 1448), &ccp).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 1448));
+
+    let (sock, snap) = portus::upgrade::take_over(NAME).unwrap();
+    old.wait().unwrap();
+
+    // no CCP is reading now, but the socket is still open: this waits for the successor.
+    dp.send_to(&measure(1, old_uid, 1448), &ccp).unwrap();
+
+    let new = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events_tx))
+        .taking_over(snap)
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    // the report under the old program reaches the flow, with its state.
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 2896));
+    let new_uid = recv_changeprog(&dp);
+    assert_ne!(new_uid, old_uid);
+    dp.send_to(&measure(1, new_uid, 1448), &ccp).unwrap();
+    assert_eq!(events.recv_timeout(TIMEOUT).unwrap(), (1, 4344));
+
+    new.kill();
+    new.wait().unwrap_or_else(|_| ());
+    std::fs::remove_file(&dp_name).unwrap_or_else(|_| ());
+}
+
+#[test]
+fn failed_handoff_after_sending_socket_stops() {
+    use std::io::Read;
+    use std::os::unix::net::UnixStream;
+
+    let name = "upgrade-test-fail";
+    let (events_tx, _events) = mpsc::channel();
+    let sock = unix::Socket::<Blocking>::new(name).unwrap();
+    let old = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(TestAlg(events_tx))
+        .with_upgrade(name)
+        .unwrap()
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    // a successor that takes the socket, then goes away without acknowledging it.
+    let mut successor = UnixStream::connect(format!("/tmp/ccp/{}.upgrade", name)).unwrap();
+    successor.set_read_timeout(Some(TIMEOUT)).unwrap();
+    let mut len = [0u8; 8];
+    successor.read_exact(&mut len).unwrap();
+    drop(successor);
+
+    // the old runtime does not go back to reading a socket the successor may have.
+    assert!(old.wait().is_err());
+}
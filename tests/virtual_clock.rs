@@ -0,0 +1,157 @@
+//! Under a `VirtualClock`, the runtime's notion of time moves only when the test advances it:
+//! report arrival times, control-loop delay, and the receive timeout are all exact.
+
+use crossbeam::channel;
+use portus::clock::VirtualClock;
+use portus::ipc::{chan, BackendBuilder, Blocking, Ipc};
+use portus::latency::LoopLatency;
+use portus::serialize;
+use portus::{CongAlg, Datapath, DatapathInfo, Flow, Report};
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+// Each report takes the flow 3 ms of virtual time to answer.
+struct Slow {
+    clock: VirtualClock,
+    arrivals: Arc<Mutex<Vec<Duration>>>,
+}
+
+struct SlowFlow<I: Ipc> {
+    control: Datapath<I>,
+    clock: VirtualClock,
+    arrivals: Arc<Mutex<Vec<Duration>>>,
+}
+
+impl<I: Ipc> CongAlg<I> for Slow {
+    type Flow = SlowFlow<I>;
+
+    fn name() -> &'static str {
+        "slow"
+    }
+
+    fn datapath_programs(&self) -> HashMap<&'static str, String> {
+        HashMap::default()
+    }
+
+    fn new_flow(&self, control: Datapath<I>, _info: DatapathInfo) -> Self::Flow {
+        SlowFlow {
+            control,
+            clock: self.clock.clone(),
+            arrivals: self.arrivals.clone(),
+        }
+    }
+}
+
+impl<I: Ipc> Flow for SlowFlow<I> {
+    fn on_report(&mut self, _sock_id: u32, m: Report) {
+        self.arrivals
+            .lock()
+            .unwrap()
+            .push(self.clock.since_start(m.received_at()));
+        self.clock.advance(Duration::from_millis(3));
+        self.control.update_regs(vec![]).unwrap();
+    }
+}
+
+fn create(sid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::create::Msg {
+        sid,
+        init_cwnd: 14480,
+        mss: 1448,
+        src_ip: 0,
+        src_port: 4242,
+        dst_ip: 0,
+        dst_port: 4242,
+        cong_alg: None,
+    })
+    .unwrap()
+}
+
+fn measure(sid: u32) -> Vec<u8> {
+    serialize::serialize(&serialize::measure::Msg {
+        sid,
+        program_uid: 0,
+        num_fields: 1,
+        fields: vec![1448],
+    })
+    .unwrap()
+}
+
+#[test]
+fn reports_and_loop_latency_in_virtual_time() {
+    let clock = VirtualClock::new();
+    let stats = LoopLatency::new();
+    let arrivals = Arc::new(Mutex::new(vec![]));
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock = chan::Socket::<Blocking>::new(to_dp, from_dp);
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Slow {
+            clock: clock.clone(),
+            arrivals: arrivals.clone(),
+        })
+        .with_clock(clock.clone())
+        .with_loop_latency(stats.clone())
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    to_ccp
+        .send(serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+        .unwrap();
+    to_ccp.send(create(1)).unwrap();
+
+    // the flow's 3 ms per report is the only time that passes, however long it takes for real.
+    for _ in 0..5 {
+        to_ccp.send(measure(1)).unwrap();
+        let update = from_ccp.recv_timeout(Duration::from_secs(5)).unwrap();
+        assert_eq!(update[0], 3);
+    }
+
+    handle.kill();
+    handle.wait().unwrap_or_else(|_| ());
+
+    let got = arrivals.lock().unwrap().clone();
+    let want: Vec<_> = (0..5).map(|i| Duration::from_millis(3 * i)).collect();
+    assert_eq!(got, want);
+
+    let h = &stats.snapshot()["slow"];
+    assert_eq!(h.count(), 5);
+    assert_eq!(h.mean_ns(), 3_000_000);
+    assert_eq!(h.max_ns(), 3_000_000);
+}
+
+#[test]
+fn recv_timeout_in_virtual_time() {
+    let clock = VirtualClock::new();
+    let (to_ccp, from_dp) = channel::unbounded();
+    let (to_dp, from_ccp) = channel::unbounded();
+    let sock =
+        chan::Socket::<Blocking>::new(to_dp, from_dp).with_recv_timeout(Duration::from_millis(1));
+    let handle = portus::RunBuilder::new(BackendBuilder { sock })
+        .default_alg(Slow {
+            clock: clock.clone(),
+            arrivals: Arc::new(Mutex::new(vec![])),
+        })
+        .with_clock(clock.clone())
+        .with_recv_timeout(Duration::from_secs(30))
+        .spawn_thread()
+        .run()
+        .unwrap();
+
+    to_ccp
+        .send(serialize::serialize(&serialize::ready::Msg { id: 0 }).unwrap())
+        .unwrap();
+    to_ccp.send(create(1)).unwrap();
+
+    // just inside the timeout: the runtime is still there to answer.
+    clock.advance(Duration::from_secs(29));
+    to_ccp.send(measure(1)).unwrap();
+    from_ccp.recv_timeout(Duration::from_secs(5)).unwrap();
+
+    clock.advance(Duration::from_secs(30));
+
+    let err = handle.wait().unwrap_err();
+    assert!(err.0.contains("No message from the datapath"), "{:?}", err);
+}